@@ -0,0 +1,119 @@
+/**
+ * shm_ring.h - q5
+ *
+ * Shared-memory transport between a same-host client and the warehouse.
+ * The client sends "SHM" on its UDS stream connection; the server answers
+ * "SHM OK" and passes a memfd holding one shm_channel_t plus two eventfds
+ * (client -> server, server -> client) via SCM_RIGHTS.
+ *
+ * Each direction is a single-producer single-consumer ring of fixed size
+ * slots, one message per slot. A consumer that is about to sleep sets
+ * consumer_waiting; the producer only writes the peer's eventfd when it is
+ * set, so a polling consumer gets messages without any system call.
+ * The stream connection stays open to detect the peer going away.
+ */
+
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define SHM_MAGIC 0x314D4853U               // "SHM1"
+#define SHM_RING_SLOTS 64
+#define SHM_SLOT_SIZE 512
+
+typedef struct {
+    uint32_t len;
+    char data[SHM_SLOT_SIZE - sizeof(uint32_t)];
+} shm_slot_t;
+
+typedef struct {
+    uint32_t head;                          // next slot to write, producer only
+    char pad_head[60];
+    uint32_t tail;                          // next slot to read, consumer only
+    uint32_t consumer_waiting;              // consumer may sleep on its eventfd
+    char pad_tail[56];
+    shm_slot_t slots[SHM_RING_SLOTS];
+} shm_ring_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t slot_size;
+    char pad[56];
+    shm_ring_t requests;                    // client -> server
+    shm_ring_t responses;                   // server -> client
+} shm_channel_t;
+
+/**
+ * shm_ring_push - copies a message into the next free slot
+ * Returns 0 on success, -1 if the ring is full or the message too long
+ */
+static inline int shm_ring_push(shm_ring_t *ring, const char *msg, size_t len) {
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail == SHM_RING_SLOTS || len > sizeof(ring->slots[0].data))
+        return -1;
+
+    shm_slot_t *slot = &ring->slots[head % SHM_RING_SLOTS];
+    memcpy(slot->data, msg, len);
+    slot->len = (uint32_t)len;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * shm_ring_pop - copies the oldest message out and frees its slot
+ * Returns the message length (NUL terminated in buf), -1 if the ring is empty
+ */
+static inline int shm_ring_pop(shm_ring_t *ring, char *buf, size_t size) {
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head == tail)
+        return -1;
+
+    shm_slot_t *slot = &ring->slots[tail % SHM_RING_SLOTS];
+    size_t len = slot->len < size - 1 ? slot->len : size - 1;
+    memcpy(buf, slot->data, len);
+    buf[len] = '\0';
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return (int)len;
+}
+
+/**
+ * shm_ring_empty - consumer side check for pending messages
+ */
+static inline int shm_ring_empty(shm_ring_t *ring) {
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail;
+}
+
+/**
+ * shm_ring_arm - consumer announces it is going to sleep
+ * Returns 1 if a message slipped in meanwhile (do not sleep), 0 otherwise
+ */
+static inline int shm_ring_arm(shm_ring_t *ring) {
+    __atomic_store_n(&ring->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+    if (!shm_ring_empty(ring)) {
+        __atomic_store_n(&ring->consumer_waiting, 0, __ATOMIC_RELAXED);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * shm_ring_disarm - consumer is awake and polling again
+ */
+static inline void shm_ring_disarm(shm_ring_t *ring) {
+    __atomic_store_n(&ring->consumer_waiting, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * shm_ring_needs_wake - producer side, after pushing: must the eventfd be written
+ */
+static inline int shm_ring_needs_wake(shm_ring_t *ring) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&ring->consumer_waiting, __ATOMIC_RELAXED) != 0;
+}
+
+#endif
@@ -1,8 +1,9 @@
 /**
  * uds_requester.c - q5
  *
- * Client with UDS support (both stream and datagram)
+ * Client with UDS support (stream, datagram and seqpacket)
  * Enhanced with proper server response handling and timeout
+ * Requests go through the warehouse_client library (pipelining, retransmits)
  */
 
 #include <stdio.h>
@@ -16,12 +17,26 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
-#include <netdb.h>
-#include <sys/time.h>  // לתמיכה בטיימאאוט
+#include <sys/mman.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+#include "shm_ring.h"
+#include "warehouse_client.h"
 
 #define BUFFER_SIZE 256
 #define MAX_ATOMS 1000000000000000000ULL
 #define RECV_TIMEOUT_SEC 5  // טיימאאוט של 5 שניות לקבלת תשובה
+#define SHM_SPIN_NS 50000   // poll the response ring this long before sleeping
+
+// Shared-memory session negotiated over the UDS stream connection
+typedef struct {
+    shm_channel_t *chan;
+    int req_efd;
+    int resp_efd;
+    int spin;               // busy-wait for replies (only with a spare CPU)
+} shm_session_t;
 
 void show_usage(const char *program_name) {
     printf("Usage: %s [network options] [uds options]\n\n", program_name);
@@ -32,10 +47,38 @@ void show_usage(const char *program_name) {
     printf("UDS options:\n");
     printf("  -f, --file PATH         UDS stream socket file path\n");
     printf("  -d, --datagram PATH     UDS datagram socket file path (enables molecule requests)\n");
+    printf("  -q PATH                 UDS seqpacket socket file path, used for all requests\n");
+    printf("  -m                      Send requests over shared memory (needs -f)\n");
+    printf("  -b COUNT                Measure COUNT STATUS round trips and exit (with -q, also\n");
+    printf("                          ADD and DELIVER round trips on each transport)\n");
+    printf("  -n DEPTH                With -b, also measure with DEPTH requests in flight\n");
+    printf("  -P PRI                  Priority of DELIVER requests, 0 (shed first) to 9\n");
+    printf("  -w MS                   Let DELIVER wait up to MS for atoms instead of failing\n");
+    printf("  -t                      Tag stream requests with ID= so replies may come in any order\n");
+    printf("\nLoad balancing (the endpoint above plus each -e):\n");
+    printf("  -e HOST:PORT[:UDP_PORT] Another warehouse instance (network)\n");
+    printf("  -e PATH[,DATAGRAM_PATH] Another warehouse instance (UDS)\n");
+    printf("  -l least|p2c            Fewest requests in flight (default), or better of two random\n");
+    printf("  -k MS                   Health check interval (default 1000)\n");
     printf("\nExamples:\n");
     printf("  %s -h 127.0.0.1 -p 12345 -u 12346\n", program_name);
     printf("  %s -f /tmp/stream.sock -d /tmp/datagram.sock\n", program_name);
     printf("  %s -f /tmp/stream.sock\n", program_name);
+    printf("  %s -f /tmp/stream.sock -m -b 100000\n", program_name);
+    printf("  %s -f /tmp/stream.sock -b 100000 -n 256\n", program_name);
+    printf("  %s -f /tmp/stream.sock -d /tmp/datagram.sock -q /tmp/seqpacket.sock -b 100000\n", program_name);
+    printf("  %s -h 127.0.0.1 -p 12345 -u 12346 -e 127.0.0.1:12355:12356 -l p2c\n", program_name);
+}
+
+/**
+ * request_deadline_ms - wall-clock time (ms) after which we stop waiting for a reply
+ * Sent as DL= so the server can drop requests nobody is waiting for any more
+ */
+unsigned long long request_deadline_ms(int wait_ms) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (unsigned long long)ts.tv_sec * 1000ULL + (unsigned long long)ts.tv_nsec / 1000000ULL +
+           RECV_TIMEOUT_SEC * 1000ULL + (unsigned long long)wait_ms;
 }
 
 void show_main_menu(int molecule_enabled) {
@@ -67,39 +110,392 @@ int read_unsigned_long_long(unsigned long long *result) {
     return 1;
 }
 
-int hostname_to_ip(const char *hostname, char *ip) {
-    struct hostent *he;
-    struct in_addr addr;
-    
-    if (inet_aton(hostname, &addr)) {
-        strcpy(ip, hostname);
-        return 0;
+int is_shutdown_message(const char *msg) {
+    return (strstr(msg, "shutting down") != NULL ||
+            strstr(msg, "shutdown") != NULL ||
+            strstr(msg, "closing") != NULL);
+}
+
+/**
+ * print_notice - shows lines the server sends on its own (welcome, shutdown)
+ * arg points to the server_connected flag, cleared on a shutdown notice
+ */
+/**
+ * print_notice - shows lines the server sends on its own
+ * arg is the connected flag to clear on shutdown; NULL when load balancing,
+ * where the balancer takes the instance out instead
+ */
+void print_notice(void *arg, int status, const char *line) {
+    (void)status;
+    printf("Server: %s", line);
+    if (is_shutdown_message(line) && arg != NULL) {
+        printf("Server is shutting down. Disconnecting...\n");
+        *(int *)arg = 0;
     }
-    
-    he = gethostbyname(hostname);
-    if (he == NULL) {
+}
+
+unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+/**
+ * shm_connect - asks the server for shared-memory rings over the UDS stream
+ * Prints anything the server sent first (the welcome line)
+ * Returns 0 on success, -1 if the server refused or did not answer
+ */
+int shm_connect(int stream_fd, shm_session_t *session) {
+    if (send(stream_fd, "SHM\n", 4, 0) == -1) {
+        perror("SHM request failed");
         return -1;
     }
-    
-    strcpy(ip, inet_ntoa(*((struct in_addr*)he->h_addr)));
+
+    char text[BUFFER_SIZE * 2];
+    size_t text_len = 0;
+    int fds[3] = {-1, -1, -1};
+
+    while (text_len < sizeof(text) - 1) {
+        struct pollfd pfd = {stream_fd, POLLIN, 0};
+        if (poll(&pfd, 1, RECV_TIMEOUT_SEC * 1000) <= 0) {
+            printf("Server response timeout.\n");
+            break;
+        }
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(fds))];
+        } control;
+        struct iovec iov = {text + text_len, sizeof(text) - 1 - text_len};
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        ssize_t n = recvmsg(stream_fd, &msg, MSG_CMSG_CLOEXEC);
+        if (n <= 0) {
+            if (n == 0) printf("Server disconnected.\n");
+            else perror("SHM reply failed");
+            break;
+        }
+        text_len += (size_t)n;
+        text[text_len] = '\0';
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+        }
+
+        char *ok = strstr(text, "SHM OK\n");
+        char *error = strstr(text, "ERROR:");
+        if (ok != NULL || (error != NULL && strchr(error, '\n') != NULL)) {
+            char *end = ok != NULL ? ok : error;
+            if (end > text) printf("Server: %.*s", (int)(end - text), text);
+            if (ok == NULL) printf("Server: %s", error);
+            break;
+        }
+    }
+
+    if (fds[0] == -1) {
+        return -1;
+    }
+    session->chan = mmap(NULL, sizeof(shm_channel_t), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if (session->chan == MAP_FAILED || session->chan->magic != SHM_MAGIC ||
+        session->chan->slot_size != SHM_SLOT_SIZE) {
+        fprintf(stderr, "Error: Server shared memory layout does not match this client\n");
+        if (session->chan != MAP_FAILED) munmap(session->chan, sizeof(shm_channel_t));
+        close(fds[1]);
+        close(fds[2]);
+        return -1;
+    }
+    session->req_efd = fds[1];
+    session->resp_efd = fds[2];
+    // Spinning only pays off when the server has a CPU of its own
+    session->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1;
     return 0;
 }
 
-int is_shutdown_message(const char *msg) {
-    return (strstr(msg, "shutting down") != NULL || 
-            strstr(msg, "shutdown") != NULL ||
-            strstr(msg, "closing") != NULL);
+/**
+ * shm_request - sends one command over the request ring and waits for its reply
+ * Watches the stream connection too, to notice the server going away
+ * Returns the reply length, -1 if the server disconnected or timed out
+ */
+int shm_request(shm_session_t *session, int stream_fd, const char *cmd, char *reply, size_t size) {
+    shm_ring_t *requests = &session->chan->requests;
+    shm_ring_t *responses = &session->chan->responses;
+
+    while (shm_ring_push(requests, cmd, strlen(cmd)) != 0) {
+        sched_yield();
+    }
+    if (shm_ring_needs_wake(requests)) {
+        uint64_t one = 1;
+        if (write(session->req_efd, &one, sizeof(one)) == -1) {
+            perror("SHM wakeup failed");
+            return -1;
+        }
+    }
+
+    if (session->spin) {
+        unsigned long long deadline = now_ns() + SHM_SPIN_NS;
+        do {
+            int n = shm_ring_pop(responses, reply, size);
+            if (n >= 0) return n;
+        } while (now_ns() < deadline);
+    }
+
+    while (1) {
+        if (shm_ring_arm(responses) == 0) {
+            struct pollfd pfds[2] = {{session->resp_efd, POLLIN, 0}, {stream_fd, POLLIN, 0}};
+            int ready = poll(pfds, 2, RECV_TIMEOUT_SEC * 1000);
+            shm_ring_disarm(responses);
+            if (ready == 0) {
+                printf("Server response timeout. The request may have been processed.\n");
+                return -1;
+            }
+            if (ready == -1 && errno != EINTR) {
+                perror("poll");
+                return -1;
+            }
+            if (ready > 0 && (pfds[0].revents & POLLIN)) {
+                uint64_t count;
+                if (read(session->resp_efd, &count, sizeof(count)) == -1) {
+                    perror("SHM wakeup read failed");
+                }
+            }
+            if (ready > 0 && pfds[1].revents != 0 && shm_ring_empty(responses)) {
+                // Nothing comes on the stream in SHM mode except a hangup or shutdown notice
+                int n = recv(stream_fd, reply, size - 1, 0);
+                if (n > 0) {
+                    reply[n] = '\0';
+                    printf("Server: %s", reply);
+                }
+                return -1;
+            }
+        }
+        int n = shm_ring_pop(responses, reply, size);
+        if (n >= 0) return n;
+    }
 }
 
-// הוספת פונקציה להגדרת טיימאאוט על סוקט
-int set_socket_timeout(int sock_fd, int seconds) {
-    struct timeval tv;
-    tv.tv_sec = seconds;
-    tv.tv_usec = 0;
-    
-    if (setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-        perror("Failed to set socket timeout");
+int compare_ull(const void *a, const void *b) {
+    unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * print_latency - prints avg/p50/p99/p99.9/min/max of DONE round trip samples (sorts them)
+ */
+void print_latency(const char *label, unsigned long long *samples, int done) {
+    unsigned long long total = 0;
+    for (int k = 0; k < done; k++) total += samples[k];
+    qsort(samples, (size_t)done, sizeof(samples[0]), compare_ull);
+    printf("%-19s %d round trips: avg %.2f us, p50 %.2f us, p99 %.2f us, p99.9 %.2f us, min %.2f us, max %.2f us\n",
+           label, done, total / (double)done / 1000.0, samples[done / 2] / 1000.0,
+           samples[(size_t)done * 99 / 100] / 1000.0, samples[(size_t)done * 999 / 1000] / 1000.0,
+           samples[0] / 1000.0, samples[done - 1] / 1000.0);
+}
+
+// Pipelined benchmark state; each request remembers its send time, since
+// tagged replies may come back in any order
+typedef struct pipeline_bench pipeline_bench_t;
+
+typedef struct {
+    pipeline_bench_t *bench;
+    unsigned long long start;
+} pipeline_request_t;
+
+struct pipeline_bench {
+    wc_conn_t *conn;
+    wc_balancer_t *balancer;            // used instead of conn when set
+    pipeline_request_t *requests;
+    unsigned long long *samples;
+    int count, submitted, done, failed;
+};
+
+void pipeline_submit(pipeline_bench_t *bench);
+
+void pipeline_reply(void *arg, int status, const char *reply) {
+    pipeline_request_t *request = arg;
+    pipeline_bench_t *bench = request->bench;
+    (void)reply;
+    if (status != WC_OK) bench->failed++;
+    bench->samples[bench->done] = now_ns() - request->start;
+    bench->done++;
+    pipeline_submit(bench);
+}
+
+void pipeline_submit(pipeline_bench_t *bench) {
+    if (bench->submitted >= bench->count || bench->failed > 0)
+        return;
+    pipeline_request_t *request = &bench->requests[bench->submitted];
+    request->bench = bench;
+    request->start = now_ns();
+    uint64_t id = bench->balancer != NULL
+        ? wc_balancer_submit(bench->balancer, "STATUS", RECV_TIMEOUT_SEC * 1000, pipeline_reply, request)
+        : wc_submit(bench->conn, "STATUS", RECV_TIMEOUT_SEC * 1000, pipeline_reply, request);
+    if (id == 0) {
+        bench->failed++;
+        return;
+    }
+    bench->submitted++;
+}
+
+/**
+ * run_pipeline_bench - sends COUNT STATUS requests keeping DEPTH in flight,
+ * on one connection or through a balancer
+ */
+void run_pipeline_bench(wc_loop_t *loop, wc_conn_t *conn, wc_balancer_t *balancer, int count, int depth) {
+    pipeline_bench_t bench = {conn, balancer, malloc(sizeof(pipeline_request_t) * (size_t)count),
+                              malloc(sizeof(unsigned long long) * (size_t)count), count, 0, 0, 0};
+    if (bench.requests == NULL || bench.samples == NULL) {
+        perror("malloc");
+        free(bench.requests);
+        free(bench.samples);
+        return;
+    }
+
+    unsigned long long start = now_ns();
+    for (int k = 0; k < depth; k++) pipeline_submit(&bench);
+    while (bench.done < bench.submitted) {
+        if (wc_loop_run(loop, -1) == -1) break;
+    }
+    unsigned long long elapsed = now_ns() - start;
+
+    if (bench.failed > 0) printf("Pipelined: %d request(s) failed.\n", bench.failed);
+    if (bench.done > 0) {
+        char label[32];
+        snprintf(label, sizeof(label), "Depth %d:", depth);
+        print_latency(label, bench.samples, bench.done);
+        printf("%-19s %.0f requests/s\n", "", bench.done / (elapsed / 1e9));
+    }
+    free(bench.requests);
+    free(bench.samples);
+}
+
+/**
+ * run_latency_bench - times COUNT STATUS round trips over the stream socket,
+ * then over shared memory when a session is open, then pipelined
+ */
+void run_latency_bench(wc_conn_t *stream_conn, shm_session_t *session, int count, int depth) {
+    unsigned long long *samples = malloc(sizeof(unsigned long long) * (size_t)count);
+    char reply[SHM_SLOT_SIZE];
+    int stream_fd = wc_conn_fd(stream_conn);
+    if (samples == NULL) {
+        perror("malloc");
+        return;
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        int use_shm = pass == 1;
+        if (use_shm && session->chan == NULL) break;
+
+        int done = 0;
+        for (; done < count; done++) {
+            unsigned long long start = now_ns();
+            int n;
+            if (use_shm) {
+                n = shm_request(session, stream_fd, "STATUS\n", reply, sizeof(reply));
+            } else {
+                n = wc_call(stream_conn, "STATUS", RECV_TIMEOUT_SEC * 1000, reply, sizeof(reply)) == WC_OK ? 0 : -1;
+            }
+            if (n < 0) {
+                printf("Round trip %d failed.\n", done);
+                break;
+            }
+            samples[done] = now_ns() - start;
+        }
+        if (done == 0) continue;
+        print_latency(use_shm ? "Shared memory:" : "Stream:", samples, done);
+    }
+    free(samples);
+
+    if (depth > 1 && session->chan == NULL) {
+        run_pipeline_bench(wc_conn_loop(stream_conn), stream_conn, NULL, count, depth);
+    }
+}
+
+/**
+ * run_transport_bench - times COUNT ADD round trips on each connection that
+ * takes them (stream, seqpacket), then COUNT DELIVER round trips on each one
+ * that takes those (datagram, seqpacket)
+ * Every ADD pass brings in atoms for two DELIVER passes, so the DELIVERs
+ * all do the same work
+ */
+void run_transport_bench(wc_conn_t *stream_conn, wc_conn_t *datagram_conn, wc_conn_t *seqpacket_conn, int count) {
+    struct {
+        const char *label;
+        wc_conn_t *conn;
+        int deliver;
+    } passes[] = {
+        {"Stream ADD:", stream_conn, 0},
+        {"Seqpacket ADD:", seqpacket_conn, 0},
+        {"Datagram DELIVER:", datagram_conn, 1},
+        {"Seqpacket DELIVER:", seqpacket_conn, 1},
+    };
+    unsigned long long *samples = malloc(sizeof(unsigned long long) * (size_t)count);
+    char reply[WC_REPLY_SIZE];
+    if (samples == NULL) {
+        perror("malloc");
+        return;
+    }
+
+    for (size_t pass = 0; pass < sizeof(passes) / sizeof(passes[0]); pass++) {
+        if (passes[pass].conn == NULL) continue;
+
+        int done = 0;
+        for (; done < count; done++) {
+            const char *request = passes[pass].deliver ? "DELIVER WATER 1"
+                                : done % 2 == 0 ? "ADD HYDROGEN 8" : "ADD OXYGEN 4";
+            unsigned long long start = now_ns();
+            if (wc_call(passes[pass].conn, request, RECV_TIMEOUT_SEC * 1000, reply, sizeof(reply)) != WC_OK) {
+                printf("%s round trip %d failed.\n", passes[pass].label, done);
+                break;
+            }
+            samples[done] = now_ns() - start;
+        }
+        if (done == 0) continue;
+        print_latency(passes[pass].label, samples, done);
+    }
+    free(samples);
+}
+
+/**
+ * add_endpoint - adds one -e instance to the balancers
+ * Network: HOST:PORT[:UDP_PORT]; UDS: STREAM_PATH[,DATAGRAM_PATH]
+ * Returns -1 if the spec is malformed
+ */
+int add_endpoint(wc_balancer_t *stream_balancer, wc_balancer_t *datagram_balancer, int use_uds, const char *spec) {
+    char buf[BUFFER_SIZE];
+    snprintf(buf, sizeof(buf), "%s", spec);
+    char *second = strchr(buf, use_uds ? ',' : ':');
+    if (second == NULL && !use_uds)
+        return -1;
+
+    if (use_uds) {
+        if (second != NULL) *second++ = '\0';
+        if (wc_balancer_add(stream_balancer, WC_UDS_STREAM, buf, 0) == -1) {
+            printf("Instance %s not reachable yet: %s\n", buf, strerror(errno));
+        }
+        if (second != NULL && datagram_balancer != NULL) {
+            wc_balancer_add(datagram_balancer, WC_UDS_DATAGRAM, second, 0);
+        }
+        return 0;
+    }
+
+    *second++ = '\0';
+    char *udp = strchr(second, ':');
+    if (udp != NULL) *udp++ = '\0';
+    int port = atoi(second), udp_port = udp != NULL ? atoi(udp) : 0;
+    if (port <= 0 || port > 65535 || (udp != NULL && (udp_port <= 0 || udp_port > 65535)))
         return -1;
+    if (wc_balancer_add(stream_balancer, WC_TCP, buf, port) == -1) {
+        printf("Instance %s:%d not reachable yet: %s\n", buf, port, strerror(errno));
+    }
+    if (udp != NULL && datagram_balancer != NULL) {
+        wc_balancer_add(datagram_balancer, WC_UDP, buf, udp_port);
     }
     return 0;
 }
@@ -108,12 +504,20 @@ int main(int argc, char *argv[]) {
     // Configuration variables
     char *server_host = NULL;
     int tcp_port = -1, udp_port = -1;
-    char *uds_stream_path = NULL, *uds_datagram_path = NULL;
+    char *uds_stream_path = NULL, *uds_datagram_path = NULL, *uds_seqpacket_path = NULL;
     int use_uds = 0, use_network = 0;
-    
+    int use_shm = 0, bench_count = 0, bench_depth = 1;
+    int priority = -1;                  // -1 = server default
+    int wait_ms = 0;                    // WAIT= for DELIVER, 0 = fail at once
+    int tagged = 0;                     // ID= on stream requests
+    char *endpoints[WC_MAX_ENDPOINTS];  // -e: more instances to balance over
+    int endpoint_count = 0;
+    wc_policy_t policy = WC_LEAST_PENDING;
+    int check_ms = 1000;
+
     // Parse arguments
     int opt;
-    while ((opt = getopt(argc, argv, "h:p:u:f:d:")) != -1) {
+    while ((opt = getopt(argc, argv, "h:p:u:f:d:q:mb:n:P:w:te:l:k:")) != -1) {
         switch (opt) {
             case 'h':
                 server_host = optarg;
@@ -143,6 +547,68 @@ int main(int argc, char *argv[]) {
                 uds_datagram_path = optarg;
                 use_uds = 1;
                 break;
+            case 'q':
+                uds_seqpacket_path = optarg;
+                use_uds = 1;
+                break;
+            case 'm':
+                use_shm = 1;
+                break;
+            case 'b':
+                bench_count = atoi(optarg);
+                if (bench_count <= 0) {
+                    fprintf(stderr, "Error: Invalid round trip count: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'n':
+                bench_depth = atoi(optarg);
+                if (bench_depth <= 0) {
+                    fprintf(stderr, "Error: Invalid pipeline depth: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'P':
+                priority = atoi(optarg);
+                if (priority < 0 || priority > 9 || optarg[0] < '0' || optarg[0] > '9') {
+                    fprintf(stderr, "Error: Invalid priority (0-9): %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'w':
+                wait_ms = atoi(optarg);
+                if (wait_ms <= 0) {
+                    fprintf(stderr, "Error: Invalid wait time: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                tagged = 1;
+                break;
+            case 'e':
+                if (endpoint_count == WC_MAX_ENDPOINTS - 1) {
+                    fprintf(stderr, "Error: At most %d instances\n", WC_MAX_ENDPOINTS);
+                    exit(EXIT_FAILURE);
+                }
+                endpoints[endpoint_count++] = optarg;
+                break;
+            case 'l':
+                if (strcmp(optarg, "least") == 0) {
+                    policy = WC_LEAST_PENDING;
+                } else if (strcmp(optarg, "p2c") == 0) {
+                    policy = WC_TWO_CHOICES;
+                } else {
+                    fprintf(stderr, "Error: Invalid balancing policy (least or p2c): %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'k':
+                check_ms = atoi(optarg);
+                if (check_ms <= 0) {
+                    fprintf(stderr, "Error: Invalid health check interval: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
             default:
                 show_usage(argv[0]);
                 exit(EXIT_FAILURE);
@@ -154,6 +620,14 @@ int main(int argc, char *argv[]) {
         fprintf(stderr, "Error: Cannot use both UDS socket files and network address/port\n");
         exit(EXIT_FAILURE);
     }
+    if (use_shm && uds_stream_path == NULL) {
+        fprintf(stderr, "Error: Shared memory (-m) needs a UDS stream connection (-f)\n");
+        exit(EXIT_FAILURE);
+    }
+    if ((use_shm || uds_seqpacket_path != NULL) && endpoint_count > 0) {
+        fprintf(stderr, "Error: Shared memory (-m) and seqpacket (-q) work with a single instance only\n");
+        exit(EXIT_FAILURE);
+    }
     
     if (use_network) {
         if (!server_host || tcp_port == -1) {
@@ -166,8 +640,8 @@ int main(int argc, char *argv[]) {
             exit(EXIT_FAILURE);
         }
     } else if (use_uds) {
-        if (!uds_stream_path) {
-            fprintf(stderr, "Error: UDS stream socket file path is required (-f option)\n");
+        if (!uds_stream_path && !uds_seqpacket_path) {
+            fprintf(stderr, "Error: UDS stream or seqpacket socket file path is required (-f or -q option)\n");
             show_usage(argv[0]);
             exit(EXIT_FAILURE);
         }
@@ -178,116 +652,148 @@ int main(int argc, char *argv[]) {
     }
     
     // Setup connections
-    int stream_fd = -1, datagram_fd = -1;
+    wc_loop_t *loop = wc_loop_create();
+    if (loop == NULL) {
+        perror("epoll");
+        exit(EXIT_FAILURE);
+    }
+    wc_conn_t *stream_conn = NULL, *datagram_conn = NULL, *seqpacket_conn = NULL;
+    wc_balancer_t *stream_balancer = NULL, *datagram_balancer = NULL;
     int molecule_enabled = 0;
-    
-    if (use_network) {
-        // TCP connection using getaddrinfo (as required in PDF)
-        struct addrinfo hints, *servinfo, *p;
-        int rv;
-        
-        memset(&hints, 0, sizeof hints);
-        hints.ai_family = AF_INET;
-        hints.ai_socktype = SOCK_STREAM;
-        
-        char port_str[6];
-        snprintf(port_str, sizeof(port_str), "%d", tcp_port);
-        
-        if ((rv = getaddrinfo(server_host, port_str, &hints, &servinfo)) != 0) {
-            fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+    int server_connected = 1;
+
+    if (endpoint_count > 0) {
+        // The -h/-p/-u (or -f/-d) instance first, then every -e
+        stream_balancer = wc_balancer_create(loop, policy, check_ms);
+        if (udp_port != -1 || uds_datagram_path != NULL) {
+            datagram_balancer = wc_balancer_create(loop, policy, check_ms);
+            molecule_enabled = 1;
+        }
+        if (stream_balancer == NULL || (molecule_enabled && datagram_balancer == NULL)) {
+            perror("malloc");
             exit(EXIT_FAILURE);
         }
-        
-        // Connection attempt
-        for(p = servinfo; p != NULL; p = p->ai_next) {
-            if ((stream_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
-                perror("socket");
-                continue;
-            }
-            
-            if (connect(stream_fd, p->ai_addr, p->ai_addrlen) == -1) {
-                close(stream_fd);
-                perror("connect");
-                continue;
+        wc_balancer_set_notice(stream_balancer, print_notice, NULL);
+        wc_balancer_set_tagged(stream_balancer, tagged);
+
+        char primary[BUFFER_SIZE];
+        if (use_network) {
+            snprintf(primary, sizeof(primary), udp_port != -1 ? "%s:%d:%d" : "%s:%d", server_host, tcp_port, udp_port);
+        } else {
+            snprintf(primary, sizeof(primary), uds_datagram_path != NULL ? "%s,%s" : "%s",
+                     uds_stream_path, uds_datagram_path);
+        }
+        add_endpoint(stream_balancer, datagram_balancer, use_uds, primary);
+        for (int k = 0; k < endpoint_count; k++) {
+            if (add_endpoint(stream_balancer, datagram_balancer, use_uds, endpoints[k]) == -1) {
+                fprintf(stderr, "Error: Invalid instance (expected %s): %s\n",
+                        use_uds ? "PATH[,DATAGRAM_PATH]" : "HOST:PORT[:UDP_PORT]", endpoints[k]);
+                exit(EXIT_FAILURE);
             }
-            
-            break;
         }
-        
-        if (p == NULL) {
-            fprintf(stderr, "Failed to connect\n");
-            freeaddrinfo(servinfo);
+        printf("Balancing over %d instances (%s, health check every %d ms)",
+               endpoint_count + 1, policy == WC_TWO_CHOICES ? "two random choices" : "least pending", check_ms);
+    } else if (use_network) {
+        stream_conn = wc_connect(loop, WC_TCP, server_host, tcp_port);
+        if (stream_conn == NULL) {
+            perror("TCP connection failed");
             exit(EXIT_FAILURE);
         }
-        
-        char server_ip[INET_ADDRSTRLEN];
-        struct sockaddr_in *addr = (struct sockaddr_in *)p->ai_addr;
-        inet_ntop(AF_INET, &(addr->sin_addr), server_ip, INET_ADDRSTRLEN);
-        
-        freeaddrinfo(servinfo);
-        
-        printf("Connected to TCP server at %s:%d", server_ip, tcp_port);
-        
+        printf("Connected to TCP server at %s:%d", server_host, tcp_port);
+
         // UDP connection (optional)
         if (udp_port != -1) {
-            datagram_fd = socket(AF_INET, SOCK_DGRAM, 0);
-            if (datagram_fd < 0) {
+            datagram_conn = wc_connect(loop, WC_UDP, server_host, udp_port);
+            if (datagram_conn == NULL) {
                 perror("UDP socket creation failed");
-                close(stream_fd);
+                wc_loop_destroy(loop);
                 exit(EXIT_FAILURE);
             }
-            
-            // הגדרת טיימאאוט לסוקט ה-UDP
-            set_socket_timeout(datagram_fd, RECV_TIMEOUT_SEC);
-            
             molecule_enabled = 1;
             printf(", UDP:%d", udp_port);
         }
-        printf("\n");
-        
     } else {
-        // UDS stream connection
-        stream_fd = socket(AF_UNIX, SOCK_STREAM, 0);
-        if (stream_fd < 0) {
-            perror("UDS stream socket creation failed");
-            exit(EXIT_FAILURE);
+        if (uds_stream_path) {
+            stream_conn = wc_connect(loop, WC_UDS_STREAM, uds_stream_path, 0);
+            if (stream_conn == NULL) {
+                perror("UDS stream connection failed");
+                exit(EXIT_FAILURE);
+            }
+            printf("Connected to UDS stream server at %s", uds_stream_path);
         }
-        
-        struct sockaddr_un stream_addr;
-        memset(&stream_addr, 0, sizeof(stream_addr));
-        stream_addr.sun_family = AF_UNIX;
-        strncpy(stream_addr.sun_path, uds_stream_path, sizeof(stream_addr.sun_path) - 1);
-        
-        if (connect(stream_fd, (struct sockaddr*)&stream_addr, sizeof(stream_addr)) < 0) {
-            perror("UDS stream connection failed");
-            close(stream_fd);
-            exit(EXIT_FAILURE);
+
+        // UDS seqpacket connection: one message per request, ADD and DELIVER alike
+        if (uds_seqpacket_path) {
+            seqpacket_conn = wc_connect(loop, WC_UDS_SEQPACKET, uds_seqpacket_path, 0);
+            if (seqpacket_conn == NULL) {
+                perror("UDS seqpacket connection failed");
+                wc_loop_destroy(loop);
+                exit(EXIT_FAILURE);
+            }
+            wc_set_notice(seqpacket_conn, print_notice, &server_connected);
+            molecule_enabled = 1;
+            printf(stream_conn != NULL ? ", seqpacket:%s" : "Connected to UDS seqpacket server at %s",
+                   uds_seqpacket_path);
         }
-        
-        printf("Connected to UDS stream server at %s", uds_stream_path);
-        
+
         // UDS datagram connection (optional)
         if (uds_datagram_path) {
-            datagram_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
-            if (datagram_fd < 0) {
+            datagram_conn = wc_connect(loop, WC_UDS_DATAGRAM, uds_datagram_path, 0);
+            if (datagram_conn == NULL) {
                 perror("UDS datagram socket creation failed");
-                close(stream_fd);
+                wc_loop_destroy(loop);
                 exit(EXIT_FAILURE);
             }
-            
-            // הגדרת טיימאאוט לסוקט ה-UDS datagram
-            set_socket_timeout(datagram_fd, RECV_TIMEOUT_SEC);
-            
             molecule_enabled = 1;
             printf(", datagram:%s", uds_datagram_path);
         }
-        printf("\n");
     }
+    printf("\n");
+    int stream_fd = -1;
+    if (stream_conn != NULL) {
+        wc_set_notice(stream_conn, print_notice, &server_connected);
+        wc_set_tagged(stream_conn, tagged);
+        stream_fd = wc_conn_fd(stream_conn);
+    }
+
+    // Upgrade the UDS stream connection to shared-memory rings
+    shm_session_t shm_session = {NULL, -1, -1, 0};
+    if (use_shm) {
+        if (shm_connect(stream_fd, &shm_session) == 0) {
+            printf("Using shared memory for requests%s\n", shm_session.spin ? " (spinning for replies)" : "");
+        } else {
+            shm_session.chan = NULL;
+            printf("Shared memory unavailable, using the stream socket.\n");
+        }
+    }
+
+    if (bench_count > 0 && stream_balancer != NULL) {
+        wc_loop_run(loop, 200);             // let the first probes answer
+        run_pipeline_bench(loop, NULL, stream_balancer, bench_count, bench_depth);
+        wc_balancer_print(stream_balancer, stdout);
+        wc_loop_destroy(loop);
+        return 0;
+    }
+    if (bench_count > 0) {
+        if (stream_conn != NULL) run_latency_bench(stream_conn, &shm_session, bench_count, bench_depth);
+        if (seqpacket_conn != NULL) run_transport_bench(stream_conn, datagram_conn, seqpacket_conn, bench_count);
+        if (shm_session.chan != NULL) munmap(shm_session.chan, sizeof(shm_channel_t));
+        wc_loop_destroy(loop);
+        return 0;
+    }
+
+    // Show the welcome line before the first menu
+    if (shm_session.chan == NULL) {
+        wc_loop_run(loop, 200);
+    }
+
+    // Seqpacket, when open, carries both kinds of request
+    wc_conn_t *add_conn = seqpacket_conn != NULL ? seqpacket_conn : stream_conn;
+    wc_conn_t *deliver_conn = seqpacket_conn != NULL ? seqpacket_conn : datagram_conn;
 
     // Main program loop
     int running = 1;
-    int server_connected = 1;
-    char buffer[BUFFER_SIZE], recv_buffer[BUFFER_SIZE];
+    char buffer[BUFFER_SIZE], recv_buffer[WC_REPLY_SIZE];
     
     while (running && server_connected) {
         show_main_menu(molecule_enabled);
@@ -327,47 +833,28 @@ int main(int argc, char *argv[]) {
                 }
 
                 snprintf(buffer, sizeof(buffer), "ADD %s %llu\n", atom, amount);
-                if (send(stream_fd, buffer, strlen(buffer), 0) == -1) {
-                    perror("Stream send failed");
-                    server_connected = 0;
-                    break;
-                }
-                
-                // Receive and display server response
-                int n = recv(stream_fd, recv_buffer, sizeof(recv_buffer) - 1, 0);
-                if (n <= 0) {
-                    if (n == 0) {
-                        printf("Server disconnected.\n");
-                    } else {
-                        perror("Stream receive failed");
-                    }
-                    server_connected = 0;
-                    break;
-                } else {
-                    recv_buffer[n] = '\0';
-                    printf("Server: %s", recv_buffer);
-                    
-                    if (is_shutdown_message(recv_buffer)) {
-                        printf("Server is shutting down. Disconnecting...\n");
+                if (shm_session.chan != NULL) {
+                    char shm_reply[SHM_SLOT_SIZE];
+                    if (shm_request(&shm_session, stream_fd, buffer, shm_reply, sizeof(shm_reply)) < 0) {
                         server_connected = 0;
                         break;
                     }
-                    
-                    // Attempt to receive additional messages (like status updates)
-                    fd_set read_fds;
-                    struct timeval timeout;
-                    FD_ZERO(&read_fds);
-                    FD_SET(stream_fd, &read_fds);
-                    timeout.tv_sec = 0;
-                    timeout.tv_usec = 100000; // 100ms timeout
-                    
-                    if (select(stream_fd + 1, &read_fds, NULL, NULL, &timeout) > 0) {
-                        n = recv(stream_fd, recv_buffer, sizeof(recv_buffer) - 1, 0);
-                        if (n > 0) {
-                            recv_buffer[n] = '\0';
-                            printf("Server: %s", recv_buffer);
-                        }
-                    }
+                    printf("Server: %s", shm_reply);
+                    continue;
+                }
+                int status = stream_balancer != NULL
+                    ? wc_balancer_call(stream_balancer, buffer, RECV_TIMEOUT_SEC * 1000, recv_buffer, sizeof(recv_buffer))
+                    : wc_call(add_conn, buffer, RECV_TIMEOUT_SEC * 1000, recv_buffer, sizeof(recv_buffer));
+                if (status == WC_OK) {
+                    printf("Server: %s", recv_buffer);
+                } else if (status == WC_TIMEOUT) {
+                    printf("Server response timeout. The request may have been processed.\n");
+                } else if (stream_balancer != NULL) {
+                    printf(status == WC_CLOSED ? "Instance lost. The request may have been processed.\n"
+                                               : "No warehouse instance available.\n");
+                } else {
+                    printf("Server disconnected.\n");
+                    server_connected = 0;
                 }
             }
 
@@ -403,56 +890,29 @@ int main(int argc, char *argv[]) {
                     printf("Invalid quantity. Please try again.\n");
                 }
 
-                snprintf(buffer, sizeof(buffer), "DELIVER %s %llu\n", mol, quantity);
-                
-                if (use_network) {
-                    // Send via UDP
-                    struct sockaddr_in udp_addr;
-                    udp_addr.sin_family = AF_INET;
-                    udp_addr.sin_port = htons(udp_port);
-                    char server_ip[16];
-                    hostname_to_ip(server_host, server_ip);
-                    inet_pton(AF_INET, server_ip, &udp_addr.sin_addr);
-                    
-                    if (sendto(datagram_fd, buffer, strlen(buffer), 0, 
-                              (struct sockaddr*)&udp_addr, sizeof(udp_addr)) == -1) {
-                        perror("UDP send failed");
-                        continue;
-                    }
-                    
-                    int n = recvfrom(datagram_fd, recv_buffer, sizeof(recv_buffer) - 1, 0, NULL, NULL);
-                    if (n > 0) {
-                        recv_buffer[n] = '\0';
-                        printf("Server: %s", recv_buffer);
-                    } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-                        // טיימאאוט - לא התקבלה תשובה מהשרת תוך פרק הזמן המוגדר
-                        printf("Server response timeout. The request may have been processed.\n");
-                    } else {
-                        perror("UDP receive failed");
-                    }
+                // The library adds ID= and retransmits until the timeout
+                int len = snprintf(buffer, sizeof(buffer), "DELIVER %s %llu DL=%llu", mol, quantity, request_deadline_ms(wait_ms));
+                if (priority >= 0) {
+                    len += snprintf(buffer + len, sizeof(buffer) - (size_t)len, " PRI=%d", priority);
+                }
+                if (wait_ms > 0) {
+                    snprintf(buffer + len, sizeof(buffer) - (size_t)len, " WAIT=%d", wait_ms);
+                }
+
+                int timeout_ms = RECV_TIMEOUT_SEC * 1000 + wait_ms;
+                int status = datagram_balancer != NULL
+                    ? wc_balancer_call(datagram_balancer, buffer, timeout_ms, recv_buffer, sizeof(recv_buffer))
+                    : wc_call(deliver_conn, buffer, timeout_ms, recv_buffer, sizeof(recv_buffer));
+                if (status == WC_OK) {
+                    printf("Server: %s", recv_buffer);
+                } else if (status == WC_TIMEOUT) {
+                    // טיימאאוט - לא התקבלה תשובה מהשרת תוך פרק הזמן המוגדר
+                    printf("Server response timeout. The request may have been processed.\n");
+                } else if (deliver_conn == seqpacket_conn && seqpacket_conn != NULL) {
+                    printf("Server disconnected.\n");
+                    server_connected = 0;
                 } else {
-                    // Send via UDS datagram
-                    struct sockaddr_un dgram_addr;
-                    memset(&dgram_addr, 0, sizeof(dgram_addr));
-                    dgram_addr.sun_family = AF_UNIX;
-                    strncpy(dgram_addr.sun_path, uds_datagram_path, sizeof(dgram_addr.sun_path) - 1);
-                    
-                    if (sendto(datagram_fd, buffer, strlen(buffer), 0, 
-                              (struct sockaddr*)&dgram_addr, sizeof(dgram_addr)) == -1) {
-                        perror("UDS datagram send failed");
-                        continue;
-                    }
-                    
-                    int n = recvfrom(datagram_fd, recv_buffer, sizeof(recv_buffer) - 1, 0, NULL, NULL);
-                    if (n > 0) {
-                        recv_buffer[n] = '\0';
-                        printf("Server: %s", recv_buffer);
-                    } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-                        // טיימאאוט - לא התקבלה תשובה מהשרת תוך פרק הזמן המוגדר
-                        printf("Server response timeout. The request may have been processed.\n");
-                    } else {
-                        perror("UDS datagram receive failed");
-                    }
+                    printf("Datagram request failed.\n");
                 }
             }
 
@@ -464,9 +924,13 @@ int main(int argc, char *argv[]) {
     }
 
     // Cleanup resources
-    close(stream_fd);
-    if (datagram_fd != -1) close(datagram_fd);
-    
+    if (shm_session.chan != NULL) {
+        munmap(shm_session.chan, sizeof(shm_channel_t));
+        close(shm_session.req_efd);
+        close(shm_session.resp_efd);
+    }
+    wc_loop_destroy(loop);
+
     if (!server_connected) {
         printf("Connection to server lost.\n");
     } else {
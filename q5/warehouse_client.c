@@ -0,0 +1,1134 @@
+/**
+ * warehouse_client.c - q5
+ *
+ * Implementation of the asynchronous warehouse client (see warehouse_client.h).
+ * Sockets are non-blocking and registered with the loop's epoll instance;
+ * stream output is buffered and flushed on EPOLLOUT, so submitting never
+ * blocks. Timers (request timeouts, datagram retransmits) are checked after
+ * every epoll_wait and bound its timeout.
+ *
+ * A UDS seqpacket connection is handled like a datagram one (one request per
+ * message, replies matched by ID=), except that it is reliable: nothing is
+ * retransmitted, and the server closing it fails its requests.
+ *
+ * A balancer spreads requests over several endpoints of one transport. Each
+ * endpoint is probed with STATUS every check interval; any answer but a
+ * draining notice counts as alive. An endpoint that closes, announces a
+ * shutdown or misses WC_MAX_FAILS probes or requests in a row is taken out
+ * and reconnected with exponential backoff.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#include "warehouse_client.h"
+
+#define WC_MAX_EVENTS 64
+#define WC_BUCKETS 256                      // ID lookup
+#define WC_RETRY_INITIAL_MS 250             // first retransmit, doubled after each one
+#define WC_NO_RETRY (~0ULL)                 // retry_ns of a sent seqpacket request
+#define WC_INBUF_SIZE 4096
+#define WC_MAX_FAILS 3                      // timeouts in a row before an endpoint is taken out
+#define WC_RECONNECT_MAX_MS 8000            // reconnect backoff limit
+
+typedef struct wc_request {
+    uint64_t id;
+    wc_callback_t callback;                 // NULL once timed out (stream: reply still to come)
+    void *arg;
+    unsigned long long deadline_ns;         // CLOCK_MONOTONIC
+    unsigned long long retry_ns;            // datagram: next retransmit, 0 = not sent yet
+    int interval_ms;
+    size_t len;
+    char text[WC_REQUEST_SIZE];             // as sent, for retransmits
+    struct wc_request *next, *prev;         // in submission order
+    struct wc_request *hash_next;           // ID bucket
+} wc_request_t;
+
+struct wc_conn {
+    wc_loop_t *loop;
+    int fd;
+    int is_stream;
+    int is_seqpacket;                       // message-based like a datagram, but reliable
+    int tagged;                             // stream requests carry ID= (datagrams always do)
+    int connected;
+    wc_request_t *head, *tail;
+    int pending;                            // requests whose callback has not run yet
+    wc_request_t *buckets[WC_BUCKETS];
+    wc_callback_t notice;
+    void *notice_arg;
+    char *out;                              // stream bytes not accepted by the socket yet
+    size_t out_len, out_cap;
+    char in[WC_INBUF_SIZE];
+    size_t in_len;
+    char reply[WC_REPLY_SIZE];              // "SUCCESS:" line waiting for its "Status:" line
+    wc_request_t *awaiting;                 // the request it answers
+    uint32_t events;                        // registered with epoll
+    struct wc_conn *next, *prev;
+};
+
+struct wc_loop {
+    int epfd;
+    wc_conn_t *conns;
+    wc_balancer_t *balancers;
+    int corked;                             // stream submissions wait for wc_loop_cork(loop, 0)
+};
+
+// Endpoint states, as seen by a balancer
+#define WC_ENDPOINT_UNKNOWN 0               // connected, no probe answered yet
+#define WC_ENDPOINT_UP 1
+#define WC_ENDPOINT_DOWN 2                  // closed, reconnect at next_ns
+
+typedef struct {
+    wc_balancer_t *balancer;
+    wc_transport_t transport;
+    char address[108];                      // host or socket path
+    int port;
+    wc_conn_t *conn;                        // NULL while down
+    int state;
+    int fails;                              // timeouts in a row
+    int probing;                            // a STATUS probe is in flight
+    int backoff_ms;
+    unsigned long long next_ns;             // next probe, or next reconnect while down
+    unsigned long long sent, failed;
+} wc_endpoint_t;
+
+struct wc_balancer {
+    wc_loop_t *loop;
+    wc_policy_t policy;
+    int check_ms;
+    int tagged;
+    wc_endpoint_t endpoints[WC_MAX_ENDPOINTS];
+    int count;
+    int next;                               // least-pending: where the scan starts, to spread ties
+    unsigned int seed;                      // two-choices: rand_r() state
+    wc_callback_t notice;
+    void *notice_arg;
+    struct wc_balancer *next_balancer;
+};
+
+static int wc_balancer_timers(wc_balancer_t *balancer);
+
+static unsigned long long wc_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+/**
+ * wc_next_id - request IDs unique to this process run
+ * Seeded from the pid and clock, so a restarted client does not reuse the IDs
+ * the server still remembers for its retransmit cache
+ */
+static uint64_t wc_next_id(void) {
+    static uint64_t next = 0;
+    if (next == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        next = ((uint64_t)getpid() << 40) ^ ((uint64_t)ts.tv_sec << 20) ^ (uint64_t)ts.tv_nsec;
+    }
+    if (next == 0) next++;
+    return next++;
+}
+
+static void wc_set_events(wc_conn_t *conn, uint32_t events) {
+    if (conn->events == events || !conn->connected)
+        return;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = conn;
+    if (epoll_ctl(conn->loop->epfd, EPOLL_CTL_MOD, conn->fd, &ev) == 0) {
+        conn->events = events;
+    }
+}
+
+static void wc_unlink(wc_conn_t *conn, wc_request_t *req) {
+    if (req->prev) req->prev->next = req->next;
+    else conn->head = req->next;
+    if (req->next) req->next->prev = req->prev;
+    else conn->tail = req->prev;
+
+    wc_request_t **link = &conn->buckets[req->id % WC_BUCKETS];
+    while (*link != NULL && *link != req) link = &(*link)->hash_next;
+    if (*link == req) *link = req->hash_next;
+    if (conn->awaiting == req) conn->awaiting = NULL;
+}
+
+static wc_request_t *wc_find(wc_conn_t *conn, uint64_t id) {
+    wc_request_t *req = conn->buckets[id % WC_BUCKETS];
+    while (req != NULL && req->id != id) req = req->hash_next;
+    return req;
+}
+
+/**
+ * wc_strip_id - removes the " ID=<hex>" echo from every line of a reply
+ * Returns 1 and sets *id (from the first one) if the reply had one
+ */
+static int wc_strip_id(char *line, uint64_t *id) {
+    char *tag = strstr(line, " ID=");
+    if (tag == NULL)
+        return 0;
+    *id = strtoull(tag + 4, NULL, 16);
+    do {
+        char *end = tag + 4 + strcspn(tag + 4, " \r\n");
+        memmove(tag, end, strlen(end) + 1);
+    } while ((tag = strstr(tag, " ID=")) != NULL);
+    return 1;
+}
+
+/**
+ * wc_finish - runs a request's callback (once) and frees it
+ */
+static void wc_finish(wc_conn_t *conn, wc_request_t *req, int status, const char *reply) {
+    wc_unlink(conn, req);
+    if (req->callback != NULL) {
+        conn->pending--;
+        req->callback(req->arg, status, reply);
+    }
+    free(req);
+}
+
+/**
+ * wc_fail_all - answers every request after the connection went away
+ */
+static void wc_fail_all(wc_conn_t *conn, int status) {
+    while (conn->head != NULL) {
+        wc_finish(conn, conn->head, status, "");
+    }
+}
+
+static void wc_lost(wc_conn_t *conn) {
+    if (!conn->connected)
+        return;
+    epoll_ctl(conn->loop->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    conn->connected = 0;
+    conn->out_len = 0;
+    conn->awaiting = NULL;
+    wc_fail_all(conn, WC_CLOSED);
+}
+
+/**
+ * wc_flush - writes buffered stream output until the socket is full
+ */
+static void wc_flush(wc_conn_t *conn) {
+    size_t sent = 0;
+    while (sent < conn->out_len) {
+        ssize_t n = send(conn->fd, conn->out + sent, conn->out_len - sent, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            wc_lost(conn);
+            return;
+        }
+        sent += (size_t)n;
+    }
+    memmove(conn->out, conn->out + sent, conn->out_len - sent);
+    conn->out_len -= sent;
+    wc_set_events(conn, conn->out_len > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
+
+/**
+ * wc_send_datagram - sends (or resends) a datagram request
+ * If the socket is full (a UDS server's queue is short) the request waits
+ * for EPOLLOUT instead of a retransmit timer
+ * Returns -1 if the connection failed
+ */
+static int wc_send_datagram(wc_conn_t *conn, wc_request_t *req, unsigned long long now) {
+    if (send(conn->fd, req->text, req->len, MSG_NOSIGNAL) == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            req->retry_ns = 0;
+            wc_set_events(conn, EPOLLIN | EPOLLOUT);
+            return 0;
+        }
+        if (errno != ECONNREFUSED || conn->is_seqpacket) {   // no server yet: retransmits keep trying
+            wc_lost(conn);
+            return -1;
+        }
+    }
+    if (conn->is_seqpacket) {
+        req->retry_ns = WC_NO_RETRY;
+        return 0;
+    }
+    req->retry_ns = now + (unsigned long long)req->interval_ms * 1000000ULL;
+    return 0;
+}
+
+/**
+ * wc_datagram_output - sends requests that found the socket full, oldest first
+ */
+static void wc_datagram_output(wc_conn_t *conn) {
+    unsigned long long now = wc_now_ns();
+    for (wc_request_t *req = conn->head; req != NULL; req = req->next) {
+        if (req->retry_ns != 0 || req->callback == NULL) continue;
+        if (wc_send_datagram(conn, req, now) == -1 || req->retry_ns == 0)
+            return;
+    }
+    wc_set_events(conn, EPOLLIN);
+}
+
+static void wc_notice(wc_conn_t *conn, const char *line) {
+    if (conn->notice != NULL) {
+        conn->notice(conn->notice_arg, WC_OK, line);
+    }
+}
+
+/**
+ * wc_stream_line - matches one complete reply line to its request: the one
+ * named by its ID= echo, or else the oldest one
+ * An ADD success is two lines ("SUCCESS: ..." then "Status: ..."), delivered
+ * as one reply; welcome, WATCH and shutdown lines are notices. A tagged line
+ * for a request that already finished is dropped
+ */
+static void wc_stream_line(wc_conn_t *conn, char *line) {
+    uint64_t id = 0;
+    int tagged = wc_strip_id(line, &id);
+
+    wc_request_t *awaiting = conn->awaiting;
+    if (awaiting != NULL) {
+        conn->awaiting = NULL;
+        if (strncmp(line, "Status:", 7) == 0 && (!tagged || awaiting->id == id)) {
+            size_t used = strlen(conn->reply);
+            snprintf(conn->reply + used, sizeof(conn->reply) - used, "%s", line);
+            wc_finish(conn, awaiting, WC_OK, conn->reply);
+            return;
+        }
+        wc_finish(conn, awaiting, WC_OK, conn->reply);
+        if (!conn->connected)
+            return;
+    }
+
+    wc_request_t *req = tagged ? wc_find(conn, id) : conn->head;
+    if ((!tagged && req == NULL) || strncmp(line, "Connected to", 12) == 0 || strncmp(line, "WATCH:", 6) == 0 ||
+        strncmp(line, "Server shutting down", 20) == 0) {
+        wc_notice(conn, line);
+        return;
+    }
+    if (req == NULL)
+        return;
+    if (strncmp(line, "SUCCESS: Added", 14) == 0) {
+        snprintf(conn->reply, sizeof(conn->reply), "%s", line);
+        conn->awaiting = req;
+        return;
+    }
+    wc_finish(conn, req, WC_OK, line);
+}
+
+static void wc_stream_input(wc_conn_t *conn) {
+    while (conn->connected) {
+        ssize_t n = recv(conn->fd, conn->in + conn->in_len, sizeof(conn->in) - 1 - conn->in_len, 0);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) {
+            wc_lost(conn);
+            return;
+        }
+        conn->in_len += (size_t)n;
+
+        size_t start = 0;
+        for (size_t k = 0; k < conn->in_len && conn->connected; k++) {
+            if (conn->in[k] != '\n') continue;
+            char line[WC_REPLY_SIZE];
+            size_t len = k + 1 - start;
+            if (len > sizeof(line) - 1) len = sizeof(line) - 1;
+            memcpy(line, conn->in + start, len);
+            line[len] = '\0';
+            wc_stream_line(conn, line);
+            start = k + 1;
+        }
+        if (!conn->connected) return;
+        // A line longer than the buffer is cut into pieces
+        if (start == 0 && conn->in_len == sizeof(conn->in) - 1) start = conn->in_len;
+        memmove(conn->in, conn->in + start, conn->in_len - start);
+        conn->in_len -= start;
+    }
+}
+
+/**
+ * wc_datagram_input - matches replies by their ID= echo
+ * Replies to requests that already finished (duplicates from retransmits,
+ * late answers after a timeout) are dropped. A seqpacket server also sends
+ * notices (welcome, WATCH, shutdown), and a two-line ADD reply in one message
+ */
+static void wc_datagram_input(wc_conn_t *conn) {
+    char reply[WC_REPLY_SIZE];
+    while (conn->connected) {
+        ssize_t n = recv(conn->fd, reply, sizeof(reply) - 1, 0);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n == -1 && errno == ECONNREFUSED) {
+            continue;                       // server not up (yet); retransmits keep trying
+        }
+        if (n == -1 || (n == 0 && conn->is_seqpacket)) {
+            wc_lost(conn);
+            return;
+        }
+        reply[n] = '\0';
+
+        uint64_t id;
+        int tagged = wc_strip_id(reply, &id);
+        if (!tagged && conn->is_seqpacket &&
+            (strncmp(reply, "Connected to", 12) == 0 || strncmp(reply, "WATCH:", 6) == 0 ||
+             strncmp(reply, "Server shutting down", 20) == 0)) {
+            wc_notice(conn, reply);
+            continue;
+        }
+        wc_request_t *req = tagged ? wc_find(conn, id) : conn->head;
+        if (req != NULL) {
+            wc_finish(conn, req, WC_OK, reply);
+        }
+    }
+}
+
+/**
+ * wc_timers - times out requests and retransmits datagrams that are due
+ * Returns the milliseconds until the next timer of this connection, -1 if none
+ */
+static int wc_timers(wc_conn_t *conn) {
+    unsigned long long now = wc_now_ns();
+    unsigned long long next = 0;
+    wc_request_t *req = conn->head;
+    while (req != NULL) {
+        wc_request_t *following = req->next;
+        if (req->callback != NULL && now >= req->deadline_ns) {
+            if (conn->is_stream) {
+                // Keep it queued: its late reply must not be taken for the next one
+                conn->pending--;
+                wc_callback_t callback = req->callback;
+                req->callback = NULL;
+                callback(req->arg, WC_TIMEOUT, "");
+            } else {
+                wc_finish(conn, req, WC_TIMEOUT, "");
+            }
+            if (!conn->connected)
+                return -1;                  // the callback's own request failed the connection
+        } else if (req->callback != NULL) {
+            if (!conn->is_stream && req->retry_ns != 0 && now >= req->retry_ns) {
+                req->interval_ms *= 2;
+                if (wc_send_datagram(conn, req, now) == -1)
+                    return -1;
+            }
+            unsigned long long due = req->deadline_ns;
+            if (!conn->is_stream && req->retry_ns != 0 && req->retry_ns < due) due = req->retry_ns;
+            if (next == 0 || due < next) next = due;
+        }
+        req = following;
+    }
+    if (next == 0)
+        return -1;
+    return next <= now ? 0 : (int)((next - now + 999999ULL) / 1000000ULL);
+}
+
+wc_loop_t *wc_loop_create(void) {
+    wc_loop_t *loop = calloc(1, sizeof(*loop));
+    if (loop == NULL)
+        return NULL;
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd == -1) {
+        free(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+/**
+ * wc_loop_destroy - closes every connection (failing their requests) and the loop
+ */
+void wc_loop_destroy(wc_loop_t *loop) {
+    while (loop->balancers != NULL) {
+        wc_balancer_destroy(loop->balancers);
+    }
+    while (loop->conns != NULL) {
+        wc_close(loop->conns);
+    }
+    close(loop->epfd);
+    free(loop);
+}
+
+/**
+ * wc_loop_fd - the epoll descriptor; readable when wc_loop_run(loop, 0) has work
+ */
+int wc_loop_fd(const wc_loop_t *loop) {
+    return loop->epfd;
+}
+
+/**
+ * wc_loop_run - waits up to timeout_ms (-1 = until a timer is due) for events
+ * and runs the callbacks of completed requests
+ * Returns 0, or -1 if epoll failed
+ */
+int wc_loop_run(wc_loop_t *loop, int timeout_ms) {
+    int wait_ms = timeout_ms;
+    for (wc_balancer_t *balancer = loop->balancers; balancer != NULL; balancer = balancer->next_balancer) {
+        int due = wc_balancer_timers(balancer);
+        if (due >= 0 && (wait_ms < 0 || due < wait_ms)) wait_ms = due;
+    }
+    for (wc_conn_t *conn = loop->conns; conn != NULL; conn = conn->next) {
+        int due = wc_timers(conn);
+        if (due >= 0 && (wait_ms < 0 || due < wait_ms)) wait_ms = due;
+    }
+
+    struct epoll_event events[WC_MAX_EVENTS];
+    int ready = epoll_wait(loop->epfd, events, WC_MAX_EVENTS, wait_ms);
+    if (ready == -1) {
+        return errno == EINTR ? 0 : -1;
+    }
+    for (int k = 0; k < ready; k++) {
+        wc_conn_t *conn = events[k].data.ptr;
+        if (!conn->connected) continue;
+        if (events[k].events & EPOLLOUT) {
+            if (conn->is_stream) wc_flush(conn);
+            else wc_datagram_output(conn);
+        }
+        if (events[k].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+            if (conn->is_stream) wc_stream_input(conn);
+            else wc_datagram_input(conn);
+        }
+    }
+    for (wc_conn_t *conn = loop->conns; conn != NULL; conn = conn->next) {
+        wc_timers(conn);
+    }
+    return 0;
+}
+
+/**
+ * wc_loop_cork - while corked, stream requests are only buffered; uncorking
+ * writes each connection's batch at once (one send for many requests)
+ */
+void wc_loop_cork(wc_loop_t *loop, int corked) {
+    loop->corked = corked;
+    if (corked)
+        return;
+    for (wc_conn_t *conn = loop->conns; conn != NULL; conn = conn->next) {
+        if (conn->connected && conn->is_stream && conn->out_len > 0) wc_flush(conn);
+    }
+}
+
+/**
+ * wc_wait - runs the loop until a future completes
+ * Returns the request status (WC_OK, WC_TIMEOUT, ...)
+ */
+int wc_wait(wc_loop_t *loop, wc_future_t *future) {
+    while (!future->done) {
+        if (wc_loop_run(loop, -1) == -1) {
+            future->done = 1;
+            future->status = WC_ERROR;
+            future->reply[0] = '\0';
+        }
+    }
+    return future->status;
+}
+
+/**
+ * wc_resolve - looks up HOST:PORT for the given socket type (IPv4, as the servers)
+ */
+static int wc_resolve(const char *host, int port, int socktype, struct sockaddr_storage *addr, socklen_t *addrlen) {
+    struct addrinfo hints, *info;
+    char port_str[8];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = socktype;
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    if (getaddrinfo(host, port_str, &hints, &info) != 0) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    memcpy(addr, info->ai_addr, info->ai_addrlen);
+    *addrlen = info->ai_addrlen;
+    freeaddrinfo(info);
+    return 0;
+}
+
+/**
+ * wc_connect - opens a connection and adds it to the loop
+ * host_or_path is a hostname for TCP/UDP and a socket path for UDS
+ * Returns NULL with errno set on failure
+ */
+wc_conn_t *wc_connect(wc_loop_t *loop, wc_transport_t transport, const char *host_or_path, int port) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int is_stream = transport == WC_TCP || transport == WC_UDS_STREAM;
+    int type = is_stream ? SOCK_STREAM : transport == WC_UDS_SEQPACKET ? SOCK_SEQPACKET : SOCK_DGRAM;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    if (transport == WC_TCP || transport == WC_UDP) {
+        if (wc_resolve(host_or_path, port, type, &addr, &addrlen) == -1)
+            return NULL;
+        fd = socket(AF_INET, type | SOCK_CLOEXEC, 0);
+    } else {
+        struct sockaddr_un *un = (struct sockaddr_un *)&addr;
+        if (strlen(host_or_path) >= sizeof(un->sun_path)) {
+            errno = ENAMETOOLONG;
+            return NULL;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, host_or_path);
+        addrlen = sizeof(*un);
+        fd = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+    }
+    if (fd == -1)
+        return NULL;
+
+    // A UDS datagram server can only reply to a bound socket; let Linux
+    // pick an abstract name
+    if (transport == WC_UDS_DATAGRAM) {
+        sa_family_t family = AF_UNIX;
+        if (bind(fd, (struct sockaddr *)&family, sizeof(family)) == -1) {
+            close(fd);
+            return NULL;
+        }
+    }
+    if (connect(fd, (struct sockaddr *)&addr, addrlen) == -1) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return NULL;
+    }
+    if (transport == WC_TCP) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    wc_conn_t *conn = calloc(1, sizeof(*conn));
+    if (conn == NULL) {
+        close(fd);
+        return NULL;
+    }
+    conn->loop = loop;
+    conn->fd = fd;
+    conn->is_stream = is_stream;
+    conn->is_seqpacket = transport == WC_UDS_SEQPACKET;
+    conn->connected = 1;
+    conn->events = EPOLLIN;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = conn;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        int saved = errno;
+        close(fd);
+        free(conn);
+        errno = saved;
+        return NULL;
+    }
+
+    conn->next = loop->conns;
+    if (loop->conns != NULL) loop->conns->prev = conn;
+    loop->conns = conn;
+    return conn;
+}
+
+/**
+ * wc_close - closes a connection; its requests finish with WC_CLOSED
+ * Must not be called from a callback of the same loop
+ */
+void wc_close(wc_conn_t *conn) {
+    wc_lost(conn);
+    wc_fail_all(conn, WC_CLOSED);
+    close(conn->fd);
+
+    if (conn->prev) conn->prev->next = conn->next;
+    else conn->loop->conns = conn->next;
+    if (conn->next) conn->next->prev = conn->prev;
+    free(conn->out);
+    free(conn);
+}
+
+/**
+ * wc_set_notice - callback for lines a stream server sends on its own
+ */
+void wc_set_notice(wc_conn_t *conn, wc_callback_t callback, void *arg) {
+    conn->notice = callback;
+    conn->notice_arg = arg;
+}
+
+/**
+ * wc_conn_fd - the connection's (non-blocking) socket
+ */
+int wc_conn_fd(const wc_conn_t *conn) {
+    return conn->fd;
+}
+
+wc_loop_t *wc_conn_loop(const wc_conn_t *conn) {
+    return conn->loop;
+}
+
+/**
+ * wc_set_tagged - makes stream requests carry an ID= tag
+ * Only for servers that echo it (persistent_warehouse); they may then answer
+ * a slow request after later ones
+ */
+void wc_set_tagged(wc_conn_t *conn, int tagged) {
+    conn->tagged = tagged;
+}
+
+int wc_connected(const wc_conn_t *conn) {
+    return conn->connected;
+}
+
+/**
+ * wc_pending - requests submitted on this connection and not finished yet
+ */
+int wc_pending(const wc_conn_t *conn) {
+    return conn->pending;
+}
+
+/**
+ * wc_submit - sends a request; callback runs once with its outcome
+ * request is one command line ("STATUS", "DELIVER WATER 2 WAIT=500\n", ...)
+ * Returns the request ID, or 0 if it could not be sent (callback not called)
+ */
+uint64_t wc_submit(wc_conn_t *conn, const char *request, int timeout_ms, wc_callback_t callback, void *arg) {
+    if (!conn->connected || callback == NULL)
+        return 0;
+
+    wc_request_t *req = calloc(1, sizeof(*req));
+    if (req == NULL)
+        return 0;
+    req->id = wc_next_id();
+    req->callback = callback;
+    req->arg = arg;
+
+    size_t len = strcspn(request, "\r\n");
+    int n;
+    if (conn->is_stream && !conn->tagged) {
+        n = snprintf(req->text, sizeof(req->text), "%.*s\n", (int)len, request);
+    } else {
+        n = snprintf(req->text, sizeof(req->text), "%.*s ID=%llx\n", (int)len, request,
+                     (unsigned long long)req->id);
+    }
+    if (n < 0 || (size_t)n >= sizeof(req->text)) {
+        free(req);
+        errno = EMSGSIZE;
+        return 0;
+    }
+    req->len = (size_t)n;
+
+    unsigned long long now = wc_now_ns();
+    req->deadline_ns = now + (unsigned long long)timeout_ms * 1000000ULL;
+    req->interval_ms = WC_RETRY_INITIAL_MS;
+
+    if (conn->is_stream) {
+        if (conn->out_len + req->len > conn->out_cap) {
+            size_t cap = conn->out_cap == 0 ? 4096 : conn->out_cap;
+            while (cap < conn->out_len + req->len) cap *= 2;
+            char *out = realloc(conn->out, cap);
+            if (out == NULL) {
+                free(req);
+                return 0;
+            }
+            conn->out = out;
+            conn->out_cap = cap;
+        }
+        memcpy(conn->out + conn->out_len, req->text, req->len);
+        conn->out_len += req->len;
+    }
+
+    req->prev = conn->tail;
+    if (conn->tail) conn->tail->next = req;
+    else conn->head = req;
+    conn->tail = req;
+    wc_request_t **bucket = &conn->buckets[req->id % WC_BUCKETS];
+    req->hash_next = *bucket;
+    *bucket = req;
+    conn->pending++;
+
+    // Either may fail every request if the peer is gone
+    uint64_t id = req->id;
+    if (conn->is_stream) {
+        if (!conn->loop->corked) wc_flush(conn);
+    } else if (conn->events & EPOLLOUT) {
+        req->retry_ns = 0;                  // queue behind the requests already waiting
+    } else {
+        wc_send_datagram(conn, req, now);
+    }
+    return id;
+}
+
+static void wc_future_done(void *arg, int status, const char *reply) {
+    wc_future_t *future = arg;
+    future->status = status;
+    snprintf(future->reply, sizeof(future->reply), "%s", reply);
+    future->done = 1;
+}
+
+/**
+ * wc_submit_future - wc_submit() that fills in a future instead of calling back
+ * A request that cannot be sent completes the future at once with WC_ERROR
+ */
+uint64_t wc_submit_future(wc_conn_t *conn, const char *request, int timeout_ms, wc_future_t *future) {
+    future->done = 0;
+    future->status = WC_ERROR;
+    future->reply[0] = '\0';
+    uint64_t id = wc_submit(conn, request, timeout_ms, wc_future_done, future);
+    if (id == 0) future->done = 1;
+    return id;
+}
+
+/**
+ * wc_call - sends one request and waits for its reply (a blocking round trip)
+ * Returns the status; reply holds the reply text on WC_OK
+ */
+int wc_call(wc_conn_t *conn, const char *request, int timeout_ms, char *reply, size_t size) {
+    wc_future_t future;
+    wc_submit_future(conn, request, timeout_ms, &future);
+    int status = wc_wait(conn->loop, &future);
+    if (size > 0) snprintf(reply, size, "%s", future.reply);
+    return status;
+}
+
+// Request routed by a balancer; endpoint->probing requests have no callback
+typedef struct {
+    wc_endpoint_t *endpoint;
+    wc_callback_t callback;
+    void *arg;
+} wc_routed_t;
+
+static void wc_endpoint_down(wc_endpoint_t *endpoint) {
+    if (endpoint->state == WC_ENDPOINT_DOWN)
+        return;
+    endpoint->state = WC_ENDPOINT_DOWN;
+    endpoint->next_ns = wc_now_ns() + (unsigned long long)endpoint->backoff_ms * 1000000ULL;
+}
+
+/**
+ * wc_endpoint_result - health bookkeeping for one finished request or probe
+ */
+static void wc_endpoint_result(wc_endpoint_t *endpoint, int status) {
+    if (status == WC_OK) {
+        endpoint->fails = 0;
+        return;
+    }
+    endpoint->failed++;
+    if (status != WC_TIMEOUT || ++endpoint->fails >= WC_MAX_FAILS) {
+        wc_endpoint_down(endpoint);
+    }
+}
+
+static void wc_routed_done(void *arg, int status, const char *reply) {
+    wc_routed_t *routed = arg;
+    wc_endpoint_result(routed->endpoint, status);
+    routed->callback(routed->arg, status, reply);
+    free(routed);
+}
+
+static void wc_probe_done(void *arg, int status, const char *reply) {
+    wc_endpoint_t *endpoint = arg;
+    endpoint->probing = 0;
+    if (endpoint->state == WC_ENDPOINT_DOWN)
+        return;                             // answer from a connection already given up
+    if (status == WC_OK && strstr(reply, "draining") != NULL) {
+        wc_endpoint_down(endpoint);         // alive, but wants no new requests
+        return;
+    }
+    wc_endpoint_result(endpoint, status);
+    if (status == WC_OK) {
+        endpoint->state = WC_ENDPOINT_UP;
+        endpoint->backoff_ms = endpoint->balancer->check_ms;
+    }
+}
+
+static void wc_endpoint_notice(void *arg, int status, const char *line) {
+    wc_endpoint_t *endpoint = arg;
+    if (strncmp(line, "Server shutting down", 20) == 0) {
+        wc_endpoint_down(endpoint);
+    }
+    if (endpoint->balancer->notice != NULL) {
+        endpoint->balancer->notice(endpoint->balancer->notice_arg, status, line);
+    }
+}
+
+/**
+ * wc_endpoint_connect - (re)opens an endpoint's connection; probed right away
+ */
+static int wc_endpoint_connect(wc_endpoint_t *endpoint) {
+    wc_balancer_t *balancer = endpoint->balancer;
+    unsigned long long now = wc_now_ns();
+    endpoint->conn = wc_connect(balancer->loop, endpoint->transport, endpoint->address, endpoint->port);
+    if (endpoint->conn == NULL) {
+        endpoint->state = WC_ENDPOINT_DOWN;
+        endpoint->next_ns = now + (unsigned long long)endpoint->backoff_ms * 1000000ULL;
+        endpoint->backoff_ms *= 2;
+        if (endpoint->backoff_ms > WC_RECONNECT_MAX_MS) endpoint->backoff_ms = WC_RECONNECT_MAX_MS;
+        return -1;
+    }
+    wc_set_notice(endpoint->conn, wc_endpoint_notice, endpoint);
+    wc_set_tagged(endpoint->conn, balancer->tagged);
+    endpoint->state = WC_ENDPOINT_UNKNOWN;
+    endpoint->fails = 0;
+    endpoint->probing = 0;
+    endpoint->next_ns = now;
+    return 0;
+}
+
+/**
+ * wc_balancer_timers - closes failed endpoints, reconnects and probes the due ones
+ * Runs outside callbacks, so closing a connection is safe here
+ * Returns the milliseconds until the next of these, -1 if none
+ */
+static int wc_balancer_timers(wc_balancer_t *balancer) {
+    unsigned long long next = 0;
+    for (int k = 0; k < balancer->count; k++) {
+        wc_endpoint_t *endpoint = &balancer->endpoints[k];
+        if (endpoint->conn != NULL && !wc_connected(endpoint->conn)) {
+            wc_endpoint_down(endpoint);     // the server hung up with nothing in flight
+        }
+        if (endpoint->state == WC_ENDPOINT_DOWN && endpoint->conn != NULL) {
+            wc_close(endpoint->conn);
+            endpoint->conn = NULL;
+            endpoint->probing = 0;
+        }
+        unsigned long long now = wc_now_ns();
+        if (endpoint->conn == NULL && now >= endpoint->next_ns) {
+            wc_endpoint_connect(endpoint);
+        }
+        if (endpoint->conn != NULL && !endpoint->probing && now >= endpoint->next_ns) {
+            endpoint->probing = 1;
+            endpoint->next_ns = now + (unsigned long long)balancer->check_ms * 1000000ULL;
+            if (wc_submit(endpoint->conn, "STATUS", balancer->check_ms, wc_probe_done, endpoint) == 0) {
+                endpoint->probing = 0;
+                wc_endpoint_down(endpoint);
+            }
+        }
+        if (!endpoint->probing && (next == 0 || endpoint->next_ns < next)) next = endpoint->next_ns;
+    }
+    if (next == 0)
+        return -1;
+    unsigned long long now = wc_now_ns();
+    return next <= now ? 0 : (int)((next - now + 999999ULL) / 1000000ULL);
+}
+
+/**
+ * wc_balancer_create - a balancer on the loop; the loop destroys it with itself
+ * check_ms is the probe interval and the first reconnect delay
+ */
+wc_balancer_t *wc_balancer_create(wc_loop_t *loop, wc_policy_t policy, int check_ms) {
+    wc_balancer_t *balancer = calloc(1, sizeof(*balancer));
+    if (balancer == NULL)
+        return NULL;
+    balancer->loop = loop;
+    balancer->policy = policy;
+    balancer->check_ms = check_ms > 0 ? check_ms : 1000;
+    balancer->seed = (unsigned int)wc_now_ns() ^ (unsigned int)getpid();
+    balancer->next_balancer = loop->balancers;
+    loop->balancers = balancer;
+    return balancer;
+}
+
+/**
+ * wc_balancer_destroy - closes every endpoint (failing their requests)
+ */
+void wc_balancer_destroy(wc_balancer_t *balancer) {
+    wc_balancer_t **link = &balancer->loop->balancers;
+    while (*link != balancer) link = &(*link)->next_balancer;
+    *link = balancer->next_balancer;
+    for (int k = 0; k < balancer->count; k++) {
+        if (balancer->endpoints[k].conn != NULL) {
+            wc_close(balancer->endpoints[k].conn);
+        }
+    }
+    free(balancer);
+}
+
+/**
+ * wc_balancer_add - adds an endpoint (same arguments as wc_connect)
+ * An endpoint that cannot be reached yet is kept and retried
+ * Returns 0 if it connected, -1 (errno set) if not
+ */
+int wc_balancer_add(wc_balancer_t *balancer, wc_transport_t transport, const char *host_or_path, int port) {
+    if (balancer->count == WC_MAX_ENDPOINTS || strlen(host_or_path) >= sizeof(balancer->endpoints[0].address)) {
+        errno = balancer->count == WC_MAX_ENDPOINTS ? ENOSPC : ENAMETOOLONG;
+        return -1;
+    }
+    wc_endpoint_t *endpoint = &balancer->endpoints[balancer->count++];
+    memset(endpoint, 0, sizeof(*endpoint));
+    endpoint->balancer = balancer;
+    endpoint->transport = transport;
+    strcpy(endpoint->address, host_or_path);
+    endpoint->port = port;
+    endpoint->backoff_ms = balancer->check_ms;
+    return wc_endpoint_connect(endpoint);
+}
+
+/**
+ * wc_balancer_set_notice - notice callback for every endpoint's connection
+ */
+void wc_balancer_set_notice(wc_balancer_t *balancer, wc_callback_t callback, void *arg) {
+    balancer->notice = callback;
+    balancer->notice_arg = arg;
+}
+
+/**
+ * wc_balancer_set_tagged - wc_set_tagged() for every endpoint's connection
+ */
+void wc_balancer_set_tagged(wc_balancer_t *balancer, int tagged) {
+    balancer->tagged = tagged;
+    for (int k = 0; k < balancer->count; k++) {
+        if (balancer->endpoints[k].conn != NULL) {
+            wc_set_tagged(balancer->endpoints[k].conn, tagged);
+        }
+    }
+}
+
+/**
+ * wc_balancer_pick - chooses an endpoint among those not tried yet
+ * Endpoints whose probe answered are preferred over ones not probed yet
+ * Returns its index, or -1 if none is usable
+ */
+static int wc_balancer_pick(wc_balancer_t *balancer, uint32_t tried) {
+    int candidates[WC_MAX_ENDPOINTS];
+    int count = 0;
+    for (int state = WC_ENDPOINT_UP; state >= WC_ENDPOINT_UNKNOWN && count == 0; state--) {
+        for (int n = 0; n < balancer->count; n++) {
+            int k = (balancer->next + n) % balancer->count;
+            wc_endpoint_t *endpoint = &balancer->endpoints[k];
+            if (endpoint->state == state && endpoint->conn != NULL && !(tried & (1U << k))) {
+                candidates[count++] = k;
+            }
+        }
+    }
+    if (count == 0)
+        return -1;
+
+    int best = candidates[0];
+    if (balancer->policy == WC_TWO_CHOICES) {
+        if (count > 1) {
+            int first = rand_r(&balancer->seed) % count;
+            int second = rand_r(&balancer->seed) % (count - 1);
+            if (second >= first) second++;
+            best = candidates[first];
+            if (wc_pending(balancer->endpoints[candidates[second]].conn) < wc_pending(balancer->endpoints[best].conn)) {
+                best = candidates[second];
+            }
+        }
+    } else {
+        for (int n = 1; n < count; n++) {
+            if (wc_pending(balancer->endpoints[candidates[n]].conn) < wc_pending(balancer->endpoints[best].conn)) {
+                best = candidates[n];
+            }
+        }
+        balancer->next = (best + 1) % balancer->count;
+    }
+    return best;
+}
+
+/**
+ * wc_balancer_route - submits on the preferred endpoint if it is usable, else
+ * on the one the policy picks (preferred -1: always the policy)
+ * An endpoint that cannot take the request is taken out and the next one
+ * tried. Requests already sent are not moved: the endpoint may have run them
+ */
+static uint64_t wc_balancer_route(wc_balancer_t *balancer, int preferred, const char *request, int timeout_ms,
+                                  wc_callback_t callback, void *arg) {
+    uint32_t tried = 0;
+    int k;
+    while (1) {
+        if (preferred != -1 && !(tried & (1U << preferred)) && balancer->endpoints[preferred].conn != NULL &&
+            balancer->endpoints[preferred].state != WC_ENDPOINT_DOWN) {
+            k = preferred;
+        } else if ((k = wc_balancer_pick(balancer, tried)) == -1) {
+            break;
+        }
+        wc_endpoint_t *endpoint = &balancer->endpoints[k];
+        tried |= 1U << k;
+        wc_routed_t *routed = malloc(sizeof(*routed));
+        if (routed == NULL)
+            return 0;
+        routed->endpoint = endpoint;
+        routed->callback = callback;
+        routed->arg = arg;
+        uint64_t id = wc_submit(endpoint->conn, request, timeout_ms, wc_routed_done, routed);
+        if (id != 0) {
+            endpoint->sent++;
+            return id;
+        }
+        free(routed);
+        if (wc_connected(endpoint->conn))
+            return 0;                       // the request itself is bad (too long)
+        wc_endpoint_down(endpoint);
+    }
+    errno = ENOTCONN;
+    return 0;
+}
+
+/**
+ * wc_balancer_submit - wc_submit() on the endpoint the policy picks
+ * Returns the request ID, or 0 if no endpoint could take it
+ */
+uint64_t wc_balancer_submit(wc_balancer_t *balancer, const char *request, int timeout_ms,
+                            wc_callback_t callback, void *arg) {
+    return wc_balancer_route(balancer, -1, request, timeout_ms, callback, arg);
+}
+
+/**
+ * wc_balancer_submit_keyed - wc_balancer_submit() that sends every request
+ * with the same key to the same endpoint while it is usable, so a stream
+ * server runs them in order (session affinity)
+ */
+uint64_t wc_balancer_submit_keyed(wc_balancer_t *balancer, unsigned int key, const char *request, int timeout_ms,
+                                  wc_callback_t callback, void *arg) {
+    if (balancer->count == 0) {
+        errno = ENOTCONN;
+        return 0;
+    }
+    return wc_balancer_route(balancer, (int)(key % (unsigned int)balancer->count), request, timeout_ms,
+                             callback, arg);
+}
+
+/**
+ * wc_balancer_call - wc_call() through the balancer
+ */
+int wc_balancer_call(wc_balancer_t *balancer, const char *request, int timeout_ms, char *reply, size_t size) {
+    wc_future_t future = {0, WC_ERROR, ""};
+    if (wc_balancer_submit(balancer, request, timeout_ms, wc_future_done, &future) == 0) {
+        future.done = 1;
+    }
+    int status = wc_wait(balancer->loop, &future);
+    if (size > 0) snprintf(reply, size, "%s", future.reply);
+    return status;
+}
+
+/**
+ * wc_balancer_available - endpoints that would take a request now
+ */
+int wc_balancer_available(const wc_balancer_t *balancer) {
+    int available = 0;
+    for (int k = 0; k < balancer->count; k++) {
+        if (balancer->endpoints[k].state != WC_ENDPOINT_DOWN && balancer->endpoints[k].conn != NULL) {
+            available++;
+        }
+    }
+    return available;
+}
+
+/**
+ * wc_balancer_print - one line per endpoint: state, requests in flight, totals
+ */
+void wc_balancer_print(const wc_balancer_t *balancer, FILE *out) {
+    static const char *state_names[] = {"unknown", "up", "down"};
+    for (int k = 0; k < balancer->count; k++) {
+        const wc_endpoint_t *endpoint = &balancer->endpoints[k];
+        char name[128];
+        if (endpoint->transport == WC_TCP || endpoint->transport == WC_UDP) {
+            snprintf(name, sizeof(name), "%s:%d", endpoint->address, endpoint->port);
+        } else {
+            snprintf(name, sizeof(name), "%s", endpoint->address);
+        }
+        fprintf(out, "  %-24s %-7s pending=%d sent=%llu failed=%llu\n", name, state_names[endpoint->state],
+                endpoint->conn != NULL ? wc_pending(endpoint->conn) : 0, endpoint->sent, endpoint->failed);
+    }
+}
@@ -0,0 +1,103 @@
+/**
+ * warehouse_client.h - q5
+ *
+ * Asynchronous client library for the warehouse servers (uds_warehouse and
+ * persistent_warehouse). A connection is TCP, UDP, UDS stream, UDS datagram
+ * or UDS seqpacket, and any number of requests can be in flight on it.
+ *
+ * Stream replies are matched to requests first in, first out (pipelining).
+ * Datagram requests get an ID= tag and are retransmitted with exponential
+ * backoff until their timeout; persistent_warehouse echoes the ID in the
+ * reply, and untagged replies go to the oldest request. wc_set_tagged() tags
+ * stream requests the same way, so a server that echoes the ID may complete
+ * them in any order. Seqpacket requests are tagged like datagrams but never
+ * retransmitted, since the connection is reliable.
+ *
+ * Completion is reported to a callback, or through a wc_future_t that
+ * wc_wait() drives the loop for. All connections of a wc_loop_t share one
+ * epoll instance; wc_loop_fd() lets an application nest it in its own loop.
+ *
+ * A wc_balancer_t spreads requests over several servers: it picks the
+ * endpoint with the fewest requests in flight (or the better of two random
+ * ones), health-checks each endpoint and reconnects the ones that failed.
+ */
+
+#ifndef WAREHOUSE_CLIENT_H
+#define WAREHOUSE_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define WC_REQUEST_SIZE 256                 // longest request line, ID= included
+#define WC_REPLY_SIZE 512                   // longest reply passed to a callback
+#define WC_MAX_ENDPOINTS 32                 // per balancer
+
+typedef enum {
+    WC_TCP,
+    WC_UDP,
+    WC_UDS_STREAM,
+    WC_UDS_DATAGRAM,
+    WC_UDS_SEQPACKET                        // persistent_warehouse -S only
+} wc_transport_t;
+
+typedef enum {
+    WC_LEAST_PENDING,                       // fewest requests in flight
+    WC_TWO_CHOICES                          // better of two random endpoints
+} wc_policy_t;
+
+// Request outcomes
+#define WC_OK 0
+#define WC_TIMEOUT -1                       // no reply in time; it may still have been processed
+#define WC_CLOSED -2                        // connection lost; it may still have been processed
+#define WC_ERROR -3                         // could not be sent
+
+typedef struct wc_loop wc_loop_t;
+typedef struct wc_conn wc_conn_t;
+typedef struct wc_balancer wc_balancer_t;
+
+// Called once per request with a NUL-terminated reply (without the ID= echo),
+// or with reply "" when status is not WC_OK. Also used for notices: lines a
+// stream server sends on its own (welcome, shutdown), with status WC_OK.
+typedef void (*wc_callback_t)(void *arg, int status, const char *reply);
+
+typedef struct {
+    int done;
+    int status;
+    char reply[WC_REPLY_SIZE];
+} wc_future_t;
+
+wc_loop_t *wc_loop_create(void);
+void wc_loop_destroy(wc_loop_t *loop);
+int wc_loop_fd(const wc_loop_t *loop);
+int wc_loop_run(wc_loop_t *loop, int timeout_ms);
+void wc_loop_cork(wc_loop_t *loop, int corked);
+int wc_wait(wc_loop_t *loop, wc_future_t *future);
+
+wc_conn_t *wc_connect(wc_loop_t *loop, wc_transport_t transport, const char *host_or_path, int port);
+void wc_close(wc_conn_t *conn);
+void wc_set_notice(wc_conn_t *conn, wc_callback_t callback, void *arg);
+void wc_set_tagged(wc_conn_t *conn, int tagged);
+int wc_conn_fd(const wc_conn_t *conn);
+wc_loop_t *wc_conn_loop(const wc_conn_t *conn);
+int wc_connected(const wc_conn_t *conn);
+int wc_pending(const wc_conn_t *conn);
+
+uint64_t wc_submit(wc_conn_t *conn, const char *request, int timeout_ms, wc_callback_t callback, void *arg);
+uint64_t wc_submit_future(wc_conn_t *conn, const char *request, int timeout_ms, wc_future_t *future);
+int wc_call(wc_conn_t *conn, const char *request, int timeout_ms, char *reply, size_t size);
+
+wc_balancer_t *wc_balancer_create(wc_loop_t *loop, wc_policy_t policy, int check_ms);
+void wc_balancer_destroy(wc_balancer_t *balancer);
+int wc_balancer_add(wc_balancer_t *balancer, wc_transport_t transport, const char *host_or_path, int port);
+void wc_balancer_set_notice(wc_balancer_t *balancer, wc_callback_t callback, void *arg);
+void wc_balancer_set_tagged(wc_balancer_t *balancer, int tagged);
+uint64_t wc_balancer_submit(wc_balancer_t *balancer, const char *request, int timeout_ms,
+                            wc_callback_t callback, void *arg);
+uint64_t wc_balancer_submit_keyed(wc_balancer_t *balancer, unsigned int key, const char *request, int timeout_ms,
+                                  wc_callback_t callback, void *arg);
+int wc_balancer_call(wc_balancer_t *balancer, const char *request, int timeout_ms, char *reply, size_t size);
+int wc_balancer_available(const wc_balancer_t *balancer);
+void wc_balancer_print(const wc_balancer_t *balancer, FILE *out);
+
+#endif
@@ -0,0 +1,67 @@
+/**
+ * inventory_feed.h - q6
+ *
+ * Packet format of the inventory feed that persistent_warehouse -M sends
+ * to a multicast (or broadcast) group. Every packet is a full snapshot,
+ * numbered by feed_seq so receivers can count lost packets. A receiver that
+ * sees a gap (or has just joined) sends "SNAPSHOT" to the server's UDP
+ * port and gets the same packet back by unicast, with FEED_FLAG_SNAPSHOT set.
+ * All fields are big-endian on the wire.
+ */
+
+#ifndef INVENTORY_FEED_H
+#define INVENTORY_FEED_H
+
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
+#define FEED_MAGIC 0x31464857U               // "WHF1"
+#define FEED_FLAG_SNAPSHOT 1U                // unicast answer to SNAPSHOT
+#define FEED_HEARTBEAT_MS 1000               // resend unchanged state this often
+
+typedef struct {
+    uint32_t magic;
+    uint32_t flags;
+    uint64_t session;                   // changes when the server restarts
+    uint64_t feed_seq;                  // packets sent to the group so far
+    uint64_t inventory_seq;
+    uint64_t carbon, oxygen, hydrogen;
+} feed_packet_t;
+
+/**
+ * feed_encode - converts a packet to wire byte order in place
+ */
+static inline void feed_encode(feed_packet_t *packet) {
+    packet->magic = htobe32(packet->magic);
+    packet->flags = htobe32(packet->flags);
+    packet->session = htobe64(packet->session);
+    packet->feed_seq = htobe64(packet->feed_seq);
+    packet->inventory_seq = htobe64(packet->inventory_seq);
+    packet->carbon = htobe64(packet->carbon);
+    packet->oxygen = htobe64(packet->oxygen);
+    packet->hydrogen = htobe64(packet->hydrogen);
+}
+
+/**
+ * feed_decode - checks and converts a received packet to host byte order
+ * Returns 0 on success, -1 if the datagram is not a feed packet
+ */
+static inline int feed_decode(const void *buf, size_t len, feed_packet_t *packet) {
+    if (len != sizeof(feed_packet_t))
+        return -1;
+    memcpy(packet, buf, sizeof(*packet));
+    packet->magic = be32toh(packet->magic);
+    if (packet->magic != FEED_MAGIC)
+        return -1;
+    packet->flags = be32toh(packet->flags);
+    packet->session = be64toh(packet->session);
+    packet->feed_seq = be64toh(packet->feed_seq);
+    packet->inventory_seq = be64toh(packet->inventory_seq);
+    packet->carbon = be64toh(packet->carbon);
+    packet->oxygen = be64toh(packet->oxygen);
+    packet->hydrogen = be64toh(packet->hydrogen);
+    return 0;
+}
+
+#endif
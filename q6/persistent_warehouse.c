@@ -8,6 +8,8 @@
  *   ./persistent_warehouse -T <tcp_port> -U <udp_port> [options]
  *   ./persistent_warehouse -s <stream_path> -d <datagram_path> [options]
  *   ./persistent_warehouse -f <save_file> [options]
+ *   ./persistent_warehouse -N <node_id> -P <peer> -P <peer> -P <peer> [options]
+ *   ./persistent_warehouse -A <atom> -s <stream_path> -f <save_file> [options]
  */
 
 #include <stdio.h>
@@ -21,21 +23,560 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 #include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <pthread.h>
+#include <time.h>
 #include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+
+#include "raft.h"
+#include "../q5/shm_ring.h"
+#include "warehouse_view.h"
+#include "inventory_feed.h"
 
 #define MAX_CLIENTS 10
 #define BUFFER_SIZE 256
 #define MAX_ATOMS 1000000000000000000ULL
 
+#define INVENTORY_MAGIC 0x31534857U          // "WHS1"
+#define INVENTORY_VERSION 1
+#define JOURNAL_MAGIC 0x314A4857U            // "WHJ1"
+#define JOURNAL_SCAN_CHUNK (4 * 1024 * 1024)
+#define JOURNAL_CHECKPOINT_BYTES (64ULL * 1024 * 1024)
+#define CRC32C_POLY 0x82F63B78U
+#define MAX_FOLLOWERS 16
+#define LEADER_RETRY_SEC 1
+#define MAX_PENDING_REPLIES 65536
+#define STREAM_BUFFER_SIZE 4096
+#define MAX_PREPARED 4096
+#define MAX_SHM_CLIENTS 64
+#define WATCH_LINE_SIZE 160
+#define CONN_QUEUE_MAX (64 * 1024)              // queued output that stops reading from a client
+
+// On-disk save file header, followed by nothing else for now
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;
+    uint64_t seq;
+    uint64_t carbon, oxygen, hydrogen;
+    uint32_t crc;                       // CRC32C of all preceding fields
+    uint32_t reserved;
+} inventory_header_t;
+
+// Journal record: full inventory state, appended before the header rewrite
+typedef struct {
+    uint32_t magic;
+    uint32_t crc;                       // CRC32C of seq and counters
+    uint64_t seq;
+    uint64_t carbon, oxygen, hydrogen;
+} journal_record_t;
+
 // Global variable for timeout
 volatile int timeout_occurred = 0;
+volatile sig_atomic_t reload_requested = 0;    // SIGHUP received
+
+// Runtime tunables. Command-line flags set base_config, the config file (-C)
+// overrides it; SIGHUP or admin RELOAD rebuilds the whole set from the file
+// and swaps it in between two requests, so connections stay up.
+#define LOG_ERROR 0                     // errors only
+#define LOG_INFO 1                      // plus connections
+#define LOG_REQUEST 2                   // plus every request (default)
+
+typedef struct {
+    unsigned long long atoms[3];        // CARBON, OXYGEN, HYDROGEN per molecule
+} recipe_t;
+
+// Token buckets: ADD and DELIVER are limited separately, per connection and
+// per source address (IPv4 address, UDS peer uid, or UDS datagram sender path)
+#define RATE_ADD 0
+#define RATE_DELIVER 1
+#define RATE_CONNECTION 0
+#define RATE_ADDRESS 1
+#define RATE_REPLY_SIZE 128
+
+typedef struct {
+    unsigned long long rate;            // tokens per second, 0 = unlimited
+    unsigned long long burst;           // bucket size
+} rate_limit_t;
+
+// Optional KEY=VALUE tokens at the end of a request line, e.g.
+// "DELIVER WATER 3 DL=1718000000000 PRI=2". A request with ID= gets it echoed
+// at the end of every reply line, so stream replies need not come in order.
+#define REQUEST_DEFAULT_PRIORITY 5      // PRI= ranges from 0 (lowest) to 9
+#define REQUEST_MAX_PRIORITY 9
+#define REQUEST_ID_SIZE 40              // ID= is at most 39 characters
+
+typedef struct {
+    unsigned long long deadline_ms;     // DL=: CLOCK_REALTIME ms, 0 = none
+    int priority;                       // PRI=
+    unsigned long long wait_ms;         // WAIT=: park a DELIVER this long, 0 = fail at once
+    char request_id[REQUEST_ID_SIZE];   // ID=: client-chosen, retransmits reuse it, "" = none
+} request_options_t;
+
+typedef struct {
+    unsigned long long max_atoms;       // storage limit per atom, and per ADD
+    int max_clients;                    // concurrent stream clients, 0 = unlimited
+    int backlog;                        // listen() backlog of the client sockets
+    int timeout_seconds;                // idle shutdown, 0 = never
+    int log_level;
+    unsigned long long bgsave_change_threshold;     // 0 = no change trigger
+    int bgsave_interval;                            // 0 = no timer trigger
+    int watch_interval_ms;
+    recipe_t recipes[4];                // indexed like molecule_names
+    rate_limit_t rate_limits[2][2];     // [RATE_ADD/RATE_DELIVER][RATE_CONNECTION/RATE_ADDRESS]
+    char rate_replies[2][RATE_REPLY_SIZE];          // empty = drop silently
+    int shed_stale_ms;                  // drop datagrams queued longer, 0 = off
+    int shed_busy_ms;                   // queue age that counts as overload, 0 = off
+    int shed_min_priority;              // under overload, shed requests below this PRI=
+    int max_wait_ms;                    // upper bound for WAIT=
+    int dedupe_ttl_ms;                  // how long a DELIVER reply is kept for retransmits
+    int welcome;                        // greet new stream clients with the inventory
+} config_t;
+
+config_t base_config = {
+    MAX_ATOMS, 0, SOMAXCONN, 0, LOG_REQUEST, 0, 0, 100,
+    {{{0, 1, 2}}, {{1, 2, 0}}, {{2, 1, 6}}, {{6, 6, 12}}},
+    {{{0, 0}, {0, 0}}, {{0, 0}, {0, 0}}},
+    {"ERROR: Rate limit exceeded, slow down.", "ERROR: Rate limit exceeded, slow down."},
+    0, 0, REQUEST_DEFAULT_PRIORITY, 30000, 60000, 1
+};
+config_t config;
+char *config_path = NULL;
+unsigned long long config_generation = 0;       // bumped by every successful reload
+unsigned long long config_reloads = 0, config_reload_failures = 0;
+const char *log_level_names[3] = {"error", "info", "request"};
 
 // File handle for inventory file
 int inventory_fd = -1;
+int journal_fd = -1;
+unsigned long long journal_bytes = 0;
+unsigned long long inventory_seq = 0;
 char *save_file_path = NULL;
 
+// CRC32C implementation picked at startup (SSE4.2 or slicing-by-8 tables)
+uint32_t crc32c_table[8][256];
+uint32_t (*crc32c_impl)(uint32_t crc, const unsigned char *buf, size_t len);
+
+// Background persistence: the event loop publishes inventory versions into two
+// alternating slots, the writer thread picks up the newest one and saves it
+typedef struct {
+    unsigned long long lock;        // odd while the slot is being written
+    unsigned long long seq;
+    unsigned long long carbon, oxygen, hydrogen;
+    unsigned long long publish_ns;
+} persist_slot_t;
+
+persist_slot_t persist_slots[2];
+unsigned long long persist_publish_count = 0;   // selects the slot, event loop only
+unsigned long long persist_published_seq = 0;   // written by event loop only
+unsigned long long persist_saved_seq = 0;       // written by writer thread only
+int persist_wake_fd = -1;
+int persist_stop = 0;
+int persist_thread_running = 0;
+pthread_t persist_thread;
+
+// Replication: a leader streams journal records (snapshot, then every change)
+// to followers, which apply them and serve read-only queries
+typedef struct {
+    int fd;
+    int is_uds;
+    unsigned long long sent_seq;
+    journal_record_t out;               // record currently being sent
+    size_t out_off, out_len;
+    int dirty;                          // newer state than the queued record
+} follower_t;
+
+follower_t followers[MAX_FOLLOWERS];
+int follower_count = 0;
+int repl_tcp_fd = -1, repl_uds_fd = -1;
+char *repl_path = NULL;
+
+char *leader_spec = NULL;               // set on followers: HOST:PORT or UDS path
+int leader_fd = -1;
+int leader_connecting = 0;
+time_t leader_retry_time = 0;
+unsigned char leader_buf[sizeof(journal_record_t)];
+size_t leader_buf_len = 0;
+unsigned long long repl_records_applied = 0;
+unsigned long long repl_bad_records = 0;
+
+// Raft cluster mode: ADD and DELIVER are proposed to the replicated log and
+// answered once the entry is committed and applied
+typedef struct {
+    uint64_t index;                     // log index, 0 = free slot
+    int fd;
+    unsigned long long conn_gen;        // stream and seqpacket clients: detects a reused fd
+    int is_datagram;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    unsigned long long dedupe_serial;   // retransmit cache entry to fill in, 0 = none
+    char request_id[REQUEST_ID_SIZE];   // echoed in the reply
+} pending_reply_t;
+
+int cluster_mode = 0;
+int node_id = -1;
+raft_peer_t cluster_peers[RAFT_MAX_PEERS];
+int cluster_size = 0;
+pending_reply_t *pending_replies = NULL;
+unsigned long long *cluster_inventory[3];       // main's counters, changed by applied entries
+unsigned long long cluster_rejected = 0;        // committed but refused by the stock check
+unsigned long long cluster_unknown = 0;         // clients told the outcome is unknown
+
+const char *atom_names[3] = {"CARBON", "OXYGEN", "HYDROGEN"};
+const char *molecule_names[4] = {"WATER", "CARBON DIOXIDE", "ALCOHOL", "GLUCOSE"};
+
+// Sharding: a shard owns one atom type; multi-atom DELIVERs run as a
+// two-phase commit driven by warehouse_coordinator over the stream socket.
+// A hold belongs to its txid, not to a connection: it outlives a dropped
+// coordinator connection until the coordinator comes back and decides it
+typedef struct {
+    unsigned long long txid;            // 0 = free slot
+    unsigned long long amount;          // atoms held until COMMIT or ABORT
+} prepared_txn_t;
+
+int shard_atom = -1;                    // index into atom_names, -1 = all atoms
+int shard_coordinator_fd = -1;          // the connection that sent COORDINATOR
+int shard_held = 0;                     // prepared transactions not decided yet
+prepared_txn_t prepared_txns[MAX_PREPARED];
+unsigned long long shard_reserved = 0;
+unsigned long long shard_prepared = 0, shard_refused = 0;
+unsigned long long shard_committed = 0, shard_aborted = 0;
+char shard_reply[2 * STREAM_BUFFER_SIZE];
+size_t shard_reply_len = 0;
+
+// Shared-memory clients: UDS stream connections upgraded with "SHM"
+typedef struct {
+    int ctl_fd;                         // the UDS stream connection
+    shm_channel_t *chan;                // NULL = free slot
+    int req_efd;                        // client -> server wakeups
+    int resp_efd;                       // server -> client wakeups
+} shm_client_t;
+
+shm_client_t shm_clients[MAX_SHM_CLIENTS];
+int shm_client_count = 0;
+int shm_poll_us = 0;                    // spin on the rings this long before sleeping
+int shm_reply_fd = -1;                  // connection whose ring command is running
+char stream_reply_id[REQUEST_ID_SIZE];  // ID= of the stream command that is running
+char shm_reply[SHM_SLOT_SIZE - sizeof(uint32_t)];
+size_t shm_reply_len = 0;
+unsigned long long shm_requests = 0, shm_wakeups = 0, shm_dropped = 0;
+
+// UDS SOCK_SEQPACKET clients: the kernel keeps message boundaries, so every
+// message is one command and its whole reply goes back as one message
+int seqpacket_reply_fd = -1;            // connection whose command is running
+char seqpacket_reply[2 * BUFFER_SIZE];
+size_t seqpacket_reply_len = 0;
+
+// Seqlock-protected inventory view mapped by local monitors (warehouse_top)
+warehouse_view_t *view = NULL;
+char *view_path = NULL;
+unsigned long long stream_requests = 0, datagram_requests = 0;
+unsigned long long delivered_count = 0, deliver_failures = 0;
+
+// Output queue and WATCH state of a client connection, allocated when a reply
+// does not fit the socket or the client subscribes. Client sockets are
+// non-blocking: what a socket does not take waits in the queue until EPOLLOUT.
+// WATCH subscribers: every config.watch_interval_ms the ones behind the
+// current inventory version get one line with the newest values (latest wins)
+typedef struct {
+    int index;                                  // position in watch_fds, -1 = not watching
+    int behind;                                 // skipped a push while its queue was not empty
+    unsigned long long sent[3];                 // values in the last push
+    uint32_t events;                            // epoll events armed for the fd
+    size_t out_len, out_cap;
+    size_t head_sent;                           // bytes of the first queued message already sent
+    char *out;                                  // queued messages, each after its uint32_t length
+} conn_side_t;
+
+int *watch_fds = NULL;                          // conn_capacity entries
+int watch_count = 0;
+unsigned long long watch_batch_seq = 0;         // inventory version of the last batch
+unsigned long long watch_batch_ns = 0;
+int watch_backlogged = 0;                       // subscribers with behind set
+unsigned long long sends_deferred = 0;          // replies a client socket did not take at once
+unsigned long long watch_pushes = 0, watch_batches = 0, watch_skipped = 0;
+
+// Multicast / broadcast inventory feed for LAN consumers
+int feed_fd = -1;
+struct sockaddr_in feed_addr;
+char *feed_interface = NULL;                    // local address to send multicast from
+int feed_rate_hz = 10;                          // max packets per second
+uint64_t feed_session = 0;
+unsigned long long feed_seq = 0;                // packets sent to the group
+unsigned long long feed_sent_inventory_seq = 0;
+unsigned long long feed_last_ns = 0;
+unsigned long long feed_snapshot_requests = 0, feed_send_errors = 0;
+
+// Admin control socket: one command per line, every reply ends with a
+// line starting with "OK" or "ERROR:"
+#define ADMIN_NONE 0
+#define ADMIN_DRAIN 1
+#define ADMIN_SHUTDOWN 2
+
+char *admin_path = NULL;
+int draining = 0;                               // no new clients, exit when the last one leaves
+int view_refresh = 0;                           // capacity changed without an inventory change
+int stream_client_count = 0;
+unsigned long long clients_rejected = 0;        // over config.max_clients
+
+// Rate limiting state. Sources live in an open-addressing hash table with a
+// bounded probe, so a lookup is O(1); when the probed slots are all taken the
+// one idle longest is reused.
+#define RATE_TABLE_SIZE 4096                    // power of two
+#define RATE_PROBE_LIMIT 8
+
+typedef struct {
+    double tokens;
+    unsigned long long last_ns;                 // 0 = bucket starts full
+} rate_bucket_t;
+
+typedef struct {
+    uint64_t key;                               // 0 = free slot
+    rate_bucket_t buckets[2];                   // RATE_ADD, RATE_DELIVER
+    unsigned long long last_ns;
+} rate_source_t;
+
+rate_source_t rate_sources[RATE_TABLE_SIZE];
+unsigned long long rate_rejected[2][2];         // [kind][scope]
+unsigned long long rate_source_count = 0, rate_evictions = 0;
+const char *rate_kind_names[2] = {"add", "deliver"};
+
+// Client connections (stream, seqpacket and admin), indexed by fd. An idle
+// connection costs one conn_t: its input buffer comes from the slab pool only
+// while a partial line is pending. The table is calloc'd for every fd
+// RLIMIT_NOFILE allows, so pages of slots never used are never touched.
+// Clients are watched with epoll, and moved to fds at or above FD_SETSIZE so
+// the low ones stay free for the sockets select() watches.
+#define CONN_FREE 0
+#define CONN_TCP 1
+#define CONN_UDS 2
+#define CONN_SEQPACKET 3
+#define CONN_ADMIN 4
+#define CONN_TABLE_MAX (1 << 20)               // fds, whatever the limit says
+#define CONN_EVENT_BATCH 256
+#define CONN_IDLE_SECONDS 60                    // STATS counts clients quiet this long as idle
+
+typedef struct {
+    unsigned char kind;                         // CONN_*
+    unsigned char framed;                       // client has sent a newline
+    unsigned short len;                         // bytes pending in buf
+    uint32_t peer;                              // IPv4 address (network order) or UDS peer uid
+    uint32_t accepted_s, active_s;              // CLOCK_MONOTONIC seconds
+    char *buf;                                  // slab chunk, NULL = nothing pending
+    conn_side_t *side;                          // NULL = nothing queued, not watching
+    uint32_t gen;                               // bumped on close, detects a reused fd
+    unsigned char gen_pending;                  // admin: a GEN reply is out, input is not read
+    uint64_t source;                            // rate limit source key
+    rate_bucket_t buckets[2];                   // RATE_ADD, RATE_DELIVER
+} conn_t;
+
+conn_t *conns = NULL;
+int conn_capacity = 0;                          // fds below this fit in the table
+int conn_high = -1;                             // highest fd that has been a client
+int conn_counts[5];                             // open connections by kind
+int conn_epoll_fd = -1;
+struct epoll_event conn_events[CONN_EVENT_BATCH];
+const char *conn_kind_names[5] = {"free", "tcp", "uds", "seqpacket", "admin"};
+
+// Connect storms: each wakeup drains a listener's accept queue, up to
+// ACCEPT_BATCH connections so the clients already connected still get
+// served; the welcome line is formatted again only when the inventory changed
+#define ACCEPT_BATCH 64
+
+typedef struct {
+    unsigned long long values[3];               // inventory it shows
+    int len;                                    // 0 = not formatted yet
+    char text[BUFFER_SIZE];
+} welcome_t;
+
+welcome_t welcomes[4];                          // indexed by CONN_TCP..CONN_SEQPACKET
+unsigned long long accept_wakeups = 0, accepted_total = 0, accept_batches_full = 0;
+int accept_max_batch = 0;
+
+// Busy-poll mode: the event loop is pinned to one core and never sleeps,
+// polling every socket with a zero select() timeout. Only the hot memory is
+// locked, so the hot path takes no page faults: the slab blocks, the stack the
+// loop runs on, and the connection table slots of the first clients. The rest
+// of the table and the worker stacks stay pageable, within the memory budget.
+#define BUSY_POLL_SLAB_BLOCKS 8                 // partial-line buffers ready up front
+#define BUSY_POLL_STACK_PREFAULT (256 * 1024)
+#define BUSY_POLL_CONNS 4096                    // table slots locked above FD_SETSIZE
+
+int busy_poll_core = -1;                        // -1 = off
+int busy_poll_usec = 0;                         // SO_BUSY_POLL on the IP sockets, 0 = not set
+size_t busy_poll_locked = 0;                    // bytes mlock()ed
+int busy_poll_lock_errno = 0;                   // first mlock() failure
+unsigned long long busy_spins = 0, busy_idle_spins = 0;
+
+// GEN worker pool: admin GEN queries run on worker threads, so the event loop
+// keeps serving ADD and DELIVER meanwhile. The loop deals jobs round-robin;
+// a worker runs its own newest job first and steals the oldest job of another
+// worker when it has none. Finished jobs go on a completion list and wake the
+// loop through an eventfd. An admin connection is not read while its GEN is
+// out, so its replies stay in order.
+#define GEN_WORKERS_MAX 64
+#define GEN_DEQUE_SIZE 64                       // jobs per worker, a power of two
+
+typedef struct gen_job {
+    struct gen_job *next;                       // completion list
+    int fd;                                     // admin connection
+    unsigned long long gen;                     // conns[fd].gen when submitted
+    int drink;                                  // gen_drink()
+    unsigned long long carbon, oxygen, hydrogen;
+    recipe_t recipes[4];                        // config.recipes when submitted
+    char reply[BUFFER_SIZE];
+} gen_job_t;
+
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    gen_job_t *jobs[GEN_DEQUE_SIZE];
+    unsigned head, tail;                        // thieves take at head, the owner at tail
+    unsigned long long ran, stolen;             // atomic, read by STATS
+} gen_worker_t;
+
+int gen_worker_count = 0;                       // -w, 0 = GEN runs inline
+int gen_workers_running = 0;
+gen_worker_t *gen_workers = NULL;
+unsigned gen_next_worker = 0;
+pthread_mutex_t gen_idle_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t gen_idle_cond = PTHREAD_COND_INITIALIZER;    // signalled on submit and stop
+unsigned gen_wakeups = 0;                       // under gen_idle_lock, bumped on every submit
+int gen_stop = 0;                               // under gen_idle_lock
+pthread_mutex_t gen_done_lock = PTHREAD_MUTEX_INITIALIZER;
+gen_job_t *gen_done = NULL;                     // finished jobs, newest first
+int gen_done_fd = -1;                           // eventfd, readable once a job finished
+unsigned long long gen_submitted = 0, gen_inline = 0, gen_completed = 0, gen_dropped = 0;
+
+// Partial-line buffers: STREAM_BUFFER_SIZE chunks carved from blocks and
+// recycled through a free list. Reads land in stream_scratch, so a client
+// only holds a chunk while a line of it is incomplete.
+#define SLAB_CHUNKS_PER_BLOCK 16
+
+typedef union slab_chunk {
+    union slab_chunk *next;                     // while free
+    char data[STREAM_BUFFER_SIZE];
+} slab_chunk_t;
+
+typedef struct slab_block {
+    struct slab_block *next;
+    slab_chunk_t chunks[SLAB_CHUNKS_PER_BLOCK];
+} slab_block_t;
+
+slab_block_t *slab_blocks = NULL;
+slab_chunk_t *slab_free_list = NULL;
+unsigned long long slab_block_count = 0, slab_in_use = 0, slab_peak = 0;
+char stream_scratch[STREAM_BUFFER_SIZE];
+
+// Load shedding: datagrams carry their kernel receive time (SO_TIMESTAMPNS),
+// so the loop knows how long each one waited in the socket queue
+unsigned long long shed_expired = 0;            // past the client's DL=
+unsigned long long shed_stale = 0;              // queued longer than shed_stale_ms
+unsigned long long shed_priority = 0;           // low PRI= while overloaded
+unsigned long long queue_age_last_us = 0, queue_age_max_us = 0;
+unsigned long long queue_age_total_us = 0, queue_age_count = 0;
+
+// DELIVER ... WAIT=MS: requests that cannot be served yet wait in one FIFO
+// queue per molecule. After inventory changes only the queue heads are
+// checked, so an ADD costs O(molecules + requests it satisfies).
+#define MAX_WAITERS 4096
+
+typedef struct {
+    int next;                           // next in its queue or the free list, -1 = end
+    int fd;                             // datagram socket (or seqpacket connection) to reply on
+    unsigned long long conn_gen;        // seqpacket clients: detects a reused fd
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    unsigned long long quantity;
+    unsigned long long deadline_ns;     // CLOCK_MONOTONIC
+    unsigned long long arrival;         // global order, oldest head is served first
+    unsigned long long dedupe_serial;   // retransmit cache entry to fill in, 0 = none
+    char request_id[REQUEST_ID_SIZE];   // echoed in the reply
+} waiter_t;
+
+waiter_t waiters[MAX_WAITERS];
+int waiter_free = -1;                           // built on first use
+int waiters_ready = 0;
+int waiter_head[4] = {-1, -1, -1, -1}, waiter_tail[4] = {-1, -1, -1, -1};
+int waiter_count = 0;
+unsigned long long waiter_arrivals = 0;
+unsigned long long waiter_next_deadline = 0;    // earliest deadline, may be stale (too early)
+unsigned long long waiter_seen_seq = 0;         // inventory version the heads were checked at
+unsigned long long waiter_seen_generation = 0;  // recipes may change on reload
+unsigned long long waiters_parked = 0, waiters_served = 0, waiters_expired = 0, waiters_refused = 0;
+int waiter_max = 0;
+
+// DELIVER ... ID=X: replies are kept per (sender address, ID) so a retransmit
+// of a request whose reply was lost gets the same reply instead of taking
+// atoms twice. Entries live in a ring (oldest is overwritten) and are found
+// through a chained hash table; a lookup also ignores entries older than
+// dedupe_ttl_ms. Entry k of the ring holds the request with serial % size == k.
+#define DEDUPE_ENTRIES 4096
+#define DEDUPE_BUCKETS 8192
+#define DEDUPE_REPLY_SIZE 128
+
+typedef struct {
+    unsigned long long serial;          // 0 = free
+    unsigned long long hash;
+    int next;                           // next entry in the bucket, -1 = end
+    int done;                           // reply known; 0 = still being worked on
+    unsigned long long stored_ns;       // CLOCK_MONOTONIC, insert or completion
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    char request_id[REQUEST_ID_SIZE];
+    char reply[DEDUPE_REPLY_SIZE];
+} dedupe_entry_t;
+
+dedupe_entry_t dedupe_entries[DEDUPE_ENTRIES];
+int dedupe_buckets[DEDUPE_BUCKETS];
+int dedupe_ready = 0;
+unsigned long long dedupe_serials = 0;
+unsigned long long dedupe_replayed = 0;         // duplicates answered from the cache
+unsigned long long dedupe_in_flight = 0;        // duplicates dropped, original not answered yet
+unsigned long long dedupe_evicted = 0;          // overwritten before their TTL ran out
+const char *rate_scope_names[2] = {"connection", "address"};
+char stdin_buf[BUFFER_SIZE];
+size_t stdin_len = 0;
+
+// Fork-based background snapshots (BGSAVE) of the whole warehouse state
+typedef struct {
+    int status;                         // 0 on success
+    unsigned long long cow_kb;          // child's private dirty memory
+} bgsave_result_t;
+
+pid_t bgsave_pid = -1;
+int bgsave_pipe_fd = -1;
+unsigned long long bgsave_changes = 0;            // changes since last BGSAVE
+time_t bgsave_last_time = 0;
+unsigned long long bgsave_started_ns = 0;
+unsigned long long bgsave_pending_seq = 0;
+
+// BGSAVE metrics
+unsigned long long bgsave_count = 0;
+unsigned long long bgsave_failures = 0;
+unsigned long long bgsave_last_seq = 0;
+unsigned long long bgsave_last_fork_us = 0;
+unsigned long long bgsave_max_fork_us = 0;
+unsigned long long bgsave_last_cow_kb = 0;
+unsigned long long bgsave_last_duration_ms = 0;
+
+// Persistence metrics (written by writer thread, read by event loop)
+unsigned long long persist_writes = 0;
+unsigned long long persist_last_lag_ns = 0;
+unsigned long long persist_max_lag_ns = 0;
+unsigned long long persist_total_lag_ns = 0;
+
 /**
  * timeout_handler - handles the timeout signal
  */
@@ -44,6 +585,14 @@ void timeout_handler(int sig) {
     timeout_occurred = 1;
 }
 
+/**
+ * hangup_handler - asks the event loop to reload the config file
+ */
+void hangup_handler(int sig) {
+    (void)sig;
+    reload_requested = 1;
+}
+
 /**
  * min3 - finds the minimum among 3 values
  */
@@ -62,102 +611,485 @@ void show_usage(const char *program_name) {
     printf("  -U, --udp-port PORT     UDP port\n\n");
     printf("UDS options:\n");
     printf("  -s, --stream-path PATH  UDS stream socket path\n");
-    printf("  -d, --datagram-path PATH UDS datagram socket path\n\n");
+    printf("  -d, --datagram-path PATH UDS datagram socket path\n");
+    printf("  -S, --seqpacket-path PATH UDS seqpacket socket path (one command per message)\n\n");
     printf("General options:\n");
     printf("  -f, --save-file PATH    Save file path (optional)\n");
     printf("  -c, --carbon NUM        Initial carbon atoms (default: 0)\n");
     printf("  -o, --oxygen NUM        Initial oxygen atoms (default: 0)\n");
     printf("  -H, --hydrogen NUM      Initial hydrogen atoms (default: 0)\n");
     printf("  -t, --timeout SEC       Timeout in seconds (default: no timeout)\n");
+    printf("  -b, --bgsave-changes N  Fork a background snapshot every N changes\n");
+    printf("  -i, --bgsave-interval SEC Fork a background snapshot every SEC seconds\n");
+    printf("  -A, --shard ATOM        Hold only CARBON, OXYGEN or HYDROGEN (DELIVER via warehouse_coordinator)\n");
+    printf("  -p, --shm-poll USEC     Busy-poll shared-memory clients for USEC before sleeping\n");
+    printf("  -L, --busy-poll CORE[:USEC] Pin the event loop to CORE and never sleep; USEC sets SO_BUSY_POLL\n");
+    printf("  -w, --gen-workers NUM   Run admin GEN queries on NUM threads (default: 0, in the event loop)\n");
+    printf("  -v, --view PATH         Publish a read-only inventory view for warehouse_top\n");
+    printf("  -W, --watch-interval MS Push WATCH updates at most every MS (default: 100)\n");
+    printf("  -M, --multicast GROUP:PORT Send inventory snapshots to a multicast group or broadcast address\n");
+    printf("  -E, --feed-rate HZ      Feed packets per second at most (default: 10)\n");
+    printf("  -I, --feed-interface ADDR Local address for multicast (e.g. 127.0.0.1)\n");
+    printf("  -a, --admin-path PATH   Admin control socket (GEN, STATS, BGSAVE, DRAIN, RELOAD, SHUTDOWN)\n");
+    printf("  -B, --backlog N         listen() backlog of the client sockets (default: SOMAXCONN)\n");
+    printf("  -C, --config PATH       Tunables file, re-read on SIGHUP or admin RELOAD\n\n");
+    printf("Replication options:\n");
+    printf("  -r, --repl-port PORT    Accept followers on this TCP port\n");
+    printf("  -R, --repl-path PATH    Accept followers on this UDS stream path\n");
+    printf("  -F, --follow LEADER     Run as read-only follower of HOST:PORT or a UDS path\n\n");
+    printf("Cluster options (Raft):\n");
+    printf("  -N, --node-id ID        This node's id in the cluster\n");
+    printf("  -P, --peer ID=HOST:RAFT_PORT:TCP_PORT[:UDP_PORT]\n");
+    printf("                          Cluster member, repeat for every node including this one\n");
     printf("\nExamples:\n");
     printf("  %s -T 12345 -U 12346 -f /tmp/inventory.dat\n", program_name);
     printf("  %s -s /tmp/stream.sock -d /tmp/datagram.sock -f /tmp/inventory.dat\n", program_name);
+    printf("  %s -T 12345 -U 12346 -r 12400                  (leader)\n", program_name);
+    printf("  %s -T 12347 -U 12348 -F 127.0.0.1:12400        (follower)\n", program_name);
+    printf("  %s -A CARBON -T 12345 -s /tmp/carbon.sock -f carbon.dat  (shard)\n", program_name);
+    printf("  %s -N 1 -P 1=127.0.0.1:7001:17001:18001 -P 2=127.0.0.1:7002:17002:18002 \\\n"
+           "     -P 3=127.0.0.1:7003:17003:18003 -f /tmp/node1        (cluster node)\n", program_name);
+}
+
+unsigned long long monotonic_ns(void);
+void calculate_possible_molecules(unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen,
+                                 unsigned long long *water, unsigned long long *co2,
+                                 unsigned long long *alcohol, unsigned long long *glucose);
+void save_inventory(unsigned long long seq, unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen);
+void process_command(int client_fd, char *cmd, unsigned long long *carbon, unsigned long long *oxygen, unsigned long long *hydrogen);
+
+/**
+ * crc32c_init_tables - builds the slicing-by-8 tables for the software CRC32C
+ */
+void crc32c_init_tables(void) {
+    for (int i = 0; i < 256; i++) {
+        uint32_t crc = (uint32_t)i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (CRC32C_POLY & (0U - (crc & 1)));
+        crc32c_table[0][i] = crc;
+    }
+    for (int i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t prev = crc32c_table[k - 1][i];
+            crc32c_table[k][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xFF];
+        }
+    }
+}
+
+/**
+ * crc32c_sw - table driven CRC32C (slicing-by-8), used without SSE4.2
+ */
+uint32_t crc32c_sw(uint32_t crc, const unsigned char *buf, size_t len) {
+    while (len >= 8) {
+        uint32_t lo = crc ^ ((uint32_t)buf[0] | (uint32_t)buf[1] << 8 |
+                             (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24);
+        crc = crc32c_table[7][lo & 0xFF] ^ crc32c_table[6][(lo >> 8) & 0xFF] ^
+              crc32c_table[5][(lo >> 16) & 0xFF] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][buf[4]] ^ crc32c_table[2][buf[5]] ^
+              crc32c_table[1][buf[6]] ^ crc32c_table[0][buf[7]];
+        buf += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *buf++) & 0xFF];
+    return crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * crc32c_hw - CRC32C using the SSE4.2 crc32 instruction
+ */
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw(uint32_t crc, const unsigned char *buf, size_t len) {
+    unsigned long long crc64 = crc;
+    while (len >= 8) {
+        unsigned long long word;
+        memcpy(&word, buf, sizeof(word));
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+        buf += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+    while (len--)
+        crc = __builtin_ia32_crc32qi(crc, *buf++);
+    return crc;
+}
+#endif
+
+/**
+ * crc32c_init - selects the CRC32C implementation for this CPU
+ */
+void crc32c_init(void) {
+    crc32c_init_tables();
+    crc32c_impl = crc32c_sw;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_impl = crc32c_hw;
+#endif
+}
+
+/**
+ * crc32c - CRC32C (Castagnoli) of a buffer
+ */
+uint32_t crc32c(const void *buf, size_t len) {
+    return ~crc32c_impl(0xFFFFFFFFU, (const unsigned char *)buf, len);
+}
+
+/**
+ * fill_inventory_header - builds a checksummed header for the given state
+ */
+void fill_inventory_header(inventory_header_t *header, unsigned long long seq,
+                           unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen) {
+    memset(header, 0, sizeof(*header));
+    header->magic = INVENTORY_MAGIC;
+    header->version = INVENTORY_VERSION;
+    header->header_size = sizeof(*header);
+    header->seq = seq;
+    header->carbon = carbon;
+    header->oxygen = oxygen;
+    header->hydrogen = hydrogen;
+    header->crc = crc32c(header, offsetof(inventory_header_t, crc));
+}
+
+/**
+ * fill_journal_record - builds a checksummed journal record for the given state
+ */
+void fill_journal_record(journal_record_t *record, unsigned long long seq,
+                         unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen) {
+    record->magic = JOURNAL_MAGIC;
+    record->seq = seq;
+    record->carbon = carbon;
+    record->oxygen = oxygen;
+    record->hydrogen = hydrogen;
+    record->crc = crc32c(&record->seq, sizeof(*record) - offsetof(journal_record_t, seq));
+}
+
+/**
+ * journal_record_valid - checks magic and checksum of a journal record
+ */
+int journal_record_valid(const journal_record_t *record) {
+    return record->magic == JOURNAL_MAGIC &&
+           record->crc == crc32c(&record->seq, sizeof(*record) - offsetof(journal_record_t, seq));
+}
+
+/**
+ * scan_journal - validates the journal and finds the newest recorded state
+ * The newest is the record with the highest seq, not the last one: processes
+ * sharing a save file interleave their appends.
+ * Reads in large chunks so multi-GB journals are scanned at disk speed.
+ * A torn or corrupt tail (crash mid-append) is truncated away.
+ * Returns the number of valid records, or -1 on I/O error
+ */
+long long scan_journal(int fd, journal_record_t *latest) {
+    unsigned char *chunk = malloc(JOURNAL_SCAN_CHUNK);
+    if (chunk == NULL) {
+        perror("Failed to allocate journal scan buffer");
+        return -1;
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    long long records = 0;
+    off_t valid_end = 0;
+    int corrupt = 0;
+    size_t carry = 0;
+    unsigned long long started = monotonic_ns();
+
+    while (!corrupt) {
+        ssize_t n = read(fd, chunk + carry, JOURNAL_SCAN_CHUNK - carry);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("Failed to read journal");
+            free(chunk);
+            return -1;
+        }
+        if (n == 0) {
+            if (carry > 0) corrupt = 1;   // partial record at the end
+            break;
+        }
+
+        size_t avail = carry + (size_t)n;
+        size_t off = 0;
+        while (avail - off >= sizeof(journal_record_t)) {
+            journal_record_t record;
+            memcpy(&record, chunk + off, sizeof(record));
+            if (!journal_record_valid(&record)) {
+                corrupt = 1;
+                break;
+            }
+            if (records == 0 || record.seq > latest->seq) *latest = record;
+            records++;
+            off += sizeof(record);
+            valid_end += sizeof(record);
+        }
+
+        carry = avail - off;
+        memmove(chunk, chunk + off, carry);
+    }
+    free(chunk);
+
+    if (corrupt) {
+        fprintf(stderr, "Warning: Journal corrupt after %lld valid records, truncating torn tail\n", records);
+        if (ftruncate(fd, valid_end) == -1) {
+            perror("Failed to truncate journal");
+            return -1;
+        }
+    }
+
+    double secs = (monotonic_ns() - started) / 1e9;
+    if (records > 0) {
+        printf("Journal scanned: %lld records, %.1f MB in %.3f s (%.0f MB/s)\n", records,
+               valid_end / 1e6, secs, secs > 0 ? valid_end / 1e6 / secs : 0.0);
+    }
+    return records;
+}
+
+/**
+ * open_journal - opens (creating if needed) the journal next to the save file
+ * Returns the journal fd, or -1 on failure
+ */
+int open_journal(const char *filepath) {
+    char journal_path[PATH_MAX];
+    if (snprintf(journal_path, sizeof(journal_path), "%s.journal", filepath) >= (int)sizeof(journal_path)) {
+        fprintf(stderr, "Error: Save file path too long for journal\n");
+        return -1;
+    }
+
+    int fd = open(journal_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror("Failed to open journal");
+    }
+    return fd;
+}
+
+/**
+ * snapshot_path - builds the BGSAVE snapshot path (or its temp file) for a save file
+ * Returns 0 on success, -1 if the path does not fit
+ */
+int snapshot_path(char *out, size_t size, const char *filepath, int temporary) {
+    int n = snprintf(out, size, temporary ? "%s.snapshot.tmp" : "%s.snapshot", filepath);
+    return (n < 0 || (size_t)n >= size) ? -1 : 0;
+}
+
+/**
+ * load_snapshot_file - reads and validates the last BGSAVE snapshot
+ * Returns 1 if a valid snapshot was loaded into header, 0 otherwise
+ */
+int load_snapshot_file(const char *filepath, inventory_header_t *header) {
+    char path[PATH_MAX];
+    if (snapshot_path(path, sizeof(path), filepath, 0) != 0)
+        return 0;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return 0;
+
+    int valid = pread(fd, header, sizeof(*header), 0) == sizeof(*header) &&
+                header->magic == INVENTORY_MAGIC &&
+                header->version == INVENTORY_VERSION &&
+                header->header_size == sizeof(*header) &&
+                header->crc == crc32c(header, offsetof(inventory_header_t, crc));
+    close(fd);
+
+    if (!valid)
+        fprintf(stderr, "Warning: Ignoring invalid snapshot file %s\n", path);
+    return valid;
 }
 
 /**
  * init_inventory_file - Initializes or loads the inventory from a file
+ * The header magic, version and CRC32C are validated; if the header is
+ * damaged the newest valid journal record is used instead.
  * Returns 0 on success, -1 on failure
  */
 int init_inventory_file(const char *filepath, unsigned long long *carbon, unsigned long long *oxygen, unsigned long long *hydrogen) {
     // If no file path provided, just return
     if (filepath == NULL)
         return 0;
-    
+
+    journal_fd = open_journal(filepath);
+    if (journal_fd == -1)
+        return -1;
+
     // Try to open existing file
-    inventory_fd = open(filepath, O_RDWR);
-    
+    inventory_fd = open(filepath, O_RDWR | O_CLOEXEC);
+
     if (inventory_fd == -1) {
         // File doesn't exist, create it with initial values
         printf("Save file doesn't exist, creating new file: %s\n", filepath);
-        inventory_fd = open(filepath, O_RDWR | O_CREAT, 0644);
+        inventory_fd = open(filepath, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
         if (inventory_fd == -1) {
             perror("Failed to create save file");
             return -1;
         }
-        
+
+        // Any journal or snapshot left over belongs to an older save file,
+        // and a snapshot would otherwise win on the next start (higher seq)
+        if (ftruncate(journal_fd, 0) == -1) {
+            perror("Failed to reset journal");
+            return -1;
+        }
+        for (int temporary = 0; temporary <= 1; temporary++) {
+            char stale[PATH_MAX];
+            if (snapshot_path(stale, sizeof(stale), filepath, temporary) == 0 &&
+                unlink(stale) == -1 && errno != ENOENT) {
+                perror("Failed to remove old snapshot");
+                return -1;
+            }
+        }
+
         // Write initial values
-        if (write(inventory_fd, carbon, sizeof(*carbon)) != sizeof(*carbon) ||
-            write(inventory_fd, oxygen, sizeof(*oxygen)) != sizeof(*oxygen) ||
-            write(inventory_fd, hydrogen, sizeof(*hydrogen)) != sizeof(*hydrogen)) {
+        inventory_header_t header;
+        fill_inventory_header(&header, 0, *carbon, *oxygen, *hydrogen);
+        if (write(inventory_fd, &header, sizeof(header)) != sizeof(header)) {
             perror("Failed to write initial inventory");
             close(inventory_fd);
+            inventory_fd = -1;
             return -1;
         }
-        
-        printf("Initialized inventory with: Carbon=%llu, Oxygen=%llu, Hydrogen=%llu\n", 
+
+        printf("Initialized inventory with: Carbon=%llu, Oxygen=%llu, Hydrogen=%llu\n",
                *carbon, *oxygen, *hydrogen);
-    } else {
-        // File exists, load values
-        printf("Loading existing save file: %s\n", filepath);
-        
-        // Lock the file for reading
-        struct flock lock;
-        lock.l_type = F_RDLCK;
-        lock.l_whence = SEEK_SET;
-        lock.l_start = 0;
-        lock.l_len = sizeof(*carbon) + sizeof(*oxygen) + sizeof(*hydrogen);
-        
-        if (fcntl(inventory_fd, F_SETLKW, &lock) == -1) {
-            perror("Failed to lock inventory file");
-            close(inventory_fd);
-            return -1;
-        }
-        
-        // Read carbon
-        if (read(inventory_fd, carbon, sizeof(*carbon)) != sizeof(*carbon)) {
-            fprintf(stderr, "Warning: Failed to read carbon from file, using default\n");
-            // Keep the default value
-        }
-        
-        // Read oxygen
-        if (read(inventory_fd, oxygen, sizeof(*oxygen)) != sizeof(*oxygen)) {
-            fprintf(stderr, "Warning: Failed to read oxygen from file, using default\n");
-            // Keep the default value
+        return 0;
+    }
+
+    // File exists, load values
+    printf("Loading existing save file: %s\n", filepath);
+
+    // Lock the file for reading
+    struct flock lock;
+    lock.l_type = F_RDLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = 0;
+    lock.l_len = sizeof(inventory_header_t);
+
+    if (fcntl(inventory_fd, F_SETLKW, &lock) == -1) {
+        perror("Failed to lock inventory file");
+        close(inventory_fd);
+        inventory_fd = -1;
+        return -1;
+    }
+
+    // Zeroed, so a short read (empty or truncated file) leaves no stale fields
+    inventory_header_t header;
+    memset(&header, 0, sizeof(header));
+    ssize_t n = pread(inventory_fd, &header, sizeof(header), 0);
+    int header_valid = 0, legacy = 0;
+
+    if (n == sizeof(header) && header.magic == INVENTORY_MAGIC) {
+        if (header.version != INVENTORY_VERSION || header.header_size != sizeof(header)) {
+            fprintf(stderr, "Error: Unsupported save file version %u\n", header.version);
+        } else if (header.crc != crc32c(&header, offsetof(inventory_header_t, crc))) {
+            fprintf(stderr, "Warning: Save file checksum mismatch, trying journal\n");
+        } else {
+            header_valid = 1;
         }
-        
-        // Read hydrogen
-        if (read(inventory_fd, hydrogen, sizeof(*hydrogen)) != sizeof(*hydrogen)) {
-            fprintf(stderr, "Warning: Failed to read hydrogen from file, using default\n");
-            // Keep the default value
+    } else if (n == 3 * sizeof(unsigned long long)) {
+        // Pre-checksum format: three raw counters
+        unsigned long long legacy_counts[3];
+        memcpy(legacy_counts, &header, sizeof(legacy_counts));
+        fill_inventory_header(&header, 0, legacy_counts[0], legacy_counts[1], legacy_counts[2]);
+        header_valid = legacy = 1;
+    } else {
+        fprintf(stderr, "Warning: Save file has no valid header, trying journal\n");
+    }
+
+    // Unlock the file
+    lock.l_type = F_UNLCK;
+    if (fcntl(inventory_fd, F_SETLK, &lock) == -1) {
+        perror("Warning: Failed to unlock inventory file");
+    }
+
+    if (n == sizeof(header) && header.magic == INVENTORY_MAGIC && header.version != INVENTORY_VERSION) {
+        close(inventory_fd);
+        inventory_fd = -1;
+        return -1;
+    }
+
+    journal_record_t latest;
+    long long records = scan_journal(journal_fd, &latest);
+    if (records < 0) {
+        close(inventory_fd);
+        inventory_fd = -1;
+        return -1;
+    }
+
+    if (records > 0 && (!header_valid || latest.seq > header.seq)) {
+        printf("Recovered newer state from journal (seq %llu)\n", (unsigned long long)latest.seq);
+        fill_inventory_header(&header, latest.seq, latest.carbon, latest.oxygen, latest.hydrogen);
+        header_valid = 1;
+    }
+
+    inventory_header_t snapshot;
+    if (load_snapshot_file(filepath, &snapshot) && (!header_valid || snapshot.seq > header.seq)) {
+        printf("Recovered newer state from background snapshot (seq %llu)\n", (unsigned long long)snapshot.seq);
+        header = snapshot;
+        header_valid = 1;
+        records = 1;    // force a header rewrite below
+    }
+
+    if (!header_valid) {
+        fprintf(stderr, "Error: Save file %s is corrupt and no journal or snapshot is available\n", filepath);
+        close(inventory_fd);
+        inventory_fd = -1;
+        return -1;
+    }
+
+    *carbon = header.carbon;
+    *oxygen = header.oxygen;
+    *hydrogen = header.hydrogen;
+    inventory_seq = header.seq;
+
+    if (legacy) {
+        printf("Upgrading legacy save file to checksummed format\n");
+    }
+    if (legacy || records > 0) {
+        // Rewrite a clean header so the next start doesn't replay again
+        save_inventory(header.seq, header.carbon, header.oxygen, header.hydrogen);
+        if (ftruncate(journal_fd, 0) == -1) {
+            perror("Warning: Failed to reset journal");
         }
-        
-        // Unlock the file
-        lock.l_type = F_UNLCK;
-        if (fcntl(inventory_fd, F_SETLK, &lock) == -1) {
-            perror("Warning: Failed to unlock inventory file");
+    }
+
+    printf("Loaded inventory: Carbon=%llu, Oxygen=%llu, Hydrogen=%llu\n",
+           *carbon, *oxygen, *hydrogen);
+
+    return 0;
+}
+
+/**
+ * append_journal - appends one checksummed state record to the journal
+ * Returns 0 on success, -1 on failure
+ */
+int append_journal(unsigned long long seq, unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen) {
+    if (journal_fd == -1)
+        return 0;
+
+    journal_record_t record;
+    fill_journal_record(&record, seq, carbon, oxygen, hydrogen);
+    if (write(journal_fd, &record, sizeof(record)) != sizeof(record)) {
+        perror("Failed to append journal record");
+        return -1;
+    }
+
+    // Once the header is current the journal can be restarted
+    journal_bytes += sizeof(record);
+    if (journal_bytes >= JOURNAL_CHECKPOINT_BYTES) {
+        if (ftruncate(journal_fd, 0) == -1) {
+            perror("Warning: Failed to checkpoint journal");
+        } else {
+            journal_bytes = 0;
+            append_journal(seq, carbon, oxygen, hydrogen);
         }
-        
-        printf("Loaded inventory: Carbon=%llu, Oxygen=%llu, Hydrogen=%llu\n", 
-               *carbon, *oxygen, *hydrogen);
     }
-    
     return 0;
 }
 
 /**
  * save_inventory - Saves inventory to the file
  */
-void save_inventory(unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen) {
+void save_inventory(unsigned long long seq, unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen) {
     if (inventory_fd == -1)
         return;
     
@@ -166,23 +1098,17 @@ void save_inventory(unsigned long long carbon, unsigned long long oxygen, unsign
     lock.l_type = F_WRLCK;
     lock.l_whence = SEEK_SET;
     lock.l_start = 0;
-    lock.l_len = sizeof(carbon) + sizeof(oxygen) + sizeof(hydrogen);
+    lock.l_len = sizeof(inventory_header_t);
     
     if (fcntl(inventory_fd, F_SETLKW, &lock) == -1) {
         perror("Failed to lock inventory file");
         return;
     }
     
-    // Seek to beginning of file
-    if (lseek(inventory_fd, 0, SEEK_SET) == -1) {
-        perror("Failed to seek in inventory file");
-        return;
-    }
-    
     // Write inventory
-    if (write(inventory_fd, &carbon, sizeof(carbon)) != sizeof(carbon) ||
-        write(inventory_fd, &oxygen, sizeof(oxygen)) != sizeof(oxygen) ||
-        write(inventory_fd, &hydrogen, sizeof(hydrogen)) != sizeof(hydrogen)) {
+    inventory_header_t header;
+    fill_inventory_header(&header, seq, carbon, oxygen, hydrogen);
+    if (pwrite(inventory_fd, &header, sizeof(header), 0) != sizeof(header)) {
         perror("Failed to write inventory");
     }
     
@@ -194,295 +1120,3822 @@ void save_inventory(unsigned long long carbon, unsigned long long oxygen, unsign
 }
 
 /**
- * cleanup_inventory - Cleans up resources
+ * realtime_ns - current CLOCK_REALTIME time in nanoseconds (what DL= is based on)
  */
-void cleanup_inventory() {
-    if (inventory_fd != -1) {
-        close(inventory_fd);
-        inventory_fd = -1;
-    }
-    
-    if (save_file_path != NULL) {
-        free(save_file_path);
-        save_file_path = NULL;
-    }
+unsigned long long realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
 }
 
 /**
- * process_command - processes ADD commands received from clients
- * enhanced with detailed feedback to client
+ * monotonic_ns - current CLOCK_MONOTONIC time in nanoseconds
  */
-void process_command(int client_fd, char *cmd, unsigned long long *carbon, unsigned long long *oxygen, unsigned long long *hydrogen) {
-    char type[16];
-    unsigned long long amount;
-    char response[BUFFER_SIZE];
+unsigned long long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
 
-    if (sscanf(cmd, "ADD %15s %llu", type, &amount) == 2) {
-        if (amount > MAX_ATOMS) {
-            snprintf(response, sizeof(response), "ERROR: Amount too large, max allowed per command is %llu.\n", MAX_ATOMS);
-            printf("Error: amount too large, max allowed per command is %llu.\n", MAX_ATOMS);
-            send(client_fd, response, strlen(response), 0);
+/**
+ * persist_version - hands the current inventory version to the writer thread
+ * Never blocks: fills the slot the writer is not expected to read and bumps
+ * the published sequence, then pokes the writer through its eventfd
+ */
+void persist_version(unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen) {
+    if (!persist_thread_running)
+        return;
+
+    unsigned long long count = persist_publish_count + 1;
+    persist_slot_t *slot = &persist_slots[count & 1];
+
+    __atomic_store_n(&slot->lock, slot->lock + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot->seq, inventory_seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->carbon, carbon, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->oxygen, oxygen, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->hydrogen, hydrogen, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->publish_ns, monotonic_ns(), __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->lock, slot->lock + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&persist_publish_count, count, __ATOMIC_RELEASE);
+    __atomic_store_n(&persist_published_seq, inventory_seq, __ATOMIC_RELEASE);
+
+    uint64_t one = 1;
+    if (write(persist_wake_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("Warning: Failed to wake persistence thread");
+    }
+}
+
+void replicate_inventory(unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen);
+
+/**
+ * publish_inventory - records a new inventory version after a change
+ * Bumps the version number, then feeds the writer thread and followers
+ */
+void publish_inventory(unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen) {
+    inventory_seq++;
+    bgsave_changes++;
+
+    persist_version(carbon, oxygen, hydrogen);
+    replicate_inventory(carbon, oxygen, hydrogen);
+}
+
+/**
+ * open_view - creates the shared inventory view file and maps it
+ * Returns 0 on success, -1 on error
+ */
+int open_view(const char *path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        perror("Error opening view file");
+        return -1;
+    }
+    if (ftruncate(fd, sizeof(warehouse_view_t)) == -1) {
+        perror("Error sizing view file");
+        close(fd);
+        return -1;
+    }
+    view = mmap(NULL, sizeof(warehouse_view_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (view == MAP_FAILED) {
+        perror("Error mapping view file");
+        view = NULL;
+        return -1;
+    }
+    view->version = VIEW_VERSION;
+    view->pid = (uint64_t)getpid();
+    __atomic_store_n(&view->magic, VIEW_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/**
+ * update_view - rewrites the shared view if the inventory or counters moved
+ * Called once per event loop iteration; readers never block the server
+ */
+void update_view(unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen) {
+    if (view->seq == inventory_seq && view->update_ns != 0 && !view_refresh &&
+        view->stream_requests == stream_requests && view->datagram_requests == datagram_requests)
+        return;
+    view_refresh = 0;
+
+    unsigned long long water, co2, alcohol, glucose;
+    calculate_possible_molecules(carbon, oxygen, hydrogen, &water, &co2, &alcohol, &glucose);
+
+    __atomic_store_n(&view->lock, view->lock + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&view->seq, inventory_seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&view->carbon, carbon, __ATOMIC_RELAXED);
+    __atomic_store_n(&view->oxygen, oxygen, __ATOMIC_RELAXED);
+    __atomic_store_n(&view->hydrogen, hydrogen, __ATOMIC_RELAXED);
+    __atomic_store_n(&view->water, water, __ATOMIC_RELAXED);
+    __atomic_store_n(&view->co2, co2, __ATOMIC_RELAXED);
+    __atomic_store_n(&view->alcohol, alcohol, __ATOMIC_RELAXED);
+    __atomic_store_n(&view->glucose, glucose, __ATOMIC_RELAXED);
+    __atomic_store_n(&view->stream_requests, stream_requests, __ATOMIC_RELAXED);
+    __atomic_store_n(&view->datagram_requests, datagram_requests, __ATOMIC_RELAXED);
+    __atomic_store_n(&view->delivered, delivered_count, __ATOMIC_RELAXED);
+    __atomic_store_n(&view->deliver_failures, deliver_failures, __ATOMIC_RELAXED);
+    __atomic_store_n(&view->update_ns, monotonic_ns(), __ATOMIC_RELAXED);
+    __atomic_store_n(&view->lock, view->lock + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * read_latest_snapshot - copies the newest published inventory version
+ * Retries if the event loop rewrote the slot while it was being copied
+ */
+void read_latest_snapshot(persist_slot_t *out) {
+    while (1) {
+        unsigned long long count = __atomic_load_n(&persist_publish_count, __ATOMIC_ACQUIRE);
+        persist_slot_t *slot = &persist_slots[count & 1];
+
+        unsigned long long before = __atomic_load_n(&slot->lock, __ATOMIC_ACQUIRE);
+        if (before & 1)
+            continue;
+        out->seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+        out->carbon = __atomic_load_n(&slot->carbon, __ATOMIC_RELAXED);
+        out->oxygen = __atomic_load_n(&slot->oxygen, __ATOMIC_RELAXED);
+        out->hydrogen = __atomic_load_n(&slot->hydrogen, __ATOMIC_RELAXED);
+        out->publish_ns = __atomic_load_n(&slot->publish_ns, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->lock, __ATOMIC_RELAXED) == before)
+            return;
+    }
+}
+
+/**
+ * persistence_thread - writer thread, saves the newest inventory version
+ * Intermediate versions published while a save is in progress are coalesced
+ */
+void *persistence_thread(void *arg) {
+    (void)arg;
+    uint64_t wakeups;
+
+    while (1) {
+        if (read(persist_wake_fd, &wakeups, sizeof(wakeups)) != sizeof(wakeups) && errno != EINTR) {
+            perror("Persistence thread wakeup");
+            break;
+        }
+
+        persist_slot_t snap;
+        read_latest_snapshot(&snap);
+        if (snap.seq != persist_saved_seq) {
+            append_journal(snap.seq, snap.carbon, snap.oxygen, snap.hydrogen);
+            save_inventory(snap.seq, snap.carbon, snap.oxygen, snap.hydrogen);
+
+            unsigned long long lag = monotonic_ns() - snap.publish_ns;
+            __atomic_store_n(&persist_saved_seq, snap.seq, __ATOMIC_RELEASE);
+            __atomic_store_n(&persist_last_lag_ns, lag, __ATOMIC_RELAXED);
+            __atomic_store_n(&persist_total_lag_ns, persist_total_lag_ns + lag, __ATOMIC_RELAXED);
+            if (lag > persist_max_lag_ns)
+                __atomic_store_n(&persist_max_lag_ns, lag, __ATOMIC_RELAXED);
+            __atomic_store_n(&persist_writes, persist_writes + 1, __ATOMIC_RELAXED);
+        }
+
+        if (__atomic_load_n(&persist_stop, __ATOMIC_ACQUIRE) &&
+            snap.seq == __atomic_load_n(&persist_published_seq, __ATOMIC_ACQUIRE))
+            break;
+    }
+
+    return NULL;
+}
+
+/**
+ * start_persistence_thread - starts the background writer
+ * Returns 0 on success, -1 on failure
+ */
+int start_persistence_thread(void) {
+    if (inventory_fd == -1)
+        return 0;
+
+    // Continue the sequence numbering of the loaded state
+    persist_published_seq = persist_saved_seq = inventory_seq;
+    persist_slots[0].seq = inventory_seq;
+
+    persist_wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (persist_wake_fd == -1) {
+        perror("Failed to create persistence eventfd");
+        return -1;
+    }
+
+    // Writes only block if the 64-bit counter would overflow, so the event
+    // loop side never waits while the writer thread sleeps in read().
+    // SIGHUP and SIGALRM must interrupt the event loop's select(), not the writer.
+    sigset_t blocked, previous;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGHUP);
+    sigaddset(&blocked, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+    int created = pthread_create(&persist_thread, NULL, persistence_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (created != 0) {
+        fprintf(stderr, "Error: Failed to start persistence thread\n");
+        close(persist_wake_fd);
+        persist_wake_fd = -1;
+        return -1;
+    }
+
+    persist_thread_running = 1;
+    return 0;
+}
+
+/**
+ * stop_persistence_thread - flushes the newest version and joins the writer
+ */
+void stop_persistence_thread(void) {
+    if (!persist_thread_running)
+        return;
+
+    __atomic_store_n(&persist_stop, 1, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (write(persist_wake_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("Warning: Failed to wake persistence thread");
+    }
+    pthread_join(persist_thread, NULL);
+    persist_thread_running = 0;
+
+    close(persist_wake_fd);
+    persist_wake_fd = -1;
+}
+
+/**
+ * print_persistence_stats - prints writer thread progress and lag
+ */
+void print_persistence_stats(FILE *out) {
+    if (!persist_thread_running) {
+        fprintf(out, "Persistence: disabled (no save file)\n");
+        return;
+    }
+
+    unsigned long long published = __atomic_load_n(&persist_published_seq, __ATOMIC_ACQUIRE);
+    unsigned long long saved = __atomic_load_n(&persist_saved_seq, __ATOMIC_ACQUIRE);
+    unsigned long long writes = __atomic_load_n(&persist_writes, __ATOMIC_RELAXED);
+    unsigned long long total_lag = __atomic_load_n(&persist_total_lag_ns, __ATOMIC_RELAXED);
+
+    fprintf(out, "Persistence: published=%llu saved=%llu pending=%llu writes=%llu coalesced=%llu\n",
+           published, saved, published - saved, writes, saved - writes);
+    fprintf(out, "Persistence lag: last=%.3f ms, max=%.3f ms, avg=%.3f ms\n",
+           __atomic_load_n(&persist_last_lag_ns, __ATOMIC_RELAXED) / 1e6,
+           __atomic_load_n(&persist_max_lag_ns, __ATOMIC_RELAXED) / 1e6,
+           writes ? (double)total_lag / writes / 1e6 : 0.0);
+}
+
+/**
+ * read_private_dirty_kb - private dirty memory of the calling process in kB
+ * In a BGSAVE child this is the copy-on-write overhead caused by the fork
+ */
+unsigned long long read_private_dirty_kb(void) {
+    char buf[4096];
+    int fd = open("/proc/self/smaps_rollup", O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return 0;
+
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+
+    // Parsed by hand: the BGSAVE child calls this, and strtoull is not
+    // async-signal-safe
+    char *field = strstr(buf, "Private_Dirty:");
+    if (field == NULL)
+        return 0;
+    field += strlen("Private_Dirty:");
+    while (*field == ' ') field++;
+    unsigned long long kb = 0;
+    while (*field >= '0' && *field <= '9') kb = kb * 10 + (unsigned long long)(*field++ - '0');
+    return kb;
+}
+
+/**
+ * read_rss_kb - resident memory of the calling process in kB
+ */
+unsigned long long read_rss_kb(void) {
+    char buf[128];
+    int fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return 0;
+
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return 0;
+    buf[n] = '\0';
+
+    unsigned long long size, resident;
+    if (sscanf(buf, "%llu %llu", &size, &resident) != 2)
+        return 0;
+    return resident * (unsigned long long)sysconf(_SC_PAGESIZE) / 1024;
+}
+
+/**
+ * bgsave_child - writes the snapshot image in the forked child
+ * Only async-signal-safe calls: other threads may hold stdio or malloc locks,
+ * so the parent builds both paths before fork()
+ */
+void bgsave_child(int result_fd, const inventory_header_t *image, const char *tmp_path, const char *final_path) {
+    bgsave_result_t result;
+
+    result.status = -1;
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd != -1) {
+        if (write(fd, image, sizeof(*image)) == sizeof(*image) && fsync(fd) == 0)
+            result.status = 0;
+        close(fd);
+        if (result.status == 0 && rename(tmp_path, final_path) == -1)
+            result.status = -1;
+    }
+
+    result.cow_kb = read_private_dirty_kb();
+    if (write(result_fd, &result, sizeof(result)) != sizeof(result)) {
+        result.status = -1;
+    }
+    _exit(result.status == 0 ? 0 : 1);
+}
+
+/**
+ * start_bgsave - forks a child that writes a consistent snapshot image
+ * The parent keeps serving; completion is reported through a pipe
+ * Returns 0 if a snapshot was started, -1 otherwise
+ */
+int start_bgsave(unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen) {
+    if (save_file_path == NULL || inventory_fd == -1) {
+        printf("BGSAVE: disabled (no save file)\n");
+        return -1;
+    }
+    if (bgsave_pid != -1) {
+        printf("BGSAVE: snapshot already in progress (pid %d)\n", (int)bgsave_pid);
+        return -1;
+    }
+
+    char tmp_path[PATH_MAX], final_path[PATH_MAX];
+    if (snapshot_path(tmp_path, sizeof(tmp_path), save_file_path, 1) != 0 ||
+        snapshot_path(final_path, sizeof(final_path), save_file_path, 0) != 0) {
+        fprintf(stderr, "BGSAVE: save file path too long for a snapshot\n");
+        return -1;
+    }
+
+    int pipe_fds[2];
+    if (pipe(pipe_fds) == -1) {
+        perror("BGSAVE pipe");
+        return -1;
+    }
+    fcntl(pipe_fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(pipe_fds[1], F_SETFD, FD_CLOEXEC);
+
+    inventory_header_t image;
+    unsigned long long seq = inventory_seq;
+    fill_inventory_header(&image, seq, carbon, oxygen, hydrogen);
+
+    fflush(stdout);
+    unsigned long long fork_start = monotonic_ns();
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("BGSAVE fork");
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        bgsave_failures++;
+        return -1;
+    }
+    if (pid == 0) {
+        close(pipe_fds[0]);
+        bgsave_child(pipe_fds[1], &image, tmp_path, final_path);
+    }
+
+    bgsave_started_ns = monotonic_ns();
+    bgsave_last_fork_us = (bgsave_started_ns - fork_start) / 1000;
+    if (bgsave_last_fork_us > bgsave_max_fork_us)
+        bgsave_max_fork_us = bgsave_last_fork_us;
+
+    close(pipe_fds[1]);
+    bgsave_pid = pid;
+    bgsave_pipe_fd = pipe_fds[0];
+    bgsave_pending_seq = seq;
+    bgsave_changes = 0;
+    bgsave_last_time = time(NULL);
+
+    printf("BGSAVE: started snapshot of seq %llu in child %d (fork took %llu us)\n",
+           seq, (int)pid, bgsave_last_fork_us);
+    return 0;
+}
+
+/**
+ * finish_bgsave - collects the result of a finished BGSAVE child
+ */
+void finish_bgsave(void) {
+    bgsave_result_t result;
+    ssize_t n;
+    do {
+        n = read(bgsave_pipe_fd, &result, sizeof(result));
+    } while (n == -1 && errno == EINTR);
+    if (n != sizeof(result))
+        result.status = -1;
+
+    int wstatus = 0;
+    while (waitpid(bgsave_pid, &wstatus, 0) == -1 && errno == EINTR)
+        ;
+    close(bgsave_pipe_fd);
+    bgsave_pipe_fd = -1;
+    bgsave_pid = -1;
+
+    bgsave_last_duration_ms = (monotonic_ns() - bgsave_started_ns) / 1000000;
+    if (result.status != 0 || !WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+        bgsave_failures++;
+        fprintf(stderr, "BGSAVE: snapshot of seq %llu failed\n", bgsave_pending_seq);
+        return;
+    }
+
+    bgsave_count++;
+    bgsave_last_seq = bgsave_pending_seq;
+    bgsave_last_cow_kb = result.cow_kb;
+    printf("BGSAVE: snapshot of seq %llu saved in %llu ms (COW overhead %llu kB)\n",
+           bgsave_last_seq, bgsave_last_duration_ms, bgsave_last_cow_kb);
+}
+
+/**
+ * maybe_start_bgsave - starts a BGSAVE when the change count or timer is due
+ */
+void maybe_start_bgsave(unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen) {
+    if (bgsave_pid != -1 || inventory_fd == -1)
+        return;
+
+    int changes_due = config.bgsave_change_threshold > 0 && bgsave_changes >= config.bgsave_change_threshold;
+    int timer_due = config.bgsave_interval > 0 && bgsave_changes > 0 &&
+                    time(NULL) - bgsave_last_time >= config.bgsave_interval;
+    if (changes_due || timer_due)
+        start_bgsave(carbon, oxygen, hydrogen);
+}
+
+/**
+ * print_bgsave_stats - prints background snapshot counters
+ */
+void print_bgsave_stats(FILE *out) {
+    fprintf(out, "BGSAVE: %s, saved=%llu failed=%llu last seq=%llu changes since=%llu\n",
+           bgsave_pid != -1 ? "in progress" : "idle",
+           bgsave_count, bgsave_failures, bgsave_last_seq, bgsave_changes);
+    fprintf(out, "BGSAVE timing: last fork=%llu us, max fork=%llu us, last duration=%llu ms, last COW=%llu kB\n",
+           bgsave_last_fork_us, bgsave_max_fork_us, bgsave_last_duration_ms, bgsave_last_cow_kb);
+}
+
+/**
+ * set_nonblocking - puts a socket into non-blocking mode
+ * Returns 0 on success, -1 on failure
+ */
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        return -1;
+    return 0;
+}
+
+/**
+ * follower_send - continues sending the queued record to a follower
+ * Returns 0 if sent or would block, -1 if the follower is gone
+ */
+int follower_send(follower_t *f) {
+    while (f->out_off < f->out_len) {
+        ssize_t n = send(f->fd, (unsigned char *)&f->out + f->out_off, f->out_len - f->out_off,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        f->out_off += (size_t)n;
+    }
+    return 0;
+}
+
+/**
+ * follower_queue_state - queues the current inventory as one record and sends it
+ * Records are full states, so a slow follower only ever needs the newest one
+ */
+void follower_queue_state(follower_t *f, unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen) {
+    fill_journal_record(&f->out, inventory_seq, carbon, oxygen, hydrogen);
+    f->out_off = 0;
+    f->out_len = sizeof(f->out);
+    f->dirty = 0;
+    f->sent_seq = inventory_seq;
+    if (follower_send(f) == -1)
+        f->fd = -f->fd - 1;   // reaped by the event loop
+}
+
+/**
+ * replicate_inventory - streams the new inventory version to all followers
+ * Followers still busy with an older record are marked dirty instead
+ */
+void replicate_inventory(unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen) {
+    for (int k = 0; k < follower_count; k++) {
+        follower_t *f = &followers[k];
+        if (f->fd < 0)
+            continue;
+        if (f->out_off < f->out_len)
+            f->dirty = 1;
+        else
+            follower_queue_state(f, carbon, oxygen, hydrogen);
+    }
+}
+
+/**
+ * add_follower - registers an accepted follower and sends it the current state
+ */
+void add_follower(int fd, int is_uds, fd_set *master_set, int *fdmax,
+                  unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen) {
+    if (follower_count >= MAX_FOLLOWERS || set_nonblocking(fd) == -1) {
+        fprintf(stderr, "Replication: rejecting follower on socket %d\n", fd);
+        close(fd);
+        return;
+    }
+
+    follower_t *f = &followers[follower_count++];
+    memset(f, 0, sizeof(*f));
+    f->fd = fd;
+    f->is_uds = is_uds;
+    FD_SET(fd, master_set);
+    if (fd > *fdmax) *fdmax = fd;
+
+    printf("Replication: follower connected on socket %d (%s), sending snapshot seq %llu\n",
+           fd, is_uds ? "UDS" : "TCP", inventory_seq);
+    follower_queue_state(f, carbon, oxygen, hydrogen);
+}
+
+/**
+ * find_follower - returns the follower index owning fd, or -1
+ */
+int find_follower(int fd) {
+    for (int k = 0; k < follower_count; k++) {
+        if (followers[k].fd == fd)
+            return k;
+    }
+    return -1;
+}
+
+/**
+ * reap_followers - closes followers that hung up or failed a send
+ */
+void reap_followers(fd_set *master_set) {
+    for (int k = 0; k < follower_count; ) {
+        if (followers[k].fd >= 0) {
+            k++;
+            continue;
+        }
+        int fd = -followers[k].fd - 1;
+        printf("Replication: follower on socket %d disconnected\n", fd);
+        close(fd);
+        FD_CLR(fd, master_set);
+        followers[k] = followers[--follower_count];
+    }
+}
+
+/**
+ * service_follower_write - resumes a blocked send once the follower is writable
+ */
+void service_follower_write(follower_t *f, unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen) {
+    if (follower_send(f) == -1) {
+        f->fd = -f->fd - 1;
+        return;
+    }
+    if (f->out_off == f->out_len && f->dirty)
+        follower_queue_state(f, carbon, oxygen, hydrogen);
+}
+
+/**
+ * connect_to_leader - starts a non-blocking connection to the leader
+ * Returns 0 if connected or in progress, -1 on failure (retried later)
+ */
+int connect_to_leader(void) {
+    leader_retry_time = time(NULL) + LEADER_RETRY_SEC;
+
+    if (strchr(leader_spec, '/') != NULL) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, leader_spec, sizeof(addr.sun_path) - 1);
+
+        leader_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (leader_fd == -1 || set_nonblocking(leader_fd) == -1) {
+            perror("Replication socket");
+            if (leader_fd != -1) close(leader_fd);
+            leader_fd = -1;
+            return -1;
+        }
+        if (connect(leader_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 && errno != EINPROGRESS) {
+            close(leader_fd);
+            leader_fd = -1;
+            return -1;
+        }
+    } else {
+        char host[256];
+        const char *colon = strrchr(leader_spec, ':');
+        if (colon == NULL || (size_t)(colon - leader_spec) >= sizeof(host)) {
+            fprintf(stderr, "Replication: invalid leader address %s\n", leader_spec);
+            return -1;
+        }
+        memcpy(host, leader_spec, colon - leader_spec);
+        host[colon - leader_spec] = '\0';
+
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host, colon + 1, &hints, &res) != 0) {
+            fprintf(stderr, "Replication: cannot resolve leader %s\n", leader_spec);
+            return -1;
+        }
+
+        leader_fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        if (leader_fd == -1 || set_nonblocking(leader_fd) == -1) {
+            perror("Replication socket");
+            if (leader_fd != -1) close(leader_fd);
+            leader_fd = -1;
+            freeaddrinfo(res);
+            return -1;
+        }
+        int rc = connect(leader_fd, res->ai_addr, res->ai_addrlen);
+        freeaddrinfo(res);
+        if (rc == -1 && errno != EINPROGRESS) {
+            close(leader_fd);
+            leader_fd = -1;
+            return -1;
+        }
+    }
+
+    leader_connecting = 1;
+    leader_buf_len = 0;
+    return 0;
+}
+
+/**
+ * disconnect_leader - drops the leader connection and schedules a retry
+ */
+void disconnect_leader(fd_set *master_set) {
+    if (leader_fd == -1)
+        return;
+    if (!leader_connecting) {
+        printf("Replication: lost connection to leader %s, serving last known state\n", leader_spec);
+        FD_CLR(leader_fd, master_set);
+    }
+    close(leader_fd);
+    leader_fd = -1;
+    leader_connecting = 0;
+    leader_retry_time = time(NULL) + LEADER_RETRY_SEC;
+}
+
+/**
+ * read_from_leader - applies replicated records received from the leader
+ * Returns 0 on success, -1 if the connection must be dropped
+ */
+int read_from_leader(unsigned long long *carbon, unsigned long long *oxygen, unsigned long long *hydrogen) {
+    unsigned char buf[64 * sizeof(journal_record_t)];
+    memcpy(buf, leader_buf, leader_buf_len);
+
+    ssize_t n = recv(leader_fd, buf + leader_buf_len, sizeof(buf) - leader_buf_len, 0);
+    if (n == 0 || (n < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK))
+        return -1;
+    if (n < 0)
+        return 0;
+
+    size_t avail = leader_buf_len + (size_t)n, off = 0;
+    int applied = 0;
+    journal_record_t record;
+    while (avail - off >= sizeof(record)) {
+        memcpy(&record, buf + off, sizeof(record));
+        off += sizeof(record);
+        if (!journal_record_valid(&record)) {
+            repl_bad_records++;
+            fprintf(stderr, "Replication: corrupt record from leader, resyncing\n");
+            return -1;
+        }
+        applied = 1;
+        repl_records_applied++;
+    }
+
+    // Records are full states, only the newest one of a batch matters
+    if (applied) {
+        *carbon = record.carbon;
+        *oxygen = record.oxygen;
+        *hydrogen = record.hydrogen;
+        inventory_seq = record.seq;
+        bgsave_changes++;
+        persist_version(*carbon, *oxygen, *hydrogen);
+        replicate_inventory(*carbon, *oxygen, *hydrogen);
+    }
+
+    leader_buf_len = avail - off;
+    memcpy(leader_buf, buf + off, leader_buf_len);
+    return 0;
+}
+
+/**
+ * print_replication_stats - prints the replication role and progress
+ */
+void print_replication_stats(FILE *out) {
+    if (leader_spec != NULL) {
+        fprintf(out, "Replication: follower of %s (%s), seq=%llu applied=%llu corrupt=%llu\n", leader_spec,
+               leader_fd == -1 ? "disconnected" : leader_connecting ? "connecting" : "connected",
+               inventory_seq, repl_records_applied, repl_bad_records);
+    }
+    if (repl_tcp_fd != -1 || repl_uds_fd != -1) {
+        fprintf(out, "Replication: leader seq=%llu followers=%d\n", inventory_seq, follower_count);
+        for (int k = 0; k < follower_count; k++) {
+            fprintf(out, "  follower socket %d (%s): sent seq=%llu lag=%llu%s\n", followers[k].fd,
+                   followers[k].is_uds ? "UDS" : "TCP", followers[k].sent_seq,
+                   inventory_seq - followers[k].sent_seq, followers[k].dirty ? " (catching up)" : "");
+        }
+    }
+}
+
+/**
+ * format_query_reply - answers the read-only STATUS and CAPACITY queries
+ * Returns 1 if cmd was a query (reply written to out), 0 otherwise
+ */
+int format_query_reply(const char *cmd, char *out, size_t size,
+                       unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen) {
+    if (strncmp(cmd, "STATUS", 6) == 0 && cluster_mode) {
+        snprintf(out, size, "STATUS: CARBON: %llu, OXYGEN: %llu, HYDROGEN: %llu (seq %llu, %s, term %llu, node %d, pid %d)\n",
+                 carbon, oxygen, hydrogen, inventory_seq, raft_is_leader() ? "leader" : "follower",
+                 (unsigned long long)raft_term(), node_id, (int)getpid());
+        return 1;
+    }
+    if (strncmp(cmd, "STATUS", 6) == 0 && shard_atom != -1) {
+        snprintf(out, size, "STATUS: CARBON: %llu, OXYGEN: %llu, HYDROGEN: %llu (seq %llu, shard %s, reserved %llu)\n",
+                 carbon, oxygen, hydrogen, inventory_seq, atom_names[shard_atom], shard_reserved);
+        return 1;
+    }
+    if (strncmp(cmd, "STATUS", 6) == 0) {
+        snprintf(out, size, "STATUS: CARBON: %llu, OXYGEN: %llu, HYDROGEN: %llu (seq %llu, %s)\n",
+                 carbon, oxygen, hydrogen, inventory_seq, leader_spec ? "follower" : "leader");
+        return 1;
+    }
+    if (strncmp(cmd, "CAPACITY", 8) == 0) {
+        unsigned long long water, co2, alcohol, glucose;
+        calculate_possible_molecules(carbon, oxygen, hydrogen, &water, &co2, &alcohol, &glucose);
+        snprintf(out, size, "CAPACITY: WATER: %llu, CARBON DIOXIDE: %llu, ALCOHOL: %llu, GLUCOSE: %llu\n",
+                 water, co2, alcohol, glucose);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * cleanup_inventory - Cleans up resources
+ */
+void cleanup_inventory() {
+    if (bgsave_pid != -1) {
+        finish_bgsave();
+    }
+
+    stop_persistence_thread();
+
+    if (inventory_fd != -1) {
+        close(inventory_fd);
+        inventory_fd = -1;
+    }
+
+    if (journal_fd != -1) {
+        close(journal_fd);
+        journal_fd = -1;
+    }
+    
+    if (save_file_path != NULL) {
+        free(save_file_path);
+        save_file_path = NULL;
+    }
+}
+
+int can_deliver(const char *molecule, unsigned long long quantity, unsigned long long *carbon, unsigned long long *oxygen, unsigned long long *hydrogen);
+
+/**
+ * conn_set_events - changes the epoll events of a client connection
+ * EPOLLHUP and EPOLLERR are reported whatever the mask
+ * Returns 0 on success, -1 on failure
+ */
+int conn_set_events(int fd, uint32_t events) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.fd = fd;
+    return epoll_ctl(conn_epoll_fd, EPOLL_CTL_MOD, fd, &event);
+}
+
+/**
+ * conn_update_events - arms EPOLLOUT while a connection has queued output, and
+ * stops reading from it while the queue is over CONN_QUEUE_MAX or a GEN is out
+ * Returns 0 on success, -1 on failure
+ */
+int conn_update_events(int fd) {
+    conn_side_t *side = conns[fd].side;
+    uint32_t events = conns[fd].gen_pending ? 0 : EPOLLIN;
+    if (side == NULL)
+        return conn_set_events(fd, events);
+    if (side->out_len > 0) {
+        events = EPOLLOUT | (side->out_len < CONN_QUEUE_MAX ? events : 0);
+    }
+    if (events != side->events) {
+        if (conn_set_events(fd, events) == -1)
+            return -1;
+        side->events = events;
+    }
+    return 0;
+}
+
+/**
+ * conn_side - a connection's side state, allocated on first use
+ * Returns NULL if out of memory
+ */
+conn_side_t *conn_side(int fd) {
+    conn_side_t *side = conns[fd].side;
+    if (side == NULL && (side = calloc(1, sizeof(conn_side_t))) != NULL) {
+        side->index = -1;
+        side->events = conns[fd].gen_pending ? 0 : EPOLLIN;
+        conns[fd].side = side;
+    }
+    return side;
+}
+
+/**
+ * flush_conn_output - sends a connection's queued messages without blocking
+ * A seqpacket socket takes a message whole or not at all; a stream socket
+ * may take part of one. Frees the state of a non-subscriber once drained
+ * Returns 1 if nothing is left, 0 if the socket is full, -1 if it failed
+ */
+int flush_conn_output(int fd) {
+    conn_side_t *side = conns[fd].side;
+    if (side == NULL)
+        return 1;
+    size_t off = 0;
+    int result = 1;
+    while (off < side->out_len) {
+        uint32_t len;
+        memcpy(&len, side->out + off, sizeof(len));
+        const char *msg = side->out + off + sizeof(len);
+        ssize_t sent = send(fd, msg + side->head_sent, len - side->head_sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent == -1 && errno == EINTR) continue;
+        if (sent <= 0) {
+            result = sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+            break;
+        }
+        side->head_sent += (size_t)sent;
+        if (side->head_sent == len) {
+            off += sizeof(len) + len;
+            side->head_sent = 0;
+        }
+    }
+    memmove(side->out, side->out + off, side->out_len - off);
+    side->out_len -= off;
+    if (result == -1)
+        return -1;
+    conn_update_events(fd);
+    if (side->out_len == 0 && side->index == -1) {
+        free(side->out);
+        free(side);
+        conns[fd].side = NULL;
+    }
+    return result;
+}
+
+/**
+ * conn_queue_msg - appends one message to a connection's queue
+ * Returns -1 if it cannot be stored, in which case it is dropped
+ */
+int conn_queue_msg(conn_side_t *side, const char *msg, size_t len) {
+    uint32_t len32 = (uint32_t)len;
+    size_t need = side->out_len + sizeof(len32) + len;
+    if (need > side->out_cap) {
+        size_t cap = side->out_cap == 0 ? 2 * WATCH_LINE_SIZE : side->out_cap;
+        while (cap < need) cap *= 2;
+        char *out = realloc(side->out, cap);
+        if (out == NULL)
+            return -1;
+        side->out = out;
+        side->out_cap = cap;
+    }
+    memcpy(side->out + side->out_len, &len32, sizeof(len32));
+    memcpy(side->out + side->out_len + sizeof(len32), msg, len);
+    side->out_len = need;
+    return 0;
+}
+
+/**
+ * conn_send - sends a reply to a stream or seqpacket client without blocking
+ * Goes straight to the socket when nothing is queued; what the socket does
+ * not take is queued, and later replies and pushes wait behind it
+ */
+void conn_send(int fd, const char *msg, size_t len) {
+    conn_side_t *side = conns[fd].side;
+    if (side == NULL || side->out_len == 0) {
+        ssize_t sent;
+        do {
+            sent = send(fd, msg, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        } while (sent == -1 && errno == EINTR);
+        if (sent == (ssize_t)len)
+            return;
+        // A failed socket is closed when its EPOLLERR / EPOLLHUP is read
+        if (sent == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return;
+        if (sent > 0) {
+            // Only a stream socket takes part of a message
+            msg += sent;
+            len -= (size_t)sent;
+        }
+        sends_deferred++;
+        if ((side = conn_side(fd)) == NULL)
+            return;
+    }
+    if (conn_queue_msg(side, msg, len) == 0) {
+        flush_conn_output(fd);
+    }
+}
+
+/**
+ * dedupe_hash - FNV-1a over the sender address and request ID
+ */
+unsigned long long dedupe_hash(const void *addr, socklen_t addrlen, const char *request_id) {
+    unsigned long long hash = 14695981039346656037ULL;
+    const unsigned char *bytes = addr;
+    for (socklen_t k = 0; k < addrlen; k++) hash = (hash ^ bytes[k]) * 1099511628211ULL;
+    for (const char *c = request_id; *c; c++) hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    return hash;
+}
+
+/**
+ * dedupe_unlink - removes a ring entry from its hash bucket and frees it
+ */
+void dedupe_unlink(int slot) {
+    dedupe_entry_t *entry = &dedupe_entries[slot];
+    int *link = &dedupe_buckets[entry->hash % DEDUPE_BUCKETS];
+    while (*link != -1 && *link != slot) link = &dedupe_entries[*link].next;
+    if (*link == slot) *link = entry->next;
+    entry->serial = 0;
+}
+
+/**
+ * dedupe_find - looks up a DELIVER by sender and ID
+ * Returns the entry, or NULL if the request is new (or its entry expired)
+ */
+dedupe_entry_t *dedupe_find(const void *addr, socklen_t addrlen, const char *request_id) {
+    if (!dedupe_ready) {
+        for (int k = 0; k < DEDUPE_BUCKETS; k++) dedupe_buckets[k] = -1;
+        dedupe_ready = 1;
+    }
+    unsigned long long hash = dedupe_hash(addr, addrlen, request_id);
+    unsigned long long now = monotonic_ns();
+    for (int slot = dedupe_buckets[hash % DEDUPE_BUCKETS]; slot != -1; slot = dedupe_entries[slot].next) {
+        dedupe_entry_t *entry = &dedupe_entries[slot];
+        if (entry->hash != hash || entry->addrlen != addrlen || strcmp(entry->request_id, request_id) != 0 ||
+            memcmp(&entry->addr, addr, addrlen) != 0)
+            continue;
+        // In-flight entries (parked, awaiting Raft commit) never expire
+        if (entry->done && now - entry->stored_ns > (unsigned long long)config.dedupe_ttl_ms * 1000000ULL)
+            return NULL;
+        return entry;
+    }
+    return NULL;
+}
+
+/**
+ * dedupe_insert - records a DELIVER that is about to run
+ * Called after dedupe_find() missed for the same request
+ * Returns its serial for dedupe_complete(), or 0 if it cannot be cached
+ */
+unsigned long long dedupe_insert(const void *addr, socklen_t addrlen, const char *request_id) {
+    if (request_id[0] == '\0' || config.dedupe_ttl_ms == 0 || addrlen > sizeof(struct sockaddr_storage))
+        return 0;
+
+    unsigned long long serial = ++dedupe_serials;
+    int slot = (int)(serial % DEDUPE_ENTRIES);
+    dedupe_entry_t *entry = &dedupe_entries[slot];
+    if (entry->serial != 0) {
+        if (!entry->done || monotonic_ns() - entry->stored_ns <= (unsigned long long)config.dedupe_ttl_ms * 1000000ULL)
+            dedupe_evicted++;
+        dedupe_unlink(slot);
+    }
+
+    entry->serial = serial;
+    entry->hash = dedupe_hash(addr, addrlen, request_id);
+    entry->done = 0;
+    entry->stored_ns = monotonic_ns();
+    memcpy(&entry->addr, addr, addrlen);
+    entry->addrlen = addrlen;
+    snprintf(entry->request_id, sizeof(entry->request_id), "%s", request_id);
+    entry->reply[0] = '\0';
+
+    // Newest first, so it shadows an expired entry for the same ID
+    int *bucket = &dedupe_buckets[entry->hash % DEDUPE_BUCKETS];
+    entry->next = *bucket;
+    *bucket = slot;
+    return serial;
+}
+
+/**
+ * dedupe_complete - stores the reply of a cached DELIVER
+ */
+void dedupe_complete(unsigned long long serial, const char *msg) {
+    dedupe_entry_t *entry = &dedupe_entries[serial % DEDUPE_ENTRIES];
+    if (serial == 0 || entry->serial != serial)
+        return;
+    snprintf(entry->reply, sizeof(entry->reply), "%s", msg);
+    entry->done = 1;
+    entry->stored_ns = monotonic_ns();
+}
+
+/**
+ * dedupe_forget - drops a cached DELIVER that did not run, so a retry runs it
+ */
+void dedupe_forget(unsigned long long serial) {
+    if (serial != 0 && dedupe_entries[serial % DEDUPE_ENTRIES].serial == serial)
+        dedupe_unlink((int)(serial % DEDUPE_ENTRIES));
+}
+
+/**
+ * print_dedupe_stats - retransmit cache counters for STATS
+ */
+void print_dedupe_stats(FILE *out) {
+    unsigned long long cached = dedupe_serials < DEDUPE_ENTRIES ? dedupe_serials : DEDUPE_ENTRIES;
+    fprintf(out, "Dedupe: %llu/%d entries (TTL %d ms), replayed=%llu in_flight=%llu evicted=%llu\n",
+           cached, DEDUPE_ENTRIES, config.dedupe_ttl_ms, dedupe_replayed, dedupe_in_flight, dedupe_evicted);
+}
+
+/**
+ * tag_reply - copies a reply with " ID=<request_id>" at the end of every line,
+ * so a client with many requests in flight can tell which one a line belongs to
+ * Returns the length of the tagged reply
+ */
+size_t tag_reply(char *out, size_t size, const char *msg, const char *request_id) {
+    size_t len = 0;
+    while (*msg != '\0' && len < size - 1) {
+        int line = (int)strcspn(msg, "\n");
+        int n = snprintf(out + len, size - len, "%.*s ID=%s\n", line, msg, request_id);
+        len += (n < 0 || (size_t)n >= size - len) ? size - 1 - len : (size_t)n;
+        msg += line;
+        if (*msg == '\n') msg++;
+    }
+    out[len] = '\0';
+    return len;
+}
+
+/**
+ * send_reply - sends a reply to a stream client or a datagram sender,
+ * echoing the request's ID= (if any)
+ */
+void send_reply(int fd, int is_datagram, void *addr, socklen_t addrlen, const char *msg, const char *request_id) {
+    char tagged[2 * BUFFER_SIZE];
+    size_t len = strlen(msg);
+    if (request_id != NULL && request_id[0] != '\0') {
+        len = tag_reply(tagged, sizeof(tagged), msg, request_id);
+        msg = tagged;
+    }
+    if (is_datagram && addrlen > 0) {
+        sendto(fd, msg, len, 0, (struct sockaddr*)addr, addrlen);
+    } else {
+        // A seqpacket DELIVER (no address) queues behind the connection's pushes
+        conn_send(fd, msg, len);
+    }
+}
+
+/**
+ * datagram_reply - answers a datagram request
+ */
+void datagram_reply(int fd, void *addr, socklen_t addrlen, const char *msg, const char *request_id) {
+    send_reply(fd, 1, addr, addrlen, msg, request_id);
+}
+
+/**
+ * send_pending_reply - answers the client that proposed a log entry
+ * Dropped if the stream client hung up since (its fd may be reused)
+ */
+void send_pending_reply(pending_reply_t *pending, const char *msg) {
+    if ((!pending->is_datagram || pending->addrlen == 0) && conns[pending->fd].gen != pending->conn_gen)
+        return;
+    send_reply(pending->fd, pending->is_datagram, &pending->addr, pending->addrlen, msg, pending->request_id);
+    dedupe_complete(pending->dedupe_serial, msg);
+}
+
+/**
+ * fail_pending_replies - answers every waiting client after losing leadership
+ * Their entries may still commit under the next leader, so the outcome is unknown
+ */
+void fail_pending_replies(void) {
+    for (int k = 0; k < MAX_PENDING_REPLIES; k++) {
+        if (pending_replies[k].index != 0) {
+            send_pending_reply(&pending_replies[k], "ERROR: Leadership lost, outcome unknown. Check STATUS before retrying.\n");
+            pending_replies[k].index = 0;
+            cluster_unknown++;
+        }
+    }
+}
+
+/**
+ * cluster_role_change - Raft callback when this node gains or loses leadership
+ */
+void cluster_role_change(int is_leader) {
+    printf("Cluster: node %d is now %s (term %llu)\n", node_id, is_leader ? "leader" : "follower",
+           (unsigned long long)raft_term());
+    if (!is_leader) {
+        fail_pending_replies();
+    }
+}
+
+/**
+ * cluster_apply - applies a committed log entry to the inventory
+ * Runs on every node in log order; limits are checked again here because
+ * entries committed before this one may have changed the stock
+ */
+void cluster_apply(uint64_t index, const raft_entry_t *entry) {
+    unsigned long long *carbon = cluster_inventory[0];
+    unsigned long long *oxygen = cluster_inventory[1];
+    unsigned long long *hydrogen = cluster_inventory[2];
+    char response[2 * BUFFER_SIZE];
+    response[0] = '\0';
+
+    if (entry->type == RAFT_ENTRY_ADD && entry->arg < 3) {
+        unsigned long long *counter = cluster_inventory[entry->arg];
+        const char *atom = atom_names[entry->arg];
+        if (*counter + entry->amount > config.max_atoms) {
+            snprintf(response, sizeof(response), "ERROR: Adding this would exceed %s storage limit (%llu).\n", atom, config.max_atoms);
+            cluster_rejected++;
+        } else {
+            *counter += entry->amount;
+            publish_inventory(*carbon, *oxygen, *hydrogen);
+            snprintf(response, sizeof(response),
+                     "SUCCESS: Added %llu %s. Total %s: %llu\nStatus: CARBON: %llu, OXYGEN: %llu, HYDROGEN: %llu\n",
+                     (unsigned long long)entry->amount, atom, atom, *counter, *carbon, *oxygen, *hydrogen);
+        }
+    } else if (entry->type == RAFT_ENTRY_DELIVER && entry->arg < 4) {
+        const char *molecule = molecule_names[entry->arg];
+        if (can_deliver(molecule, entry->amount, carbon, oxygen, hydrogen)) {
+            if (entry->amount == 1) {
+                snprintf(response, sizeof(response), "Molecule delivered successfully.\n");
+            } else {
+                snprintf(response, sizeof(response), "Delivered %llu %s successfully.\n",
+                         (unsigned long long)entry->amount, molecule);
+            }
+        } else {
+            snprintf(response, sizeof(response), "Not enough atoms for this molecule.\n");
+            cluster_rejected++;
+        }
+    }
+
+    pending_reply_t *pending = &pending_replies[index % MAX_PENDING_REPLIES];
+    if (pending->index == index) {
+        if (response[0] != '\0') {
+            send_pending_reply(pending, response);
+        }
+        pending->index = 0;
+    }
+}
+
+/**
+ * cluster_propose - appends a client's ADD or DELIVER to the Raft log
+ * The reply is sent when the entry is applied; nodes that are not the
+ * leader answer with a redirect instead
+ */
+void cluster_propose(uint8_t type, uint8_t arg, unsigned long long amount, int fd, int is_datagram,
+                     void *addr, socklen_t addrlen, unsigned long long dedupe_serial, const char *request_id) {
+    uint64_t index = raft_propose(type, arg, amount);
+    if (index == 0) {
+        char response[BUFFER_SIZE];
+        const raft_peer_t *leader = raft_leader();
+        if (leader == NULL) {
+            snprintf(response, sizeof(response), "ERROR: No leader elected yet, retry shortly.\n");
+        } else {
+            int port = is_datagram ? leader->udp_port : leader->tcp_port;
+            snprintf(response, sizeof(response), "ERROR: Not leader, redirect to %s:%d (node %d).\n",
+                     leader->host, port, leader->id);
+        }
+        send_reply(fd, is_datagram, addr, addrlen, response, request_id);
+        dedupe_forget(dedupe_serial);
+        return;
+    }
+
+    pending_reply_t *pending = &pending_replies[index % MAX_PENDING_REPLIES];
+    if (pending->index != 0) {
+        send_pending_reply(pending, "ERROR: Too many pending requests, outcome unknown.\n");
+        cluster_unknown++;
+    }
+    pending->index = index;
+    pending->fd = fd;
+    pending->is_datagram = is_datagram;
+    pending->conn_gen = conns[fd].gen;
+    pending->dedupe_serial = dedupe_serial;
+    snprintf(pending->request_id, sizeof(pending->request_id), "%s", request_id != NULL ? request_id : "");
+    pending->addrlen = 0;
+    if (is_datagram && addrlen > 0 && addrlen <= sizeof(pending->addr)) {
+        memcpy(&pending->addr, addr, addrlen);
+        pending->addrlen = addrlen;
+    }
+}
+
+/**
+ * stream_reply - answers a stream client, or collects the reply of a ring or
+ * seqpacket command
+ */
+void stream_reply(int fd, const char *msg) {
+    char tagged[2 * BUFFER_SIZE];
+    size_t len = strlen(msg);
+    if (stream_reply_id[0] != '\0') {
+        len = tag_reply(tagged, sizeof(tagged), msg, stream_reply_id);
+        msg = tagged;
+    }
+    if (fd == seqpacket_reply_fd) {
+        if (len > sizeof(seqpacket_reply) - seqpacket_reply_len) {
+            len = sizeof(seqpacket_reply) - seqpacket_reply_len;
+        }
+        memcpy(seqpacket_reply + seqpacket_reply_len, msg, len);
+        seqpacket_reply_len += len;
+        return;
+    }
+    if (fd != shm_reply_fd) {
+        conn_send(fd, msg, len);
+        return;
+    }
+    if (len > sizeof(shm_reply) - shm_reply_len) {
+        len = sizeof(shm_reply) - shm_reply_len;
+    }
+    memcpy(shm_reply + shm_reply_len, msg, len);
+    shm_reply_len += len;
+}
+
+/**
+ * start_watch - subscribes a stream client to inventory changes
+ * Answers with the current inventory; later pushes carry the change since the previous one
+ */
+void start_watch(int fd, unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen) {
+    char response[WATCH_LINE_SIZE];
+    if (fd == shm_reply_fd) {
+        stream_reply(fd, "ERROR: WATCH needs a stream connection.\n");
+        return;
+    }
+    conn_side_t *watch = conn_side(fd);
+    if (watch == NULL) {
+        stream_reply(fd, "ERROR: Out of memory.\n");
+        return;
+    }
+    if (watch->index == -1) {
+        watch->index = watch_count;
+        watch_fds[watch_count++] = fd;
+    }
+    watch->sent[0] = carbon;
+    watch->sent[1] = oxygen;
+    watch->sent[2] = hydrogen;
+    snprintf(response, sizeof(response), "WATCH OK: CARBON: %llu, OXYGEN: %llu, HYDROGEN: %llu (seq %llu)\n",
+             carbon, oxygen, hydrogen, inventory_seq);
+    stream_reply(fd, response);
+}
+
+/**
+ * stop_watch - removes a subscriber (UNWATCH or closed connection)
+ * After UNWATCH the queue is kept until it drains, so replies stay in order
+ */
+void stop_watch(int fd, int closing) {
+    conn_side_t *watch = conns[fd].side;
+    if (watch == NULL)
+        return;
+    if (watch->index != -1) {
+        if (watch->behind) watch_backlogged--;
+        watch->behind = 0;
+        watch_fds[watch->index] = watch_fds[--watch_count];
+        conns[watch_fds[watch->index]].side->index = watch->index;
+        watch->index = -1;
+    }
+    if (closing || watch->out_len == 0) {
+        free(watch->out);
+        free(watch);
+        conns[fd].side = NULL;
+    }
+}
+
+/**
+ * format_delta - prints the signed change of a counter
+ */
+void format_delta(char *out, size_t size, unsigned long long now, unsigned long long before) {
+    if (now >= before) snprintf(out, size, "+%llu", now - before);
+    else snprintf(out, size, "-%llu", before - now);
+}
+
+/**
+ * push_watchers - sends one coalesced update to every subscriber that is behind
+ * Runs at most once per config.watch_interval_ms, however many changes happened
+ * meanwhile; a subscriber with queued output skips updates until EPOLLOUT
+ * drains it, and is looked at again in the next batch
+ */
+void push_watchers(unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen) {
+    if (inventory_seq == watch_batch_seq && watch_backlogged == 0)
+        return;
+    unsigned long long now = monotonic_ns();
+    if (now < watch_batch_ns + (unsigned long long)config.watch_interval_ms * 1000000ULL)
+        return;
+    watch_batch_ns = now;
+    watch_batch_seq = inventory_seq;
+    watch_batches++;
+
+    unsigned long long values[3] = {carbon, oxygen, hydrogen};
+    for (int k = 0; k < watch_count; k++) {
+        int fd = watch_fds[k];
+        conn_side_t *watch = conns[fd].side;
+        if (watch->out_len > 0) {
+            if (!watch->behind) {
+                watch->behind = 1;
+                watch_backlogged++;
+            }
+            watch_skipped++;
+            continue;
+        }
+        if (watch->behind) {
+            watch->behind = 0;
+            watch_backlogged--;
+        }
+        if (memcmp(watch->sent, values, sizeof(values)) == 0)
+            continue;
+
+        char line[WATCH_LINE_SIZE];
+        char delta[3][24];
+        for (int a = 0; a < 3; a++) {
+            format_delta(delta[a], sizeof(delta[a]), values[a], watch->sent[a]);
+        }
+        int len = snprintf(line, sizeof(line),
+                           "WATCH: CARBON: %llu (%s), OXYGEN: %llu (%s), HYDROGEN: %llu (%s) (seq %llu)\n",
+                           carbon, delta[0], oxygen, delta[1], hydrogen, delta[2], inventory_seq);
+        memcpy(watch->sent, values, sizeof(values));
+        watch_pushes++;
+        conn_send(fd, line, (size_t)len < sizeof(line) ? (size_t)len : sizeof(line) - 1);
+    }
+}
+
+/**
+ * watch_timeout_ms - time until subscribers are due an update, -1 if none are
+ */
+int watch_timeout_ms(void) {
+    if (watch_count == 0 || (inventory_seq == watch_batch_seq && watch_backlogged == 0))
+        return -1;
+    unsigned long long due = watch_batch_ns + (unsigned long long)config.watch_interval_ms * 1000000ULL;
+    unsigned long long now = monotonic_ns();
+    return now >= due ? 0 : (int)((due - now + 999999ULL) / 1000000ULL);
+}
+
+/**
+ * open_feed - creates the feed socket for a GROUP:PORT multicast or broadcast address
+ * Returns 0 on success, -1 on error
+ */
+int open_feed(const char *spec) {
+    char host[64];
+    const char *colon = strrchr(spec, ':');
+    if (colon == NULL || colon == spec || (size_t)(colon - spec) >= sizeof(host) || atoi(colon + 1) <= 0 ||
+        atoi(colon + 1) > 65535) {
+        fprintf(stderr, "Error: Invalid feed address (expected GROUP:PORT): %s\n", spec);
+        return -1;
+    }
+    memcpy(host, spec, (size_t)(colon - spec));
+    host[colon - spec] = '\0';
+
+    memset(&feed_addr, 0, sizeof(feed_addr));
+    feed_addr.sin_family = AF_INET;
+    feed_addr.sin_port = htons(atoi(colon + 1));
+    if (inet_pton(AF_INET, host, &feed_addr.sin_addr) != 1) {
+        fprintf(stderr, "Error: Invalid feed address: %s\n", host);
+        return -1;
+    }
+
+    feed_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (feed_fd == -1) {
+        perror("Feed socket");
+        return -1;
+    }
+    int on = 1;
+    if (IN_MULTICAST(ntohl(feed_addr.sin_addr.s_addr))) {
+        unsigned char ttl = 1, loop = 1;
+        setsockopt(feed_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+        setsockopt(feed_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+        if (feed_interface != NULL) {
+            struct in_addr local;
+            if (inet_pton(AF_INET, feed_interface, &local) != 1 ||
+                setsockopt(feed_fd, IPPROTO_IP, IP_MULTICAST_IF, &local, sizeof(local)) == -1) {
+                fprintf(stderr, "Error: Cannot send multicast from %s\n", feed_interface);
+                return -1;
+            }
+        }
+    } else if (setsockopt(feed_fd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on)) == -1) {
+        perror("Feed SO_BROADCAST");
+        return -1;
+    }
+    set_nonblocking(feed_fd);
+    feed_session = ((uint64_t)time(NULL) << 32) | (uint64_t)getpid();
+    printf("Inventory feed: %s:%d, at most %d packets/s\n", host, ntohs(feed_addr.sin_port), feed_rate_hz);
+    return 0;
+}
+
+/**
+ * build_feed_packet - fills a wire-format snapshot of the inventory
+ */
+void build_feed_packet(feed_packet_t *packet, uint32_t flags,
+                       unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen) {
+    packet->magic = FEED_MAGIC;
+    packet->flags = flags;
+    packet->session = feed_session;
+    packet->feed_seq = feed_seq;
+    packet->inventory_seq = inventory_seq;
+    packet->carbon = carbon;
+    packet->oxygen = oxygen;
+    packet->hydrogen = hydrogen;
+    feed_encode(packet);
+}
+
+/**
+ * feed_timeout_ms - time until the next feed packet is due
+ */
+int feed_timeout_ms(void) {
+    unsigned long long wait_ms = inventory_seq != feed_sent_inventory_seq ? 1000ULL / feed_rate_hz : FEED_HEARTBEAT_MS;
+    unsigned long long due = feed_last_ns + wait_ms * 1000000ULL;
+    unsigned long long now = monotonic_ns();
+    return now >= due ? 0 : (int)((due - now + 999999ULL) / 1000000ULL);
+}
+
+/**
+ * feed_tick - sends the newest inventory to the group if it changed (at most
+ * feed_rate_hz times a second), or a heartbeat copy once a second
+ */
+void feed_tick(unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen) {
+    if (feed_timeout_ms() > 0)
+        return;
+
+    feed_packet_t packet;
+    feed_seq++;
+    build_feed_packet(&packet, 0, carbon, oxygen, hydrogen);
+    if (sendto(feed_fd, &packet, sizeof(packet), 0, (struct sockaddr*)&feed_addr, sizeof(feed_addr)) == -1) {
+        feed_send_errors++;
+    }
+    feed_sent_inventory_seq = inventory_seq;
+    feed_last_ns = monotonic_ns();
+}
+
+/**
+ * queue_shard_reply - buffers a participant reply, sent after the whole input chunk
+ */
+void queue_shard_reply(int fd, const char *msg) {
+    if (fd == shm_reply_fd || fd == seqpacket_reply_fd) {
+        stream_reply(fd, msg);
+        return;
+    }
+    size_t len = strlen(msg);
+    if (shard_reply_len + len > sizeof(shard_reply)) {
+        conn_send(fd, shard_reply, shard_reply_len);
+        shard_reply_len = 0;
+    }
+    memcpy(shard_reply + shard_reply_len, msg, len);
+    shard_reply_len += len;
+}
+
+/**
+ * release_coordinator - forgets a closed coordinator connection
+ * Its prepared holds stay: the coordinator may already have sent COMMIT to
+ * other shards, so only the coordinator may decide them
+ */
+void release_coordinator(int fd) {
+    if (fd != shard_coordinator_fd)
+        return;
+    shard_coordinator_fd = -1;
+    printf("Shard: coordinator disconnected, %d transaction(s) held until it reconnects\n", shard_held);
+}
+
+/**
+ * start_coordinator - makes a connection the shard's coordinator
+ * Only a UDS stream peer running as the shard's own user qualifies, and only
+ * one at a time. Answers INDOUBT <txid> for every hold, then COORDINATOR OK
+ */
+void start_coordinator(int client_fd) {
+    char reply[64];
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (conns[client_fd].kind != CONN_UDS || getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 ||
+        cred.uid != getuid()) {
+        stream_reply(client_fd, "ERROR: COORDINATOR needs a UDS stream connection from the shard's own user.\n");
+        return;
+    }
+    if (shard_coordinator_fd != -1 && shard_coordinator_fd != client_fd) {
+        stream_reply(client_fd, "ERROR: Another coordinator is connected.\n");
+        return;
+    }
+    shard_coordinator_fd = client_fd;
+    for (int k = 0; k < MAX_PREPARED; k++) {
+        if (prepared_txns[k].txid != 0) {
+            snprintf(reply, sizeof(reply), "INDOUBT %llu\n", prepared_txns[k].txid);
+            queue_shard_reply(client_fd, reply);
+        }
+    }
+    snprintf(reply, sizeof(reply), "COORDINATOR OK %d\n", shard_held);
+    queue_shard_reply(client_fd, reply);
+}
+
+/**
+ * process_shard_command - two-phase commit participant and ADD routing
+ * PREPARE <txid> <amount> holds atoms and votes PREPARED or REFUSED;
+ * COMMIT/ABORT <txid> take or release the hold and answer COMMITTED or
+ * ABORTED (UNKNOWN if nothing is held). These are taken only from the
+ * connection that sent COORDINATOR
+ * Returns 1 if the command was handled, 0 to continue with normal handling
+ */
+int process_shard_command(int client_fd, char *cmd, unsigned long long *counter,
+                          unsigned long long *carbon, unsigned long long *oxygen, unsigned long long *hydrogen) {
+    char type[16], reply[64];
+    unsigned long long txid, amount;
+
+    if (strncmp(cmd, "COORDINATOR", 11) == 0 && (cmd[11] == '\n' || cmd[11] == '\r' || cmd[11] == '\0')) {
+        start_coordinator(client_fd);
+        return 1;
+    }
+    if ((strncmp(cmd, "PREPARE ", 8) == 0 || strncmp(cmd, "COMMIT ", 7) == 0 || strncmp(cmd, "ABORT ", 6) == 0) &&
+        client_fd != shard_coordinator_fd) {
+        stream_reply(client_fd, "ERROR: PREPARE, COMMIT and ABORT are only taken from the coordinator.\n");
+        return 1;
+    }
+
+    if (sscanf(cmd, "PREPARE %llu %llu", &txid, &amount) == 2) {
+        prepared_txn_t *txn = &prepared_txns[txid % MAX_PREPARED];
+        if (txid != 0 && txn->txid == 0 && amount <= *counter - shard_reserved) {
+            txn->txid = txid;
+            txn->amount = amount;
+            shard_reserved += amount;
+            shard_held++;
+            shard_prepared++;
+            snprintf(reply, sizeof(reply), "PREPARED %llu\n", txid);
+        } else {
+            shard_refused++;
+            snprintf(reply, sizeof(reply), "REFUSED %llu\n", txid);
+        }
+        queue_shard_reply(client_fd, reply);
+        return 1;
+    }
+
+    int is_commit = sscanf(cmd, "COMMIT %llu", &txid) == 1;
+    if (is_commit || sscanf(cmd, "ABORT %llu", &txid) == 1) {
+        prepared_txn_t *txn = &prepared_txns[txid % MAX_PREPARED];
+        if (txid == 0 || txn->txid != txid) {
+            printf("Shard: %s for unknown transaction %llu\n", is_commit ? "COMMIT" : "ABORT", txid);
+            snprintf(reply, sizeof(reply), "UNKNOWN %llu\n", txid);
+            queue_shard_reply(client_fd, reply);
+            return 1;
+        }
+        shard_reserved -= txn->amount;
+        shard_held--;
+        txn->txid = 0;
+        if (is_commit) {
+            *counter -= txn->amount;
+            shard_committed++;
+            publish_inventory(*carbon, *oxygen, *hydrogen);
+        } else {
+            shard_aborted++;
+        }
+        snprintf(reply, sizeof(reply), "%s %llu\n", is_commit ? "COMMITTED" : "ABORTED", txid);
+        queue_shard_reply(client_fd, reply);
+        return 1;
+    }
+
+    if (sscanf(cmd, "ADD %15s", type) == 1 && strcmp(type, atom_names[shard_atom]) != 0) {
+        char response[BUFFER_SIZE];
+        snprintf(response, sizeof(response), "ERROR: This shard holds only %s, send %s to its own shard.\n",
+                 atom_names[shard_atom], type);
+        stream_reply(client_fd, response);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * start_shm_session - upgrades a UDS stream client to the shared-memory rings
+ * Sends "SHM OK" with the channel memfd and both eventfds attached
+ */
+void start_shm_session(int fd) {
+    struct sockaddr_storage local;
+    socklen_t local_len = sizeof(local);
+    int slot = -1;
+
+    if (fd == shm_reply_fd || conns[fd].kind == CONN_SEQPACKET || getsockname(fd, (struct sockaddr*)&local, &local_len) == -1 ||
+        local.ss_family != AF_UNIX) {
+        stream_reply(fd, "ERROR: SHM needs a UDS stream connection.\n");
+        return;
+    }
+    if (cluster_mode) {
+        stream_reply(fd, "ERROR: SHM is not available in cluster mode.\n");
+        return;
+    }
+    if (conns[fd].side != NULL && conns[fd].side->out_len > 0) {
+        // The descriptors cannot wait in the queue behind earlier replies
+        stream_reply(fd, "ERROR: SHM needs the earlier replies read first.\n");
+        return;
+    }
+    for (int k = 0; k < MAX_SHM_CLIENTS && slot == -1; k++) {
+        if (shm_clients[k].chan == NULL) slot = k;
+    }
+    if (slot == -1) {
+        stream_reply(fd, "ERROR: Too many shared-memory clients.\n");
+        return;
+    }
+
+    int memfd = memfd_create("warehouse-shm", MFD_CLOEXEC);
+    if (memfd == -1 || ftruncate(memfd, sizeof(shm_channel_t)) == -1) {
+        perror("SHM memfd");
+        if (memfd != -1) close(memfd);
+        stream_reply(fd, "ERROR: Shared memory setup failed.\n");
+        return;
+    }
+    shm_channel_t *chan = mmap(NULL, sizeof(shm_channel_t), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    int req_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    int resp_efd = eventfd(0, EFD_CLOEXEC);
+    if (chan == MAP_FAILED || req_efd == -1 || resp_efd == -1 || req_efd >= FD_SETSIZE) {
+        perror("SHM setup");
+        if (chan != MAP_FAILED) munmap(chan, sizeof(shm_channel_t));
+        if (req_efd != -1) close(req_efd);
+        if (resp_efd != -1) close(resp_efd);
+        close(memfd);
+        stream_reply(fd, "ERROR: Shared memory setup failed.\n");
+        return;
+    }
+    chan->magic = SHM_MAGIC;
+    chan->slot_size = SHM_SLOT_SIZE;
+    chan->requests.consumer_waiting = 1;
+
+    // The descriptors ride along with the reply line
+    char ok[] = "SHM OK\n";
+    int fds[3] = {memfd, req_efd, resp_efd};
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } control;
+    struct iovec iov = {ok, strlen(ok)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    int sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    close(memfd);
+    if (sent == -1) {
+        perror("SHM sendmsg");
+        munmap(chan, sizeof(shm_channel_t));
+        close(req_efd);
+        close(resp_efd);
+        return;
+    }
+
+    shm_clients[slot].ctl_fd = fd;
+    shm_clients[slot].chan = chan;
+    shm_clients[slot].req_efd = req_efd;
+    shm_clients[slot].resp_efd = resp_efd;
+    shm_client_count++;
+    if (config.log_level >= LOG_INFO) printf("Socket %d switched to shared memory\n", fd);
+}
+
+/**
+ * close_shm_session - unmaps the rings of a closing stream client
+ */
+void close_shm_session(int fd) {
+    for (int k = 0; k < MAX_SHM_CLIENTS; k++) {
+        if (shm_clients[k].chan != NULL && shm_clients[k].ctl_fd == fd) {
+            munmap(shm_clients[k].chan, sizeof(shm_channel_t));
+            close(shm_clients[k].req_efd);
+            close(shm_clients[k].resp_efd);
+            shm_clients[k].chan = NULL;
+            shm_client_count--;
+        }
+    }
+}
+
+/**
+ * shm_fill_fds - adds the request eventfds to the select() read set
+ */
+void shm_fill_fds(fd_set *read_fds, int *maxfd) {
+    for (int k = 0; k < MAX_SHM_CLIENTS; k++) {
+        if (shm_clients[k].chan != NULL) {
+            FD_SET(shm_clients[k].req_efd, read_fds);
+            if (shm_clients[k].req_efd > *maxfd) *maxfd = shm_clients[k].req_efd;
+        }
+    }
+}
+
+/**
+ * shm_arm - tells every client the server is about to sleep
+ * Returns 1 if a request is already waiting, so select() must not block
+ */
+int shm_arm(void) {
+    int pending = 0;
+    for (int k = 0; k < MAX_SHM_CLIENTS; k++) {
+        if (shm_clients[k].chan != NULL && shm_ring_arm(&shm_clients[k].chan->requests)) {
+            pending = 1;
+        }
+    }
+    return pending;
+}
+
+/**
+ * shm_service - runs every queued ring command, one response slot per command
+ * Returns the number of commands run
+ */
+int shm_service(unsigned long long *carbon, unsigned long long *oxygen, unsigned long long *hydrogen) {
+    char cmd[SHM_SLOT_SIZE];
+    int served = 0;
+
+    for (int k = 0; k < MAX_SHM_CLIENTS; k++) {
+        shm_client_t *client = &shm_clients[k];
+        int ran = 0;
+        while (client->chan != NULL && shm_ring_pop(&client->chan->requests, cmd, sizeof(cmd)) >= 0) {
+            shm_reply_fd = client->ctl_fd;
+            shm_reply_len = 0;
+            process_command(client->ctl_fd, cmd, carbon, oxygen, hydrogen);
+            shm_reply_fd = -1;
+            if (shm_reply_len > 0 &&
+                shm_ring_push(&client->chan->responses, shm_reply, shm_reply_len) != 0) {
+                shm_dropped++;
+            }
+            ran++;
+        }
+        if (ran > 0 && shm_ring_needs_wake(&client->chan->responses)) {
+            uint64_t one = 1;
+            if (write(client->resp_efd, &one, sizeof(one)) == sizeof(one)) shm_wakeups++;
+        }
+        served += ran;
+    }
+    shm_requests += served;
+    return served;
+}
+
+/**
+ * shm_handle_fds - drains woken request eventfds and services the rings
+ * Returns 1 if any ring command was run
+ */
+int shm_handle_fds(fd_set *read_fds, unsigned long long *carbon, unsigned long long *oxygen, unsigned long long *hydrogen) {
+    for (int k = 0; k < MAX_SHM_CLIENTS; k++) {
+        if (shm_clients[k].chan == NULL) continue;
+        if (FD_ISSET(shm_clients[k].req_efd, read_fds)) {
+            uint64_t count;
+            if (read(shm_clients[k].req_efd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+                perror("SHM eventfd read");
+            }
+            FD_CLR(shm_clients[k].req_efd, read_fds);
+        }
+        shm_ring_disarm(&shm_clients[k].chan->requests);
+    }
+    return shm_service(carbon, oxygen, hydrogen) > 0;
+}
+
+/**
+ * shm_busy_poll - spins on the rings for up to shm_poll_us without system calls
+ * Returns 1 if any command arrived, so the loop should keep polling
+ */
+int shm_busy_poll(unsigned long long *carbon, unsigned long long *oxygen, unsigned long long *hydrogen) {
+    unsigned long long deadline = monotonic_ns() + (unsigned long long)shm_poll_us * 1000ULL;
+    int served = 0;
+    do {
+        served += shm_service(carbon, oxygen, hydrogen);
+    } while (monotonic_ns() < deadline);
+    return served > 0;
+}
+
+/**
+ * rate_take - takes one token from a bucket, refilling it for the time passed
+ * Returns 1 if the request may run, 0 if the bucket is empty
+ */
+int rate_take(rate_bucket_t *bucket, const rate_limit_t *limit, unsigned long long now) {
+    if (limit->rate == 0)
+        return 1;
+    if (bucket->last_ns == 0) {
+        bucket->tokens = (double)limit->burst;
+    } else {
+        bucket->tokens += (double)(now - bucket->last_ns) * (double)limit->rate / 1e9;
+        if (bucket->tokens > (double)limit->burst) bucket->tokens = (double)limit->burst;
+    }
+    bucket->last_ns = now;
+    if (bucket->tokens < 1.0)
+        return 0;
+    bucket->tokens -= 1.0;
+    return 1;
+}
+
+/**
+ * rate_lookup - finds or adds the hash table entry of a source address
+ */
+rate_source_t *rate_lookup(uint64_t key, unsigned long long now) {
+    size_t slot = (size_t)((key * 0x9E3779B97F4A7C15ULL) >> 52) & (RATE_TABLE_SIZE - 1);
+    rate_source_t *oldest = NULL;
+    for (int probe = 0; probe < RATE_PROBE_LIMIT; probe++) {
+        rate_source_t *entry = &rate_sources[(slot + probe) & (RATE_TABLE_SIZE - 1)];
+        if (entry->key == key)
+            return entry;
+        if (entry->key == 0) {
+            oldest = entry;
+            rate_source_count++;
+            break;
+        }
+        if (oldest == NULL || entry->last_ns < oldest->last_ns) oldest = entry;
+    }
+    if (oldest->key != 0) rate_evictions++;
+    memset(oldest, 0, sizeof(*oldest));
+    oldest->key = key;
+    oldest->last_ns = now;
+    return oldest;
+}
+
+/**
+ * rate_key_for_address - source key of a peer address
+ * IPv4 clients are keyed by address, UDS datagram clients by their bound path
+ * (unbound senders share one key); UDS stream clients use rate_key_for_uid
+ */
+uint64_t rate_key_for_address(const void *addr, socklen_t addrlen, int is_uds) {
+    if (!is_uds) {
+        const struct sockaddr_in *in = addr;
+        return (1ULL << 62) | ntohl(in->sin_addr.s_addr);
+    }
+    const struct sockaddr_un *un = addr;
+    uint64_t hash = 14695981039346656037ULL;    // FNV-1a of the sender path
+    size_t path_len = addrlen > offsetof(struct sockaddr_un, sun_path) ? addrlen - offsetof(struct sockaddr_un, sun_path) : 0;
+    for (size_t k = 0; k < path_len && k < sizeof(un->sun_path); k++) {
+        hash = (hash ^ (unsigned char)un->sun_path[k]) * 1099511628211ULL;
+    }
+    return (3ULL << 62) | (hash >> 2);
+}
+
+/**
+ * rate_key_for_uid - source key of a UDS stream peer (its user id)
+ */
+uint64_t rate_key_for_uid(int fd) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+        return 2ULL << 62;
+    return (2ULL << 62) | (uint64_t)cred.uid;
+}
+
+/**
+ * rate_attach - gives a new stream client fresh buckets and its source key
+ */
+void rate_attach(int fd, uint64_t key) {
+    memset(conns[fd].buckets, 0, sizeof(conns[fd].buckets));
+    conns[fd].source = key;
+}
+
+/**
+ * rate_kind - which limit a request falls under, by its first word only
+ * Returns RATE_ADD, RATE_DELIVER or -1 for requests that are not limited
+ */
+int rate_kind(const char *cmd) {
+    if (strncmp(cmd, "ADD", 3) == 0) return RATE_ADD;
+    if (strncmp(cmd, "DELIVER", 7) == 0) return RATE_DELIVER;
+    return -1;
+}
+
+/**
+ * rate_allow - charges a request to its connection (fd, -1 for datagrams)
+ * and source buckets; returns 1 if it may run, 0 if it must be rejected
+ */
+int rate_allow(int kind, int fd, uint64_t key) {
+    const rate_limit_t *limits = config.rate_limits[kind];
+    if (limits[RATE_CONNECTION].rate == 0 && limits[RATE_ADDRESS].rate == 0)
+        return 1;
+
+    unsigned long long now = monotonic_ns();
+    if (fd >= 0 && !rate_take(&conns[fd].buckets[kind], &limits[RATE_CONNECTION], now)) {
+        rate_rejected[kind][RATE_CONNECTION]++;
+        return 0;
+    }
+    if (limits[RATE_ADDRESS].rate > 0) {
+        rate_source_t *source = rate_lookup(key, now);
+        source->last_ns = now;
+        if (!rate_take(&source->buckets[kind], &limits[RATE_ADDRESS], now)) {
+            rate_rejected[kind][RATE_ADDRESS]++;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * rate_reply - formats the configured rejection reply
+ * An empty reply drops datagrams silently; stream and seqpacket clients may
+ * match replies in order, so they get base_config's text instead
+ * Returns its length, 0 if the request should be dropped without a reply
+ */
+size_t rate_reply(int kind, int connected, char *out, size_t size) {
+    const char *text = config.rate_replies[kind];
+    if (text[0] == '\0') {
+        if (!connected)
+            return 0;
+        text = base_config.rate_replies[kind];
+    }
+    snprintf(out, size, "%s\n", text);
+    return strlen(out);
+}
+
+/**
+ * parse_request_options - strips trailing KEY=VALUE option tokens from a request
+ * The line keeps its newline, so the command parsers see what they always did.
+ * Returns 0 on success, -1 for a malformed option value
+ */
+int parse_request_options(char *line, request_options_t *opts) {
+    opts->deadline_ms = 0;
+    opts->priority = REQUEST_DEFAULT_PRIORITY;
+    opts->wait_ms = 0;
+    opts->request_id[0] = '\0';
+
+    size_t end = strcspn(line, "\r\n");
+    int had_newline = line[end] != '\0';
+    while (end > 0) {
+        size_t start = end;
+        while (start > 0 && line[start - 1] != ' ') start--;
+        char *token = line + start;
+        char *endp;
+        if (strncmp(token, "DL=", 3) == 0) {
+            opts->deadline_ms = strtoull(token + 3, &endp, 10);
+        } else if (strncmp(token, "WAIT=", 5) == 0) {
+            opts->wait_ms = strtoull(token + 5, &endp, 10);
+        } else if (strncmp(token, "ID=", 3) == 0) {
+            size_t id_len = (size_t)(line + end - (token + 3));
+            if (id_len >= REQUEST_ID_SIZE) return -1;
+            memcpy(opts->request_id, token + 3, id_len);
+            opts->request_id[id_len] = '\0';
+            endp = line + end;
+        } else if (strncmp(token, "PRI=", 4) == 0) {
+            opts->priority = (int)strtol(token + 4, &endp, 10);
+            if (opts->priority < 0 || opts->priority > REQUEST_MAX_PRIORITY) return -1;
+        } else {
+            break;
+        }
+        if (endp != line + end || endp == strchr(token, '=') + 1) return -1;
+        end = start > 0 ? start - 1 : 0;
+    }
+    if (had_newline) line[end++] = '\n';
+    line[end] = '\0';
+    return 0;
+}
+
+/**
+ * shed_reason - decides whether a request should be dropped before any work
+ * received_ns is the kernel receive time (0 if unknown, e.g. stream input)
+ * Returns NULL to run it, "" to drop it silently, or a reply for the client
+ */
+const char *shed_reason(const request_options_t *opts, unsigned long long received_ns) {
+    unsigned long long now = realtime_ns();
+
+    if (opts->deadline_ms != 0 && now / 1000000ULL > opts->deadline_ms) {
+        shed_expired++;
+        return received_ns != 0 ? "" : "ERROR: Deadline expired, request dropped.\n";
+    }
+    if (received_ns == 0)
+        return NULL;
+
+    unsigned long long age_us = now > received_ns ? (now - received_ns) / 1000ULL : 0;
+    queue_age_last_us = age_us;
+    if (age_us > queue_age_max_us) queue_age_max_us = age_us;
+    queue_age_total_us += age_us;
+    queue_age_count++;
+
+    if (config.shed_stale_ms > 0 && age_us > (unsigned long long)config.shed_stale_ms * 1000ULL) {
+        // Without a deadline, assume the client gave up after shed_stale_ms
+        shed_stale++;
+        return "";
+    }
+    if (config.shed_busy_ms > 0 && age_us > (unsigned long long)config.shed_busy_ms * 1000ULL &&
+        opts->priority < config.shed_min_priority) {
+        shed_priority++;
+        return "ERROR: Server overloaded, low-priority request shed.\n";
+    }
+    return NULL;
+}
+
+/**
+ * recv_datagram - receives one datagram along with its kernel receive time
+ * Returns the byte count (buffer is NUL-terminated) or -1 on error
+ */
+ssize_t recv_datagram(int fd, char *buffer, size_t size, void *addr, socklen_t *addrlen, unsigned long long *received_ns) {
+    struct iovec iov = {buffer, size - 1};
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = addr;
+    msg.msg_namelen = *addrlen;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t nbytes = recvmsg(fd, &msg, 0);
+    if (nbytes < 0)
+        return -1;
+    buffer[nbytes] = '\0';
+    *addrlen = msg.msg_namelen;
+    *received_ns = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            *received_ns = (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+        }
+    }
+    return nbytes;
+}
+
+/**
+ * print_shedding_stats - prints load shedding counters and datagram queue age
+ */
+void print_shedding_stats(FILE *out) {
+    fprintf(out, "Shedding: expired=%llu stale=%llu priority=%llu (stale after %d ms, busy after %d ms, min PRI %d)\n",
+           shed_expired, shed_stale, shed_priority, config.shed_stale_ms, config.shed_busy_ms,
+           config.shed_min_priority);
+    fprintf(out, "Datagram queue age: last=%llu us, max=%llu us, avg=%llu us over %llu requests\n",
+           queue_age_last_us, queue_age_max_us,
+           queue_age_count > 0 ? queue_age_total_us / queue_age_count : 0, queue_age_count);
+}
+
+/**
+ * run_command - processes ADD commands received from clients
+ * enhanced with detailed feedback to client
+ */
+void run_command(int client_fd, char *cmd, unsigned long long *carbon, unsigned long long *oxygen, unsigned long long *hydrogen) {
+    char type[16];
+    unsigned long long amount;
+    char response[BUFFER_SIZE];
+
+    // Rate limits run before the command is parsed, so a flood costs as little
+    // as possible; a rejected request's options are only read for its ID=
+    request_options_t opts;
+    int kind = rate_kind(cmd);
+    if (kind != -1 && !rate_allow(kind, client_fd, conns[client_fd].source)) {
+        rate_reply(kind, 1, response, sizeof(response));
+        parse_request_options(cmd, &opts);
+        memcpy(stream_reply_id, opts.request_id, sizeof(stream_reply_id));
+        stream_reply(client_fd, response);
+        return;
+    }
+
+    int parsed = parse_request_options(cmd, &opts);
+    memcpy(stream_reply_id, opts.request_id, sizeof(stream_reply_id));
+    if (parsed == -1) {
+        stream_reply(client_fd, "ERROR: Invalid request option.\n");
+        return;
+    }
+
+    // Stream clients may match replies in order, so even shed requests get one
+    const char *shed = shed_reason(&opts, 0);
+    if (shed != NULL) {
+        stream_reply(client_fd, shed);
+        return;
+    }
+
+    stream_requests++;
+
+    if (strncmp(cmd, "SHM", 3) == 0 && (cmd[3] == '\n' || cmd[3] == '\r' || cmd[3] == '\0')) {
+        start_shm_session(client_fd);
+        return;
+    }
+
+    if (strncmp(cmd, "WATCH", 5) == 0 && (cmd[5] == '\n' || cmd[5] == '\r' || cmd[5] == '\0')) {
+        start_watch(client_fd, *carbon, *oxygen, *hydrogen);
+        return;
+    }
+    if (strncmp(cmd, "UNWATCH", 7) == 0 && (cmd[7] == '\n' || cmd[7] == '\r' || cmd[7] == '\0')) {
+        stop_watch(client_fd, 0);
+        stream_reply(client_fd, "UNWATCH OK\n");
+        return;
+    }
+
+    if (format_query_reply(cmd, response, sizeof(response), *carbon, *oxygen, *hydrogen)) {
+        stream_reply(client_fd, response);
+        return;
+    }
+
+    if (leader_spec != NULL && strncmp(cmd, "ADD", 3) == 0) {
+        snprintf(response, sizeof(response), "ERROR: Read-only follower, send ADD to the leader (%s).\n", leader_spec);
+        stream_reply(client_fd, response);
+        return;
+    }
+
+    if (shard_atom != -1) {
+        unsigned long long *counters[3] = {carbon, oxygen, hydrogen};
+        if (process_shard_command(client_fd, cmd, counters[shard_atom], carbon, oxygen, hydrogen)) {
+            return;
+        }
+    }
+
+    if (cluster_mode && sscanf(cmd, "ADD %15s %llu", type, &amount) == 2) {
+        int atom = -1;
+        for (int k = 0; k < 3; k++) {
+            if (strcmp(type, atom_names[k]) == 0) atom = k;
+        }
+        if (amount > config.max_atoms) {
+            snprintf(response, sizeof(response), "ERROR: Amount too large, max allowed per command is %llu.\n", config.max_atoms);
+            stream_reply(client_fd, response);
+        } else if (atom < 0) {
+            snprintf(response, sizeof(response), "ERROR: Unknown atom type: %s\n", type);
+            stream_reply(client_fd, response);
+        } else {
+            cluster_propose(RAFT_ENTRY_ADD, (uint8_t)atom, amount, client_fd, 0, NULL, 0, 0, stream_reply_id);
+        }
+        return;
+    }
+
+    if (sscanf(cmd, "ADD %15s %llu", type, &amount) == 2) {
+        if (amount > config.max_atoms) {
+            snprintf(response, sizeof(response), "ERROR: Amount too large, max allowed per command is %llu.\n", config.max_atoms);
+            if (config.log_level >= LOG_REQUEST) printf("Error: amount too large, max allowed per command is %llu.\n", config.max_atoms);
+            stream_reply(client_fd, response);
+            return;
+        }
+
+        int updated = 0;
+        if (strcmp(type, "CARBON") == 0) {
+            if (*carbon + amount > config.max_atoms) {
+                snprintf(response, sizeof(response), "ERROR: Adding this would exceed CARBON storage limit (%llu).\n", config.max_atoms);
+                if (config.log_level >= LOG_REQUEST) printf("Error: adding this would exceed CARBON storage limit (%llu).\n", config.max_atoms);
+                stream_reply(client_fd, response);
+                return;
+            }
+            *carbon += amount;
+            updated = 1;
+            snprintf(response, sizeof(response), "SUCCESS: Added %llu CARBON. Total CARBON: %llu\n", amount, *carbon);
+            if (config.log_level >= LOG_REQUEST) printf("Added %llu CARBON.\n", amount);
+        } else if (strcmp(type, "OXYGEN") == 0) {
+            if (*oxygen + amount > config.max_atoms) {
+                snprintf(response, sizeof(response), "ERROR: Adding this would exceed OXYGEN storage limit (%llu).\n", config.max_atoms);
+                if (config.log_level >= LOG_REQUEST) printf("Error: adding this would exceed OXYGEN storage limit (%llu).\n", config.max_atoms);
+                stream_reply(client_fd, response);
+                return;
+            }
+            *oxygen += amount;
+            updated = 1;
+            snprintf(response, sizeof(response), "SUCCESS: Added %llu OXYGEN. Total OXYGEN: %llu\n", amount, *oxygen);
+            if (config.log_level >= LOG_REQUEST) printf("Added %llu OXYGEN.\n", amount);
+        } else if (strcmp(type, "HYDROGEN") == 0) {
+            if (*hydrogen + amount > config.max_atoms) {
+                snprintf(response, sizeof(response), "ERROR: Adding this would exceed HYDROGEN storage limit (%llu).\n", config.max_atoms);
+                if (config.log_level >= LOG_REQUEST) printf("Error: adding this would exceed HYDROGEN storage limit (%llu).\n", config.max_atoms);
+                stream_reply(client_fd, response);
+                return;
+            }
+            *hydrogen += amount;
+            updated = 1;
+            snprintf(response, sizeof(response), "SUCCESS: Added %llu HYDROGEN. Total HYDROGEN: %llu\n", amount, *hydrogen);
+            if (config.log_level >= LOG_REQUEST) printf("Added %llu HYDROGEN.\n", amount);
+        } else {
+            snprintf(response, sizeof(response), "ERROR: Unknown atom type: %s\n", type);
+            if (config.log_level >= LOG_REQUEST) printf("Unknown atom type: %s\n", type);
+            stream_reply(client_fd, response);
+            return;
+        }
+        
+        // Hand the new version to the writer thread if inventory was updated
+        if (updated) {
+            publish_inventory(*carbon, *oxygen, *hydrogen);
+        }
+    } else {
+        snprintf(response, sizeof(response), "ERROR: Invalid command format: %s", cmd);
+        if (config.log_level >= LOG_REQUEST) printf("Invalid command: %s\n", cmd);
+        stream_reply(client_fd, response);
+        return;
+    }
+
+    // Send success response
+    stream_reply(client_fd, response);
+    
+    // Print current status to server console
+    if (config.log_level >= LOG_REQUEST) {
+        printf("Current warehouse status:\n");
+        printf("CARBON: %llu\n", *carbon);
+        printf("OXYGEN: %llu\n", *oxygen);
+        printf("HYDROGEN: %llu\n", *hydrogen);
+    }
+    
+    // Send warehouse status to client
+    char status_msg[BUFFER_SIZE];
+    snprintf(status_msg, sizeof(status_msg), "Status: CARBON: %llu, OXYGEN: %llu, HYDROGEN: %llu\n", 
+             *carbon, *oxygen, *hydrogen);
+    stream_reply(client_fd, status_msg);
+}
+
+/**
+ * process_command - runs one stream or ring command
+ * Replies carry the command's ID= until it returns
+ */
+void process_command(int client_fd, char *cmd, unsigned long long *carbon, unsigned long long *oxygen, unsigned long long *hydrogen) {
+    run_command(client_fd, cmd, carbon, oxygen, hydrogen);
+    stream_reply_id[0] = '\0';
+}
+
+/**
+ * can_deliver - checks and performs molecule delivery
+ * returns 1 on success, 0 on failure
+ */
+int can_deliver(const char *molecule, unsigned long long quantity, unsigned long long *carbon, unsigned long long *oxygen, unsigned long long *hydrogen) {
+    const recipe_t *recipe = NULL;
+    for (int k = 0; k < 4; k++) {
+        if (strcmp(molecule, molecule_names[k]) == 0) recipe = &config.recipes[k];
+    }
+    if (recipe == NULL) {
+        deliver_failures++;
+        return 0; // Unknown molecule
+    }
+
+    unsigned long long needed[3];
+    for (int k = 0; k < 3; k++) {
+        if (recipe->atoms[k] > 0 && quantity > ULLONG_MAX / recipe->atoms[k]) {
+            deliver_failures++;
+            return 0; // More atoms than any warehouse can hold
+        }
+        needed[k] = recipe->atoms[k] * quantity;
+    }
+    unsigned long long needed_c = needed[0], needed_o = needed[1], needed_h = needed[2];
+
+    if (*carbon >= needed_c && *oxygen >= needed_o && *hydrogen >= needed_h) {
+        *carbon -= needed_c;
+        *oxygen -= needed_o;
+        *hydrogen -= needed_h;
+        
+        // Queue updated inventory for the writer thread
+        publish_inventory(*carbon, *oxygen, *hydrogen);
+        
+        delivered_count++;
+        return 1;
+    }
+    
+    deliver_failures++;
+    return 0;
+}
+
+/**
+ * recipe_capacity - how many molecules of a recipe the given atoms make
+ */
+unsigned long long recipe_capacity(const recipe_t *recipe, unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen) {
+    const unsigned long long have[3] = {carbon, oxygen, hydrogen};
+    unsigned long long possible = ULLONG_MAX;
+    for (int k = 0; k < 3; k++) {
+        if (recipe->atoms[k] > 0 && have[k] / recipe->atoms[k] < possible) {
+            possible = have[k] / recipe->atoms[k];
+        }
+    }
+    return possible;                    // every recipe needs at least one atom
+}
+
+/**
+ * calculate_possible_molecules - calculates how many molecules can be produced
+ * Uses the configured recipes (default WATER 2H + 1O, CARBON DIOXIDE 1C + 2O,
+ * ALCOHOL 2C + 6H + 1O, GLUCOSE 6C + 12H + 6O)
+ */
+void calculate_possible_molecules(unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen,
+                                 unsigned long long *water, unsigned long long *co2,
+                                 unsigned long long *alcohol, unsigned long long *glucose) {
+    *water = recipe_capacity(&config.recipes[0], carbon, oxygen, hydrogen);
+    *co2 = recipe_capacity(&config.recipes[1], carbon, oxygen, hydrogen);
+    *alcohol = recipe_capacity(&config.recipes[2], carbon, oxygen, hydrogen);
+    *glucose = recipe_capacity(&config.recipes[3], carbon, oxygen, hydrogen);
+}
+
+/**
+ * gen_drink - which drink a GEN command asks for
+ * Returns 0 (SOFT DRINK), 1 (VODKA), 2 (CHAMPAGNE), or -1 for anything else
+ */
+int gen_drink(const char *cmd) {
+    if (strcmp(cmd, "GEN SOFT DRINK") == 0) return 0;
+    if (strcmp(cmd, "GEN VODKA") == 0) return 1;
+    if (strcmp(cmd, "GEN CHAMPAGNE") == 0) return 2;
+    return -1;
+}
+
+/**
+ * format_gen_reply - how many of a drink the inventory makes with the given
+ * recipes; safe to call from a worker thread
+ */
+void format_gen_reply(int drink, const recipe_t *recipes,
+                      unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen,
+                      char *out, size_t size) {
+    unsigned long long water = recipe_capacity(&recipes[0], carbon, oxygen, hydrogen);
+    unsigned long long co2 = recipe_capacity(&recipes[1], carbon, oxygen, hydrogen);
+    unsigned long long alcohol = recipe_capacity(&recipes[2], carbon, oxygen, hydrogen);
+    unsigned long long glucose = recipe_capacity(&recipes[3], carbon, oxygen, hydrogen);
+
+    if (drink == 0) {
+        snprintf(out, size, "Can produce %llu SOFT DRINK(s) (needs: WATER + CARBON DIOXIDE + ALCOHOL)\n",
+                 min3(water, co2, alcohol));
+    } else if (drink == 1) {
+        snprintf(out, size, "Can produce %llu VODKA(s) (needs: WATER + ALCOHOL + GLUCOSE)\n",
+                 min3(water, alcohol, glucose));
+    } else {
+        snprintf(out, size, "Can produce %llu CHAMPAGNE(s) (needs: WATER + CARBON DIOXIDE + GLUCOSE)\n",
+                 min3(water, co2, glucose));
+    }
+}
+
+/**
+ * gen_take - claims a job: the newest one of the worker's own deque, or else
+ * the oldest one of another worker's
+ * Takes only the deque locks
+ * Returns NULL if every deque is empty
+ */
+gen_job_t *gen_take(gen_worker_t *self) {
+    gen_job_t *job = NULL;
+    pthread_mutex_lock(&self->lock);
+    if (self->tail != self->head) {
+        job = self->jobs[--self->tail % GEN_DEQUE_SIZE];
+    }
+    pthread_mutex_unlock(&self->lock);
+
+    int own = (int)(self - gen_workers);
+    for (int k = 1; job == NULL && k < gen_worker_count; k++) {
+        gen_worker_t *victim = &gen_workers[(own + k) % gen_worker_count];
+        pthread_mutex_lock(&victim->lock);
+        if (victim->tail != victim->head) {
+            job = victim->jobs[victim->head++ % GEN_DEQUE_SIZE];
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if (job != NULL) __atomic_fetch_add(&self->stolen, 1, __ATOMIC_RELAXED);
+    }
+    return job;
+}
+
+/**
+ * gen_worker_thread - runs GEN jobs until the pool stops and none are left
+ */
+void *gen_worker_thread(void *arg) {
+    gen_worker_t *self = arg;
+
+    while (1) {
+        // gen_wakeups is read before looking, so a job submitted after an
+        // empty look changes it and the worker does not sleep through it
+        pthread_mutex_lock(&gen_idle_lock);
+        unsigned seen = gen_wakeups;
+        int stop = gen_stop;
+        pthread_mutex_unlock(&gen_idle_lock);
+
+        gen_job_t *job = gen_take(self);
+        if (job == NULL) {
+            if (stop)
+                break;
+            pthread_mutex_lock(&gen_idle_lock);
+            while (gen_wakeups == seen && !gen_stop) {
+                pthread_cond_wait(&gen_idle_cond, &gen_idle_lock);
+            }
+            pthread_mutex_unlock(&gen_idle_lock);
+            continue;
+        }
+        format_gen_reply(job->drink, job->recipes, job->carbon, job->oxygen, job->hydrogen,
+                         job->reply, sizeof(job->reply) - 3);
+        strcat(job->reply, "OK\n");
+        __atomic_fetch_add(&self->ran, 1, __ATOMIC_RELAXED);
+
+        pthread_mutex_lock(&gen_done_lock);
+        job->next = gen_done;
+        gen_done = job;
+        pthread_mutex_unlock(&gen_done_lock);
+        uint64_t one = 1;
+        if (write(gen_done_fd, &one, sizeof(one)) != sizeof(one)) {
+            perror("Warning: Failed to wake the event loop");
+        }
+    }
+    return NULL;
+}
+
+/**
+ * start_gen_workers - starts gen_worker_count workers and their completion eventfd
+ * Returns 0 on success (also when the pool is off), -1 on failure
+ */
+int start_gen_workers(void) {
+    if (gen_worker_count == 0)
+        return 0;
+
+    gen_done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    gen_workers = calloc((size_t)gen_worker_count, sizeof(gen_worker_t));
+    if (gen_done_fd == -1 || gen_workers == NULL) {
+        perror("GEN worker pool");
+        return -1;
+    }
+
+    // SIGHUP and SIGALRM must interrupt the event loop's select(), not a worker
+    sigset_t blocked, previous;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGHUP);
+    sigaddset(&blocked, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+    for (int k = 0; k < gen_worker_count; k++) {
+        pthread_mutex_init(&gen_workers[k].lock, NULL);
+        if (pthread_create(&gen_workers[k].thread, NULL, gen_worker_thread, &gen_workers[k]) != 0) {
+            fprintf(stderr, "Error: Failed to start GEN worker %d\n", k);
+            pthread_sigmask(SIG_SETMASK, &previous, NULL);
+            gen_worker_count = k;
+            return -1;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    gen_workers_running = 1;
+    return 0;
+}
+
+/**
+ * stop_gen_workers - lets the workers finish what is queued and joins them
+ * Replies still on the completion list are dropped
+ */
+void stop_gen_workers(void) {
+    if (!gen_workers_running)
+        return;
+
+    pthread_mutex_lock(&gen_idle_lock);
+    gen_stop = 1;
+    pthread_cond_broadcast(&gen_idle_cond);
+    pthread_mutex_unlock(&gen_idle_lock);
+    for (int k = 0; k < gen_worker_count; k++) {
+        pthread_join(gen_workers[k].thread, NULL);
+        pthread_mutex_destroy(&gen_workers[k].lock);
+    }
+    gen_workers_running = 0;
+
+    while (gen_done != NULL) {
+        gen_job_t *next = gen_done->next;
+        free(gen_done);
+        gen_done = next;
+    }
+    free(gen_workers);
+    gen_workers = NULL;
+    close(gen_done_fd);
+    gen_done_fd = -1;
+}
+
+/**
+ * gen_submit - hands an admin GEN command to the worker pool and stops reading
+ * the connection until the reply has been sent
+ * Returns 0 if submitted, -1 if the command has to run inline (not a GEN
+ * command, pool off, or every deque full)
+ */
+int gen_submit(int fd, const char *cmd, unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen) {
+    int drink = gen_drink(cmd);
+    if (drink == -1 || !gen_workers_running)
+        return -1;
+
+    gen_job_t *job = malloc(sizeof(gen_job_t));
+    if (job == NULL) {
+        gen_inline++;
+        return -1;
+    }
+    job->fd = fd;
+    job->gen = conns[fd].gen;
+    job->drink = drink;
+    job->carbon = carbon;
+    job->oxygen = oxygen;
+    job->hydrogen = hydrogen;
+    memcpy(job->recipes, config.recipes, sizeof(job->recipes));
+
+    int queued = 0;
+    for (int k = 0; k < gen_worker_count && !queued; k++) {
+        gen_worker_t *worker = &gen_workers[gen_next_worker++ % (unsigned)gen_worker_count];
+        pthread_mutex_lock(&worker->lock);
+        if (worker->tail - worker->head < GEN_DEQUE_SIZE) {
+            worker->jobs[worker->tail++ % GEN_DEQUE_SIZE] = job;
+            queued = 1;
+        }
+        pthread_mutex_unlock(&worker->lock);
+    }
+    if (!queued) {
+        free(job);
+        gen_inline++;
+        return -1;
+    }
+
+    pthread_mutex_lock(&gen_idle_lock);
+    gen_wakeups++;
+    pthread_cond_signal(&gen_idle_cond);
+    pthread_mutex_unlock(&gen_idle_lock);
+
+    // Lines after this one wait in the connection's buffer; epoll still
+    // reports a hangup, which closes the connection and drops the reply
+    conns[fd].gen_pending = 1;
+    conn_update_events(fd);
+    gen_submitted++;
+    return 0;
+}
+
+/**
+ * print_gen_stats - prints worker pool activity
+ */
+void print_gen_stats(FILE *out) {
+    if (!gen_workers_running) {
+        fprintf(out, "GEN pool: off (GEN runs inline)\n");
+        return;
+    }
+    unsigned long long ran = 0, stolen = 0;
+    for (int k = 0; k < gen_worker_count; k++) {
+        ran += __atomic_load_n(&gen_workers[k].ran, __ATOMIC_RELAXED);
+        stolen += __atomic_load_n(&gen_workers[k].stolen, __ATOMIC_RELAXED);
+    }
+    fprintf(out, "GEN pool: workers=%d submitted=%llu ran=%llu stolen=%llu inline=%llu replied=%llu dropped=%llu\n",
+           gen_worker_count, gen_submitted, ran, stolen, gen_inline, gen_completed, gen_dropped);
+}
+
+/**
+ * parse_config_number - parses a whole decimal value within [min, max]
+ * Returns 0 on success, -1 on error
+ */
+int parse_config_number(const char *value, unsigned long long min, unsigned long long max, unsigned long long *out) {
+    char *end;
+    if (*value < '0' || *value > '9') return -1;
+    errno = 0;
+    unsigned long long number = strtoull(value, &end, 10);
+    if (errno != 0 || *end != '\0' || number < min || number > max) return -1;
+    *out = number;
+    return 0;
+}
+
+/**
+ * set_config_value - applies one KEY = VALUE line to a config being built
+ * Returns 0 on success, -1 for an unknown key or a bad value
+ */
+int set_config_value(config_t *next, const char *key, const char *value) {
+    unsigned long long number;
+
+    if (strcmp(key, "log_level") == 0) {
+        for (int k = 0; k < 3; k++) {
+            if (strcmp(value, log_level_names[k]) == 0) {
+                next->log_level = k;
+                return 0;
+            }
+        }
+        return -1;
+    }
+    if (strncmp(key, "recipe.", 7) == 0) {
+        // recipe.carbon_dioxide = C O H
+        char name[32];
+        snprintf(name, sizeof(name), "%s", key + 7);
+        for (char *c = name; *c; c++) {
+            *c = *c == '_' ? ' ' : (char)(*c >= 'a' && *c <= 'z' ? *c - 'a' + 'A' : *c);
+        }
+        recipe_t recipe;
+        char extra;
+        if (sscanf(value, "%llu %llu %llu %c", &recipe.atoms[0], &recipe.atoms[1], &recipe.atoms[2], &extra) != 3)
+            return -1;
+        if (recipe.atoms[0] + recipe.atoms[1] + recipe.atoms[2] == 0 ||
+            recipe.atoms[0] > MAX_ATOMS || recipe.atoms[1] > MAX_ATOMS || recipe.atoms[2] > MAX_ATOMS)
+            return -1;
+        for (int k = 0; k < 4; k++) {
+            if (strcmp(name, molecule_names[k]) == 0) {
+                next->recipes[k] = recipe;
+                return 0;
+            }
+        }
+        return -1;
+    }
+
+    if (strncmp(key, "rate_", 5) == 0) {
+        // rate_add_connection = RATE [BURST], rate_deliver_reply = TEXT
+        for (int kind = 0; kind < 2; kind++) {
+            char name[64];
+            snprintf(name, sizeof(name), "rate_%s_reply", rate_kind_names[kind]);
+            if (strcmp(key, name) == 0) {
+                if (strlen(value) >= RATE_REPLY_SIZE) return -1;
+                snprintf(next->rate_replies[kind], RATE_REPLY_SIZE, "%s", value);
+                return 0;
+            }
+            for (int scope = 0; scope < 2; scope++) {
+                snprintf(name, sizeof(name), "rate_%s_%s", rate_kind_names[kind], rate_scope_names[scope]);
+                if (strcmp(key, name) == 0) {
+                    rate_limit_t limit;
+                    char extra;
+                    int fields = sscanf(value, "%llu %llu %c", &limit.rate, &limit.burst, &extra);
+                    if (fields == 1) {
+                        limit.burst = limit.rate;
+                    } else if (fields != 2 || (limit.rate > 0 && limit.burst == 0)) {
+                        return -1;
+                    }
+                    if (limit.rate > 1000000000ULL || limit.burst > 1000000000ULL) return -1;
+                    next->rate_limits[kind][scope] = limit;
+                    return 0;
+                }
+            }
+        }
+        return -1;
+    }
+
+    if (strcmp(key, "max_atoms") == 0) {
+        if (parse_config_number(value, 1, MAX_ATOMS, &number) == -1) return -1;
+        next->max_atoms = number;
+    } else if (strcmp(key, "max_clients") == 0) {
+        if (parse_config_number(value, 0, CONN_TABLE_MAX, &number) == -1) return -1;
+        next->max_clients = (int)number;
+    } else if (strcmp(key, "backlog") == 0) {
+        if (parse_config_number(value, 1, 65535, &number) == -1) return -1;
+        next->backlog = (int)number;
+    } else if (strcmp(key, "timeout") == 0) {
+        if (parse_config_number(value, 0, INT_MAX, &number) == -1) return -1;
+        next->timeout_seconds = (int)number;
+    } else if (strcmp(key, "bgsave_changes") == 0) {
+        if (parse_config_number(value, 0, ULLONG_MAX, &number) == -1) return -1;
+        next->bgsave_change_threshold = number;
+    } else if (strcmp(key, "bgsave_interval") == 0) {
+        if (parse_config_number(value, 0, INT_MAX, &number) == -1) return -1;
+        next->bgsave_interval = (int)number;
+    } else if (strcmp(key, "shed_stale_ms") == 0) {
+        if (parse_config_number(value, 0, INT_MAX, &number) == -1) return -1;
+        next->shed_stale_ms = (int)number;
+    } else if (strcmp(key, "shed_busy_ms") == 0) {
+        if (parse_config_number(value, 0, INT_MAX, &number) == -1) return -1;
+        next->shed_busy_ms = (int)number;
+    } else if (strcmp(key, "shed_min_priority") == 0) {
+        if (parse_config_number(value, 0, REQUEST_MAX_PRIORITY + 1, &number) == -1) return -1;
+        next->shed_min_priority = (int)number;
+    } else if (strcmp(key, "max_wait_ms") == 0) {
+        if (parse_config_number(value, 0, 3600000, &number) == -1) return -1;
+        next->max_wait_ms = (int)number;
+    } else if (strcmp(key, "dedupe_ttl_ms") == 0) {
+        if (parse_config_number(value, 0, 3600000, &number) == -1) return -1;
+        next->dedupe_ttl_ms = (int)number;
+    } else if (strcmp(key, "watch_interval_ms") == 0) {
+        if (parse_config_number(value, 1, 3600000, &number) == -1) return -1;
+        next->watch_interval_ms = (int)number;
+    } else if (strcmp(key, "welcome") == 0) {
+        if (parse_config_number(value, 0, 1, &number) == -1) return -1;
+        next->welcome = (int)number;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * trim - strips leading and trailing white space in place
+ */
+char *trim(char *text) {
+    while (*text == ' ' || *text == '\t') text++;
+    size_t len = strlen(text);
+    while (len > 0 && (text[len - 1] == ' ' || text[len - 1] == '\t' || text[len - 1] == '\r' || text[len - 1] == '\n')) {
+        text[--len] = '\0';
+    }
+    return text;
+}
+
+/**
+ * load_config - builds a config from base_config and the config file
+ * Lines are "key = value", '#' starts a comment. Nothing is applied here;
+ * on error err describes the first bad line and -1 is returned.
+ */
+int load_config(const char *path, config_t *next, char *err, size_t err_size) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        snprintf(err, err_size, "%s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    *next = base_config;
+    char line[BUFFER_SIZE];
+    int line_no = 0;
+    int result = 0;
+    while (result == 0 && fgets(line, sizeof(line), file) != NULL) {
+        line_no++;
+        char *comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+        char *equals = strchr(line, '=');
+        if (equals == NULL) {
+            if (*trim(line) != '\0') {
+                snprintf(err, err_size, "%s:%d: expected key = value", path, line_no);
+                result = -1;
+            }
+            continue;
+        }
+        *equals = '\0';
+        char *key = trim(line);
+        char *value = trim(equals + 1);
+        if (set_config_value(next, key, value) == -1) {
+            snprintf(err, err_size, "%s:%d: bad setting '%s = %s'", path, line_no, key, value);
+            result = -1;
+        }
+    }
+    fclose(file);
+    if (result != 0) return -1;
+
+    // Replicas apply the same log entries, so they must agree on the storage
+    // limit and recipes; a node replaying its log after a restart must too
+    if (cluster_mode && (next->bgsave_change_threshold > 0 || next->bgsave_interval > 0 ||
+                         next->max_atoms != base_config.max_atoms ||
+                         memcmp(next->recipes, base_config.recipes, sizeof(next->recipes)) != 0)) {
+        snprintf(err, err_size, "%s: BGSAVE, max_atoms and recipe settings cannot be used in cluster mode", path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * reload_config - re-reads the config file and swaps it in if it is valid
+ * Runs between requests, so every request sees either the old or the new set.
+ * Returns 0 on success, -1 (keeping the old config) on error
+ */
+int reload_config(char *msg, size_t msg_size) {
+    config_t next;
+    if (config_path == NULL) {
+        snprintf(msg, msg_size, "No config file, start the server with -C PATH");
+        config_reload_failures++;
+        return -1;
+    }
+    if (load_config(config_path, &next, msg, msg_size) == -1) {
+        config_reload_failures++;
+        return -1;
+    }
+
+    config = next;
+    config_generation++;
+    config_reloads++;
+    view_refresh = 1;
+    snprintf(msg, msg_size, "Reloaded %s (generation %llu): max_atoms=%llu max_clients=%d backlog=%d timeout=%d log_level=%s",
+             config_path, config_generation, config.max_atoms, config.max_clients, config.backlog,
+             config.timeout_seconds, log_level_names[config.log_level]);
+    return 0;
+}
+
+/**
+ * print_config_stats - prints the active tunables
+ */
+void print_config_stats(FILE *out) {
+    fprintf(out, "Config: %s, generation %llu, reloads=%llu failed=%llu, clients=%d rejected=%llu\n",
+           config_path ? config_path : "(flags only)", config_generation, config_reloads, config_reload_failures,
+           stream_client_count, clients_rejected);
+    fprintf(out, "Config: max_atoms=%llu max_clients=%d backlog=%d timeout=%d log_level=%s bgsave=%llu changes/%d s watch=%d ms welcome=%d\n",
+           config.max_atoms, config.max_clients, config.backlog, config.timeout_seconds,
+           log_level_names[config.log_level], config.bgsave_change_threshold, config.bgsave_interval,
+           config.watch_interval_ms, config.welcome);
+    fprintf(out, "Rate limits (per second/burst, 0 = off):");
+    for (int kind = 0; kind < 2; kind++) {
+        for (int scope = 0; scope < 2; scope++) {
+            fprintf(out, " %s/%s %llu/%llu rejected=%llu", rate_kind_names[kind], rate_scope_names[scope],
+                   config.rate_limits[kind][scope].rate, config.rate_limits[kind][scope].burst,
+                   rate_rejected[kind][scope]);
+        }
+    }
+    fprintf(out, ", sources=%llu evictions=%llu\n", rate_source_count, rate_evictions);
+    fprintf(out, "Recipes (C O H):");
+    for (int k = 0; k < 4; k++) {
+        fprintf(out, " %s %llu %llu %llu%s", molecule_names[k], config.recipes[k].atoms[0],
+               config.recipes[k].atoms[1], config.recipes[k].atoms[2], k < 3 ? "," : "\n");
+    }
+}
+
+/**
+ * conn_clock - CLOCK_MONOTONIC in whole seconds, for connection timestamps
+ */
+uint32_t conn_clock(void) {
+    return (uint32_t)(monotonic_ns() / 1000000000ULL);
+}
+
+/**
+ * print_conn_stats - prints connection counts and what they cost
+ */
+void print_conn_stats(FILE *out) {
+    int idle = 0, queued = 0;
+    uint32_t now = conn_clock();
+    for (int fd = 0; fd <= conn_high; fd++) {
+        if (conns[fd].kind != CONN_FREE && conns[fd].kind != CONN_ADMIN &&
+            now - conns[fd].active_s >= CONN_IDLE_SECONDS)
+            idle++;
+        if (conns[fd].kind != CONN_FREE && conns[fd].side != NULL && conns[fd].side->out_len > 0)
+            queued++;
+    }
+    fprintf(out, "Connections:");
+    for (int kind = CONN_TCP; kind <= CONN_ADMIN; kind++) {
+        fprintf(out, " %s=%d", conn_kind_names[kind], conn_counts[kind]);
+    }
+    fprintf(out, " idle=%d, table=%d slots of %zu B (%llu KB spanned), buffers=%llu in use (peak %llu, %llu KB pooled), rss=%llu KB\n",
+           idle, conn_capacity, sizeof(conn_t), (unsigned long long)(conn_high + 1) * sizeof(conn_t) / 1024,
+           slab_in_use, slab_peak, slab_block_count * sizeof(slab_block_t) / 1024, read_rss_kb());
+    fprintf(out, "Accept: wakeups=%llu accepted=%llu max per wakeup=%d, batch limit (%d) reached=%llu\n",
+           accept_wakeups, accepted_total, accept_max_batch, ACCEPT_BATCH, accept_batches_full);
+    fprintf(out, "Output: %d connection(s) with queued replies, %llu sends deferred\n", queued, sends_deferred);
+}
+
+/**
+ * process_drink_command - processes drink commands from administrator
+ * Output goes to out (stdout, or the reply of an admin socket command)
+ * Returns 0 on success, -1 for an unknown or failed command
+ */
+int process_drink_command(char *cmd, FILE *out, unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen) {
+    char *newline = strchr(cmd, '\n');
+    if (newline) *newline = '\0';
+    
+    int drink = gen_drink(cmd);
+    if (drink != -1) {
+        char text[BUFFER_SIZE];
+        format_gen_reply(drink, config.recipes, carbon, oxygen, hydrogen, text, sizeof(text));
+        fputs(text, out);
+
+    } else if (strcmp(cmd, "STATS") == 0) {
+        print_config_stats(out);
+        print_conn_stats(out);
+        print_shedding_stats(out);
+        fprintf(out, "Waiters: %d waiting (max %d), parked=%llu served=%llu expired=%llu refused=%llu\n",
+               waiter_count, waiter_max, waiters_parked, waiters_served, waiters_expired, waiters_refused);
+        print_dedupe_stats(out);
+        print_persistence_stats(out);
+        print_bgsave_stats(out);
+        print_replication_stats(out);
+        if (cluster_mode) {
+            raft_print_stats(out);
+            fprintf(out, "Cluster: rejected at apply=%llu outcome unknown=%llu\n", cluster_rejected, cluster_unknown);
+        }
+        if (feed_fd != -1 || feed_snapshot_requests > 0) {
+            fprintf(out, "Feed: packets=%llu send errors=%llu snapshot requests=%llu\n",
+                   feed_seq, feed_send_errors, feed_snapshot_requests);
+        }
+        if (watch_count > 0 || watch_pushes > 0) {
+            fprintf(out, "Watch: subscribers=%d batches=%llu pushes=%llu skipped while backlogged=%llu\n",
+                   watch_count, watch_batches, watch_pushes, watch_skipped);
+        }
+        print_gen_stats(out);
+        if (busy_poll_core != -1) {
+            fprintf(out, "Busy poll: core %d, SO_BUSY_POLL %d us, %zu KB locked%s, spins=%llu idle=%llu\n",
+                   busy_poll_core, busy_poll_usec, busy_poll_locked / 1024,
+                   busy_poll_lock_errno != 0 ? " (some regions failed)" : "", busy_spins, busy_idle_spins);
+        }
+        if (shm_client_count > 0 || shm_requests > 0) {
+            fprintf(out, "Shared memory: clients=%d requests=%llu wakeups=%llu dropped=%llu\n",
+                   shm_client_count, shm_requests, shm_wakeups, shm_dropped);
+        }
+        if (shard_atom != -1) {
+            fprintf(out, "Shard %s: reserved=%llu held=%d prepared=%llu refused=%llu committed=%llu aborted=%llu coordinator=%s\n",
+                   atom_names[shard_atom], shard_reserved, shard_held, shard_prepared, shard_refused,
+                   shard_committed, shard_aborted, shard_coordinator_fd != -1 ? "connected" : "none");
+        }
+
+    } else if (strcmp(cmd, "BGSAVE") == 0) {
+        if (start_bgsave(carbon, oxygen, hydrogen) == -1) {
+            return -1;
+        }
+        fprintf(out, "BGSAVE started\n");
+
+    } else if (strcmp(cmd, "shutdown") == 0) {
+        // Server will handle shutdown in main loop
+        return 0;
+    } else {
+        fprintf(out, "Unknown command: %s\n", cmd);
+        fprintf(out, "Available commands: GEN SOFT DRINK, GEN VODKA, GEN CHAMPAGNE, STATS, BGSAVE, shutdown\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * park_waiter - queues a DELIVER behind the other waiters for its molecule
+ * Returns 0 on success, -1 if the waiter table is full
+ */
+int park_waiter(int index, unsigned long long quantity, const request_options_t *opts,
+                int fd, const void *addr, socklen_t addrlen, unsigned long long dedupe_serial) {
+    if (!waiters_ready) {
+        for (int k = 0; k < MAX_WAITERS; k++) waiters[k].next = k + 1 < MAX_WAITERS ? k + 1 : -1;
+        waiter_free = 0;
+        waiters_ready = 1;
+    }
+    if (waiter_free == -1 || addrlen > sizeof(struct sockaddr_storage)) {
+        waiters_refused++;
+        return -1;
+    }
+
+    unsigned long long now = monotonic_ns();
+    unsigned long long wait_ms = opts->wait_ms, deadline_ms = opts->deadline_ms;
+    if (wait_ms > (unsigned long long)config.max_wait_ms) wait_ms = (unsigned long long)config.max_wait_ms;
+    unsigned long long deadline = now + wait_ms * 1000000ULL;
+    if (deadline_ms != 0) {
+        // DL= is wall-clock; never wait past the point the client gives up
+        unsigned long long wall_ms = realtime_ns() / 1000000ULL;
+        unsigned long long left_ms = deadline_ms > wall_ms ? deadline_ms - wall_ms : 0;
+        if (now + left_ms * 1000000ULL < deadline) deadline = now + left_ms * 1000000ULL;
+    }
+
+    int slot = waiter_free;
+    waiter_t *waiter = &waiters[slot];
+    waiter_free = waiter->next;
+    waiter->next = -1;
+    waiter->fd = fd;
+    waiter->conn_gen = conns[fd].gen;
+    if (addrlen > 0) memcpy(&waiter->addr, addr, addrlen);
+    waiter->addrlen = addrlen;
+    waiter->quantity = quantity;
+    waiter->deadline_ns = deadline;
+    waiter->arrival = ++waiter_arrivals;
+    waiter->dedupe_serial = dedupe_serial;
+    snprintf(waiter->request_id, sizeof(waiter->request_id), "%s", opts->request_id);
+
+    if (waiter_tail[index] == -1) waiter_head[index] = slot;
+    else waiters[waiter_tail[index]].next = slot;
+    waiter_tail[index] = slot;
+
+    if (waiter_count == 0 || deadline < waiter_next_deadline) waiter_next_deadline = deadline;
+    waiter_count++;
+    if (waiter_count > waiter_max) waiter_max = waiter_count;
+    waiters_parked++;
+    return 0;
+}
+
+/**
+ * reply_waiter - answers a waiter and returns its slot to the free list
+ */
+void reply_waiter(int slot, const char *msg) {
+    waiter_t *waiter = &waiters[slot];
+    if (waiter->addrlen > 0 || conns[waiter->fd].gen == waiter->conn_gen) {
+        datagram_reply(waiter->fd, &waiter->addr, waiter->addrlen, msg, waiter->request_id);
+    }
+    dedupe_complete(waiter->dedupe_serial, msg);
+    waiter->next = waiter_free;
+    waiter_free = slot;
+    waiter_count--;
+}
+
+/**
+ * serve_waiters - delivers to queue heads the inventory can now satisfy
+ * Heads are served oldest first; a queue stops at its first head that does not
+ * fit, so waiters of one molecule are always served in arrival order.
+ */
+void serve_waiters(unsigned long long *carbon, unsigned long long *oxygen, unsigned long long *hydrogen) {
+    if (inventory_seq == waiter_seen_seq && config_generation == waiter_seen_generation)
+        return;
+
+    while (1) {
+        int best = -1;
+        for (int k = 0; k < 4; k++) {
+            int head = waiter_head[k];
+            if (head == -1 || recipe_capacity(&config.recipes[k], *carbon, *oxygen, *hydrogen) < waiters[head].quantity)
+                continue;
+            if (best == -1 || waiters[head].arrival < waiters[waiter_head[best]].arrival) best = k;
+        }
+        if (best == -1)
+            break;
+
+        int slot = waiter_head[best];
+        waiter_head[best] = waiters[slot].next;
+        if (waiter_head[best] == -1) waiter_tail[best] = -1;
+        can_deliver(molecule_names[best], waiters[slot].quantity, carbon, oxygen, hydrogen);
+
+        char success_msg[BUFFER_SIZE];
+        if (waiters[slot].quantity == 1) {
+            snprintf(success_msg, sizeof(success_msg), "Molecule delivered successfully.\n");
+        } else {
+            snprintf(success_msg, sizeof(success_msg), "Delivered %llu %s successfully.\n",
+                     waiters[slot].quantity, molecule_names[best]);
+        }
+        reply_waiter(slot, success_msg);
+        waiters_served++;
+    }
+    waiter_seen_seq = inventory_seq;
+    waiter_seen_generation = config_generation;
+}
+
+/**
+ * expire_waiters - fails waiters whose time is up
+ * Only scans when the earliest known deadline has passed
+ */
+void expire_waiters(void) {
+    unsigned long long now = monotonic_ns();
+    if (now < waiter_next_deadline)
+        return;
+
+    unsigned long long next = ULLONG_MAX;
+    for (int k = 0; k < 4; k++) {
+        int prev = -1;
+        for (int slot = waiter_head[k]; slot != -1; ) {
+            int following = waiters[slot].next;
+            if (waiters[slot].deadline_ns <= now) {
+                if (prev == -1) waiter_head[k] = following;
+                else waiters[prev].next = following;
+                if (waiter_tail[k] == slot) waiter_tail[k] = prev;
+                reply_waiter(slot, "Not enough atoms for this molecule.\n");
+                deliver_failures++;
+                waiters_expired++;
+            } else {
+                if (waiters[slot].deadline_ns < next) next = waiters[slot].deadline_ns;
+                prev = slot;
+            }
+            slot = following;
+        }
+    }
+    waiter_next_deadline = next;
+}
+
+/**
+ * waiter_timeout_ms - milliseconds until the earliest waiter deadline, -1 if none
+ */
+int waiter_timeout_ms(void) {
+    if (waiter_count == 0)
+        return -1;
+    unsigned long long now = monotonic_ns();
+    if (waiter_next_deadline <= now)
+        return 0;
+    return (int)((waiter_next_deadline - now + 999999ULL) / 1000000ULL);
+}
+
+/**
+ * handle_molecule_request - handles molecule requests via UDP/UDS datagram
+ * A seqpacket connection has no client_addr (addrlen 0): replies go to req_fd
+ * itself, and since it never retransmits there is no dedupe
+ * received_ns is the kernel receive time, used for queue age and shedding
+ */
+void handle_molecule_request(char *buffer, int req_fd, void *client_addr, socklen_t addrlen,
+                           unsigned long long *carbon, unsigned long long *oxygen, unsigned long long *hydrogen, int is_uds,
+                           unsigned long long received_ns) {
+    // As on streams, the rate check comes first and a rejection only reads
+    // the options for its ID=, so clients with several requests out match it
+    request_options_t opts;
+    int kind = rate_kind(buffer);
+    uint64_t source = addrlen == 0 ? conns[req_fd].source : rate_key_for_address(client_addr, addrlen, is_uds);
+    if (kind != -1 && !rate_allow(kind, addrlen == 0 ? req_fd : -1, source)) {
+        char reply[BUFFER_SIZE];
+        if (rate_reply(kind, addrlen == 0, reply, sizeof(reply)) > 0) {
+            parse_request_options(buffer, &opts);
+            datagram_reply(req_fd, client_addr, addrlen, reply, opts.request_id);
+        }
+        return;
+    }
+
+    // Drop work nobody is waiting for any more, low priority first under overload
+    if (parse_request_options(buffer, &opts) == -1) {
+        datagram_reply(req_fd, client_addr, addrlen, "ERROR: Invalid request option.\n", opts.request_id);
+        return;
+    }
+    const char *shed = shed_reason(&opts, received_ns);
+    if (shed != NULL) {
+        if (*shed != '\0') datagram_reply(req_fd, client_addr, addrlen, shed, opts.request_id);
+        return;
+    }
+
+    // A retransmitted DELIVER gets the original reply; it never runs twice
+    if (opts.request_id[0] != '\0' && addrlen > 0 && strncmp(buffer, "DELIVER", 7) == 0) {
+        dedupe_entry_t *entry = dedupe_find(client_addr, addrlen, opts.request_id);
+        if (entry != NULL) {
+            if (entry->done) {
+                datagram_reply(req_fd, client_addr, addrlen, entry->reply, entry->request_id);
+                dedupe_replayed++;
+            } else {
+                dedupe_in_flight++;
+            }
+            return;
+        }
+    }
+
+    if (config.log_level >= LOG_REQUEST) printf("Received molecule request: %s\n", buffer);
+    datagram_requests++;
+
+    if (draining) {
+        const char *msg = "ERROR: Server is draining, send requests elsewhere.\n";
+        datagram_reply(req_fd, client_addr, addrlen, msg, opts.request_id);
+        return;
+    }
+
+    // Feed receivers recover from lost packets with a unicast snapshot
+    if (strncmp(buffer, "SNAPSHOT", 8) == 0) {
+        feed_packet_t packet;
+        build_feed_packet(&packet, FEED_FLAG_SNAPSHOT, *carbon, *oxygen, *hydrogen);
+        sendto(req_fd, &packet, sizeof(packet), 0, (struct sockaddr*)client_addr, addrlen);
+        feed_snapshot_requests++;
+        return;
+    }
+
+    char reply[BUFFER_SIZE];
+    if (format_query_reply(buffer, reply, sizeof(reply), *carbon, *oxygen, *hydrogen)) {
+        datagram_reply(req_fd, client_addr, addrlen, reply, opts.request_id);
+        return;
+    }
+
+    if (leader_spec != NULL) {
+        snprintf(reply, sizeof(reply), "ERROR: Read-only follower, send DELIVER to the leader (%s).\n", leader_spec);
+        datagram_reply(req_fd, client_addr, addrlen, reply, opts.request_id);
+        return;
+    }
+
+    if (shard_atom != -1) {
+        snprintf(reply, sizeof(reply), "ERROR: This shard holds only %s, send DELIVER to the coordinator.\n",
+                 atom_names[shard_atom]);
+        datagram_reply(req_fd, client_addr, addrlen, reply, opts.request_id);
+        return;
+    }
+
+    char molecule[64];
+    unsigned long long quantity = 1;
+    
+    int parsed = sscanf(buffer, "DELIVER %63s %llu", molecule, &quantity);
+    
+    if (parsed >= 1) {
+        if (strcmp(molecule, "CARBON") == 0) {
+            char dioxide[32];
+            if (sscanf(buffer, "DELIVER CARBON %31s %llu", dioxide, &quantity) >= 2 && 
+                strcmp(dioxide, "DIOXIDE") == 0) {
+                strcpy(molecule, "CARBON DIOXIDE");
+            } else if (sscanf(buffer, "DELIVER CARBON %31s", dioxide) == 1 && 
+                      strcmp(dioxide, "DIOXIDE") == 0) {
+                strcpy(molecule, "CARBON DIOXIDE");
+                quantity = 1;
+            }
+        }
+        
+        if (parsed == 1) {
+            quantity = 1;
+        }
+        
+        // Strict quantity validation
+        if (quantity == 0 || quantity > config.max_atoms) {
+            char error_msg[BUFFER_SIZE];
+            snprintf(error_msg, sizeof(error_msg), "ERROR: Invalid quantity %llu (must be 1-%llu).\n", quantity, config.max_atoms);
+            datagram_reply(req_fd, client_addr, addrlen, error_msg, opts.request_id);
+            if (config.log_level >= LOG_REQUEST) printf("Invalid quantity for %s: %llu\n", molecule, quantity);
             return;
         }
 
-        int updated = 0;
-        if (strcmp(type, "CARBON") == 0) {
-            if (*carbon + amount > MAX_ATOMS) {
-                snprintf(response, sizeof(response), "ERROR: Adding this would exceed CARBON storage limit (%llu).\n", MAX_ATOMS);
-                printf("Error: adding this would exceed CARBON storage limit (%llu).\n", MAX_ATOMS);
-                send(client_fd, response, strlen(response), 0);
-                return;
+        // From here on the request runs, so remember it for retransmits
+        unsigned long long dedupe_serial = addrlen > 0 ? dedupe_insert(client_addr, addrlen, opts.request_id) : 0;
+
+        if (cluster_mode) {
+            int index = -1;
+            for (int k = 0; k < 4; k++) {
+                if (strcmp(molecule, molecule_names[k]) == 0) index = k;
             }
-            *carbon += amount;
-            updated = 1;
-            snprintf(response, sizeof(response), "SUCCESS: Added %llu CARBON. Total CARBON: %llu\n", amount, *carbon);
-            printf("Added %llu CARBON.\n", amount);
-        } else if (strcmp(type, "OXYGEN") == 0) {
-            if (*oxygen + amount > MAX_ATOMS) {
-                snprintf(response, sizeof(response), "ERROR: Adding this would exceed OXYGEN storage limit (%llu).\n", MAX_ATOMS);
-                printf("Error: adding this would exceed OXYGEN storage limit (%llu).\n", MAX_ATOMS);
-                send(client_fd, response, strlen(response), 0);
-                return;
+            if (index < 0) {
+                datagram_reply(req_fd, client_addr, addrlen, "Not enough atoms for this molecule.\n", opts.request_id);
+                dedupe_complete(dedupe_serial, "Not enough atoms for this molecule.\n");
+            } else {
+                cluster_propose(RAFT_ENTRY_DELIVER, (uint8_t)index, quantity, req_fd, 1, client_addr, addrlen,
+                                dedupe_serial, opts.request_id);
             }
-            *oxygen += amount;
-            updated = 1;
-            snprintf(response, sizeof(response), "SUCCESS: Added %llu OXYGEN. Total OXYGEN: %llu\n", amount, *oxygen);
-            printf("Added %llu OXYGEN.\n", amount);
-        } else if (strcmp(type, "HYDROGEN") == 0) {
-            if (*hydrogen + amount > MAX_ATOMS) {
-                snprintf(response, sizeof(response), "ERROR: Adding this would exceed HYDROGEN storage limit (%llu).\n", MAX_ATOMS);
-                printf("Error: adding this would exceed HYDROGEN storage limit (%llu).\n", MAX_ATOMS);
-                send(client_fd, response, strlen(response), 0);
+            return;
+        }
+        
+        // WAIT=: queue behind earlier waiters instead of failing straight away
+        int index = -1;
+        for (int k = 0; k < 4; k++) {
+            if (strcmp(molecule, molecule_names[k]) == 0) index = k;
+        }
+        if (opts.wait_ms > 0 && index >= 0 &&
+            (waiter_head[index] != -1 || recipe_capacity(&config.recipes[index], *carbon, *oxygen, *hydrogen) < quantity)) {
+            if (park_waiter(index, quantity, &opts, req_fd, client_addr, addrlen, dedupe_serial) == 0) {
+                if (config.log_level >= LOG_REQUEST) printf("Waiting for atoms: %llu %s.\n", quantity, molecule);
                 return;
             }
-            *hydrogen += amount;
-            updated = 1;
-            snprintf(response, sizeof(response), "SUCCESS: Added %llu HYDROGEN. Total HYDROGEN: %llu\n", amount, *hydrogen);
-            printf("Added %llu HYDROGEN.\n", amount);
+        }
+
+        if (can_deliver(molecule, quantity, carbon, oxygen, hydrogen)) {
+            char success_msg[BUFFER_SIZE];
+            if (quantity == 1) {
+                snprintf(success_msg, sizeof(success_msg), 
+                        "Molecule delivered successfully.\n");
+            } else {
+                snprintf(success_msg, sizeof(success_msg), 
+                        "Delivered %llu %s successfully.\n", quantity, molecule);
+            }
+            
+            datagram_reply(req_fd, client_addr, addrlen, success_msg, opts.request_id);
+            dedupe_complete(dedupe_serial, success_msg);
+            if (config.log_level >= LOG_REQUEST) {
+                printf("Delivered %llu %s.\n", quantity, molecule);
+                
+                printf("Current warehouse status:\n");
+                printf("CARBON: %llu\n", *carbon);
+                printf("OXYGEN: %llu\n", *oxygen);
+                printf("HYDROGEN: %llu\n", *hydrogen);
+            }
         } else {
-            snprintf(response, sizeof(response), "ERROR: Unknown atom type: %s\n", type);
-            printf("Unknown atom type: %s\n", type);
-            send(client_fd, response, strlen(response), 0);
-            return;
+            char fail_msg[] = "Not enough atoms for this molecule.\n";
+            datagram_reply(req_fd, client_addr, addrlen, fail_msg, opts.request_id);
+            dedupe_complete(dedupe_serial, fail_msg);
+            if (config.log_level >= LOG_REQUEST) printf("Failed to deliver %llu %s: insufficient atoms.\n", quantity, molecule);
         }
-        
-        // Save to file if inventory was updated
-        if (updated && inventory_fd != -1) {
-            save_inventory(*carbon, *oxygen, *hydrogen);
+    } else {
+        char error_msg[] = "Invalid DELIVER command.\n";
+        datagram_reply(req_fd, client_addr, addrlen, error_msg, opts.request_id);
+        if (config.log_level >= LOG_REQUEST) printf("Invalid request command.\n");
+    }
+}
+
+/**
+ * handle_admin_command - runs one admin socket command and sends the reply
+ * Returns ADMIN_SHUTDOWN or ADMIN_DRAIN when the main loop has to act
+ */
+int handle_admin_command(int fd, char *cmd, unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen) {
+    char *reply = NULL;
+    size_t reply_len = 0;
+    int action = ADMIN_NONE;
+    cmd[strcspn(cmd, "\r\n")] = '\0';
+
+    // The worker pool sends the reply when it has one
+    if (gen_submit(fd, cmd, carbon, oxygen, hydrogen) == 0) {
+        return ADMIN_NONE;
+    }
+
+    FILE *out = open_memstream(&reply, &reply_len);
+    if (out == NULL) {
+        perror("Admin reply buffer");
+        return ADMIN_NONE;
+    }
+
+    if (strcmp(cmd, "SHUTDOWN") == 0 || strcmp(cmd, "shutdown") == 0) {
+        fprintf(out, "OK shutting down\n");
+        action = ADMIN_SHUTDOWN;
+    } else if (strcmp(cmd, "DRAIN") == 0) {
+        fprintf(out, "OK draining, %d client(s) still connected\n", stream_client_count);
+        action = ADMIN_DRAIN;
+    } else if (strcmp(cmd, "RELOAD") == 0) {
+        char msg[2 * BUFFER_SIZE];
+        if (reload_config(msg, sizeof(msg)) == 0) {
+            printf("Admin RELOAD: %s\n", msg);
+            fprintf(out, "OK %s\n", msg);
+        } else {
+            fprintf(out, "ERROR: %s\n", msg);
         }
+    } else if (strcmp(cmd, "HELP") == 0) {
+        fprintf(out, "Commands: GEN SOFT DRINK, GEN VODKA, GEN CHAMPAGNE, STATUS, CAPACITY, STATS, BGSAVE, DRAIN, RELOAD, SHUTDOWN\n");
+        fprintf(out, "OK\n");
     } else {
-        snprintf(response, sizeof(response), "ERROR: Invalid command format: %s", cmd);
-        printf("Invalid command: %s\n", cmd);
-        send(client_fd, response, strlen(response), 0);
-        return;
+        char query[BUFFER_SIZE];
+        if (format_query_reply(cmd, query, sizeof(query), carbon, oxygen, hydrogen)) {
+            fputs(query, out);
+            fprintf(out, "OK\n");
+        } else if (strcmp(cmd, "BGSAVE") == 0 && process_drink_command(cmd, out, carbon, oxygen, hydrogen) == -1) {
+            fprintf(out, "ERROR: BGSAVE not started (no save file or one already running)\n");
+        } else if (strcmp(cmd, "BGSAVE") != 0 && process_drink_command(cmd, out, carbon, oxygen, hydrogen) == -1) {
+            fprintf(out, "ERROR: Unknown command\n");
+        } else {
+            fprintf(out, "OK\n");
+        }
     }
 
-    // Send success response
-    send(client_fd, response, strlen(response), 0);
-    
-    // Print current status to server console
-    printf("Current warehouse status:\n");
-    printf("CARBON: %llu\n", *carbon);
-    printf("OXYGEN: %llu\n", *oxygen);
-    printf("HYDROGEN: %llu\n", *hydrogen);
-    
-    // Send warehouse status to client
-    char status_msg[BUFFER_SIZE];
-    snprintf(status_msg, sizeof(status_msg), "Status: CARBON: %llu, OXYGEN: %llu, HYDROGEN: %llu\n", 
-             *carbon, *oxygen, *hydrogen);
-    send(client_fd, status_msg, strlen(status_msg), 0);
+    fclose(out);
+    conn_send(fd, reply, reply_len);
+    free(reply);
+    return action;
 }
 
 /**
- * can_deliver - checks and performs molecule delivery
- * returns 1 on success, 0 on failure
+ * slab_grow - adds a block of free chunks to the pool
+ * Returns -1 if it cannot be allocated
  */
-int can_deliver(const char *molecule, unsigned long long quantity, unsigned long long *carbon, unsigned long long *oxygen, unsigned long long *hydrogen) {
-    unsigned long long needed_c = 0, needed_o = 0, needed_h = 0;
-    
-    if (strcmp(molecule, "WATER") == 0) {
-        needed_h = 2 * quantity;
-        needed_o = 1 * quantity;
-    } else if (strcmp(molecule, "CARBON DIOXIDE") == 0) {
-        needed_c = 1 * quantity;
-        needed_o = 2 * quantity;
-    } else if (strcmp(molecule, "ALCOHOL") == 0) {
-        needed_c = 2 * quantity;
-        needed_h = 6 * quantity;
-        needed_o = 1 * quantity;
-    } else if (strcmp(molecule, "GLUCOSE") == 0) {
-        needed_c = 6 * quantity;
-        needed_h = 12 * quantity;
-        needed_o = 6 * quantity;
+int slab_grow(void) {
+    slab_block_t *block = malloc(sizeof(slab_block_t));
+    if (block == NULL)
+        return -1;
+    block->next = slab_blocks;
+    slab_blocks = block;
+    slab_block_count++;
+    for (int k = 0; k < SLAB_CHUNKS_PER_BLOCK; k++) {
+        block->chunks[k].next = slab_free_list;
+        slab_free_list = &block->chunks[k];
+    }
+    return 0;
+}
+
+/**
+ * slab_alloc - takes a STREAM_BUFFER_SIZE chunk from the pool
+ * Returns NULL if a new block cannot be allocated
+ */
+char *slab_alloc(void) {
+    if (slab_free_list == NULL && slab_grow() == -1)
+        return NULL;
+    slab_chunk_t *chunk = slab_free_list;
+    slab_free_list = chunk->next;
+    if (++slab_in_use > slab_peak) slab_peak = slab_in_use;
+    return chunk->data;
+}
+
+/**
+ * slab_free - returns a chunk to the pool
+ */
+void slab_free(char *buf) {
+    slab_chunk_t *chunk = (slab_chunk_t *)buf;
+    chunk->next = slab_free_list;
+    slab_free_list = chunk;
+    slab_in_use--;
+}
+
+/**
+ * conn_table_init - sizes the connection table for every fd the process may
+ * open, raising the soft RLIMIT_NOFILE to the hard one first
+ * Returns -1 on failure
+ */
+int conn_table_init(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1) {
+        perror("getrlimit");
+        return -1;
+    }
+    rlim_t want = limit.rlim_max == RLIM_INFINITY || limit.rlim_max > CONN_TABLE_MAX ? CONN_TABLE_MAX : limit.rlim_max;
+    if (limit.rlim_cur == RLIM_INFINITY || limit.rlim_cur > want) {
+        limit.rlim_cur = want;
+    } else if (limit.rlim_cur < want) {
+        rlim_t soft = limit.rlim_cur;
+        limit.rlim_cur = want;
+        if (setrlimit(RLIMIT_NOFILE, &limit) == -1) limit.rlim_cur = soft;
+    }
+    conn_capacity = (int)limit.rlim_cur;
+
+    conns = calloc((size_t)conn_capacity, sizeof(conn_t));
+    watch_fds = malloc(sizeof(int) * (size_t)conn_capacity);
+    conn_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (conns == NULL || watch_fds == NULL || conn_epoll_fd == -1) {
+        perror("Connection table");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * conn_watch - adds a client connection to the epoll set
+ * Returns 0 on success, -1 on failure
+ */
+int conn_watch(int fd) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(conn_epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * conn_open - moves a new client above the select() range, then enters it in
+ * the connection table and the epoll set
+ * Returns the fd to use from now on, or -1 if the client was closed
+ */
+int conn_open(int fd, int kind, uint32_t peer) {
+    if (fd < FD_SETSIZE) {
+        int high = fcntl(fd, F_DUPFD_CLOEXEC, FD_SETSIZE);
+        if (high != -1) {
+            close(fd);
+            fd = high;
+        }
+    }
+    if (fd >= conn_capacity || conn_watch(fd) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    conn_t *conn = &conns[fd];
+    conn->kind = (unsigned char)kind;
+    conn->framed = 0;
+    conn->gen_pending = 0;
+    conn->len = 0;
+    conn->peer = peer;
+    conn->accepted_s = conn->active_s = conn_clock();
+    conn_counts[kind]++;
+    if (fd > conn_high) conn_high = fd;
+    return fd;
+}
+
+/**
+ * conn_input - where the next read of a connection goes: after its pending
+ * partial line, or into the shared scratch buffer when nothing is pending
+ */
+char *conn_input(int fd) {
+    return conns[fd].buf != NULL ? conns[fd].buf : stream_scratch;
+}
+
+/**
+ * conn_keep - keeps the unprocessed tail of a read for the next one
+ * The chunk is taken when a partial line first remains and returned once
+ * nothing does; if none can be taken the partial line is dropped
+ */
+void conn_keep(int fd, const char *tail, size_t rest) {
+    conn_t *conn = &conns[fd];
+    if (rest == 0) {
+        if (conn->buf != NULL) {
+            slab_free(conn->buf);
+            conn->buf = NULL;
+        }
+    } else if (conn->buf != NULL) {
+        memmove(conn->buf, tail, rest);
+    } else if ((conn->buf = slab_alloc()) != NULL) {
+        memcpy(conn->buf, tail, rest);
     } else {
-        return 0; // Unknown molecule
+        perror("Stream buffer allocation");
+        rest = 0;
     }
-    
-    if (*carbon >= needed_c && *oxygen >= needed_o && *hydrogen >= needed_h) {
-        *carbon -= needed_c;
-        *oxygen -= needed_o;
-        *hydrogen -= needed_h;
-        
-        // Save updated inventory to file
-        if (inventory_fd != -1) {
-            save_inventory(*carbon, *oxygen, *hydrogen);
+    conn->len = (unsigned short)rest;
+}
+
+/**
+ * process_admin_input - runs every complete line received on an admin connection
+ * Returns the strongest action requested by the lines
+ */
+int process_admin_input(int fd, char *buf, size_t had, size_t nbytes,
+                        unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen) {
+    size_t len = had + nbytes;
+    size_t start = 0;
+    int action = ADMIN_NONE;
+    buf[len] = '\0';
+
+    // Stops at a GEN handed to the worker pool; the rest waits for its reply
+    for (size_t k = had; k < len && !conns[fd].gen_pending; k++) {
+        if (buf[k] == '\n') {
+            buf[k] = '\0';
+            int result = handle_admin_command(fd, buf + start, carbon, oxygen, hydrogen);
+            if (result > action) action = result;
+            start = k + 1;
         }
-        
-        return 1;
     }
-    
+    size_t rest = len - start;
+    if (rest == STREAM_BUFFER_SIZE - 1 && !conns[fd].gen_pending) {
+        handle_admin_command(fd, buf + start, carbon, oxygen, hydrogen);
+        rest = 0;
+    }
+    conn_keep(fd, buf + len - rest, rest);
+    return action;
+}
+
+/**
+ * read_stdin_commands - reads admin commands typed on stdin without blocking
+ * Returns ADMIN_SHUTDOWN for "shutdown", -1 once stdin is closed
+ */
+int read_stdin_commands(unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen) {
+    ssize_t nbytes = read(STDIN_FILENO, stdin_buf + stdin_len, sizeof(stdin_buf) - 1 - stdin_len);
+    if (nbytes == 0) {
+        printf("Standard input closed, use the admin socket (-a) for commands.\n");
+        return -1;
+    }
+    if (nbytes < 0) {
+        return errno == EAGAIN || errno == EINTR ? ADMIN_NONE : -1;
+    }
+    stdin_len += (size_t)nbytes;
+    stdin_buf[stdin_len] = '\0';
+
+    int action = ADMIN_NONE;
+    char *line = stdin_buf;
+    char *newline;
+    while ((newline = strchr(line, '\n')) != NULL || (line == stdin_buf && stdin_len == sizeof(stdin_buf) - 1)) {
+        if (newline != NULL) *newline = '\0';
+        if (strncmp(line, "shutdown", 8) == 0) {
+            action = ADMIN_SHUTDOWN;
+        } else {
+            process_drink_command(line, stdout, carbon, oxygen, hydrogen);
+        }
+        if (newline == NULL) {
+            line = stdin_buf + stdin_len;
+            break;
+        }
+        line = newline + 1;
+    }
+    stdin_len -= (size_t)(line - stdin_buf);
+    memmove(stdin_buf, line, stdin_len);
+    return action;
+}
+
+/**
+ * reject_over_limit - turns a new stream client away when max_clients are connected
+ * Returns 1 if the connection was closed
+ */
+int reject_over_limit(int fd) {
+    if (config.max_clients == 0 || stream_client_count < config.max_clients)
+        return 0;
+    const char *msg = "ERROR: Too many clients, try again later.\n";
+    send(fd, msg, strlen(msg), MSG_NOSIGNAL);
+    close(fd);
+    clients_rejected++;
+    return 1;
+}
+
+/**
+ * close_stream_client - closes a client connection and drops its buffered input
+ */
+void close_stream_client(int fd) {
+    if (shard_atom != -1) {
+        release_coordinator(fd);
+    }
+    if (shm_client_count > 0) {
+        close_shm_session(fd);
+    }
+    stop_watch(fd, 1);
+    conn_t *conn = &conns[fd];
+    if (conn->kind != CONN_ADMIN) {
+        stream_client_count--;
+    }
+    conn_counts[conn->kind]--;
+    // A BGSAVE child may still hold the socket, which would keep it in the set
+    epoll_ctl(conn_epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    conn_keep(fd, NULL, 0);
+    conn->kind = CONN_FREE;
+    conn->gen++;
+}
+
+/**
+ * process_stream_input - runs every complete line received from a stream client
+ * Lets clients pipeline commands; a client that never sent a newline keeps
+ * the old one-recv-one-command behaviour
+ */
+void process_stream_input(int fd, char *buf, size_t had, size_t nbytes,
+                          unsigned long long *carbon, unsigned long long *oxygen, unsigned long long *hydrogen) {
+    size_t len = had + nbytes;
+    size_t start = 0;
+    buf[len] = '\0';
+
+    for (size_t k = had; k < len; k++) {
+        if (buf[k] == '\n') {
+            char saved = buf[k + 1];
+            buf[k + 1] = '\0';
+            process_command(fd, buf + start, carbon, oxygen, hydrogen);
+            buf[k + 1] = saved;
+            start = k + 1;
+            conns[fd].framed = 1;
+        }
+    }
+
+    size_t rest = len - start;
+    if (rest > 0 && (!conns[fd].framed || rest == STREAM_BUFFER_SIZE - 1)) {
+        // Unterminated command from an old client, or a line too long to buffer
+        process_command(fd, buf + start, carbon, oxygen, hydrogen);
+        rest = 0;
+    }
+    conn_keep(fd, buf + len - rest, rest);
+
+    if (shard_reply_len > 0) {
+        conn_send(fd, shard_reply, shard_reply_len);
+        shard_reply_len = 0;
+    }
+}
+
+/**
+ * process_seqpacket_input - runs the one command in a seqpacket message and
+ * sends its reply as one message
+ * Returns -1 if the client hung up
+ */
+int process_seqpacket_input(int fd, unsigned long long *carbon, unsigned long long *oxygen, unsigned long long *hydrogen) {
+    char cmd[BUFFER_SIZE];
+    struct iovec iov = {cmd, sizeof(cmd) - 2};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    ssize_t nbytes = recvmsg(fd, &msg, 0);
+    if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+    if (nbytes <= 0) {
+        if (nbytes == 0 && config.log_level >= LOG_INFO) printf("Socket %d hung up\n", fd);
+        else if (nbytes < 0) perror("recvmsg");
+        return -1;
+    }
+    if (msg.msg_flags & MSG_TRUNC) {
+        // The rest of the message is gone, so don't run what is left of it
+        const char *err = "ERROR: Command too long.\n";
+        conn_send(fd, err, strlen(err));
+        return 0;
+    }
+    size_t len = (size_t)nbytes;
+    if (cmd[len - 1] != '\n') cmd[len++] = '\n';
+    cmd[len] = '\0';
+
+    // DELIVER runs as on the datagram sockets, minus retransmit dedupe
+    if (strncmp(cmd, "DELIVER", 7) == 0) {
+        handle_molecule_request(cmd, fd, NULL, 0, carbon, oxygen, hydrogen, 1, 0);
+        return 0;
+    }
+
+    seqpacket_reply_fd = fd;
+    seqpacket_reply_len = 0;
+    process_command(fd, cmd, carbon, oxygen, hydrogen);
+    seqpacket_reply_fd = -1;
+    if (seqpacket_reply_len > 0) {
+        conn_send(fd, seqpacket_reply, seqpacket_reply_len);
+    }
     return 0;
 }
 
 /**
- * calculate_possible_molecules - calculates how many molecules can be produced
+ * finish_gen_jobs - sends the replies of finished GEN jobs and goes on with
+ * the lines their connections sent meanwhile
+ * Returns the strongest admin action those lines requested
  */
-void calculate_possible_molecules(unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen,
-                                 unsigned long long *water, unsigned long long *co2, 
-                                 unsigned long long *alcohol, unsigned long long *glucose) {
-    
-    // WATER: 2H + 1O
-    *water = 0;
-    if (hydrogen >= 2 && oxygen >= 1) {
-        unsigned long long from_hydrogen = hydrogen / 2;
-        unsigned long long from_oxygen = oxygen;
-        *water = (from_hydrogen < from_oxygen) ? from_hydrogen : from_oxygen;
+int finish_gen_jobs(unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen) {
+    uint64_t count;
+    if (read(gen_done_fd, &count, sizeof(count)) != sizeof(count)) {
+        return ADMIN_NONE;
     }
-    
-    // CARBON DIOXIDE: 1C + 2O  
-    *co2 = 0;
-    if (carbon >= 1 && oxygen >= 2) {
-        unsigned long long from_carbon = carbon;
-        unsigned long long from_oxygen = oxygen / 2;
-        *co2 = (from_carbon < from_oxygen) ? from_carbon : from_oxygen;
+    pthread_mutex_lock(&gen_done_lock);
+    gen_job_t *done = gen_done;
+    gen_done = NULL;
+    pthread_mutex_unlock(&gen_done_lock);
+
+    // Oldest first
+    gen_job_t *ordered = NULL;
+    while (done != NULL) {
+        gen_job_t *next = done->next;
+        done->next = ordered;
+        ordered = done;
+        done = next;
     }
-    
-    // ALCOHOL: 2C + 6H + 1O
-    *alcohol = 0;
-    if (carbon >= 2 && hydrogen >= 6 && oxygen >= 1) {
-        unsigned long long from_carbon = carbon / 2;
-        unsigned long long from_hydrogen = hydrogen / 6;
-        unsigned long long from_oxygen = oxygen;
-        *alcohol = min3(from_carbon, from_hydrogen, from_oxygen);
+
+    int action = ADMIN_NONE;
+    while (ordered != NULL) {
+        gen_job_t *job = ordered;
+        ordered = job->next;
+        int fd = job->fd;
+        if (conns[fd].kind != CONN_ADMIN || conns[fd].gen != job->gen) {
+            gen_dropped++;                      // the client hung up meanwhile
+            free(job);
+            continue;
+        }
+        conn_send(fd, job->reply, strlen(job->reply));
+        gen_completed++;
+        free(job);
+
+        conns[fd].gen_pending = 0;
+        if (conn_update_events(fd) == -1) {
+            close_stream_client(fd);
+            continue;
+        }
+        int result = process_admin_input(fd, conn_input(fd), 0, conns[fd].len, carbon, oxygen, hydrogen);
+        if (result > action) action = result;
     }
-    
-    // GLUCOSE: 6C + 12H + 6O
-    *glucose = 0;
-    if (carbon >= 6 && hydrogen >= 12 && oxygen >= 6) {
-        unsigned long long from_carbon = carbon / 6;
-        unsigned long long from_hydrogen = hydrogen / 12;
-        unsigned long long from_oxygen = oxygen / 6;
-        *glucose = min3(from_carbon, from_hydrogen, from_oxygen);
+    return action;
+}
+
+/**
+ * service_conn - reads what a client connection sent and runs it
+ * Returns the admin action requested, if any
+ */
+int service_conn(int fd, unsigned long long *carbon, unsigned long long *oxygen, unsigned long long *hydrogen) {
+    conn_t *conn = &conns[fd];
+    if (conn->gen_pending) {
+        // Only a hangup is reported while a GEN is out
+        close_stream_client(fd);
+        return ADMIN_NONE;
     }
+    conn->active_s = conn_clock();
+    if (conn->kind == CONN_SEQPACKET) {
+        if (process_seqpacket_input(fd, carbon, oxygen, hydrogen) == -1) {
+            close_stream_client(fd);
+        }
+        return ADMIN_NONE;
+    }
+
+    // One command per line (TCP, UDS stream and admin)
+    char *buf = conn_input(fd);
+    size_t had = conn->len;
+    ssize_t nbytes = recv(fd, buf + had, STREAM_BUFFER_SIZE - 1 - had, 0);
+    if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return ADMIN_NONE;
+    if (nbytes <= 0) {
+        if (conn->kind != CONN_ADMIN) {
+            if (nbytes == 0 && config.log_level >= LOG_INFO) printf("Socket %d hung up\n", fd);
+            else if (nbytes < 0) perror("recv");
+        }
+        close_stream_client(fd);
+        return ADMIN_NONE;
+    }
+    if (conn->kind == CONN_ADMIN) {
+        return process_admin_input(fd, buf, had, (size_t)nbytes, *carbon, *oxygen, *hydrogen);
+    }
+    process_stream_input(fd, buf, had, (size_t)nbytes, carbon, oxygen, hydrogen);
+    return ADMIN_NONE;
 }
 
 /**
- * process_drink_command - processes drink commands from administrator
+ * busy_poll_lock - locks one hot region into memory, counting what it locked
+ * A failure is remembered; the region then stays pageable
  */
-void process_drink_command(char *cmd, unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen) {
-    char *newline = strchr(cmd, '\n');
-    if (newline) *newline = '\0';
-    
-    if (strcmp(cmd, "GEN SOFT DRINK") == 0) {
-        unsigned long long water, co2, alcohol, glucose;
-        calculate_possible_molecules(carbon, oxygen, hydrogen, &water, &co2, &alcohol, &glucose);
-        unsigned long long possible_soft_drinks = min3(water, co2, alcohol);
-        printf("Can produce %llu SOFT DRINK(s) (needs: WATER + CARBON DIOXIDE + ALCOHOL)\n", possible_soft_drinks);
-        
-    } else if (strcmp(cmd, "GEN VODKA") == 0) {
-        unsigned long long water, co2, alcohol, glucose;
-        calculate_possible_molecules(carbon, oxygen, hydrogen, &water, &co2, &alcohol, &glucose);
-        unsigned long long possible_vodka = min3(water, alcohol, glucose);
-        printf("Can produce %llu VODKA(s) (needs: WATER + ALCOHOL + GLUCOSE)\n", possible_vodka);
-        
-    } else if (strcmp(cmd, "GEN CHAMPAGNE") == 0) {
-        unsigned long long water, co2, alcohol, glucose;
-        calculate_possible_molecules(carbon, oxygen, hydrogen, &water, &co2, &alcohol, &glucose);
-        unsigned long long possible_champagne = min3(water, co2, glucose);
-        printf("Can produce %llu CHAMPAGNE(s) (needs: WATER + CARBON DIOXIDE + GLUCOSE)\n", possible_champagne);
-        
-    } else if (strcmp(cmd, "shutdown") == 0) {
-        // Server will handle shutdown in main loop
-        return;
-    } else {
-        printf("Unknown command: %s\n", cmd);
-        printf("Available commands: GEN SOFT DRINK, GEN VODKA, GEN CHAMPAGNE, shutdown\n");
+void busy_poll_lock(const void *addr, size_t len) {
+    if (mlock(addr, len) == 0) {
+        busy_poll_locked += len;
+    } else if (busy_poll_lock_errno == 0) {
+        busy_poll_lock_errno = errno;
+    }
+}
+
+/**
+ * lock_stack - touches and locks the stack the event loop may grow into
+ * The pages stay locked after the frame is popped
+ */
+void lock_stack(void) {
+    volatile char stack[BUSY_POLL_STACK_PREFAULT];
+    for (size_t k = 0; k < sizeof(stack); k += 4096) {
+        stack[k] = 0;
+    }
+    busy_poll_lock((const void *)stack, sizeof(stack));
+}
+
+/**
+ * start_busy_poll - pins the event loop to busy_poll_core, sets SO_BUSY_POLL
+ * on the given sockets and locks the hot memory
+ * Returns -1 if the core cannot be used; the other steps only warn
+ */
+int start_busy_poll(const int *fds, int fd_count) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(busy_poll_core, &cpus);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (err != 0) {
+        fprintf(stderr, "Error: Cannot pin the event loop to core %d: %s\n", busy_poll_core, strerror(err));
+        return -1;
+    }
+
+    // Lets the kernel poll the device queue on reads (NICs with NAPI only)
+    for (int k = 0; k < fd_count && busy_poll_usec > 0; k++) {
+        if (fds[k] != -1 && setsockopt(fds[k], SOL_SOCKET, SO_BUSY_POLL, &busy_poll_usec, sizeof(busy_poll_usec)) == -1) {
+            perror("SO_BUSY_POLL");
+        }
+    }
+
+    // Blocks the pool grows by later stay pageable
+    for (int k = 0; k < BUSY_POLL_SLAB_BLOCKS; k++) {
+        if (slab_grow() == -1) break;
+    }
+    for (slab_block_t *block = slab_blocks; block != NULL; block = block->next) {
+        busy_poll_lock(block, sizeof(*block));
+    }
+    int slots = conn_capacity < FD_SETSIZE + BUSY_POLL_CONNS ? conn_capacity : FD_SETSIZE + BUSY_POLL_CONNS;
+    busy_poll_lock(conns, (size_t)slots * sizeof(conn_t));
+    lock_stack();
+    if (busy_poll_lock_errno != 0) {
+        fprintf(stderr, "Warning: mlock: %s (raise ulimit -l), part of the hot memory stays pageable\n",
+                strerror(busy_poll_lock_errno));
     }
+    printf("Busy-poll: event loop pinned to core %d, %zu KB locked\n", busy_poll_core, busy_poll_locked / 1024);
+    return 0;
 }
 
 /**
- * handle_molecule_request - handles molecule requests via UDP/UDS datagram
+ * welcome_message - the greeting for a new client of a transport
+ * Formatted again only when the inventory changed since the last one
  */
-void handle_molecule_request(char *buffer, int req_fd, void *client_addr, socklen_t addrlen, 
-                           unsigned long long *carbon, unsigned long long *oxygen, unsigned long long *hydrogen, int is_uds) {
-    printf("Received molecule request: %s\n", buffer);
+const char *welcome_message(int kind, unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen,
+                            size_t *len) {
+    static const char *transport_names[4] = {"", "TCP", "UDS", "UDS seqpacket"};
+    welcome_t *welcome = &welcomes[kind];
+    if (welcome->len == 0 || welcome->values[0] != carbon || welcome->values[1] != oxygen ||
+        welcome->values[2] != hydrogen) {
+        welcome->len = snprintf(welcome->text, sizeof(welcome->text),
+                                "Connected to Persistent Warehouse Server (%s). Current inventory: C=%llu, O=%llu, H=%llu\n",
+                                transport_names[kind], carbon, oxygen, hydrogen);
+        welcome->values[0] = carbon;
+        welcome->values[1] = oxygen;
+        welcome->values[2] = hydrogen;
+    }
+    *len = (size_t)welcome->len;
+    return welcome->text;
+}
 
-    char molecule[64];
-    unsigned long long quantity = 1;
-    
-    int parsed = sscanf(buffer, "DELIVER %63s %llu", molecule, &quantity);
-    
-    if (parsed >= 1) {
-        if (strcmp(molecule, "CARBON") == 0) {
-            char dioxide[32];
-            if (sscanf(buffer, "DELIVER CARBON %31s %llu", dioxide, &quantity) >= 2 && 
-                strcmp(dioxide, "DIOXIDE") == 0) {
-                strcpy(molecule, "CARBON DIOXIDE");
-            } else if (sscanf(buffer, "DELIVER CARBON %31s", dioxide) == 1 && 
-                      strcmp(dioxide, "DIOXIDE") == 0) {
-                strcpy(molecule, "CARBON DIOXIDE");
-                quantity = 1;
+/**
+ * accept_clients - accepts the connections queued on a client listener
+ * Takes at most ACCEPT_BATCH, so a connect storm cannot starve the clients
+ * already connected; the rest are taken on the next loop iteration
+ */
+void accept_clients(int listen_fd, int kind,
+                    unsigned long long carbon, unsigned long long oxygen, unsigned long long hydrogen) {
+    int taken = 0;
+    accept_wakeups++;
+    while (taken < ACCEPT_BATCH) {
+        struct sockaddr_storage client_addr;
+        socklen_t addrlen = sizeof(client_addr);
+        int new_fd = accept4(listen_fd, (struct sockaddr*)&client_addr, &addrlen, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (new_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror(kind == CONN_TCP ? "TCP accept" : kind == CONN_UDS ? "UDS stream accept" : "UDS seqpacket accept");
             }
+            break;
         }
-        
-        if (parsed == 1) {
-            quantity = 1;
+        taken++;
+        if (reject_over_limit(new_fd)) continue;
+
+        uint64_t key;
+        uint32_t peer;
+        struct sockaddr_in *in = (struct sockaddr_in*)&client_addr;
+        if (kind == CONN_TCP) {
+            key = rate_key_for_address(in, addrlen, 0);
+            peer = in->sin_addr.s_addr;
+        } else {
+            // The uid is the low half of the source key
+            key = rate_key_for_uid(new_fd);
+            peer = (uint32_t)key;
         }
-        
-        // Strict quantity validation
-        if (quantity == 0 || quantity > MAX_ATOMS) {
-            char error_msg[BUFFER_SIZE];
-            snprintf(error_msg, sizeof(error_msg), "ERROR: Invalid quantity %llu (must be 1-%llu).\n", quantity, MAX_ATOMS);
-            sendto(req_fd, error_msg, strlen(error_msg), 0, (struct sockaddr*)client_addr, addrlen);
-            printf("Invalid quantity for %s: %llu\n", molecule, quantity);
-            return;
+        new_fd = conn_open(new_fd, kind, peer);
+        if (new_fd == -1) continue;
+        rate_attach(new_fd, key);
+        stream_client_count++;
+        if (config.log_level >= LOG_INFO) {
+            if (kind == CONN_TCP)
+                printf("New TCP connection from %s on socket %d\n", inet_ntoa(in->sin_addr), new_fd);
+            else
+                printf("New %s connection on socket %d\n", kind == CONN_UDS ? "UDS stream" : "UDS seqpacket", new_fd);
         }
-        
-        if (can_deliver(molecule, quantity, carbon, oxygen, hydrogen)) {
-            char success_msg[BUFFER_SIZE];
-            if (quantity == 1) {
-                snprintf(success_msg, sizeof(success_msg), 
-                        "Molecule delivered successfully.\n");
-            } else {
-                snprintf(success_msg, sizeof(success_msg), 
-                        "Delivered %llu %s successfully.\n", quantity, molecule);
-            }
-            
-            sendto(req_fd, success_msg, strlen(success_msg), 0, (struct sockaddr*)client_addr, addrlen);
-            printf("Delivered %llu %s.\n", quantity, molecule);
-            
-            printf("Current warehouse status:\n");
-            printf("CARBON: %llu\n", *carbon);
-            printf("OXYGEN: %llu\n", *oxygen);
-            printf("HYDROGEN: %llu\n", *hydrogen);
-        } else {
-            char fail_msg[] = "Not enough atoms for this molecule.\n";
-            sendto(req_fd, fail_msg, strlen(fail_msg), 0, (struct sockaddr*)client_addr, addrlen);
-            printf("Failed to deliver %llu %s: insufficient atoms.\n", quantity, molecule);
+
+        if (config.welcome) {
+            size_t len;
+            const char *welcome = welcome_message(kind, carbon, oxygen, hydrogen, &len);
+            conn_send(new_fd, welcome, len);
         }
-    } else {
-        char error_msg[] = "Invalid DELIVER command.\n";
-        sendto(req_fd, error_msg, strlen(error_msg), 0, (struct sockaddr*)client_addr, addrlen);
-        printf("Invalid request command.\n");
     }
+    accepted_total += (unsigned long long)taken;
+    if (taken > accept_max_batch) accept_max_batch = taken;
+    if (taken == ACCEPT_BATCH) accept_batches_full++;
 }
 
 int main(int argc, char *argv[]) {
     // Default values
     int tcp_port = -1, udp_port = -1;
-    char *stream_path = NULL, *datagram_path = NULL;
+    char *stream_path = NULL, *datagram_path = NULL, *seqpacket_path = NULL;
     unsigned long long carbon = 0, oxygen = 0, hydrogen = 0;
-    int timeout_seconds = 0;
+    int repl_port = -1;
+    const char *feed_spec = NULL;
     
     // Long options
     static struct option long_options[] = {
@@ -490,18 +4943,38 @@ int main(int argc, char *argv[]) {
         {"udp-port", required_argument, 0, 'U'},
         {"stream-path", required_argument, 0, 's'},
         {"datagram-path", required_argument, 0, 'd'},
+        {"seqpacket-path", required_argument, 0, 'S'},
         {"save-file", required_argument, 0, 'f'},
         {"carbon", required_argument, 0, 'c'},
         {"oxygen", required_argument, 0, 'o'},
         {"hydrogen", required_argument, 0, 'H'},
         {"timeout", required_argument, 0, 't'},
+        {"bgsave-changes", required_argument, 0, 'b'},
+        {"bgsave-interval", required_argument, 0, 'i'},
+        {"repl-port", required_argument, 0, 'r'},
+        {"repl-path", required_argument, 0, 'R'},
+        {"follow", required_argument, 0, 'F'},
+        {"node-id", required_argument, 0, 'N'},
+        {"peer", required_argument, 0, 'P'},
+        {"shard", required_argument, 0, 'A'},
+        {"shm-poll", required_argument, 0, 'p'},
+        {"busy-poll", required_argument, 0, 'L'},
+        {"gen-workers", required_argument, 0, 'w'},
+        {"view", required_argument, 0, 'v'},
+        {"watch-interval", required_argument, 0, 'W'},
+        {"multicast", required_argument, 0, 'M'},
+        {"feed-rate", required_argument, 0, 'E'},
+        {"feed-interface", required_argument, 0, 'I'},
+        {"admin-path", required_argument, 0, 'a'},
+        {"backlog", required_argument, 0, 'B'},
+        {"config", required_argument, 0, 'C'},
         {"help", no_argument, 0, '?'},
         {0, 0, 0, 0}
     };
     
     // Parse arguments
     int opt;
-    while ((opt = getopt_long(argc, argv, "T:U:s:d:f:c:o:H:t:", long_options, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "T:U:s:d:S:f:c:o:H:t:b:i:r:R:F:N:P:A:p:L:w:v:W:M:E:I:a:B:C:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'T':
                 tcp_port = atoi(optarg);
@@ -523,6 +4996,9 @@ int main(int argc, char *argv[]) {
             case 'd':
                 datagram_path = strdup(optarg);
                 break;
+            case 'S':
+                seqpacket_path = strdup(optarg);
+                break;
             case 'f':
                 save_file_path = strdup(optarg);
                 break;
@@ -548,12 +5024,128 @@ int main(int argc, char *argv[]) {
                 }
                 break;
             case 't':
-                timeout_seconds = atoi(optarg);
-                if (timeout_seconds <= 0) {
+                base_config.timeout_seconds = atoi(optarg);
+                if (base_config.timeout_seconds <= 0) {
                     fprintf(stderr, "Error: Invalid timeout: %s\n", optarg);
                     exit(EXIT_FAILURE);
                 }
                 break;
+            case 'b':
+                base_config.bgsave_change_threshold = strtoull(optarg, NULL, 10);
+                if (base_config.bgsave_change_threshold == 0) {
+                    fprintf(stderr, "Error: Invalid BGSAVE change count: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'i':
+                base_config.bgsave_interval = atoi(optarg);
+                if (base_config.bgsave_interval <= 0) {
+                    fprintf(stderr, "Error: Invalid BGSAVE interval: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'r':
+                repl_port = atoi(optarg);
+                if (repl_port <= 0 || repl_port > 65535) {
+                    fprintf(stderr, "Error: Invalid replication port: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'R':
+                repl_path = strdup(optarg);
+                break;
+            case 'F':
+                leader_spec = strdup(optarg);
+                break;
+            case 'N':
+                node_id = atoi(optarg);
+                if (node_id <= 0 || node_id > 255) {
+                    fprintf(stderr, "Error: Invalid node id: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'P':
+                if (cluster_size >= RAFT_MAX_PEERS) {
+                    fprintf(stderr, "Error: At most %d cluster peers are supported\n", RAFT_MAX_PEERS);
+                    exit(EXIT_FAILURE);
+                }
+                if (raft_parse_peer(optarg, &cluster_peers[cluster_size]) != 0) {
+                    fprintf(stderr, "Error: Invalid peer (expected ID=HOST:RAFT_PORT:TCP_PORT[:UDP_PORT]): %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                cluster_size++;
+                break;
+            case 'A':
+                for (int k = 0; k < 3; k++) {
+                    if (strcmp(optarg, atom_names[k]) == 0) shard_atom = k;
+                }
+                if (shard_atom == -1) {
+                    fprintf(stderr, "Error: Invalid shard atom (CARBON, OXYGEN or HYDROGEN): %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'p':
+                shm_poll_us = atoi(optarg);
+                if (shm_poll_us <= 0 || shm_poll_us > 1000000) {
+                    fprintf(stderr, "Error: Invalid shared-memory poll time: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'L': {
+                int fields = sscanf(optarg, "%d:%d", &busy_poll_core, &busy_poll_usec);
+                if (fields < 1 || busy_poll_core < 0 || busy_poll_core >= CPU_SETSIZE ||
+                    busy_poll_usec < 0 || busy_poll_usec > 1000000) {
+                    fprintf(stderr, "Error: Invalid busy-poll setting: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            case 'w': {
+                char *end;
+                long workers = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || workers < 0 || workers > GEN_WORKERS_MAX) {
+                    fprintf(stderr, "Error: Invalid GEN worker count (0-%d): %s\n", GEN_WORKERS_MAX, optarg);
+                    exit(EXIT_FAILURE);
+                }
+                gen_worker_count = (int)workers;
+                break;
+            }
+            case 'v':
+                view_path = strdup(optarg);
+                break;
+            case 'B':
+                base_config.backlog = atoi(optarg);
+                if (base_config.backlog <= 0 || base_config.backlog > 65535) {
+                    fprintf(stderr, "Error: Invalid backlog: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'W':
+                base_config.watch_interval_ms = atoi(optarg);
+                if (base_config.watch_interval_ms <= 0) {
+                    fprintf(stderr, "Error: Invalid watch interval: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'M':
+                feed_spec = optarg;
+                break;
+            case 'E':
+                feed_rate_hz = atoi(optarg);
+                if (feed_rate_hz <= 0 || feed_rate_hz > 1000) {
+                    fprintf(stderr, "Error: Invalid feed rate (1-1000): %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'I':
+                feed_interface = optarg;
+                break;
+            case 'a':
+                admin_path = strdup(optarg);
+                break;
+            case 'C':
+                config_path = strdup(optarg);
+                break;
             case '?':
             default:
                 show_usage(argv[0]);
@@ -561,12 +5153,41 @@ int main(int argc, char *argv[]) {
         }
     }
     
+    // Cluster mode: the node's client ports default to its own peer entry
+    cluster_mode = node_id != -1 || cluster_size > 0;
+
+    // Tunables: flags first, then the config file
+    config = base_config;
+    if (config_path != NULL) {
+        char err[2 * BUFFER_SIZE];
+        if (load_config(config_path, &config, err, sizeof(err)) == -1) {
+            fprintf(stderr, "Error: %s\n", err);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (cluster_mode) {
+        const raft_peer_t *self = NULL;
+        for (int k = 0; k < cluster_size; k++) {
+            if (cluster_peers[k].id == node_id) self = &cluster_peers[k];
+        }
+        if (self == NULL) {
+            fprintf(stderr, "Error: Cluster mode needs -N and a -P entry for this node\n");
+            exit(EXIT_FAILURE);
+        }
+        if (leader_spec != NULL || shard_atom != -1 || config.bgsave_change_threshold > 0 || config.bgsave_interval > 0) {
+            fprintf(stderr, "Error: -F, -A and BGSAVE options cannot be used in cluster mode\n");
+            exit(EXIT_FAILURE);
+        }
+        if (tcp_port == -1) tcp_port = self->tcp_port;
+        if (udp_port == -1 && self->udp_port != -1) udp_port = self->udp_port;
+    }
+
     // Check that we have either ports or UDS paths
     int has_network = (tcp_port != -1) || (udp_port != -1);
-    int has_uds = (stream_path != NULL) || (datagram_path != NULL);
+    int has_uds = (stream_path != NULL) || (datagram_path != NULL) || (seqpacket_path != NULL);
     
     if (!has_network && !has_uds) {
-        fprintf(stderr, "Error: Must specify either network ports (-T/-U) or UDS paths (-s/-d)\n");
+        fprintf(stderr, "Error: Must specify either network ports (-T/-U) or UDS paths (-s/-d/-S)\n");
         show_usage(argv[0]);
         exit(EXIT_FAILURE);
     }
@@ -576,8 +5197,25 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
     
+    // Checksums are used by the save file, the journal and replication
+    crc32c_init();
+
+    // Cluster nodes rebuild the inventory by replaying the Raft log, which
+    // is stored next to the save file path
+    if (cluster_mode) {
+        cluster_inventory[0] = &carbon;
+        cluster_inventory[1] = &oxygen;
+        cluster_inventory[2] = &hydrogen;
+        pending_replies = calloc(MAX_PENDING_REPLIES, sizeof(*pending_replies));
+        if (pending_replies == NULL ||
+            raft_init(node_id, cluster_peers, cluster_size, save_file_path, cluster_apply, cluster_role_change) != 0) {
+            fprintf(stderr, "Error: Failed to start cluster node\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
     // Initialize inventory from file if save_file_path is provided
-    if (save_file_path != NULL) {
+    if (save_file_path != NULL && !cluster_mode) {
         if (init_inventory_file(save_file_path, &carbon, &oxygen, &hydrogen) != 0) {
             fprintf(stderr, "Error: Failed to initialize inventory file\n");
             exit(EXIT_FAILURE);
@@ -585,26 +5223,43 @@ int main(int argc, char *argv[]) {
         
         // Register cleanup function
         atexit(cleanup_inventory);
+
+        // Persist in the background so request handling never waits on disk
+        if (start_persistence_thread() != 0) {
+            fprintf(stderr, "Error: Failed to start background persistence\n");
+            exit(EXIT_FAILURE);
+        }
     }
     
-    // Set timeout if needed
-    if (timeout_seconds > 0) {
-        signal(SIGALRM, timeout_handler);
-        alarm(timeout_seconds);
-        printf("Server will timeout after %d seconds of inactivity\n", timeout_seconds);
+    if (start_gen_workers() != 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Set timeout if needed; a reload can turn it on later
+    signal(SIGALRM, timeout_handler);
+    if (config.timeout_seconds > 0) {
+        alarm(config.timeout_seconds);
+        printf("Server will timeout after %d seconds of inactivity\n", config.timeout_seconds);
     }
+    signal(SIGHUP, hangup_handler);
     
     printf("Starting Persistent Warehouse server with:\n");
     if (tcp_port != -1) printf("TCP port: %d\n", tcp_port);
     if (udp_port != -1) printf("UDP port: %d\n", udp_port);
     if (stream_path) printf("UDS stream path: %s\n", stream_path);
     if (datagram_path) printf("UDS datagram path: %s\n", datagram_path);
+    if (seqpacket_path) printf("UDS seqpacket path: %s\n", seqpacket_path);
     if (save_file_path) printf("Save file: %s\n", save_file_path);
+    if (repl_port != -1) printf("Replication port: %d\n", repl_port);
+    if (repl_path) printf("Replication path: %s\n", repl_path);
+    if (leader_spec) printf("Following leader: %s (read-only)\n", leader_spec);
+    if (cluster_mode) printf("Cluster node %d of %d\n", node_id, cluster_size);
+    if (shard_atom != -1) printf("Shard for %s only\n", atom_names[shard_atom]);
     printf("Initial atoms - Carbon: %llu, Oxygen: %llu, Hydrogen: %llu\n", carbon, oxygen, hydrogen);
     
     // Initialize sockets
-    int tcp_fd = -1, udp_fd = -1, uds_stream_fd = -1, uds_datagram_fd = -1;
-    int new_fd, fdmax = STDIN_FILENO;
+    int tcp_fd = -1, udp_fd = -1, uds_stream_fd = -1, uds_datagram_fd = -1, uds_seqpacket_fd = -1;
+    int fdmax = STDIN_FILENO;
     fd_set master_set, read_fds;
     
     // TCP socket
@@ -615,6 +5270,10 @@ int main(int argc, char *argv[]) {
         
         int reuse = 1;
         setsockopt(tcp_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        // Replies are sent in pieces, don't let Nagle hold them back; accepted
+        // sockets inherit this, which saves a setsockopt per connection
+        int nodelay = 1;
+        setsockopt(tcp_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
         
         tcp_addr.sin_family = AF_INET;
         tcp_addr.sin_addr.s_addr = INADDR_ANY;
@@ -624,7 +5283,7 @@ int main(int argc, char *argv[]) {
             perror("TCP bind");
             exit(1);
         }
-        if (listen(tcp_fd, MAX_CLIENTS) < 0) {
+        if (listen(tcp_fd, config.backlog) < 0 || set_nonblocking(tcp_fd) == -1) {
             perror("TCP listen");
             exit(1);
         }
@@ -645,6 +5304,9 @@ int main(int argc, char *argv[]) {
             perror("UDP bind");
             exit(1);
         }
+        // Kernel receive times give the queue age of every request
+        int on = 1;
+        setsockopt(udp_fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
         if (udp_fd > fdmax) fdmax = udp_fd;
     }
     
@@ -664,13 +5326,36 @@ int main(int argc, char *argv[]) {
             perror("UDS stream bind");
             exit(1);
         }
-        if (listen(uds_stream_fd, MAX_CLIENTS) < 0) {
+        if (listen(uds_stream_fd, config.backlog) < 0 || set_nonblocking(uds_stream_fd) == -1) {
             perror("UDS stream listen");
             exit(1);
         }
         if (uds_stream_fd > fdmax) fdmax = uds_stream_fd;
     }
     
+    // UDS seqpacket socket
+    if (seqpacket_path) {
+        struct sockaddr_un seqpacket_addr;
+        unlink(seqpacket_path); // Remove existing socket file
+        
+        uds_seqpacket_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+        if (uds_seqpacket_fd < 0) { perror("UDS seqpacket socket error"); exit(1); }
+        
+        memset(&seqpacket_addr, 0, sizeof(seqpacket_addr));
+        seqpacket_addr.sun_family = AF_UNIX;
+        strncpy(seqpacket_addr.sun_path, seqpacket_path, sizeof(seqpacket_addr.sun_path) - 1);
+        
+        if (bind(uds_seqpacket_fd, (struct sockaddr*)&seqpacket_addr, sizeof(seqpacket_addr)) < 0) {
+            perror("UDS seqpacket bind");
+            exit(1);
+        }
+        if (listen(uds_seqpacket_fd, config.backlog) < 0 || set_nonblocking(uds_seqpacket_fd) == -1) {
+            perror("UDS seqpacket listen");
+            exit(1);
+        }
+        if (uds_seqpacket_fd > fdmax) fdmax = uds_seqpacket_fd;
+    }
+    
     // UDS datagram socket
     if (datagram_path) {
         struct sockaddr_un datagram_addr;
@@ -687,20 +5372,138 @@ int main(int argc, char *argv[]) {
             perror("UDS datagram bind");
             exit(1);
         }
+        int on = 1;
+        setsockopt(uds_datagram_fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
         if (uds_datagram_fd > fdmax) fdmax = uds_datagram_fd;
     }
     
+    // Replication listeners for followers
+    if (repl_port != -1) {
+        struct sockaddr_in repl_addr;
+        repl_tcp_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (repl_tcp_fd < 0) { perror("Replication socket error"); exit(1); }
+
+        int reuse = 1;
+        setsockopt(repl_tcp_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+        memset(&repl_addr, 0, sizeof(repl_addr));
+        repl_addr.sin_family = AF_INET;
+        repl_addr.sin_addr.s_addr = INADDR_ANY;
+        repl_addr.sin_port = htons(repl_port);
+
+        if (bind(repl_tcp_fd, (struct sockaddr*)&repl_addr, sizeof(repl_addr)) < 0) {
+            perror("Replication bind");
+            exit(1);
+        }
+        if (listen(repl_tcp_fd, MAX_FOLLOWERS) < 0) {
+            perror("Replication listen");
+            exit(1);
+        }
+        if (repl_tcp_fd > fdmax) fdmax = repl_tcp_fd;
+    }
+
+    if (repl_path) {
+        struct sockaddr_un repl_addr;
+        unlink(repl_path); // Remove existing socket file
+
+        repl_uds_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (repl_uds_fd < 0) { perror("Replication UDS socket error"); exit(1); }
+
+        memset(&repl_addr, 0, sizeof(repl_addr));
+        repl_addr.sun_family = AF_UNIX;
+        strncpy(repl_addr.sun_path, repl_path, sizeof(repl_addr.sun_path) - 1);
+
+        if (bind(repl_uds_fd, (struct sockaddr*)&repl_addr, sizeof(repl_addr)) < 0) {
+            perror("Replication UDS bind");
+            exit(1);
+        }
+        if (listen(repl_uds_fd, MAX_FOLLOWERS) < 0) {
+            perror("Replication UDS listen");
+            exit(1);
+        }
+        if (repl_uds_fd > fdmax) fdmax = repl_uds_fd;
+    }
+
+    if (conn_table_init() == -1) {
+        exit(1);
+    }
+
+    if (feed_spec != NULL && open_feed(feed_spec) == -1) {
+        exit(1);
+    }
+
+    // Admin control socket
+    int admin_fd = -1;
+    if (admin_path) {
+        struct sockaddr_un admin_addr;
+        unlink(admin_path);
+
+        admin_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (admin_fd < 0) { perror("Admin socket error"); exit(1); }
+
+        memset(&admin_addr, 0, sizeof(admin_addr));
+        admin_addr.sun_family = AF_UNIX;
+        strncpy(admin_addr.sun_path, admin_path, sizeof(admin_addr.sun_path) - 1);
+
+        if (bind(admin_fd, (struct sockaddr*)&admin_addr, sizeof(admin_addr)) < 0) {
+            perror("Admin bind");
+            exit(1);
+        }
+        if (listen(admin_fd, MAX_CLIENTS) < 0) {
+            perror("Admin listen");
+            exit(1);
+        }
+        if (admin_fd > fdmax) fdmax = admin_fd;
+    }
+
+    // Local monitors map the view instead of querying the server
+    if (view_path != NULL) {
+        if (open_view(view_path) == -1) {
+            exit(1);
+        }
+        update_view(carbon, oxygen, hydrogen);
+    }
+
+    // Followers and the leader must not be killed by a peer closing mid-send
+    signal(SIGPIPE, SIG_IGN);
+
     // Setup select
     FD_ZERO(&master_set);
     if (tcp_fd != -1) FD_SET(tcp_fd, &master_set);
     if (udp_fd != -1) FD_SET(udp_fd, &master_set);
     if (uds_stream_fd != -1) FD_SET(uds_stream_fd, &master_set);
+    if (uds_seqpacket_fd != -1) FD_SET(uds_seqpacket_fd, &master_set);
     if (uds_datagram_fd != -1) FD_SET(uds_datagram_fd, &master_set);
+    if (repl_tcp_fd != -1) FD_SET(repl_tcp_fd, &master_set);
+    if (repl_uds_fd != -1) FD_SET(repl_uds_fd, &master_set);
+    if (admin_fd != -1) FD_SET(admin_fd, &master_set);
+    FD_SET(conn_epoll_fd, &master_set);
+    if (conn_epoll_fd > fdmax) fdmax = conn_epoll_fd;
+    if (gen_done_fd != -1) {
+        FD_SET(gen_done_fd, &master_set);
+        if (gen_done_fd > fdmax) fdmax = gen_done_fd;
+    }
     FD_SET(STDIN_FILENO, &master_set);
+    set_nonblocking(STDIN_FILENO);
     
     printf("Server ready. Type 'shutdown' to stop.\n");
     printf("Available drink commands: GEN SOFT DRINK, GEN VODKA, GEN CHAMPAGNE\n");
+    printf("Type 'STATS' to show persistence progress and lag, 'BGSAVE' to fork a snapshot.\n");
+    if (admin_path) printf("Admin socket: %s\n", admin_path);
+    bgsave_last_time = time(NULL);
     
+    int shm_active = 0;                 // shared-memory clients sent work last iteration
+
+    if (busy_poll_core != -1) {
+        int busy_fds[2] = {tcp_fd, udp_fd};
+        if (start_busy_poll(busy_fds, 2) == -1) {
+            exit(1);
+        }
+    }
+
+    int admin_action = ADMIN_NONE;
+    unsigned long long applied_generation = config_generation;
+
     // Main loop
     while (1) {
         // Check timeout
@@ -708,61 +5511,171 @@ int main(int argc, char *argv[]) {
             printf("Timeout occurred. Server shutting down.\n");
             break;
         }
+
+        if (reload_requested) {
+            char msg[2 * BUFFER_SIZE];
+            reload_requested = 0;
+            if (reload_config(msg, sizeof(msg)) == 0) {
+                printf("SIGHUP: %s\n", msg);
+            } else {
+                fprintf(stderr, "SIGHUP: %s, keeping the current configuration\n", msg);
+            }
+        }
+        // Tunables that live in the kernel follow a reload here
+        if (applied_generation != config_generation) {
+            applied_generation = config_generation;
+            if (tcp_fd != -1 && listen(tcp_fd, config.backlog) < 0) perror("TCP listen");
+            if (uds_stream_fd != -1 && listen(uds_stream_fd, config.backlog) < 0) perror("UDS stream listen");
+            if (uds_seqpacket_fd != -1 && listen(uds_seqpacket_fd, config.backlog) < 0) perror("UDS seqpacket listen");
+            alarm(config.timeout_seconds);
+        }
         
+        // Followers (re)connect to their leader in the background
+        if (leader_spec != NULL && leader_fd == -1 && time(NULL) >= leader_retry_time) {
+            connect_to_leader();
+        }
+
+        // Shared-memory clients: spin while they are busy, else sleep on their eventfds
+        if (shm_poll_us > 0 && shm_active) {
+            shm_active = shm_busy_poll(&carbon, &oxygen, &hydrogen);
+        }
+
         read_fds = master_set;
-        if (select(fdmax + 1, &read_fds, NULL, NULL, NULL) == -1) {
+        int select_max = fdmax;
+        if (bgsave_pipe_fd != -1) {
+            FD_SET(bgsave_pipe_fd, &read_fds);
+            if (bgsave_pipe_fd > select_max) select_max = bgsave_pipe_fd;
+        }
+
+        fd_set write_fds;
+        FD_ZERO(&write_fds);
+        for (int k = 0; k < follower_count; k++) {
+            if (followers[k].fd >= 0 && followers[k].out_off < followers[k].out_len) {
+                FD_SET(followers[k].fd, &write_fds);
+                if (followers[k].fd > select_max) select_max = followers[k].fd;
+            }
+        }
+        if (leader_fd != -1 && leader_connecting) {
+            FD_SET(leader_fd, &write_fds);
+            if (leader_fd > select_max) select_max = leader_fd;
+        }
+        if (cluster_mode) {
+            raft_fill_fds(&read_fds, &write_fds, &select_max);
+        }
+        int shm_pending = 0;
+        if (shm_client_count > 0) {
+            shm_fill_fds(&read_fds, &select_max);
+            shm_pending = (shm_poll_us > 0 && shm_active) || shm_arm();
+        }
+
+        // Wake up periodically only when a timer (BGSAVE, leader retry, Raft) is pending
+        struct timeval tick = {1, 0};
+        int need_tick = config.bgsave_interval > 0 || (leader_spec != NULL && leader_fd == -1);
+        if (cluster_mode) {
+            int raft_ms = raft_timeout_ms();
+            if (!need_tick || raft_ms < 1000) {
+                tick.tv_sec = raft_ms / 1000;
+                tick.tv_usec = (raft_ms % 1000) * 1000;
+            }
+            need_tick = 1;
+        }
+        // WATCH batches and feed packets are due at their own times
+        int due_ms = watch_timeout_ms();
+        if (feed_fd != -1) {
+            int feed_ms = feed_timeout_ms();
+            if (due_ms < 0 || feed_ms < due_ms) due_ms = feed_ms;
+        }
+        int waiter_ms = waiter_timeout_ms();
+        if (waiter_ms >= 0 && (due_ms < 0 || waiter_ms < due_ms)) due_ms = waiter_ms;
+        if (due_ms >= 0 && (!need_tick || due_ms < tick.tv_sec * 1000 + tick.tv_usec / 1000)) {
+            tick.tv_sec = due_ms / 1000;
+            tick.tv_usec = (due_ms % 1000) * 1000;
+            need_tick = 1;
+        }
+        if (shm_pending || busy_poll_core != -1) {
+            tick.tv_sec = 0;
+            tick.tv_usec = 0;
+            need_tick = 1;
+        }
+        int ready = select(select_max + 1, &read_fds, &write_fds, NULL, need_tick ? &tick : NULL);
+        if (ready == -1) {
             if (timeout_occurred) break;
+            if (errno == EINTR) continue;
             perror("select");
             exit(1);
         }
+        if (busy_poll_core != -1) {
+            busy_spins++;
+            if (ready == 0) busy_idle_spins++;
+        }
+
+        if (cluster_mode) {
+            raft_handle_fds(&read_fds, &write_fds);
+        }
+        if (shm_client_count > 0) {
+            shm_active = shm_handle_fds(&read_fds, &carbon, &oxygen, &hydrogen);
+        }
         
+        if (bgsave_pipe_fd != -1 && FD_ISSET(bgsave_pipe_fd, &read_fds)) {
+            FD_CLR(bgsave_pipe_fd, &read_fds);
+            finish_bgsave();
+            ready--;
+        }
+
         // Reset alarm on activity
-        if (timeout_seconds > 0) {
-            alarm(timeout_seconds);
+        if (config.timeout_seconds > 0 && ready > 0) {
+            alarm(config.timeout_seconds);
+        }
+
+        // Finish a pending leader connection
+        if (leader_fd != -1 && leader_connecting && FD_ISSET(leader_fd, &write_fds)) {
+            int err = 0;
+            socklen_t errlen = sizeof(err);
+            if (getsockopt(leader_fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == -1 || err != 0) {
+                disconnect_leader(&master_set);
+            } else {
+                leader_connecting = 0;
+                FD_SET(leader_fd, &master_set);
+                if (leader_fd > fdmax) fdmax = leader_fd;
+                printf("Replication: connected to leader %s\n", leader_spec);
+            }
+        }
+
+        // Resume sends to followers that were backed up
+        for (int k = 0; k < follower_count; k++) {
+            if (followers[k].fd >= 0 && FD_ISSET(followers[k].fd, &write_fds)) {
+                service_follower_write(&followers[k], carbon, oxygen, hydrogen);
+            }
         }
         
         for (int i = 0; i <= fdmax; i++) {
             if (FD_ISSET(i, &read_fds)) {
-                if (i == tcp_fd || i == uds_stream_fd) {
-                    // New stream connection (TCP or UDS)
-                    if (i == tcp_fd) {
-                        struct sockaddr_in client_addr;
-                        socklen_t addrlen = sizeof(client_addr);
-                        new_fd = accept(tcp_fd, (struct sockaddr*)&client_addr, &addrlen);
-                        if (new_fd == -1) {
-                            perror("TCP accept");
-                        } else {
-                            FD_SET(new_fd, &master_set);
-                            if (new_fd > fdmax) fdmax = new_fd;
-                            printf("New TCP connection from %s on socket %d\n",
-                                   inet_ntoa(client_addr.sin_addr), new_fd);
-                            
-                            // Send welcome message
-                            char welcome_msg[BUFFER_SIZE];
-                            snprintf(welcome_msg, sizeof(welcome_msg), 
-                                    "Connected to Persistent Warehouse Server (TCP). Current inventory: C=%llu, O=%llu, H=%llu\n", 
-                                    carbon, oxygen, hydrogen);
-                            send(new_fd, welcome_msg, strlen(welcome_msg), 0);
-                        }
+                if (i == repl_tcp_fd || i == repl_uds_fd) {
+                    // New follower
+                    int follower_fd = accept(i, NULL, NULL);
+                    if (follower_fd == -1) {
+                        perror("Replication accept");
                     } else {
-                        struct sockaddr_un client_addr;
-                        socklen_t addrlen = sizeof(client_addr);
-                        new_fd = accept(uds_stream_fd, (struct sockaddr*)&client_addr, &addrlen);
-                        if (new_fd == -1) {
-                            perror("UDS stream accept");
-                        } else {
-                            FD_SET(new_fd, &master_set);
-                            if (new_fd > fdmax) fdmax = new_fd;
-                            printf("New UDS stream connection on socket %d\n", new_fd);
-                            
-                            // Send welcome message
-                            char welcome_msg[BUFFER_SIZE];
-                            snprintf(welcome_msg, sizeof(welcome_msg), 
-                                    "Connected to Persistent Warehouse Server (UDS). Current inventory: C=%llu, O=%llu, H=%llu\n", 
-                                    carbon, oxygen, hydrogen);
-                            send(new_fd, welcome_msg, strlen(welcome_msg), 0);
-                        }
+                        add_follower(follower_fd, i == repl_uds_fd, &master_set, &fdmax,
+                                     carbon, oxygen, hydrogen);
+                    }
+                } else if (find_follower(i) != -1) {
+                    // Followers only send to hang up
+                    char discard[BUFFER_SIZE];
+                    ssize_t nbytes = recv(i, discard, sizeof(discard), MSG_DONTWAIT);
+                    if (nbytes == 0 || (nbytes < 0 && errno != EAGAIN && errno != EINTR)) {
+                        followers[find_follower(i)].fd = -i - 1;
+                    }
+                } else if (i == leader_fd && !leader_connecting) {
+                    if (read_from_leader(&carbon, &oxygen, &hydrogen) == -1) {
+                        disconnect_leader(&master_set);
                     }
+                } else if (i == tcp_fd) {
+                    accept_clients(tcp_fd, CONN_TCP, carbon, oxygen, hydrogen);
+                } else if (i == uds_stream_fd) {
+                    accept_clients(uds_stream_fd, CONN_UDS, carbon, oxygen, hydrogen);
+                } else if (i == uds_seqpacket_fd) {
+                    accept_clients(uds_seqpacket_fd, CONN_SEQPACKET, carbon, oxygen, hydrogen);
                 } else if (i == udp_fd || i == uds_datagram_fd) {
                     // Handle datagram request (UDP or UDS)
                     char buffer[BUFFER_SIZE];
@@ -770,62 +5683,120 @@ int main(int argc, char *argv[]) {
                     if (i == udp_fd) {
                         struct sockaddr_in client_addr;
                         socklen_t addrlen = sizeof(client_addr);
-                        int nbytes = recvfrom(udp_fd, buffer, sizeof(buffer) - 1, 0,
-                                              (struct sockaddr*)&client_addr, &addrlen);
-                        if (nbytes < 0) {
+                        unsigned long long received_ns;
+                        if (recv_datagram(udp_fd, buffer, sizeof(buffer), &client_addr, &addrlen, &received_ns) < 0) {
                             perror("UDP recvfrom");
                             continue;
                         }
-                        buffer[nbytes] = '\0';
-                        handle_molecule_request(buffer, udp_fd, &client_addr, addrlen, 
-                                              &carbon, &oxygen, &hydrogen, 0);
+                        handle_molecule_request(buffer, udp_fd, &client_addr, addrlen,
+                                              &carbon, &oxygen, &hydrogen, 0, received_ns);
                     } else {
                         struct sockaddr_un client_addr;
                         socklen_t addrlen = sizeof(client_addr);
-                        int nbytes = recvfrom(uds_datagram_fd, buffer, sizeof(buffer) - 1, 0,
-                                              (struct sockaddr*)&client_addr, &addrlen);
-                        if (nbytes < 0) {
+                        unsigned long long received_ns;
+                        if (recv_datagram(uds_datagram_fd, buffer, sizeof(buffer), &client_addr, &addrlen, &received_ns) < 0) {
                             perror("UDS datagram recvfrom");
                             continue;
                         }
-                        buffer[nbytes] = '\0';
-                        handle_molecule_request(buffer, uds_datagram_fd, &client_addr, addrlen, 
-                                              &carbon, &oxygen, &hydrogen, 1);
+                        handle_molecule_request(buffer, uds_datagram_fd, &client_addr, addrlen,
+                                              &carbon, &oxygen, &hydrogen, 1, received_ns);
                     }
                 } else if (i == STDIN_FILENO) {
-                    // Handle admin input
-                    char input[BUFFER_SIZE];
-                    if (fgets(input, sizeof(input), stdin)) {
-                        if (strncmp(input, "shutdown", 8) == 0) {
-                            printf("Shutdown command received. Notifying clients...\n");
-                            for (int j = 0; j <= fdmax; j++) {
-                                if (FD_ISSET(j, &master_set) && j != tcp_fd && j != udp_fd && 
-                                    j != uds_stream_fd && j != uds_datagram_fd && j != STDIN_FILENO) {
-                                    send(j, "Server shutting down.\n", strlen("Server shutting down.\n"), 0);
-                                    close(j);
-                                }
-                            }
-                            goto shutdown_cleanup; // Clean exit from loop
-                        } else {
-                            process_drink_command(input, carbon, oxygen, hydrogen);
-                        }
+                    // Handle admin input, complete lines only
+                    int action = read_stdin_commands(carbon, oxygen, hydrogen);
+                    if (action == -1) {
+                        FD_CLR(STDIN_FILENO, &master_set);
+                    } else if (action > admin_action) {
+                        admin_action = action;
                     }
-                } else {
-                    // Handle stream client data (TCP or UDS)
-                    char buffer[BUFFER_SIZE];
-                    int nbytes = recv(i, buffer, sizeof(buffer) - 1, 0);
-                    if (nbytes <= 0) {
-                        if (nbytes == 0) printf("Socket %d hung up\n", i);
-                        else perror("recv");
-                        close(i);
-                        FD_CLR(i, &master_set);
+                } else if (i == admin_fd) {
+                    int ctl_fd = accept4(admin_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+                    if (ctl_fd == -1) {
+                        perror("Admin accept");
                     } else {
-                        buffer[nbytes] = '\0';
-                        process_command(i, buffer, &carbon, &oxygen, &hydrogen);
+                        conn_open(ctl_fd, CONN_ADMIN, 0);
+                    }
+                } else if (i == gen_done_fd) {
+                    int action = finish_gen_jobs(carbon, oxygen, hydrogen);
+                    if (action > admin_action) admin_action = action;
+                } else if (i == conn_epoll_fd) {
+                    // Client connections: only the ready ones are visited
+                    int count = epoll_wait(conn_epoll_fd, conn_events, CONN_EVENT_BATCH, 0);
+                    for (int k = 0; k < count; k++) {
+                        int fd = conn_events[k].data.fd;
+                        if ((conn_events[k].events & EPOLLOUT) && flush_conn_output(fd) == -1) {
+                            close_stream_client(fd);
+                            continue;
+                        }
+                        if (conn_events[k].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                            int action = service_conn(fd, &carbon, &oxygen, &hydrogen);
+                            if (action > admin_action) admin_action = action;
+                        }
                     }
                 }
             }
         }
+
+        reap_followers(&master_set);
+        maybe_start_bgsave(carbon, oxygen, hydrogen);
+
+        // Draining: stop accepting clients, exit once the last one has left
+        if (admin_action == ADMIN_DRAIN && !draining) {
+            printf("Draining: no new connections, %d client(s) left.\n", stream_client_count);
+            draining = 1;
+            if (tcp_fd != -1) {
+                FD_CLR(tcp_fd, &master_set);
+                close(tcp_fd);
+                tcp_fd = -1;
+            }
+            if (uds_stream_fd != -1) {
+                FD_CLR(uds_stream_fd, &master_set);
+                close(uds_stream_fd);
+                uds_stream_fd = -1;
+                if (stream_path) unlink(stream_path);
+            }
+            if (uds_seqpacket_fd != -1) {
+                FD_CLR(uds_seqpacket_fd, &master_set);
+                close(uds_seqpacket_fd);
+                uds_seqpacket_fd = -1;
+                unlink(seqpacket_path);
+            }
+        }
+        if (draining && stream_client_count == 0) {
+            printf("Drain complete.\n");
+            admin_action = ADMIN_SHUTDOWN;
+        }
+        if (admin_action == ADMIN_SHUTDOWN) {
+            printf("Shutdown command received. Notifying clients...\n");
+            for (int j = 0; j <= conn_high; j++) {
+                if (conns[j].kind != CONN_FREE && conns[j].kind != CONN_ADMIN) {
+                    // Best effort: the socket is closed right after
+                    conn_send(j, "Server shutting down.\n", strlen("Server shutting down.\n"));
+                    close_stream_client(j);
+                }
+            }
+            goto shutdown_cleanup; // Clean exit from loop
+        }
+
+        // Sync and ship this iteration's log entries as one batch
+        if (cluster_mode) {
+            raft_flush();
+        }
+
+        // Waiters go first, so views and pushes show the inventory after them
+        if (waiter_count > 0) {
+            serve_waiters(&carbon, &oxygen, &hydrogen);
+            expire_waiters();
+        }
+        if (view != NULL) {
+            update_view(carbon, oxygen, hydrogen);
+        }
+        if (watch_count > 0) {
+            push_watchers(carbon, oxygen, hydrogen);
+        }
+        if (feed_fd != -1) {
+            feed_tick(carbon, oxygen, hydrogen);
+        }
     }
     
 shutdown_cleanup:
@@ -840,9 +5811,53 @@ shutdown_cleanup:
         close(uds_datagram_fd);
         if (datagram_path) unlink(datagram_path);
     }
+    if (uds_seqpacket_fd != -1) {
+        close(uds_seqpacket_fd);
+        unlink(seqpacket_path);
+    }
+    if (admin_fd != -1) {
+        close(admin_fd);
+        unlink(admin_path);
+    }
     
+    for (int k = 0; k < follower_count; k++) {
+        close(followers[k].fd >= 0 ? followers[k].fd : -followers[k].fd - 1);
+    }
+    if (repl_tcp_fd != -1) close(repl_tcp_fd);
+    if (repl_uds_fd != -1) {
+        close(repl_uds_fd);
+        if (repl_path) unlink(repl_path);
+    }
+    if (leader_fd != -1) close(leader_fd);
+    if (cluster_mode) {
+        raft_shutdown();
+        free(pending_replies);
+    }
+    stop_gen_workers();
+    for (int k = 0; k <= conn_high; k++) {
+        if (conns[k].kind != CONN_FREE) close_stream_client(k);
+    }
+    while (slab_blocks != NULL) {
+        slab_block_t *next = slab_blocks->next;
+        free(slab_blocks);
+        slab_blocks = next;
+    }
+    free(conns);
+    free(watch_fds);
+    close(conn_epoll_fd);
+
     if (stream_path) free(stream_path);
     if (datagram_path) free(datagram_path);
+    if (seqpacket_path) free(seqpacket_path);
+    if (admin_path) free(admin_path);
+    if (repl_path) free(repl_path);
+    if (leader_spec) free(leader_spec);
+    if (view != NULL) {
+        munmap(view, sizeof(warehouse_view_t));
+        unlink(view_path);
+    }
+    if (view_path) free(view_path);
+    if (feed_fd != -1) close(feed_fd);
     
     printf("Server terminated.\n");
     if (save_file_path) {
@@ -0,0 +1,1080 @@
+/**
+ * raft.c - q6
+ *
+ * Raft leader election and log replication for the persistent warehouse
+ * cluster mode (3 or 5 nodes on TCP).
+ *
+ * Entries proposed during one event loop iteration are written with a single
+ * fdatasync and shipped to each follower in one AppendEntries (batching).
+ * The leader keeps sending new batches without waiting for the previous
+ * acknowledgement, up to RAFT_MAX_INFLIGHT entries per follower (pipelining).
+ * All socket writes and disk syncs happen in raft_flush, once per iteration,
+ * so replies to AppendEntries/RequestVote are only sent after the log and
+ * vote they acknowledge are durable.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "raft.h"
+
+#define RAFT_HEARTBEAT_MS 50
+#define RAFT_ELECTION_MIN_MS 300
+#define RAFT_ELECTION_MAX_MS 600
+#define RAFT_RECONNECT_MS 200
+#define RAFT_MAX_BATCH 512
+#define RAFT_MAX_INFLIGHT 8192
+#define RAFT_MAX_OUTBUF (8 * 1024 * 1024)
+
+#define RAFT_MSG_VOTE_REQ 1
+#define RAFT_MSG_VOTE_RESP 2
+#define RAFT_MSG_APPEND_REQ 3
+#define RAFT_MSG_APPEND_RESP 4
+
+#define RAFT_FOLLOWER 0
+#define RAFT_CANDIDATE 1
+#define RAFT_LEADER 2
+
+// Wire header, followed by `count` raft_entry_t for append requests
+typedef struct {
+    uint8_t type;
+    uint8_t from;                       // sender node id
+    uint16_t count;
+    uint32_t reserved;
+    uint64_t term;
+    uint64_t a, b, c;                   // vote req: last index, last term
+                                        // vote resp: granted
+                                        // append req: prev index, prev term, leader commit
+                                        // append resp: success, match index (or retry hint)
+} raft_msg_t;
+
+// Persistent term and vote
+typedef struct {
+    uint64_t term;
+    int64_t voted_for;
+    uint32_t crc;
+    uint32_t reserved;
+} raft_meta_t;
+
+typedef struct {
+    int fd;
+    int connecting;
+    unsigned char *in;
+    size_t in_len, in_cap;
+    unsigned char *out;
+    size_t out_len, out_off, out_cap;
+    uint64_t ack_term, ack_match;       // AppendEntries success owed once durable, term 0 = none
+} raft_conn_t;
+
+static raft_peer_t peers[RAFT_MAX_PEERS];
+static int peer_count = 0;
+static int self_idx = -1;
+static raft_apply_fn apply_cb = NULL;
+static raft_role_fn role_cb = NULL;
+
+// Persistent state (log[0] is a sentinel so log[i] is index i)
+static uint64_t current_term = 0;
+static int voted_for = -1;              // node id
+static raft_entry_t *rlog = NULL;
+static uint64_t rlog_len = 1, rlog_cap = 0;
+
+// Volatile state
+static int role = RAFT_FOLLOWER;
+static int leader_idx = -1;
+static uint64_t commit_index = 0, last_applied = 0, persisted_index = 0;
+static uint64_t next_index[RAFT_MAX_PEERS], match_index[RAFT_MAX_PEERS];
+static uint64_t sent_commit[RAFT_MAX_PEERS];
+static unsigned int vote_mask = 0;
+static uint64_t election_deadline = 0;
+static uint64_t heartbeat_due[RAFT_MAX_PEERS];
+static uint64_t next_connect[RAFT_MAX_PEERS];
+
+// Sockets: one outbound connection per peer for our requests and their
+// responses, inbound connections carry the peers' requests
+static int listen_fd = -1;
+static raft_conn_t out_conns[RAFT_MAX_PEERS];
+static raft_conn_t in_conns[2 * RAFT_MAX_PEERS];
+static int in_count = 0;
+
+// Storage
+static int log_fd = -1, meta_fd = -1;
+static int meta_dirty = 0;
+
+// Metrics
+static uint64_t stat_elections = 0, stat_append_msgs = 0, stat_entries_sent = 0;
+static uint64_t stat_syncs = 0, stat_leader_since = 0;
+
+/**
+ * now_ms - monotonic clock in milliseconds
+ */
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/**
+ * reset_election_timer - picks a new randomized election deadline
+ */
+static void reset_election_timer(void) {
+    election_deadline = now_ms() + RAFT_ELECTION_MIN_MS +
+                        (uint64_t)(rand() % (RAFT_ELECTION_MAX_MS - RAFT_ELECTION_MIN_MS));
+}
+
+/**
+ * peer_index - maps a node id to its index in peers, or -1
+ */
+static int peer_index(int id) {
+    for (int p = 0; p < peer_count; p++) {
+        if (peers[p].id == id)
+            return p;
+    }
+    return -1;
+}
+
+/**
+ * entry_crc - CRC32C of an entry with the crc field zeroed
+ */
+static uint32_t entry_crc(const raft_entry_t *entry) {
+    raft_entry_t copy = *entry;
+    copy.crc = 0;
+    return crc32c(&copy, sizeof(copy));
+}
+
+/**
+ * log_append - appends an entry to the in-memory log
+ * Returns 0 on success, -1 if out of memory
+ */
+static int log_append(const raft_entry_t *entry) {
+    if (rlog_len == rlog_cap) {
+        uint64_t cap = rlog_cap ? rlog_cap * 2 : 4096;
+        raft_entry_t *grown = realloc(rlog, cap * sizeof(*grown));
+        if (grown == NULL) {
+            perror("Raft log allocation");
+            return -1;
+        }
+        rlog = grown;
+        rlog_cap = cap;
+    }
+    rlog[rlog_len++] = *entry;
+    return 0;
+}
+
+/**
+ * log_truncate - drops every entry from index on (conflict with the leader)
+ */
+static void log_truncate(uint64_t index) {
+    rlog_len = index;
+    if (persisted_index >= index) {
+        persisted_index = index - 1;
+        if (log_fd != -1 && ftruncate(log_fd, (off_t)(persisted_index * sizeof(raft_entry_t))) == -1)
+            perror("Raft log truncate");
+    }
+}
+
+/**
+ * persist_state - writes new log entries and term/vote, then syncs once
+ * Returns 0 when everything is durable, -1 if a write or sync failed
+ */
+static int persist_state(void) {
+    uint64_t last = rlog_len - 1;
+
+    if (log_fd == -1) {
+        persisted_index = last;
+        meta_dirty = 0;
+        return 0;
+    }
+
+    int synced = 0;
+    if (last > persisted_index) {
+        size_t bytes = (size_t)(last - persisted_index) * sizeof(raft_entry_t);
+        off_t offset = (off_t)(persisted_index * sizeof(raft_entry_t));
+        const unsigned char *src = (const unsigned char *)&rlog[persisted_index + 1];
+        while (bytes > 0) {
+            ssize_t n = pwrite(log_fd, src, bytes, offset);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                perror("Raft log write");
+                return -1;
+            }
+            src += n;
+            offset += n;
+            bytes -= (size_t)n;
+        }
+        if (fdatasync(log_fd) == -1) {
+            perror("Raft log sync");
+            return -1;
+        }
+        persisted_index = last;
+        synced = 1;
+    }
+
+    if (meta_dirty) {
+        raft_meta_t meta;
+        memset(&meta, 0, sizeof(meta));
+        meta.term = current_term;
+        meta.voted_for = voted_for;
+        meta.crc = crc32c(&meta, offsetof(raft_meta_t, crc));
+        if (pwrite(meta_fd, &meta, sizeof(meta), 0) != sizeof(meta) || fdatasync(meta_fd) == -1) {
+            perror("Raft meta write");
+            return -1;
+        }
+        meta_dirty = 0;
+        synced = 1;
+    }
+
+    if (synced)
+        stat_syncs++;
+    return 0;
+}
+
+/**
+ * load_storage - opens the log and meta files and reloads them
+ * Returns 0 on success, -1 on failure
+ */
+static int load_storage(const char *prefix) {
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s.raft-meta", prefix);
+    meta_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (meta_fd == -1) {
+        perror("Raft meta open");
+        return -1;
+    }
+    raft_meta_t meta;
+    if (pread(meta_fd, &meta, sizeof(meta), 0) == sizeof(meta) &&
+        meta.crc == crc32c(&meta, offsetof(raft_meta_t, crc))) {
+        current_term = meta.term;
+        voted_for = (int)meta.voted_for;
+    }
+
+    snprintf(path, sizeof(path), "%s.raft-log", prefix);
+    log_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (log_fd == -1) {
+        perror("Raft log open");
+        return -1;
+    }
+
+    raft_entry_t chunk[1024];
+    off_t offset = 0;
+    int torn = 0;
+    while (!torn) {
+        ssize_t n = pread(log_fd, chunk, sizeof(chunk), offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("Raft log read");
+            return -1;
+        }
+        if (n == 0)
+            break;
+        size_t whole = (size_t)n / sizeof(raft_entry_t);
+        if (whole == 0) {
+            torn = 1;
+            break;
+        }
+        for (size_t k = 0; k < whole; k++) {
+            if (chunk[k].crc != entry_crc(&chunk[k])) {
+                torn = 1;
+                break;
+            }
+            if (log_append(&chunk[k]) != 0)
+                return -1;
+        }
+        offset += (off_t)(whole * sizeof(raft_entry_t));
+    }
+    persisted_index = rlog_len - 1;
+    if (torn) {
+        fprintf(stderr, "Raft: truncating torn log tail after index %llu\n",
+                (unsigned long long)persisted_index);
+        if (ftruncate(log_fd, (off_t)(persisted_index * sizeof(raft_entry_t))) == -1)
+            perror("Raft log truncate");
+    }
+
+    printf("Raft: recovered term %llu, %llu log entries\n",
+           (unsigned long long)current_term, (unsigned long long)persisted_index);
+    return 0;
+}
+
+/**
+ * conn_reset - closes a peer connection and frees its buffers
+ */
+static void conn_reset(raft_conn_t *conn) {
+    if (conn->fd != -1)
+        close(conn->fd);
+    free(conn->in);
+    free(conn->out);
+    memset(conn, 0, sizeof(*conn));
+    conn->fd = -1;
+}
+
+/**
+ * conn_queue - appends a message (and its entries) to a connection's output
+ */
+static void conn_queue(raft_conn_t *conn, const raft_msg_t *msg, const raft_entry_t *entries, size_t count) {
+    if (conn->fd == -1)
+        return;
+
+    size_t need = sizeof(*msg) + count * sizeof(raft_entry_t);
+    if (conn->out_off > 0 && conn->out_off == conn->out_len) {
+        conn->out_off = conn->out_len = 0;
+    }
+    if (conn->out_len - conn->out_off + need > RAFT_MAX_OUTBUF) {
+        // Peer is not draining; Raft tolerates the loss, the leader resends
+        conn_reset(conn);
+        return;
+    }
+    if (conn->out_len + need > conn->out_cap) {
+        memmove(conn->out, conn->out + conn->out_off, conn->out_len - conn->out_off);
+        conn->out_len -= conn->out_off;
+        conn->out_off = 0;
+        size_t cap = conn->out_cap ? conn->out_cap : 16384;
+        while (cap < conn->out_len + need)
+            cap *= 2;
+        unsigned char *grown = realloc(conn->out, cap);
+        if (grown == NULL) {
+            conn_reset(conn);
+            return;
+        }
+        conn->out = grown;
+        conn->out_cap = cap;
+    }
+    memcpy(conn->out + conn->out_len, msg, sizeof(*msg));
+    if (count > 0)
+        memcpy(conn->out + conn->out_len + sizeof(*msg), entries, count * sizeof(raft_entry_t));
+    conn->out_len += need;
+}
+
+/**
+ * conn_flush - writes as much queued output as the socket takes
+ */
+static void conn_flush(raft_conn_t *conn) {
+    while (conn->fd != -1 && !conn->connecting && conn->out_off < conn->out_len) {
+        ssize_t n = send(conn->fd, conn->out + conn->out_off, conn->out_len - conn->out_off,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                conn_reset(conn);
+            return;
+        }
+        conn->out_off += (size_t)n;
+    }
+}
+
+/**
+ * make_msg - fills the common header fields
+ */
+static void make_msg(raft_msg_t *msg, uint8_t type) {
+    memset(msg, 0, sizeof(*msg));
+    msg->type = type;
+    msg->from = (uint8_t)peers[self_idx].id;
+    msg->term = current_term;
+}
+
+/**
+ * become_follower - steps down, adopting a newer term if one was seen
+ */
+static void become_follower(uint64_t term) {
+    if (term > current_term) {
+        current_term = term;
+        voted_for = -1;
+        meta_dirty = 1;
+    }
+    int was_leader = role == RAFT_LEADER;
+    role = RAFT_FOLLOWER;
+    if (was_leader) {
+        leader_idx = -1;
+        printf("Raft: stepping down in term %llu\n", (unsigned long long)current_term);
+        reset_election_timer();
+        if (role_cb) role_cb(0);
+    }
+}
+
+/**
+ * apply_committed - hands newly committed entries to the state machine
+ */
+static void apply_committed(void) {
+    while (last_applied < commit_index) {
+        last_applied++;
+        if (apply_cb) apply_cb(last_applied, &rlog[last_applied]);
+    }
+}
+
+/**
+ * send_append - queues one AppendEntries for a peer
+ */
+static void send_append(int p, uint64_t prev, uint64_t count) {
+    raft_msg_t msg;
+    make_msg(&msg, RAFT_MSG_APPEND_REQ);
+    msg.count = (uint16_t)count;
+    msg.a = prev;
+    msg.b = rlog[prev].term;
+    msg.c = commit_index;
+    conn_queue(&out_conns[p], &msg, count ? &rlog[prev + 1] : NULL, (size_t)count);
+    sent_commit[p] = commit_index;
+    stat_append_msgs++;
+    stat_entries_sent += count;
+}
+
+/**
+ * replicate_to - ships pending entries to a peer, pipelined, or a heartbeat
+ */
+static void replicate_to(int p, uint64_t now) {
+    raft_conn_t *conn = &out_conns[p];
+    if (conn->fd == -1 || conn->connecting)
+        return;
+
+    uint64_t last = rlog_len - 1;
+    int sent = 0;
+    while (next_index[p] <= last && next_index[p] - match_index[p] - 1 < RAFT_MAX_INFLIGHT &&
+           conn->out_len - conn->out_off < RAFT_MAX_OUTBUF / 2) {
+        uint64_t count = last - next_index[p] + 1;
+        if (count > RAFT_MAX_BATCH) count = RAFT_MAX_BATCH;
+        send_append(p, next_index[p] - 1, count);
+        next_index[p] += count;
+        sent = 1;
+        if (conn->fd == -1) return;
+    }
+
+    if (!sent && (now >= heartbeat_due[p] || sent_commit[p] < commit_index)) {
+        send_append(p, next_index[p] - 1, 0);
+        sent = 1;
+    }
+    if (sent)
+        heartbeat_due[p] = now + RAFT_HEARTBEAT_MS;
+}
+
+/**
+ * become_leader - takes over after winning an election
+ */
+static void become_leader(void) {
+    role = RAFT_LEADER;
+    leader_idx = self_idx;
+    stat_leader_since = now_ms();
+    for (int p = 0; p < peer_count; p++) {
+        next_index[p] = rlog_len;
+        match_index[p] = 0;
+        heartbeat_due[p] = 0;
+    }
+    printf("Raft: node %d is leader for term %llu\n", peers[self_idx].id, (unsigned long long)current_term);
+
+    // A no-op of the new term lets entries of earlier terms commit
+    raft_entry_t noop;
+    memset(&noop, 0, sizeof(noop));
+    noop.term = current_term;
+    noop.type = RAFT_ENTRY_NOOP;
+    noop.crc = entry_crc(&noop);
+    log_append(&noop);
+
+    if (role_cb) role_cb(1);
+}
+
+/**
+ * start_election - becomes candidate for the next term and requests votes
+ */
+static void start_election(void) {
+    role = RAFT_CANDIDATE;
+    current_term++;
+    voted_for = peers[self_idx].id;
+    meta_dirty = 1;
+    leader_idx = -1;
+    vote_mask = 1U << self_idx;
+    stat_elections++;
+    reset_election_timer();
+
+    if (peer_count == 1) {
+        become_leader();
+        return;
+    }
+
+    raft_msg_t msg;
+    make_msg(&msg, RAFT_MSG_VOTE_REQ);
+    msg.a = rlog_len - 1;
+    msg.b = rlog[rlog_len - 1].term;
+    for (int p = 0; p < peer_count; p++) {
+        if (p != self_idx)
+            conn_queue(&out_conns[p], &msg, NULL, 0);
+    }
+}
+
+/**
+ * advance_commit - commits the highest index stored on a majority
+ */
+static void advance_commit(void) {
+    if (role != RAFT_LEADER)
+        return;
+
+    uint64_t matches[RAFT_MAX_PEERS];
+    for (int p = 0; p < peer_count; p++)
+        matches[p] = (p == self_idx) ? persisted_index : match_index[p];
+
+    // Sort descending, the majority-th value is stored on a majority
+    for (int i = 1; i < peer_count; i++) {
+        uint64_t v = matches[i];
+        int j = i - 1;
+        while (j >= 0 && matches[j] < v) {
+            matches[j + 1] = matches[j];
+            j--;
+        }
+        matches[j + 1] = v;
+    }
+    uint64_t candidate = matches[peer_count / 2];
+
+    if (candidate > commit_index && rlog[candidate].term == current_term) {
+        commit_index = candidate;
+        apply_committed();
+    }
+}
+
+/**
+ * handle_vote_request - RequestVote receiver
+ */
+static void handle_vote_request(raft_conn_t *conn, const raft_msg_t *msg) {
+    if (msg->term > current_term)
+        become_follower(msg->term);
+
+    uint64_t last = rlog_len - 1;
+    int up_to_date = msg->b > rlog[last].term || (msg->b == rlog[last].term && msg->a >= last);
+    int granted = 0;
+    if (msg->term == current_term && up_to_date && (voted_for == -1 || voted_for == msg->from)) {
+        voted_for = msg->from;
+        meta_dirty = 1;
+        granted = 1;
+        reset_election_timer();
+    }
+
+    raft_msg_t resp;
+    make_msg(&resp, RAFT_MSG_VOTE_RESP);
+    resp.a = (uint64_t)granted;
+    conn_queue(conn, &resp, NULL, 0);
+}
+
+/**
+ * handle_vote_response - counts votes while candidate
+ */
+static void handle_vote_response(const raft_msg_t *msg) {
+    if (msg->term > current_term) {
+        become_follower(msg->term);
+        return;
+    }
+    int p = peer_index(msg->from);
+    if (role != RAFT_CANDIDATE || msg->term != current_term || !msg->a || p < 0)
+        return;
+
+    vote_mask |= 1U << p;
+    if (__builtin_popcount(vote_mask) > peer_count / 2)
+        become_leader();
+}
+
+/**
+ * handle_append_request - AppendEntries receiver
+ */
+static void handle_append_request(raft_conn_t *conn, const raft_msg_t *msg, const raft_entry_t *entries) {
+    raft_msg_t resp;
+
+    if (msg->term < current_term) {
+        make_msg(&resp, RAFT_MSG_APPEND_RESP);
+        resp.a = 0;
+        resp.b = rlog_len - 1;
+        conn_queue(conn, &resp, NULL, 0);
+        return;
+    }
+
+    if (msg->term > current_term || role != RAFT_FOLLOWER)
+        become_follower(msg->term);
+    leader_idx = peer_index(msg->from);
+    reset_election_timer();
+
+    make_msg(&resp, RAFT_MSG_APPEND_RESP);
+    uint64_t prev = msg->a;
+    if (prev > rlog_len - 1 || rlog[prev].term != msg->b) {
+        resp.a = 0;
+        resp.b = prev > rlog_len - 1 ? rlog_len - 1 : prev - 1;
+        conn_queue(conn, &resp, NULL, 0);
+        return;
+    }
+
+    for (uint16_t k = 0; k < msg->count; k++) {
+        uint64_t index = prev + 1 + k;
+        if (entries[k].crc != entry_crc(&entries[k])) {
+            fprintf(stderr, "Raft: dropping corrupt entry %llu from leader\n", (unsigned long long)index);
+            resp.a = 0;
+            resp.b = index - 1;
+            conn_queue(conn, &resp, NULL, 0);
+            return;
+        }
+        if (index < rlog_len) {
+            if (rlog[index].term == entries[k].term)
+                continue;
+            log_truncate(index);
+        }
+        if (log_append(&entries[k]) != 0)
+            return;
+    }
+
+    uint64_t match = prev + msg->count;
+    if (msg->c > commit_index) {
+        commit_index = msg->c < match ? msg->c : match;
+        apply_committed();
+    }
+
+    // The success is sent by raft_flush once the entries are on disk
+    if (conn->ack_term != current_term || match > conn->ack_match)
+        conn->ack_match = match;
+    conn->ack_term = current_term;
+}
+
+/**
+ * handle_append_response - updates replication progress on the leader
+ */
+static void handle_append_response(const raft_msg_t *msg) {
+    if (msg->term > current_term) {
+        become_follower(msg->term);
+        return;
+    }
+    int p = peer_index(msg->from);
+    if (role != RAFT_LEADER || msg->term != current_term || p < 0)
+        return;
+
+    if (msg->a) {
+        if (msg->b > match_index[p]) {
+            match_index[p] = msg->b;
+            advance_commit();
+        }
+        if (next_index[p] <= match_index[p])
+            next_index[p] = match_index[p] + 1;
+    } else {
+        // Back up to the follower's hint, never below what it already has
+        uint64_t retry = msg->b + 1;
+        if (retry < next_index[p])
+            next_index[p] = retry;
+        if (next_index[p] <= match_index[p])
+            next_index[p] = match_index[p] + 1;
+    }
+}
+
+/**
+ * conn_read - reads from a peer connection and dispatches whole messages
+ */
+static void conn_read(raft_conn_t *conn) {
+    if (conn->in_cap - conn->in_len < 4096) {
+        size_t cap = conn->in_cap ? conn->in_cap * 2 : 65536;
+        unsigned char *grown = realloc(conn->in, cap);
+        if (grown == NULL) {
+            conn_reset(conn);
+            return;
+        }
+        conn->in = grown;
+        conn->in_cap = cap;
+    }
+
+    ssize_t n = recv(conn->fd, conn->in + conn->in_len, conn->in_cap - conn->in_len, MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        conn_reset(conn);
+        return;
+    }
+    if (n < 0)
+        return;
+    conn->in_len += (size_t)n;
+
+    size_t off = 0;
+    while (conn->in_len - off >= sizeof(raft_msg_t)) {
+        raft_msg_t msg;
+        memcpy(&msg, conn->in + off, sizeof(msg));
+        if (msg.count > RAFT_MAX_BATCH || (msg.count > 0 && msg.type != RAFT_MSG_APPEND_REQ)) {
+            fprintf(stderr, "Raft: protocol error from node %d\n", msg.from);
+            conn_reset(conn);
+            return;
+        }
+        size_t need = sizeof(msg) + msg.count * sizeof(raft_entry_t);
+        if (conn->in_len - off < need)
+            break;
+
+        raft_entry_t entries[RAFT_MAX_BATCH];
+        memcpy(entries, conn->in + off + sizeof(msg), msg.count * sizeof(raft_entry_t));
+        off += need;
+
+        switch (msg.type) {
+            case RAFT_MSG_VOTE_REQ: handle_vote_request(conn, &msg); break;
+            case RAFT_MSG_VOTE_RESP: handle_vote_response(&msg); break;
+            case RAFT_MSG_APPEND_REQ: handle_append_request(conn, &msg, entries); break;
+            case RAFT_MSG_APPEND_RESP: handle_append_response(&msg); break;
+            default: break;
+        }
+        if (conn->fd == -1)
+            return;
+    }
+
+    memmove(conn->in, conn->in + off, conn->in_len - off);
+    conn->in_len -= off;
+}
+
+/**
+ * connect_peer - starts a non-blocking connection to a peer's raft port
+ */
+static void connect_peer(int p, uint64_t now) {
+    raft_conn_t *conn = &out_conns[p];
+    next_connect[p] = now + RAFT_RECONNECT_MS;
+
+    struct addrinfo hints, *res;
+    char port[16];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", peers[p].raft_port);
+    if (getaddrinfo(peers[p].host, port, &hints, &res) != 0)
+        return;
+
+    int fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, res->ai_protocol);
+    if (fd == -1) {
+        freeaddrinfo(res);
+        return;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    int rc = connect(fd, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if (rc == -1 && errno != EINPROGRESS) {
+        close(fd);
+        return;
+    }
+    conn->fd = fd;
+    conn->connecting = 1;
+}
+
+/**
+ * raft_parse_peer - parses ID=HOST:RAFT_PORT:TCP_PORT[:UDP_PORT]
+ * Returns 0 on success, -1 on malformed input
+ */
+int raft_parse_peer(const char *spec, raft_peer_t *peer) {
+    memset(peer, 0, sizeof(*peer));
+    peer->udp_port = -1;
+    int consumed = 0;
+    if (sscanf(spec, "%d=%63[^:]:%d:%d%n", &peer->id, peer->host, &peer->raft_port,
+               &peer->tcp_port, &consumed) != 4)
+        return -1;
+    if (spec[consumed] == ':' && sscanf(spec + consumed + 1, "%d", &peer->udp_port) != 1)
+        return -1;
+    if (peer->id <= 0 || peer->id > 255 || peer->raft_port <= 0 || peer->raft_port > 65535 ||
+        peer->tcp_port <= 0 || peer->tcp_port > 65535 || peer->udp_port > 65535)
+        return -1;
+    return 0;
+}
+
+/**
+ * raft_init - sets up the node, reloads storage and starts listening
+ * Returns 0 on success, -1 on failure
+ */
+int raft_init(int self_id, const raft_peer_t *cluster, int count, const char *storage_prefix,
+              raft_apply_fn apply, raft_role_fn role_change) {
+    if (count < 1 || count > RAFT_MAX_PEERS) {
+        fprintf(stderr, "Raft: cluster must have 1-%d nodes\n", RAFT_MAX_PEERS);
+        return -1;
+    }
+    memcpy(peers, cluster, count * sizeof(*cluster));
+    peer_count = count;
+    self_idx = peer_index(self_id);
+    if (self_idx < 0) {
+        fprintf(stderr, "Raft: node id %d is not in the peer list\n", self_id);
+        return -1;
+    }
+    apply_cb = apply;
+    role_cb = role_change;
+
+    raft_entry_t sentinel;
+    memset(&sentinel, 0, sizeof(sentinel));
+    rlog_len = 0;
+    if (log_append(&sentinel) != 0)
+        return -1;
+
+    if (storage_prefix != NULL) {
+        if (load_storage(storage_prefix) != 0)
+            return -1;
+    } else {
+        printf("Raft: no save file, log and votes are kept in memory only\n");
+    }
+
+    for (int p = 0; p < RAFT_MAX_PEERS; p++)
+        out_conns[p].fd = -1;
+    for (int k = 0; k < 2 * RAFT_MAX_PEERS; k++)
+        in_conns[k].fd = -1;
+
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1) {
+        perror("Raft socket");
+        return -1;
+    }
+    int reuse = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(peers[self_idx].raft_port);
+    if (bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, RAFT_MAX_PEERS) < 0) {
+        perror("Raft bind/listen");
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+
+    srand((unsigned int)(time(NULL) ^ getpid() ^ (self_id << 16)));
+    reset_election_timer();
+    return 0;
+}
+
+/**
+ * raft_shutdown - closes all sockets and storage
+ */
+void raft_shutdown(void) {
+    for (int p = 0; p < peer_count; p++)
+        conn_reset(&out_conns[p]);
+    for (int k = 0; k < in_count; k++)
+        conn_reset(&in_conns[k]);
+    in_count = 0;
+    if (listen_fd != -1) close(listen_fd);
+    if (log_fd != -1) close(log_fd);
+    if (meta_fd != -1) close(meta_fd);
+    listen_fd = log_fd = meta_fd = -1;
+    free(rlog);
+    rlog = NULL;
+    rlog_len = rlog_cap = 0;
+}
+
+int raft_is_leader(void) {
+    return role == RAFT_LEADER;
+}
+
+const raft_peer_t *raft_leader(void) {
+    return leader_idx >= 0 ? &peers[leader_idx] : NULL;
+}
+
+uint64_t raft_term(void) {
+    return current_term;
+}
+
+/**
+ * raft_propose - appends an operation to the leader's log
+ * Persisted and replicated by the next raft_flush, applied once committed
+ * Returns the log index, or 0 if this node is not the leader
+ */
+uint64_t raft_propose(uint8_t type, uint8_t arg, uint64_t amount) {
+    if (role != RAFT_LEADER)
+        return 0;
+
+    raft_entry_t entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.term = current_term;
+    entry.type = type;
+    entry.arg = arg;
+    entry.amount = amount;
+    entry.crc = entry_crc(&entry);
+    if (log_append(&entry) != 0)
+        return 0;
+    return rlog_len - 1;
+}
+
+/**
+ * raft_timeout_ms - time until the next election, heartbeat or reconnect
+ */
+int raft_timeout_ms(void) {
+    uint64_t now = now_ms();
+    uint64_t next = (role == RAFT_LEADER) ? now + RAFT_HEARTBEAT_MS : election_deadline;
+
+    for (int p = 0; p < peer_count; p++) {
+        if (p == self_idx) continue;
+        if (role == RAFT_LEADER && heartbeat_due[p] < next)
+            next = heartbeat_due[p];
+        if (out_conns[p].fd == -1 && next_connect[p] < next)
+            next = next_connect[p];
+    }
+    return next > now ? (int)(next - now) : 0;
+}
+
+/**
+ * raft_fill_fds - adds the module's sockets to the select sets
+ */
+void raft_fill_fds(fd_set *read_fds, fd_set *write_fds, int *maxfd) {
+    if (listen_fd != -1) {
+        FD_SET(listen_fd, read_fds);
+        if (listen_fd > *maxfd) *maxfd = listen_fd;
+    }
+    for (int p = 0; p < peer_count; p++) {
+        raft_conn_t *conn = &out_conns[p];
+        if (conn->fd == -1) continue;
+        if (conn->connecting || conn->out_off < conn->out_len)
+            FD_SET(conn->fd, write_fds);
+        if (!conn->connecting)
+            FD_SET(conn->fd, read_fds);
+        if (conn->fd > *maxfd) *maxfd = conn->fd;
+    }
+    for (int k = 0; k < in_count; k++) {
+        raft_conn_t *conn = &in_conns[k];
+        FD_SET(conn->fd, read_fds);
+        if (conn->out_off < conn->out_len)
+            FD_SET(conn->fd, write_fds);
+        if (conn->fd > *maxfd) *maxfd = conn->fd;
+    }
+}
+
+/**
+ * raft_handle_fds - services ready peer sockets
+ * Clears the handled bits so the server loop never sees raft sockets
+ */
+void raft_handle_fds(fd_set *read_fds, fd_set *write_fds) {
+    if (listen_fd != -1 && FD_ISSET(listen_fd, read_fds)) {
+        FD_CLR(listen_fd, read_fds);
+        int fd;
+        while ((fd = accept(listen_fd, NULL, NULL)) != -1) {
+            if (in_count >= 2 * RAFT_MAX_PEERS) {
+                close(fd);
+                continue;
+            }
+            int flags = fcntl(fd, F_GETFL);
+            fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            memset(&in_conns[in_count], 0, sizeof(in_conns[in_count]));
+            in_conns[in_count++].fd = fd;
+        }
+    }
+
+    for (int p = 0; p < peer_count; p++) {
+        raft_conn_t *conn = &out_conns[p];
+        if (conn->fd == -1) continue;
+        int fd = conn->fd;
+        if (FD_ISSET(fd, write_fds)) {
+            FD_CLR(fd, write_fds);
+            if (conn->connecting) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+                    conn_reset(conn);
+                    continue;
+                }
+                conn->connecting = 0;
+                // Resume from what the peer is known to have
+                if (role == RAFT_LEADER)
+                    next_index[p] = match_index[p] + 1;
+            }
+            conn_flush(conn);
+        }
+        if (conn->fd != -1 && FD_ISSET(fd, read_fds)) {
+            FD_CLR(fd, read_fds);
+            conn_read(conn);
+        }
+    }
+
+    for (int k = 0; k < in_count; k++) {
+        raft_conn_t *conn = &in_conns[k];
+        int fd = conn->fd;
+        if (FD_ISSET(fd, write_fds)) {
+            FD_CLR(fd, write_fds);
+            conn_flush(conn);
+        }
+        if (conn->fd != -1 && FD_ISSET(fd, read_fds)) {
+            FD_CLR(fd, read_fds);
+            conn_read(conn);
+        }
+    }
+
+    // Compact closed inbound connections
+    for (int k = 0; k < in_count; ) {
+        if (in_conns[k].fd == -1)
+            in_conns[k] = in_conns[--in_count];
+        else
+            k++;
+    }
+}
+
+/**
+ * raft_flush - end of loop iteration: timers, batched replication, one
+ * durable sync of log and vote, then all queued messages are sent
+ */
+void raft_flush(void) {
+    uint64_t now = now_ms();
+
+    for (int p = 0; p < peer_count; p++) {
+        if (p != self_idx && out_conns[p].fd == -1 && now >= next_connect[p])
+            connect_peer(p, now);
+    }
+
+    if (role != RAFT_LEADER && now >= election_deadline)
+        start_election();
+
+    if (role == RAFT_LEADER) {
+        for (int p = 0; p < peer_count; p++) {
+            if (p != self_idx)
+                replicate_to(p, now);
+        }
+    }
+
+    int durable = persist_state() == 0;
+    advance_commit();
+
+    for (int p = 0; p < peer_count; p++)
+        conn_flush(&out_conns[p]);
+    for (int k = 0; k < in_count; k++) {
+        raft_conn_t *conn = &in_conns[k];
+        if (!durable) {
+            // Replies queued this iteration acknowledge state that is not on
+            // disk; drop the connection, the leader resends from its match
+            if (conn->ack_term != 0 || conn->out_off < conn->out_len)
+                conn_reset(conn);
+            continue;
+        }
+        if (conn->ack_term != 0) {
+            // A success from an older term would be misread by the new leader
+            if (conn->ack_term == current_term) {
+                raft_msg_t resp;
+                make_msg(&resp, RAFT_MSG_APPEND_RESP);
+                resp.a = 1;
+                resp.b = conn->ack_match < persisted_index ? conn->ack_match : persisted_index;
+                conn_queue(conn, &resp, NULL, 0);
+            }
+            conn->ack_term = conn->ack_match = 0;
+        }
+        conn_flush(conn);
+    }
+}
+
+/**
+ * raft_print_stats - prints role, log progress and replication counters
+ */
+void raft_print_stats(FILE *out) {
+    static const char *roles[] = {"follower", "candidate", "leader"};
+    const raft_peer_t *leader = raft_leader();
+
+    fprintf(out, "Raft: node %d %s, term=%llu leader=%d\n", peers[self_idx].id, roles[role],
+           (unsigned long long)current_term, leader ? leader->id : -1);
+    fprintf(out, "Raft log: last=%llu persisted=%llu commit=%llu applied=%llu syncs=%llu elections=%llu\n",
+           (unsigned long long)(rlog_len - 1), (unsigned long long)persisted_index,
+           (unsigned long long)commit_index, (unsigned long long)last_applied,
+           (unsigned long long)stat_syncs, (unsigned long long)stat_elections);
+    fprintf(out, "Raft replication: append messages=%llu entries=%llu (%.1f per message)\n",
+           (unsigned long long)stat_append_msgs, (unsigned long long)stat_entries_sent,
+           stat_append_msgs ? (double)stat_entries_sent / stat_append_msgs : 0.0);
+    if (role == RAFT_LEADER) {
+        fprintf(out, "Raft leader for %.1f s\n", (now_ms() - stat_leader_since) / 1000.0);
+        for (int p = 0; p < peer_count; p++) {
+            if (p == self_idx) continue;
+            fprintf(out, "  node %d: match=%llu next=%llu %s\n", peers[p].id,
+                   (unsigned long long)match_index[p], (unsigned long long)next_index[p],
+                   out_conns[p].fd == -1 ? "(disconnected)" : "");
+        }
+    }
+}
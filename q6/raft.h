@@ -0,0 +1,67 @@
+/**
+ * raft.h - q6
+ *
+ * Raft consensus for the persistent warehouse cluster mode.
+ * The module owns its peer sockets and plugs into the server's select()
+ * loop through raft_fill_fds / raft_handle_fds / raft_flush.
+ */
+
+#ifndef RAFT_H
+#define RAFT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/select.h>
+
+#define RAFT_MAX_PEERS 7
+
+// Log entry types
+#define RAFT_ENTRY_NOOP 0
+#define RAFT_ENTRY_ADD 1
+#define RAFT_ENTRY_DELIVER 2
+
+// One replicated operation, also the on-disk log record
+typedef struct {
+    uint64_t term;
+    uint8_t type;                       // RAFT_ENTRY_*
+    uint8_t arg;                        // atom or molecule index
+    uint16_t reserved;
+    uint32_t crc;                       // CRC32C of the other fields
+    uint64_t amount;
+} raft_entry_t;
+
+// Cluster member, parsed from ID=HOST:RAFT_PORT:TCP_PORT[:UDP_PORT]
+typedef struct {
+    int id;
+    char host[64];
+    int raft_port;
+    int tcp_port;
+    int udp_port;
+} raft_peer_t;
+
+// Called for every committed entry, in log order, on every node
+typedef void (*raft_apply_fn)(uint64_t index, const raft_entry_t *entry);
+// Called when this node gains or loses leadership
+typedef void (*raft_role_fn)(int is_leader);
+
+// Provided by persistent_warehouse.c
+uint32_t crc32c(const void *buf, size_t len);
+
+int raft_parse_peer(const char *spec, raft_peer_t *peer);
+int raft_init(int self_id, const raft_peer_t *peers, int peer_count, const char *storage_prefix,
+              raft_apply_fn apply, raft_role_fn role_change);
+void raft_shutdown(void);
+
+int raft_is_leader(void);
+const raft_peer_t *raft_leader(void);
+uint64_t raft_term(void);
+uint64_t raft_propose(uint8_t type, uint8_t arg, uint64_t amount);
+
+int raft_timeout_ms(void);
+void raft_fill_fds(fd_set *read_fds, fd_set *write_fds, int *maxfd);
+void raft_handle_fds(fd_set *read_fds, fd_set *write_fds);
+void raft_flush(void);
+void raft_print_stats(FILE *out);
+
+#endif
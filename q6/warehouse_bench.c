@@ -0,0 +1,810 @@
+/**
+ * warehouse_bench.c - q6
+ *
+ * Load generator for persistent_warehouse servers, Raft clusters and shards.
+ * Finds the leader through STATUS, keeps a window of pipelined ADD commands
+ * in flight and reports committed ops/sec. With -k it then kills the leader
+ * (nodes must run on this host) and measures how long the cluster takes to
+ * elect a new leader and commit the next ADD. With -D it instead sends
+ * DELIVER datagrams to a server or to warehouse_coordinator. With -i it opens
+ * that many idle connections and checks the server's resident memory grew by
+ * no more than the budget per connection (the server must run on this host).
+ * With -s it opens that many connections at once and measures how long the
+ * server takes to answer a STATUS on every one of them.
+ *
+ * Usage:
+ *   ./warehouse_bench -n 127.0.0.1:17001,127.0.0.1:17002,127.0.0.1:17003 [-c COUNT] [-w WINDOW] [-k]
+ *   ./warehouse_bench -n 127.0.0.1:12345 -a OXYGEN [-c COUNT] [-w WINDOW]
+ *   ./warehouse_bench -D 127.0.0.1:12346 -m WATER [-c COUNT] [-w WINDOW]
+ *   ./warehouse_bench -n 127.0.0.1:12345 -i 100000 -p PID [-b BYTES]
+ *   ./warehouse_bench -n 127.0.0.1:12345 -s 10000
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#define MAX_NODES 7
+#define LINE_BUFFER_SIZE 65536
+#define FAILOVER_TIMEOUT_MS 10000
+#define IDLE_BUDGET_BYTES 256           // server memory per idle connection
+#define FD_RESERVE 100                  // fds kept free for everything but connections
+#define IDLE_PER_SOURCE 25000           // loopback connections per source address (ephemeral ports)
+#define STORM_TIMEOUT_MS 30000
+
+typedef struct {
+    char host[64];
+    int port;
+} bench_node_t;
+
+char add_command[32] = "ADD CARBON 1\n";
+
+// Buffered line reader over a stream socket
+typedef struct {
+    int fd;
+    char buf[LINE_BUFFER_SIZE];
+    size_t len;
+} line_reader_t;
+
+/**
+ * show_usage - displays usage instructions
+ */
+void show_usage(const char *program_name) {
+    printf("Usage: %s -n HOST:PORT[,HOST:PORT...] [options]\n\n", program_name);
+    printf("  -n, --nodes LIST        TCP client ports of all cluster nodes\n");
+    printf("  -c, --count NUM         ADD commands to send (default: 100000)\n");
+    printf("  -w, --window NUM        Commands in flight (default: 256)\n");
+    printf("  -k, --kill-leader       Kill the leader afterwards and measure failover\n");
+    printf("  -a, --atom ATOM         Atom type to ADD (default: CARBON)\n");
+    printf("  -D, --deliver HOST:PORT Send DELIVER datagrams over UDP instead of ADDs\n");
+    printf("  -m, --molecule NAME     Molecule to DELIVER (default: WATER)\n");
+    printf("  -i, --idle NUM          Hold NUM idle connections and check the server's memory per connection\n");
+    printf("  -p, --pid PID           Server process to measure for -i (default: from STATUS)\n");
+    printf("  -b, --budget BYTES      Memory allowed per idle connection (default: %d)\n", IDLE_BUDGET_BYTES);
+    printf("  -s, --storm NUM         Open NUM connections at once, time a STATUS on each\n");
+    printf("\nExamples:\n");
+    printf("  %s -n 127.0.0.1:17001,127.0.0.1:17002,127.0.0.1:17003 -c 200000 -w 512 -k\n", program_name);
+    printf("  %s -D 127.0.0.1:12346 -m WATER -c 100000 -w 64\n", program_name);
+    printf("  %s -n 127.0.0.1:12345 -i 100000 -p $(pidof persistent_warehouse)\n", program_name);
+    printf("  %s -n 127.0.0.1:12345 -s 10000\n", program_name);
+}
+
+/**
+ * now_ms - monotonic clock in milliseconds
+ */
+double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/**
+ * connect_node - opens a TCP connection to a node, -1 on failure
+ */
+int connect_node(const bench_node_t *node) {
+    struct addrinfo hints, *res;
+    char port[16];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", node->port);
+    if (getaddrinfo(node->host, port, &hints, &res) != 0)
+        return -1;
+
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd != -1 && connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd != -1) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+/**
+ * read_line - returns the next line (without newline) within timeout_ms
+ * Returns 1 on a line, 0 on timeout, -1 if the connection closed
+ */
+int read_line(line_reader_t *reader, char *out, size_t size, int timeout_ms) {
+    while (1) {
+        char *newline = memchr(reader->buf, '\n', reader->len);
+        if (newline != NULL) {
+            size_t line_len = (size_t)(newline - reader->buf);
+            size_t copy = line_len < size - 1 ? line_len : size - 1;
+            memcpy(out, reader->buf, copy);
+            out[copy] = '\0';
+            reader->len -= line_len + 1;
+            memmove(reader->buf, newline + 1, reader->len);
+            return 1;
+        }
+        if (reader->len == sizeof(reader->buf))
+            reader->len = 0;        // overlong line, drop it
+
+        fd_set read_fds;
+        FD_ZERO(&read_fds);
+        FD_SET(reader->fd, &read_fds);
+        struct timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+        int ready = select(reader->fd + 1, &read_fds, NULL, NULL, &tv);
+        if (ready == 0)
+            return 0;
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        ssize_t n = recv(reader->fd, reader->buf + reader->len, sizeof(reader->buf) - reader->len, 0);
+        if (n <= 0)
+            return -1;
+        reader->len += (size_t)n;
+    }
+}
+
+/**
+ * query_status - asks a node for STATUS
+ * Returns 1 if it accepts writes (leader, standalone server or shard, pid
+ * filled in when reported), 0 for followers, -1 if unreachable
+ */
+int query_status(const bench_node_t *node, int *pid) {
+    static line_reader_t reader;
+    char line[512];
+
+    reader.fd = connect_node(node);
+    reader.len = 0;
+    if (reader.fd == -1)
+        return -1;
+
+    // The welcome line, if the server sends one, comes before the reply
+    int result = -1;
+    if (send(reader.fd, "STATUS\n", 7, MSG_NOSIGNAL) == 7 &&
+        read_line(&reader, line, sizeof(line), 1000) == 1 &&
+        (strncmp(line, "Connected", 9) != 0 || read_line(&reader, line, sizeof(line), 1000) == 1)) {
+        char *pid_field = strstr(line, "pid ");
+        if (pid_field != NULL)
+            *pid = atoi(pid_field + 4);
+        result = strncmp(line, "STATUS", 6) == 0 && strstr(line, "follower") == NULL;
+    }
+    close(reader.fd);
+    return result;
+}
+
+/**
+ * find_leader - polls the nodes until one reports being leader
+ * Returns the node index, or -1 after timeout_ms
+ */
+int find_leader(const bench_node_t *nodes, int count, int skip, int *pid, int timeout_ms) {
+    double deadline = now_ms() + timeout_ms;
+    while (now_ms() < deadline) {
+        for (int k = 0; k < count; k++) {
+            if (k != skip && query_status(&nodes[k], pid) == 1)
+                return k;
+        }
+        usleep(10000);
+    }
+    return -1;
+}
+
+/**
+ * run_load - sends count pipelined ADDs, at most window unanswered
+ * Returns the number of SUCCESS replies; errors are counted separately
+ */
+long run_load(const bench_node_t *node, long count, int window, long *errors) {
+    static line_reader_t reader;
+    char line[512];
+    char batch[LINE_BUFFER_SIZE];
+    long sent = 0, answered = 0, ok = 0;
+
+    *errors = 0;
+    reader.fd = connect_node(node);
+    reader.len = 0;
+    if (reader.fd == -1) {
+        fprintf(stderr, "Cannot connect to leader %s:%d\n", node->host, node->port);
+        return 0;
+    }
+
+    while (answered < count) {
+        size_t batch_len = 0;
+        size_t command_len = strlen(add_command);
+        while (sent < count && sent - answered < window && batch_len + command_len < sizeof(batch)) {
+            memcpy(batch + batch_len, add_command, command_len);
+            batch_len += command_len;
+            sent++;
+        }
+        if (batch_len > 0 && send(reader.fd, batch, batch_len, MSG_NOSIGNAL) != (ssize_t)batch_len) {
+            perror("send");
+            break;
+        }
+
+        // Read at least one reply, then whatever else is already buffered
+        int rc = read_line(&reader, line, sizeof(line), 5000);
+        if (rc != 1) {
+            fprintf(stderr, rc == 0 ? "Timed out waiting for replies\n" : "Leader closed the connection\n");
+            break;
+        }
+        do {
+            if (strncmp(line, "SUCCESS", 7) == 0) {
+                ok++;
+                answered++;
+            } else if (strncmp(line, "ERROR", 5) == 0) {
+                if (*errors == 0) fprintf(stderr, "First error: %s\n", line);
+                (*errors)++;
+                answered++;
+            }
+        } while (memchr(reader.buf, '\n', reader.len) != NULL && read_line(&reader, line, sizeof(line), 0) == 1);
+    }
+
+    close(reader.fd);
+    return ok;
+}
+
+/**
+ * run_deliver - sends count DELIVER datagrams, at most window unanswered
+ * Replies lost for a second end the run; returns the number delivered
+ */
+long run_deliver(const bench_node_t *target, const char *molecule, long count, int window,
+                 long *refused, long *errors) {
+    struct addrinfo hints, *res;
+    char port[16], request[64], reply[512];
+    long sent = 0, answered = 0, ok = 0;
+
+    *refused = *errors = 0;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    snprintf(port, sizeof(port), "%d", target->port);
+    if (getaddrinfo(target->host, port, &hints, &res) != 0) {
+        fprintf(stderr, "Cannot resolve %s\n", target->host);
+        return 0;
+    }
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd == -1 || connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
+        perror("UDP socket");
+        freeaddrinfo(res);
+        return 0;
+    }
+    freeaddrinfo(res);
+
+    struct timeval tv = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    snprintf(request, sizeof(request), "DELIVER %s 1", molecule);
+
+    while (answered < count) {
+        while (sent < count && sent - answered < window) {
+            if (send(fd, request, strlen(request), 0) < 0) {
+                perror("send");
+                break;
+            }
+            sent++;
+        }
+        ssize_t n = recv(fd, reply, sizeof(reply) - 1, 0);
+        if (n < 0) {
+            fprintf(stderr, "Timed out with %ld replies missing\n", sent - answered);
+            break;
+        }
+        reply[n] = '\0';
+        answered++;
+        if (strstr(reply, "delivered") != NULL) {
+            ok++;
+        } else if (strncmp(reply, "Not enough", 10) == 0) {
+            (*refused)++;
+        } else {
+            if (*errors == 0) fprintf(stderr, "First error: %s", reply);
+            (*errors)++;
+        }
+    }
+
+    close(fd);
+    return ok;
+}
+
+/**
+ * commit_one - retries a single ADD until a leader commits it
+ * Returns 0 on success, -1 after timeout_ms
+ */
+/**
+ * read_kb_field - a "Name: N kB" field of a /proc file, 0 if missing
+ */
+unsigned long long read_kb_field(const char *path, const char *name) {
+    char line[256];
+    unsigned long long value = 0;
+    size_t name_len = strlen(name);
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strncmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            value = strtoull(line + name_len + 1, NULL, 10);
+            break;
+        }
+    }
+    fclose(file);
+    return value;
+}
+
+/**
+ * resolve_node - fills in the IPv4 address of a node, -1 on failure
+ */
+int resolve_node(const bench_node_t *node, struct sockaddr_in *target) {
+    struct addrinfo hints, *res;
+    char port[16];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", node->port);
+    if (getaddrinfo(node->host, port, &hints, &res) != 0) {
+        fprintf(stderr, "Error: Cannot resolve %s\n", node->host);
+        return -1;
+    }
+    memcpy(target, res->ai_addr, sizeof(*target));
+    freeaddrinfo(res);
+    return 0;
+}
+
+/**
+ * raise_fd_limit - makes room for count connections, since each one needs
+ * an fd: raises both limits if allowed (root), else the soft one to the hard
+ * Returns how many connections the limit leaves room for
+ */
+long raise_fd_limit(long count) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == -1)
+        return count;
+    rlim_t wanted = (rlim_t)count + FD_RESERVE;
+    if (limit.rlim_cur < wanted) {
+        struct rlimit raised = {wanted, limit.rlim_max > wanted ? limit.rlim_max : wanted};
+        if (setrlimit(RLIMIT_NOFILE, &raised) == 0) {
+            return count;
+        }
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    getrlimit(RLIMIT_NOFILE, &limit);
+    return limit.rlim_cur < wanted ? (long)limit.rlim_cur - FD_RESERVE : count;
+}
+
+/**
+ * bench_socket - a TCP socket for the k-th of many connections to target
+ * Loopback connections are spread over 127.0.0.x source addresses, since
+ * one source address runs out of ephemeral ports long before 100k
+ */
+int bench_socket(const struct sockaddr_in *target, long k, int flags) {
+    int fd = socket(AF_INET, SOCK_STREAM | flags, 0);
+    if (fd == -1)
+        return -1;
+    if ((ntohl(target->sin_addr.s_addr) >> 24) == 127) {
+        struct sockaddr_in source;
+        memset(&source, 0, sizeof(source));
+        source.sin_family = AF_INET;
+        source.sin_addr.s_addr = htonl(0x7F000001 + (uint32_t)(k / IDLE_PER_SOURCE));
+#ifdef IP_BIND_ADDRESS_NO_PORT
+        int one = 1;
+        setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+#endif
+        bind(fd, (struct sockaddr *)&source, sizeof(source));
+    }
+    return fd;
+}
+
+/**
+ * connect_idle - opens the k-th idle connection and waits for the welcome line
+ * Returns the fd, or -1 if the server refused or could not be reached
+ */
+int connect_idle(const struct sockaddr_in *target, long k) {
+    int fd = bench_socket(target, k, 0);
+    if (fd == -1)
+        return -1;
+
+    char welcome[256];
+    ssize_t n;
+    if (connect(fd, (const struct sockaddr *)target, sizeof(*target)) == -1 ||
+        (n = recv(fd, welcome, sizeof(welcome) - 1, 0)) <= 0) {
+        close(fd);
+        return -1;
+    }
+    welcome[n] = '\0';
+    if (strncmp(welcome, "Connected", 9) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * run_idle - holds count idle connections to a server and measures how much
+ * its resident memory grew per connection
+ * If RLIMIT_NOFILE cannot be raised far enough, the test runs at the count
+ * it allows and says so; the budget is only checked at the count opened
+ * Returns 0 if all of them were opened within budget bytes per connection,
+ * 1 if over budget, -1 on errors or if fewer were opened
+ */
+int run_idle(const bench_node_t *node, long count, int pid, long budget) {
+    char proc_path[64];
+    struct sockaddr_in target;
+    if (resolve_node(node, &target) == -1)
+        return -1;
+
+    long allowed = raise_fd_limit(count);
+    if (allowed < count) {
+        printf("RLIMIT_NOFILE allows only %ld connections (raise the hard ulimit -n), testing %ld instead of %ld\n",
+               allowed, allowed, count);
+        count = allowed;
+        if (count <= 0)
+            return -1;
+    }
+    int *fds = malloc(sizeof(int) * (size_t)count);
+    if (fds == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    snprintf(proc_path, sizeof(proc_path), "/proc/%d/status", pid);
+    unsigned long long rss_before = read_kb_field(proc_path, "VmRSS");
+    unsigned long long slab_before = read_kb_field("/proc/meminfo", "Slab");
+    if (rss_before == 0) {
+        fprintf(stderr, "Error: Cannot read the memory of pid %d\n", pid);
+        free(fds);
+        return -1;
+    }
+
+    double start = now_ms();
+    long opened = 0;
+    errno = 0;
+    while (opened < count && (fds[opened] = connect_idle(&target, opened)) != -1) {
+        opened++;
+    }
+    double elapsed = now_ms() - start;
+    if (opened < count) {
+        fprintf(stderr, "Stopped after %ld connections: %s\n", opened, errno ? strerror(errno) : "refused");
+    }
+    unsigned long long rss_after = read_kb_field(proc_path, "VmRSS");
+    unsigned long long slab_after = read_kb_field("/proc/meminfo", "Slab");
+
+    double per_conn = opened > 0 && rss_after > rss_before ? (rss_after - rss_before) * 1024.0 / opened : 0.0;
+    double kernel_per_conn = opened > 0 && slab_after > slab_before ? (slab_after - slab_before) * 1024.0 / opened : 0.0;
+    printf("Opened %ld/%ld idle connections in %.1f ms\n", opened, count, elapsed);
+    printf("Server RSS: %llu KB -> %llu KB, %.0f B per connection for %ld connections (budget %ld B, %.1f MB)\n",
+           rss_before, rss_after, per_conn, opened, budget, budget * (double)opened / (1024 * 1024));
+    printf("Kernel slab (both socket ends, whole host): %.0f B per connection\n", kernel_per_conn);
+
+    for (long k = 0; k < opened; k++) {
+        close(fds[k]);
+    }
+    free(fds);
+    if (per_conn > budget)
+        return 1;
+    if (opened < count) {
+        printf("Incomplete: budget checked for %ld of %ld connections only\n", opened, count);
+        return -1;
+    }
+    printf("Within budget at %ld connections\n", opened);
+    return 0;
+}
+
+/**
+ * compare_ms - qsort order for latencies
+ */
+int compare_ms(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * run_storm - starts count non-blocking connects at once, sends STATUS on
+ * each as soon as it is established, and times the first STATUS reply
+ * Returns the number of connections answered; failures are counted separately
+ */
+long run_storm(const bench_node_t *node, long count, long *failed) {
+    struct sockaddr_in target;
+    if (resolve_node(node, &target) == -1)
+        return -1;
+    if (raise_fd_limit(count) < count) {
+        fprintf(stderr, "Warning: RLIMIT_NOFILE is too low for %ld connections, some will fail\n", count);
+    }
+
+    int epoll_fd = epoll_create1(0);
+    int *fds = malloc(sizeof(int) * (size_t)count);
+    double *latency = malloc(sizeof(double) * (size_t)count);
+    if (epoll_fd == -1 || fds == NULL || latency == NULL) {
+        perror("Storm setup");
+        free(fds);
+        free(latency);
+        return -1;
+    }
+
+    long answered = 0, open_count = 0;
+    *failed = 0;
+    double start = now_ms();
+    for (long k = 0; k < count; k++) {
+        fds[k] = bench_socket(&target, k, SOCK_NONBLOCK);
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLOUT;
+        event.data.u64 = (uint64_t)k;
+        if (fds[k] == -1 ||
+            (connect(fds[k], (struct sockaddr *)&target, sizeof(target)) == -1 && errno != EINPROGRESS) ||
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fds[k], &event) == -1) {
+            if (fds[k] != -1) close(fds[k]);
+            fds[k] = -1;
+            (*failed)++;
+            continue;
+        }
+        open_count++;
+    }
+    double launched = now_ms();
+
+    struct epoll_event events[256];
+    while (open_count > 0 && now_ms() - start < STORM_TIMEOUT_MS) {
+        int ready = epoll_wait(epoll_fd, events, 256, 100);
+        for (int e = 0; e < ready; e++) {
+            long k = (long)events[e].data.u64;
+            int fd = fds[k];
+            int done = 0, err = 0;
+            socklen_t errlen = sizeof(err);
+
+            if (events[e].events & EPOLLOUT) {
+                // Established (or refused): ask for STATUS, then wait for it
+                struct epoll_event event;
+                memset(&event, 0, sizeof(event));
+                event.events = EPOLLIN;
+                event.data.u64 = (uint64_t)k;
+                if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == -1 || err != 0 ||
+                    send(fd, "STATUS\n", 7, MSG_NOSIGNAL) != 7 ||
+                    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event) == -1) {
+                    done = -1;
+                }
+            } else {
+                // The welcome line may come first; the STATUS reply ends the wait
+                char buf[1024];
+                ssize_t n = recv(fd, buf, sizeof(buf) - 1, 0);
+                if (n <= 0) {
+                    done = n == -1 && errno == EAGAIN ? 0 : -1;
+                } else {
+                    buf[n] = '\0';
+                    if (strncmp(buf, "STATUS", 6) == 0 || strstr(buf, "\nSTATUS") != NULL) {
+                        latency[answered++] = now_ms() - start;
+                        done = 1;
+                    } else if (strncmp(buf, "ERROR", 5) == 0) {
+                        done = -1;
+                    }
+                }
+            }
+            if (done != 0) {
+                if (done == -1) (*failed)++;
+                close(fd);
+                fds[k] = -1;
+                open_count--;
+            }
+        }
+    }
+    double elapsed = now_ms() - start;
+
+    for (long k = 0; k < count; k++) {
+        if (fds[k] != -1) close(fds[k]);
+    }
+    *failed += open_count;
+    close(epoll_fd);
+
+    printf("Storm: %ld connects issued in %.1f ms, %ld/%ld answered in %.1f ms (%.0f conn/sec), %ld failed or timed out\n",
+           count, launched - start, answered, count, elapsed, elapsed > 0 ? answered * 1000.0 / elapsed : 0.0, *failed);
+    if (answered > 0) {
+        qsort(latency, (size_t)answered, sizeof(double), compare_ms);
+        printf("Time to STATUS reply: p50=%.1f ms p90=%.1f ms p99=%.1f ms max=%.1f ms\n",
+               latency[answered / 2], latency[answered * 9 / 10], latency[answered * 99 / 100],
+               latency[answered - 1]);
+    }
+    free(fds);
+    free(latency);
+    return answered;
+}
+
+int commit_one(const bench_node_t *nodes, int count, int skip, int timeout_ms) {
+    double deadline = now_ms() + timeout_ms;
+    while (now_ms() < deadline) {
+        int pid = 0;
+        int leader = find_leader(nodes, count, skip, &pid, (int)(deadline - now_ms()));
+        if (leader < 0)
+            break;
+        long errors;
+        if (run_load(&nodes[leader], 1, 1, &errors) == 1)
+            return 0;
+        usleep(10000);
+    }
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    bench_node_t nodes[MAX_NODES];
+    int node_count = 0;
+    long count = 100000;
+    int window = 256;
+    int kill_leader = 0;
+    bench_node_t deliver_target;
+    int deliver_mode = 0;
+    const char *molecule = "WATER";
+    long idle = 0;
+    int server_pid = 0;
+    long budget = IDLE_BUDGET_BYTES;
+    long storm = 0;
+
+    static struct option long_options[] = {
+        {"nodes", required_argument, 0, 'n'},
+        {"count", required_argument, 0, 'c'},
+        {"window", required_argument, 0, 'w'},
+        {"kill-leader", no_argument, 0, 'k'},
+        {"atom", required_argument, 0, 'a'},
+        {"deliver", required_argument, 0, 'D'},
+        {"molecule", required_argument, 0, 'm'},
+        {"idle", required_argument, 0, 'i'},
+        {"pid", required_argument, 0, 'p'},
+        {"budget", required_argument, 0, 'b'},
+        {"storm", required_argument, 0, 's'},
+        {"help", no_argument, 0, '?'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:c:w:ka:D:m:i:p:b:s:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'n': {
+                char *list = strdup(optarg);
+                for (char *item = strtok(list, ","); item != NULL; item = strtok(NULL, ",")) {
+                    if (node_count == MAX_NODES ||
+                        sscanf(item, "%63[^:]:%d", nodes[node_count].host, &nodes[node_count].port) != 2) {
+                        fprintf(stderr, "Error: Invalid node list: %s\n", optarg);
+                        exit(EXIT_FAILURE);
+                    }
+                    node_count++;
+                }
+                free(list);
+                break;
+            }
+            case 'c':
+                count = atol(optarg);
+                if (count <= 0) {
+                    fprintf(stderr, "Error: Invalid count: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'w':
+                window = atoi(optarg);
+                if (window <= 0 || window > LINE_BUFFER_SIZE / 32) {
+                    fprintf(stderr, "Error: Invalid window: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'k':
+                kill_leader = 1;
+                break;
+            case 'a':
+                snprintf(add_command, sizeof(add_command), "ADD %.16s 1\n", optarg);
+                break;
+            case 'D':
+                if (sscanf(optarg, "%63[^:]:%d", deliver_target.host, &deliver_target.port) != 2) {
+                    fprintf(stderr, "Error: Invalid DELIVER target: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                deliver_mode = 1;
+                break;
+            case 'm':
+                molecule = optarg;
+                break;
+            case 'i':
+                idle = atol(optarg);
+                if (idle <= 0) {
+                    fprintf(stderr, "Error: Invalid idle count: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'p':
+                server_pid = atoi(optarg);
+                break;
+            case 'b':
+                budget = atol(optarg);
+                if (budget <= 0) {
+                    fprintf(stderr, "Error: Invalid budget: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 's':
+                storm = atol(optarg);
+                if (storm <= 0) {
+                    fprintf(stderr, "Error: Invalid storm size: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case '?':
+            default:
+                show_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (deliver_mode) {
+        long refused, errors;
+        double start = now_ms();
+        long ok = run_deliver(&deliver_target, molecule, count, window, &refused, &errors);
+        double elapsed = now_ms() - start;
+        printf("Delivered %ld/%ld %s in %.1f ms (%ld refused, %ld errors), window %d: %.0f ops/sec\n",
+               ok, count, molecule, elapsed, refused, errors, window,
+               elapsed > 0 ? (ok + refused) * 1000.0 / elapsed : 0.0);
+        return 0;
+    }
+
+    if (node_count == 0) {
+        show_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    int leader_pid = 0;
+    int leader = find_leader(nodes, node_count, -1, &leader_pid, FAILOVER_TIMEOUT_MS);
+    if (leader < 0) {
+        fprintf(stderr, "Error: No leader found\n");
+        exit(EXIT_FAILURE);
+    }
+    printf("Leader: %s:%d (pid %d)\n", nodes[leader].host, nodes[leader].port, leader_pid);
+
+    if (storm > 0) {
+        long failed;
+        return run_storm(&nodes[leader], storm, &failed) == storm ? 0 : EXIT_FAILURE;
+    }
+
+    if (idle > 0) {
+        if (server_pid <= 0) server_pid = leader_pid;
+        if (server_pid <= 0) {
+            fprintf(stderr, "Error: Server pid unknown, pass -p\n");
+            exit(EXIT_FAILURE);
+        }
+        int result = run_idle(&nodes[leader], idle, server_pid, budget);
+        if (result == 1) printf("Over budget\n");
+        return result == 0 ? 0 : EXIT_FAILURE;
+    }
+
+    long errors;
+    double start = now_ms();
+    long ok = run_load(&nodes[leader], count, window, &errors);
+    double elapsed = now_ms() - start;
+    printf("Committed %ld/%ld ADDs in %.1f ms (%ld errors), window %d: %.0f ops/sec\n",
+           ok, count, elapsed, errors, window, elapsed > 0 ? ok * 1000.0 / elapsed : 0.0);
+
+    if (kill_leader) {
+        if (leader_pid <= 0 || kill(leader_pid, SIGKILL) == -1) {
+            perror("Failed to kill leader");
+            exit(EXIT_FAILURE);
+        }
+        double killed = now_ms();
+        printf("Killed leader pid %d\n", leader_pid);
+
+        int new_pid = 0;
+        int new_leader = find_leader(nodes, node_count, leader, &new_pid, FAILOVER_TIMEOUT_MS);
+        if (new_leader < 0) {
+            printf("No new leader within %d ms\n", FAILOVER_TIMEOUT_MS);
+            exit(EXIT_FAILURE);
+        }
+        double elected = now_ms();
+        if (commit_one(nodes, node_count, leader, FAILOVER_TIMEOUT_MS) != 0) {
+            printf("No commit within %d ms of the new election\n", FAILOVER_TIMEOUT_MS);
+            exit(EXIT_FAILURE);
+        }
+        double committed = now_ms();
+        printf("Failover: new leader %s:%d after %.1f ms, first commit after %.1f ms\n",
+               nodes[new_leader].host, nodes[new_leader].port, elected - killed, committed - killed);
+    }
+
+    return 0;
+}
@@ -0,0 +1,761 @@
+/**
+ * warehouse_coordinator.c - q6
+ *
+ * Two-phase commit coordinator for the sharded warehouse.
+ * Every shard is a persistent_warehouse started with --shard ATOM that owns
+ * one atom type. Clients send DELIVER requests here (UDP or UDS datagram):
+ * the coordinator asks each shard involved to PREPARE (hold) its atoms and
+ * sends COMMIT only if all of them agreed, ABORT otherwise. A delivery is
+ * reported only once every shard has acknowledged its COMMIT.
+ *
+ * Each connection starts with COORDINATOR, which the shards require before
+ * taking PREPARE, COMMIT or ABORT. A shard keeps its holds when the
+ * connection drops and lists them (INDOUBT) when it comes back, so the
+ * decision that got lost is sent again. Holds of an earlier coordinator
+ * process are left in doubt: decisions are not logged.
+ *
+ * Shards are reached over their UDS stream sockets. Many transactions are in
+ * flight at once, and all messages for a shard produced in one loop
+ * iteration go out in a single write.
+ *
+ * Usage:
+ *   ./warehouse_coordinator -C carbon.sock -O oxygen.sock -H hydrogen.sock -U <udp_port> [-d <datagram_path>]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define BUFFER_SIZE 256
+#define MAX_ATOMS 1000000000000000000ULL
+#define SHARD_COUNT 3
+#define SHARD_BUFFER_SIZE 65536
+#define MAX_TXNS 4096
+#define SHARD_RETRY_SEC 1
+
+// Connection to one shard's UDS stream socket
+typedef struct {
+    const char *atom;
+    char *path;
+    int fd;
+    char in[SHARD_BUFFER_SIZE];
+    size_t in_len;
+    char *out;
+    size_t out_len, out_cap;
+    time_t retry_time;
+} shard_conn_t;
+
+// One DELIVER in progress
+typedef struct {
+    unsigned long long txid;            // 0 = free slot
+    unsigned char needed;               // shards taking part (bit per shard)
+    unsigned char prepared;             // shards that voted PREPARED
+    unsigned char answered;             // shards that voted or failed
+    unsigned char acked;                // shards that applied the decision or hold nothing
+    unsigned char listed;               // shards that reported it in doubt after reconnecting
+    int refused;
+    int failed;                         // a shard connection was lost
+    int committed;                      // COMMIT sent
+    int replied;
+    unsigned long long quantity;
+    const char *molecule;
+    int reply_fd;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    unsigned long long start_ns;
+} txn_t;
+
+// Atoms per molecule, in shard order: CARBON, OXYGEN, HYDROGEN
+typedef struct {
+    const char *name;
+    unsigned long long atoms[SHARD_COUNT];
+} recipe_t;
+
+const recipe_t recipes[] = {
+    {"WATER", {0, 1, 2}},
+    {"CARBON DIOXIDE", {1, 2, 0}},
+    {"ALCOHOL", {2, 1, 6}},
+    {"GLUCOSE", {6, 6, 12}},
+};
+
+volatile int timeout_occurred = 0;
+
+shard_conn_t shards[SHARD_COUNT];
+txn_t txns[MAX_TXNS];
+unsigned long long next_txid = 1;               // the high half tells coordinator processes apart
+int txns_active = 0;
+
+// Metrics
+unsigned long long stat_committed = 0, stat_refused = 0, stat_failed = 0, stat_busy = 0, stat_in_doubt = 0;
+unsigned long long stat_total_ns = 0, stat_max_ns = 0;
+
+/**
+ * timeout_handler - handles the timeout signal
+ */
+void timeout_handler(int sig) {
+    (void)sig;  // Prevent compiler warning
+    timeout_occurred = 1;
+}
+
+/**
+ * show_usage - displays usage instructions
+ */
+void show_usage(const char *program_name) {
+    printf("Usage: %s -C PATH -O PATH -H PATH [client options]\n\n", program_name);
+    printf("Shard options (UDS stream paths of persistent_warehouse --shard):\n");
+    printf("  -C, --carbon-shard PATH   Shard holding CARBON\n");
+    printf("  -O, --oxygen-shard PATH   Shard holding OXYGEN\n");
+    printf("  -H, --hydrogen-shard PATH Shard holding HYDROGEN\n\n");
+    printf("Client options:\n");
+    printf("  -U, --udp-port PORT       UDP port for DELIVER requests\n");
+    printf("  -d, --datagram-path PATH  UDS datagram path for DELIVER requests\n");
+    printf("  -t, --timeout SEC         Timeout in seconds (default: no timeout)\n");
+    printf("\nExample:\n");
+    printf("  %s -C /tmp/carbon.sock -O /tmp/oxygen.sock -H /tmp/hydrogen.sock -U 12346\n", program_name);
+}
+
+/**
+ * monotonic_ns - monotonic clock in nanoseconds
+ */
+unsigned long long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+/**
+ * connect_shard - connects to a shard's UDS stream socket
+ * Returns 0 on success, -1 on failure (retried later)
+ */
+int connect_shard(shard_conn_t *shard) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, shard->path, sizeof(addr.sun_path) - 1);
+
+    shard->retry_time = time(NULL) + SHARD_RETRY_SEC;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("Shard socket");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Sent before anything else; the socket buffer is empty, so this cannot block
+    const char *hello = "COORDINATOR\n";
+    if (send(fd, hello, strlen(hello), MSG_NOSIGNAL) != (ssize_t)strlen(hello)) {
+        perror("Shard hello");
+        close(fd);
+        return -1;
+    }
+
+    shard->fd = fd;
+    shard->in_len = 0;
+    shard->out_len = 0;
+    printf("Connected to %s shard at %s\n", shard->atom, shard->path);
+    return 0;
+}
+
+/**
+ * queue_shard - appends a protocol line to a shard's output buffer
+ */
+void queue_shard(shard_conn_t *shard, const char *line) {
+    size_t len = strlen(line);
+    if (shard->out_len + len > shard->out_cap) {
+        size_t cap = shard->out_cap ? shard->out_cap * 2 : SHARD_BUFFER_SIZE;
+        while (cap < shard->out_len + len)
+            cap *= 2;
+        char *grown = realloc(shard->out, cap);
+        if (grown == NULL) {
+            perror("Shard buffer allocation");
+            return;
+        }
+        shard->out = grown;
+        shard->out_cap = cap;
+    }
+    memcpy(shard->out + shard->out_len, line, len);
+    shard->out_len += len;
+}
+
+/**
+ * flush_shard - writes as much queued output as the shard accepts
+ * Returns 0 on success, -1 if the connection failed
+ */
+int flush_shard(shard_conn_t *shard) {
+    size_t off = 0;
+    while (off < shard->out_len) {
+        ssize_t n = send(shard->fd, shard->out + off, shard->out_len - off, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        off += (size_t)n;
+    }
+    memmove(shard->out, shard->out + off, shard->out_len - off);
+    shard->out_len -= off;
+    return 0;
+}
+
+/**
+ * reply_client - sends a reply to the datagram client of a transaction
+ */
+void reply_client(txn_t *txn, const char *msg) {
+    sendto(txn->reply_fd, msg, strlen(msg), 0, (struct sockaddr*)&txn->addr, txn->addrlen);
+}
+
+/**
+ * reply_txn - tells the client how its DELIVER ended
+ */
+void reply_txn(txn_t *txn) {
+    char reply[BUFFER_SIZE];
+    if (!txn->refused) {
+        if (txn->quantity == 1) {
+            snprintf(reply, sizeof(reply), "Molecule delivered successfully.\n");
+        } else {
+            snprintf(reply, sizeof(reply), "Delivered %llu %s successfully.\n", txn->quantity, txn->molecule);
+        }
+        stat_committed++;
+    } else if (txn->failed) {
+        snprintf(reply, sizeof(reply), "ERROR: Shard unavailable, transaction aborted.\n");
+    } else {
+        snprintf(reply, sizeof(reply), "Not enough atoms for this molecule.\n");
+    }
+    reply_client(txn, reply);
+
+    unsigned long long elapsed = monotonic_ns() - txn->start_ns;
+    stat_total_ns += elapsed;
+    if (elapsed > stat_max_ns) stat_max_ns = elapsed;
+    txn->replied = 1;
+}
+
+/**
+ * finish_txn - answers the client once every shard acknowledged the COMMIT,
+ * or once every shard has voted or failed if the transaction was aborted
+ * The slot is freed when no shard may still hold atoms for it
+ */
+void finish_txn(txn_t *txn) {
+    if (!txn->replied && (txn->committed ? txn->acked == txn->needed : txn->answered == txn->needed && txn->refused)) {
+        reply_txn(txn);
+    }
+    if (txn->replied && txn->acked == txn->needed) {
+        txn->txid = 0;
+        txns_active--;
+    }
+}
+
+/**
+ * decide_txn - COMMITs once all shards prepared, ABORTs prepared shards on refusal
+ */
+void decide_txn(txn_t *txn) {
+    char line[64];
+    if (!txn->refused && !txn->committed && txn->prepared == txn->needed) {
+        txn->committed = 1;
+        snprintf(line, sizeof(line), "COMMIT %llu\n", txn->txid);
+        for (int s = 0; s < SHARD_COUNT; s++) {
+            if (txn->needed & (1 << s)) queue_shard(&shards[s], line);
+        }
+    }
+    finish_txn(txn);
+}
+
+/**
+ * handle_ack - applies a COMMITTED, ABORTED or UNKNOWN line from shard s
+ */
+void handle_ack(int s, unsigned long long txid) {
+    txn_t *txn = &txns[txid % MAX_TXNS];
+    if (txn->txid != txid || !(txn->needed & (1 << s)))
+        return;
+    txn->acked |= 1 << s;
+    finish_txn(txn);
+}
+
+/**
+ * handle_in_doubt - sends a reconnected shard the decision on a hold it still has
+ */
+void handle_in_doubt(int s, unsigned long long txid) {
+    char line[64];
+    txn_t *txn = &txns[txid % MAX_TXNS];
+    if (txn->txid != txid || !(txn->needed & (1 << s))) {
+        printf("%s shard holds transaction %llu of an earlier coordinator, left in doubt\n", shards[s].atom, txid);
+        stat_in_doubt++;
+        return;
+    }
+    txn->listed |= 1 << s;
+    if (txn->committed || txn->refused) {
+        snprintf(line, sizeof(line), "%s %llu\n", txn->committed ? "COMMIT" : "ABORT", txid);
+        queue_shard(&shards[s], line);
+    }
+}
+
+/**
+ * finish_resync - after a reconnect, takes the transactions shard s did not
+ * list as settled there: it applied the decision before the connection dropped,
+ * or never held atoms for them
+ */
+void finish_resync(int s) {
+    for (int k = 0; k < MAX_TXNS; k++) {
+        txn_t *txn = &txns[k];
+        if (txn->txid == 0 || !(txn->needed & (1 << s)) || !(txn->answered & (1 << s)) || (txn->acked & (1 << s)))
+            continue;
+        if (txn->listed & (1 << s)) {
+            txn->listed &= ~(1 << s);
+            continue;
+        }
+        txn->acked |= 1 << s;
+        finish_txn(txn);
+    }
+}
+
+/**
+ * handle_vote - applies a PREPARED or REFUSED line from shard s
+ */
+void handle_vote(int s, const char *line) {
+    unsigned long long txid;
+    int prepared = sscanf(line, "PREPARED %llu", &txid) == 1;
+    if (!prepared && sscanf(line, "REFUSED %llu", &txid) != 1) {
+        printf("Unexpected reply from %s shard: %s\n", shards[s].atom, line);
+        return;
+    }
+
+    txn_t *txn = &txns[txid % MAX_TXNS];
+    if (txn->txid != txid || !(txn->needed & (1 << s)) || (txn->answered & (1 << s)))
+        return;
+
+    txn->answered |= 1 << s;
+    if (!prepared) txn->acked |= 1 << s;
+    if (prepared) {
+        txn->prepared |= 1 << s;
+        if (txn->refused) {
+            // Another shard already refused, release this hold right away
+            char abort_line[64];
+            snprintf(abort_line, sizeof(abort_line), "ABORT %llu\n", txid);
+            queue_shard(&shards[s], abort_line);
+        }
+    } else if (!txn->refused) {
+        txn->refused = 1;
+        stat_refused++;
+        char abort_line[64];
+        snprintf(abort_line, sizeof(abort_line), "ABORT %llu\n", txid);
+        for (int k = 0; k < SHARD_COUNT; k++) {
+            if (txn->prepared & (1 << k)) queue_shard(&shards[k], abort_line);
+        }
+    }
+    decide_txn(txn);
+}
+
+/**
+ * disconnect_shard - drops a shard connection and aborts the transactions
+ * still waiting for its vote
+ * The shard keeps its holds, so transactions it voted on, and decisions it
+ * has not acknowledged, are settled when it reconnects
+ */
+void disconnect_shard(int s) {
+    printf("Lost connection to %s shard\n", shards[s].atom);
+    close(shards[s].fd);
+    shards[s].fd = -1;
+    shards[s].out_len = 0;
+    shards[s].retry_time = time(NULL) + SHARD_RETRY_SEC;
+
+    char abort_line[64];
+    for (int k = 0; k < MAX_TXNS; k++) {
+        txn_t *txn = &txns[k];
+        if (txn->txid == 0 || !(txn->needed & (1 << s)) || (txn->answered & (1 << s)))
+            continue;
+        if (!txn->refused) {
+            txn->refused = 1;
+            stat_failed++;
+            snprintf(abort_line, sizeof(abort_line), "ABORT %llu\n", txn->txid);
+            for (int j = 0; j < SHARD_COUNT; j++) {
+                if (j != s && (txn->prepared & (1 << j))) queue_shard(&shards[j], abort_line);
+            }
+        }
+        txn->answered |= 1 << s;
+        txn->failed = 1;
+        finish_txn(txn);
+    }
+}
+
+/**
+ * read_shard - reads replies from a shard and dispatches complete lines
+ * Returns 0 on success, -1 if the connection closed
+ */
+int read_shard(int s) {
+    shard_conn_t *shard = &shards[s];
+    ssize_t n = recv(shard->fd, shard->in + shard->in_len, sizeof(shard->in) - 1 - shard->in_len, 0);
+    if (n <= 0)
+        return -1;
+    shard->in_len += (size_t)n;
+    shard->in[shard->in_len] = '\0';
+
+    char *start = shard->in;
+    char *newline;
+    unsigned long long txid;
+    while ((newline = strchr(start, '\n')) != NULL) {
+        *newline = '\0';
+        if (strncmp(start, "Connected to", 12) == 0) {
+            // Welcome line, unless the shard runs with welcome = 0
+        } else if (strncmp(start, "Server shutting down", 20) == 0) {
+            return -1;
+        } else if (strncmp(start, "ERROR:", 6) == 0) {
+            // e.g. another coordinator holds the shard; try again later
+            printf("%s shard: %s\n", shard->atom, start);
+            return -1;
+        } else if (sscanf(start, "COMMITTED %llu", &txid) == 1 || sscanf(start, "ABORTED %llu", &txid) == 1) {
+            handle_ack(s, txid);
+        } else if (sscanf(start, "UNKNOWN %llu", &txid) == 1) {
+            printf("%s shard did not hold transaction %llu\n", shard->atom, txid);
+            handle_ack(s, txid);
+        } else if (sscanf(start, "INDOUBT %llu", &txid) == 1) {
+            handle_in_doubt(s, txid);
+        } else if (strncmp(start, "COORDINATOR OK", 14) == 0) {
+            finish_resync(s);
+        } else {
+            handle_vote(s, start);
+        }
+        start = newline + 1;
+    }
+    shard->in_len -= (size_t)(start - shard->in);
+    memmove(shard->in, start, shard->in_len);
+    if (shard->in_len == sizeof(shard->in) - 1)
+        shard->in_len = 0;              // overlong line, drop it
+    return 0;
+}
+
+/**
+ * handle_deliver - parses a DELIVER request and starts its transaction
+ */
+void handle_deliver(char *buffer, int req_fd, void *client_addr, socklen_t addrlen) {
+    char molecule[64];
+    unsigned long long quantity = 1;
+    char reply[BUFFER_SIZE];
+
+    int parsed = sscanf(buffer, "DELIVER %63s %llu", molecule, &quantity);
+    if (parsed < 1) {
+        snprintf(reply, sizeof(reply), "Invalid DELIVER command.\n");
+        sendto(req_fd, reply, strlen(reply), 0, (struct sockaddr*)client_addr, addrlen);
+        return;
+    }
+    if (strcmp(molecule, "CARBON") == 0) {
+        char dioxide[32];
+        if (sscanf(buffer, "DELIVER CARBON %31s %llu", dioxide, &quantity) >= 2 &&
+            strcmp(dioxide, "DIOXIDE") == 0) {
+            strcpy(molecule, "CARBON DIOXIDE");
+        } else if (sscanf(buffer, "DELIVER CARBON %31s", dioxide) == 1 &&
+                   strcmp(dioxide, "DIOXIDE") == 0) {
+            strcpy(molecule, "CARBON DIOXIDE");
+            quantity = 1;
+        }
+    }
+    if (parsed == 1) {
+        quantity = 1;
+    }
+
+    if (quantity == 0 || quantity > MAX_ATOMS) {
+        snprintf(reply, sizeof(reply), "ERROR: Invalid quantity %llu (must be 1-%llu).\n", quantity, MAX_ATOMS);
+        sendto(req_fd, reply, strlen(reply), 0, (struct sockaddr*)client_addr, addrlen);
+        return;
+    }
+
+    const recipe_t *recipe = NULL;
+    for (size_t k = 0; k < sizeof(recipes) / sizeof(recipes[0]); k++) {
+        if (strcmp(molecule, recipes[k].name) == 0) recipe = &recipes[k];
+    }
+    if (recipe == NULL) {
+        snprintf(reply, sizeof(reply), "Not enough atoms for this molecule.\n");
+        sendto(req_fd, reply, strlen(reply), 0, (struct sockaddr*)client_addr, addrlen);
+        return;
+    }
+
+    for (int s = 0; s < SHARD_COUNT; s++) {
+        if (recipe->atoms[s] > 0 && shards[s].fd == -1) {
+            snprintf(reply, sizeof(reply), "ERROR: %s shard unavailable, retry shortly.\n", shards[s].atom);
+            sendto(req_fd, reply, strlen(reply), 0, (struct sockaddr*)client_addr, addrlen);
+            stat_failed++;
+            return;
+        }
+    }
+
+    txn_t *txn = &txns[next_txid % MAX_TXNS];
+    if (txn->txid != 0 || addrlen > sizeof(txn->addr)) {
+        snprintf(reply, sizeof(reply), "ERROR: Coordinator busy, retry shortly.\n");
+        sendto(req_fd, reply, strlen(reply), 0, (struct sockaddr*)client_addr, addrlen);
+        stat_busy++;
+        return;
+    }
+
+    memset(txn, 0, sizeof(*txn));
+    txn->txid = next_txid++;
+    txn->quantity = quantity;
+    txn->molecule = recipe->name;
+    txn->reply_fd = req_fd;
+    memcpy(&txn->addr, client_addr, addrlen);
+    txn->addrlen = addrlen;
+    txn->start_ns = monotonic_ns();
+    txns_active++;
+
+    // Phase one: every shard involved holds its share
+    char line[96];
+    for (int s = 0; s < SHARD_COUNT; s++) {
+        if (recipe->atoms[s] == 0) continue;
+        txn->needed |= 1 << s;
+        snprintf(line, sizeof(line), "PREPARE %llu %llu\n", txn->txid, recipe->atoms[s] * quantity);
+        queue_shard(&shards[s], line);
+    }
+}
+
+/**
+ * print_stats - prints transaction counters and latency
+ */
+void print_stats(void) {
+    unsigned long long done = stat_committed + stat_refused;
+    printf("2PC: committed=%llu refused=%llu failed=%llu busy=%llu in flight=%d in doubt=%llu\n",
+           stat_committed, stat_refused, stat_failed, stat_busy, txns_active, stat_in_doubt);
+    printf("2PC latency: avg=%.1f us max=%.1f us\n",
+           done ? stat_total_ns / 1000.0 / done : 0.0, stat_max_ns / 1000.0);
+    for (int s = 0; s < SHARD_COUNT; s++) {
+        printf("  %s shard %s: %s\n", shards[s].atom, shards[s].path,
+               shards[s].fd == -1 ? "disconnected" : "connected");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int udp_port = -1;
+    char *datagram_path = NULL;
+    int timeout_seconds = 0;
+    const char *atoms[SHARD_COUNT] = {"CARBON", "OXYGEN", "HYDROGEN"};
+
+    for (int s = 0; s < SHARD_COUNT; s++) {
+        shards[s].atom = atoms[s];
+        shards[s].fd = -1;
+    }
+
+    static struct option long_options[] = {
+        {"carbon-shard", required_argument, 0, 'C'},
+        {"oxygen-shard", required_argument, 0, 'O'},
+        {"hydrogen-shard", required_argument, 0, 'H'},
+        {"udp-port", required_argument, 0, 'U'},
+        {"datagram-path", required_argument, 0, 'd'},
+        {"timeout", required_argument, 0, 't'},
+        {"help", no_argument, 0, '?'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "C:O:H:U:d:t:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'C':
+                shards[0].path = strdup(optarg);
+                break;
+            case 'O':
+                shards[1].path = strdup(optarg);
+                break;
+            case 'H':
+                shards[2].path = strdup(optarg);
+                break;
+            case 'U':
+                udp_port = atoi(optarg);
+                if (udp_port <= 0 || udp_port > 65535) {
+                    fprintf(stderr, "Error: Invalid UDP port: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'd':
+                datagram_path = strdup(optarg);
+                break;
+            case 't':
+                timeout_seconds = atoi(optarg);
+                if (timeout_seconds <= 0) {
+                    fprintf(stderr, "Error: Invalid timeout: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case '?':
+            default:
+                show_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (shards[0].path == NULL || shards[1].path == NULL || shards[2].path == NULL) {
+        fprintf(stderr, "Error: All three shard paths (-C/-O/-H) are required\n");
+        show_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (udp_port == -1 && datagram_path == NULL) {
+        fprintf(stderr, "Error: Must specify a UDP port (-U) or UDS datagram path (-d)\n");
+        show_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // A shard may still hold transactions of an earlier process; their txids must not come up again
+    next_txid = (unsigned long long)((unsigned)time(NULL) ^ ((unsigned)getpid() << 16)) << 32 | 1;
+
+    signal(SIGPIPE, SIG_IGN);
+    if (timeout_seconds > 0) {
+        signal(SIGALRM, timeout_handler);
+        alarm(timeout_seconds);
+        printf("Coordinator will timeout after %d seconds of inactivity\n", timeout_seconds);
+    }
+
+    int udp_fd = -1, uds_datagram_fd = -1;
+    int fdmax = STDIN_FILENO;
+
+    if (udp_port != -1) {
+        struct sockaddr_in udp_addr;
+        udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (udp_fd < 0) { perror("UDP socket error"); exit(1); }
+
+        memset(&udp_addr, 0, sizeof(udp_addr));
+        udp_addr.sin_family = AF_INET;
+        udp_addr.sin_addr.s_addr = INADDR_ANY;
+        udp_addr.sin_port = htons(udp_port);
+
+        if (bind(udp_fd, (struct sockaddr*)&udp_addr, sizeof(udp_addr)) < 0) {
+            perror("UDP bind");
+            exit(1);
+        }
+        if (udp_fd > fdmax) fdmax = udp_fd;
+    }
+
+    if (datagram_path) {
+        struct sockaddr_un datagram_addr;
+        unlink(datagram_path); // Remove existing socket file
+
+        uds_datagram_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+        if (uds_datagram_fd < 0) { perror("UDS datagram socket error"); exit(1); }
+
+        memset(&datagram_addr, 0, sizeof(datagram_addr));
+        datagram_addr.sun_family = AF_UNIX;
+        strncpy(datagram_addr.sun_path, datagram_path, sizeof(datagram_addr.sun_path) - 1);
+
+        if (bind(uds_datagram_fd, (struct sockaddr*)&datagram_addr, sizeof(datagram_addr)) < 0) {
+            perror("UDS datagram bind");
+            exit(1);
+        }
+        if (uds_datagram_fd > fdmax) fdmax = uds_datagram_fd;
+    }
+
+    for (int s = 0; s < SHARD_COUNT; s++) {
+        if (connect_shard(&shards[s]) != 0) {
+            printf("%s shard at %s not reachable yet, retrying\n", shards[s].atom, shards[s].path);
+        }
+    }
+
+    printf("Coordinator ready. Type 'STATS' for transaction counters, 'shutdown' to stop.\n");
+
+    while (1) {
+        if (timeout_occurred) {
+            printf("Timeout occurred. Coordinator shutting down.\n");
+            break;
+        }
+
+        int missing = 0;
+        for (int s = 0; s < SHARD_COUNT; s++) {
+            if (shards[s].fd == -1 && time(NULL) >= shards[s].retry_time) connect_shard(&shards[s]);
+            if (shards[s].fd == -1) missing = 1;
+        }
+
+        fd_set read_fds, write_fds;
+        FD_ZERO(&read_fds);
+        FD_ZERO(&write_fds);
+        int select_max = fdmax;
+        FD_SET(STDIN_FILENO, &read_fds);
+        if (udp_fd != -1) FD_SET(udp_fd, &read_fds);
+        if (uds_datagram_fd != -1) FD_SET(uds_datagram_fd, &read_fds);
+        for (int s = 0; s < SHARD_COUNT; s++) {
+            if (shards[s].fd == -1) continue;
+            FD_SET(shards[s].fd, &read_fds);
+            if (shards[s].out_len > 0) FD_SET(shards[s].fd, &write_fds);
+            if (shards[s].fd > select_max) select_max = shards[s].fd;
+        }
+
+        struct timeval tick = {SHARD_RETRY_SEC, 0};
+        int ready = select(select_max + 1, &read_fds, &write_fds, NULL, missing ? &tick : NULL);
+        if (ready == -1) {
+            if (timeout_occurred) break;
+            if (errno == EINTR) continue;
+            perror("select");
+            exit(1);
+        }
+
+        if (timeout_seconds > 0 && ready > 0) {
+            alarm(timeout_seconds);
+        }
+
+        for (int s = 0; s < SHARD_COUNT; s++) {
+            if (shards[s].fd != -1 && FD_ISSET(shards[s].fd, &read_fds) && read_shard(s) != 0) {
+                disconnect_shard(s);
+            }
+        }
+
+        // Drain every queued client request before flushing, so they share writes
+        int datagram_fds[2] = {udp_fd, uds_datagram_fd};
+        for (int k = 0; k < 2; k++) {
+            int fd = datagram_fds[k];
+            if (fd == -1 || !FD_ISSET(fd, &read_fds))
+                continue;
+            while (1) {
+                char buffer[BUFFER_SIZE];
+                struct sockaddr_storage client_addr;
+                socklen_t addrlen = sizeof(client_addr);
+                ssize_t nbytes = recvfrom(fd, buffer, sizeof(buffer) - 1, MSG_DONTWAIT,
+                                          (struct sockaddr*)&client_addr, &addrlen);
+                if (nbytes < 0) {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("recvfrom");
+                    break;
+                }
+                buffer[nbytes] = '\0';
+                handle_deliver(buffer, fd, &client_addr, addrlen);
+            }
+        }
+
+        if (FD_ISSET(STDIN_FILENO, &read_fds)) {
+            char input[BUFFER_SIZE];
+            if (fgets(input, sizeof(input), stdin) == NULL || strncmp(input, "shutdown", 8) == 0) {
+                printf("Shutdown command received.\n");
+                break;
+            } else if (strncmp(input, "STATS", 5) == 0) {
+                print_stats();
+            } else {
+                printf("Available commands: STATS, shutdown\n");
+            }
+        }
+
+        for (int s = 0; s < SHARD_COUNT; s++) {
+            if (shards[s].fd != -1 && shards[s].out_len > 0 && flush_shard(&shards[s]) != 0) {
+                disconnect_shard(s);
+            }
+        }
+    }
+
+    print_stats();
+    for (int s = 0; s < SHARD_COUNT; s++) {
+        if (shards[s].fd != -1) close(shards[s].fd);
+        free(shards[s].out);
+        free(shards[s].path);
+    }
+    if (udp_fd != -1) close(udp_fd);
+    if (uds_datagram_fd != -1) {
+        close(uds_datagram_fd);
+        unlink(datagram_path);
+        free(datagram_path);
+    }
+
+    printf("Coordinator terminated.\n");
+    return 0;
+}
@@ -0,0 +1,873 @@
+/**
+ * warehouse_proxy.c - q6
+ *
+ * Connection-pooling proxy in front of persistent_warehouse instances.
+ * Clients connect here (TCP or UDS stream) and speak the usual line protocol;
+ * their requests are multiplexed over a few persistent backend connections
+ * per instance, so a short-lived client costs the backends nothing.
+ *
+ * Backend connections carry ID= tags, so replies are matched to requests
+ * whatever client they came from. A client always uses the same pooled
+ * connection, so the backend runs its commands in the order sent. All
+ * requests for a backend connection that
+ * arrive in one loop iteration go out in a single write. DELIVER, which the
+ * backends take as datagrams only, is forwarded over the backend's datagram
+ * address with retransmits.
+ *
+ * Routing: a request ending in TENANT=NAME goes to the backend named NAME;
+ * ADD ATOM goes to the backend named after the atom (sharded warehouses);
+ * everything else goes to an unnamed backend, the same one for the whole
+ * client connection.
+ *
+ * Usage:
+ *   ./warehouse_proxy -T <tcp_port> [-s <stream_path>] -b [NAME=]HOST:PORT[:UDP_PORT] ...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "../q5/warehouse_client.h"
+
+#define BUFFER_SIZE 256
+#define MAX_BACKENDS 16
+#define MAX_CLIENT_FDS 65536
+#define CLIENT_BUFFER_SIZE 4096
+#define MAX_CLIENT_PENDING 1024             // requests in flight per client
+#define MAX_CLIENT_OUTPUT (64 * 1024)       // queued reply bytes before the client is no longer read
+#define PROXY_MAX_EVENTS 256
+#define PROXY_TICK_MS 50                    // how often backend timers are checked when idle
+#define BACKEND_TIMEOUT_MS 5000
+#define DEFAULT_POOL_SIZE 4
+#define REQUEST_ID_SIZE 40                  // as in persistent_warehouse
+
+// One backend instance: a pool of stream connections and a datagram path
+typedef struct {
+    char *name;                             // tenant or atom, NULL = default backend
+    char *spec;
+    wc_balancer_t *pool;
+    wc_balancer_t *datagram;                // NULL if the backend has no datagram address
+    unsigned long long forwarded;
+} backend_t;
+
+typedef struct proxy_request proxy_request_t;
+
+// One client connection
+typedef struct {
+    int fd;
+    int default_backend;                    // sticky choice among unnamed backends
+    unsigned int key;                       // picks its pooled connection
+    char in[CLIENT_BUFFER_SIZE];
+    size_t in_len;
+    char *out;                              // replies the socket did not take yet
+    size_t out_len, out_cap;
+    int discarding;                         // skipping the rest of an overlong line
+    int dead;                               // close at the end of the iteration
+    proxy_request_t *head, *tail;           // in arrival order
+    int pending;
+} proxy_client_t;
+
+// A forwarded request; replies leave in arrival order unless the client tagged it
+struct proxy_request {
+    proxy_client_t *client;                 // NULL once the client left
+    proxy_request_t *next;
+    char client_id[REQUEST_ID_SIZE];        // the client's own ID=, "" = none
+    char *reply;                            // set when done
+    int sent;
+};
+
+volatile int timeout_occurred = 0;
+
+wc_loop_t *wc_loop = NULL;
+backend_t backends[MAX_BACKENDS];
+int backend_count = 0;
+int default_backends[MAX_BACKENDS];         // indexes of unnamed backends
+int default_count = 0;
+
+proxy_client_t *clients[MAX_CLIENT_FDS];
+int client_count = 0;
+int dead_fds[MAX_CLIENT_FDS];               // clients to close at the end of the iteration
+int dead_count = 0;
+int epfd = -1;
+char welcome[BUFFER_SIZE];                  // built once, sent to every client
+int next_default = 0;
+
+// Metrics
+unsigned long long stat_accepted = 0, stat_forwarded = 0, stat_local = 0, stat_failed = 0;
+unsigned long long stat_batches = 0, stat_paused = 0, stat_too_long = 0;
+
+/**
+ * timeout_handler - handles the timeout signal
+ */
+void timeout_handler(int sig) {
+    (void)sig;  // Prevent compiler warning
+    timeout_occurred = 1;
+}
+
+/**
+ * show_usage - displays usage instructions
+ */
+void show_usage(const char *program_name) {
+    printf("Usage: %s -T PORT [-s PATH] -b BACKEND [-b BACKEND ...] [options]\n\n", program_name);
+    printf("Client options:\n");
+    printf("  -T, --tcp-port PORT       TCP port for clients\n");
+    printf("  -s, --stream-path PATH    UDS stream path for clients\n\n");
+    printf("Backend options:\n");
+    printf("  -b, --backend [NAME=]HOST:PORT[:UDP_PORT]\n");
+    printf("  -b, --backend [NAME=]PATH[,DATAGRAM_PATH]\n");
+    printf("                            A persistent_warehouse instance (UDP/datagram needed for DELIVER)\n");
+    printf("                            NAME is a tenant (requests ending in TENANT=NAME) or an atom\n");
+    printf("                            (ADD of that atom); unnamed backends take everything else\n");
+    printf("  -n, --pool-size N         Connections per backend (default %d)\n", DEFAULT_POOL_SIZE);
+    printf("  -l, --balance least|p2c   How requests pick a pooled connection (default least)\n");
+    printf("  -t, --timeout SEC         Timeout in seconds (default: no timeout)\n");
+    printf("\nExample:\n");
+    printf("  %s -T 12400 -b 127.0.0.1:12345:12346 -b acme=127.0.0.1:12355:12356\n", program_name);
+}
+
+/**
+ * mark_dead - schedules a client for closing (not safe inside a callback)
+ */
+void mark_dead(proxy_client_t *client) {
+    if (client->dead)
+        return;
+    client->dead = 1;
+    dead_fds[dead_count++] = client->fd;
+}
+
+/**
+ * client_events - watches a client for input unless its replies are backed
+ * up past MAX_CLIENT_OUTPUT, and for output while any are queued
+ * Only requests already in flight add to a paused client's queue, so it
+ * stays below MAX_CLIENT_OUTPUT plus MAX_CLIENT_PENDING replies
+ */
+void client_events(proxy_client_t *client) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = (client->out_len < MAX_CLIENT_OUTPUT ? EPOLLIN : 0) | (client->out_len > 0 ? EPOLLOUT : 0);
+    ev.data.fd = client->fd;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, client->fd, &ev);
+}
+
+/**
+ * client_flush - writes queued replies until the socket is full
+ */
+void client_flush(proxy_client_t *client) {
+    size_t off = 0;
+    while (off < client->out_len) {
+        ssize_t n = send(client->fd, client->out + off, client->out_len - off, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) mark_dead(client);
+            break;
+        }
+        off += (size_t)n;
+    }
+    memmove(client->out, client->out + off, client->out_len - off);
+    client->out_len -= off;
+    client_events(client);
+}
+
+/**
+ * client_write - queues a reply for a client and tries to send it
+ */
+void client_write(proxy_client_t *client, const char *msg) {
+    size_t len = strlen(msg);
+    if (client->out_len + len > client->out_cap) {
+        size_t cap = client->out_cap ? client->out_cap * 2 : CLIENT_BUFFER_SIZE;
+        while (cap < client->out_len + len)
+            cap *= 2;
+        char *grown = realloc(client->out, cap);
+        if (grown == NULL) {
+            mark_dead(client);
+            return;
+        }
+        client->out = grown;
+        client->out_cap = cap;
+    }
+    memcpy(client->out + client->out_len, msg, len);
+    client->out_len += len;
+    if (client->out_len == len) {
+        client_flush(client);
+    } else if (client->out_len >= MAX_CLIENT_OUTPUT && client->out_len - len < MAX_CLIENT_OUTPUT) {
+        stat_paused++;                      // it sends faster than it reads
+        client_events(client);
+    }
+}
+
+/**
+ * send_ready_replies - sends finished replies from the front of a client's queue
+ * A request the client tagged with ID= has already been answered out of order
+ */
+void send_ready_replies(proxy_client_t *client) {
+    while (client->head != NULL && client->head->reply != NULL) {
+        proxy_request_t *request = client->head;
+        if (!request->sent) client_write(client, request->reply);
+        client->head = request->next;
+        if (client->head == NULL) client->tail = NULL;
+        client->pending--;
+        free(request->reply);
+        free(request);
+    }
+}
+
+/**
+ * finish_request - stores a reply (with the client's ID= echoed on every line)
+ */
+void finish_request(proxy_request_t *request, const char *msg) {
+    char tagged[2 * WC_REPLY_SIZE];
+    if (request->client_id[0] != '\0') {
+        size_t len = 0;
+        while (*msg != '\0' && len < sizeof(tagged) - 1) {
+            int line = (int)strcspn(msg, "\n");
+            int n = snprintf(tagged + len, sizeof(tagged) - len, "%.*s ID=%s\n", line, msg, request->client_id);
+            len += (n < 0 || (size_t)n >= sizeof(tagged) - len) ? sizeof(tagged) - 1 - len : (size_t)n;
+            msg += line;
+            if (*msg == '\n') msg++;
+        }
+        tagged[len] = '\0';
+        msg = tagged;
+    }
+
+    if (request->client == NULL) {
+        free(request);                      // the client hung up meanwhile
+        return;
+    }
+    request->reply = strdup(msg);
+    if (request->reply == NULL) request->reply = strdup("");
+    if (request->client_id[0] != '\0' && request->reply != NULL) {
+        client_write(request->client, request->reply);
+        request->sent = 1;
+    }
+    send_ready_replies(request->client);
+}
+
+/**
+ * backend_reply - completion callback of a forwarded request
+ */
+void backend_reply(void *arg, int status, const char *reply) {
+    proxy_request_t *request = arg;
+    if (status == WC_OK) {
+        finish_request(request, reply);
+        return;
+    }
+    stat_failed++;
+    if (status == WC_TIMEOUT) {
+        finish_request(request, "ERROR: Backend timeout, the request may have been processed.\n");
+    } else if (status == WC_CLOSED) {
+        finish_request(request, "ERROR: Backend connection lost, the request may have been processed.\n");
+    } else {
+        finish_request(request, "ERROR: Backend unavailable, retry shortly.\n");
+    }
+}
+
+/**
+ * take_options - removes the proxy's own trailing options from a request line
+ * ID= and TENANT= are taken out; DL=, PRI= and WAIT= stay for the backend.
+ * Stops at the first token that is not an option, like the server does
+ */
+void take_options(char *line, char *client_id, char *tenant, size_t size, unsigned long long *wait_ms) {
+    client_id[0] = '\0';
+    tenant[0] = '\0';
+    *wait_ms = 0;
+
+    size_t end = strcspn(line, "\r\n");
+    line[end] = '\0';
+    size_t keep = end;                      // everything from here on is dropped
+    char kept[BUFFER_SIZE] = "";            // option tokens passed through, in order
+    while (end > 0) {
+        size_t start = end;
+        while (start > 0 && line[start - 1] != ' ') start--;
+        char *token = line + start;
+        size_t len = end - start;
+        if (strncmp(token, "ID=", 3) == 0 || strncmp(token, "TENANT=", 7) == 0) {
+            char *value = strchr(token, '=') + 1;
+            char *dest = token[0] == 'I' ? client_id : tenant;
+            size_t value_len = (size_t)(line + end - value);
+            if (value_len >= size) value_len = size - 1;
+            memcpy(dest, value, value_len);
+            dest[value_len] = '\0';
+        } else if (strncmp(token, "DL=", 3) == 0 || strncmp(token, "PRI=", 4) == 0 ||
+                   strncmp(token, "WAIT=", 5) == 0) {
+            if (strncmp(token, "WAIT=", 5) == 0) *wait_ms = strtoull(token + 5, NULL, 10);
+            size_t kept_len = strlen(kept);
+            if (len + 1 + kept_len < sizeof(kept)) {
+                memmove(kept + len + 1, kept, kept_len + 1);
+                kept[0] = ' ';
+                memcpy(kept + 1, token, len);
+            }
+        } else {
+            break;
+        }
+        keep = start > 0 ? start - 1 : 0;
+        end = keep;
+    }
+    line[keep] = '\0';
+    size_t used = strlen(line);
+    snprintf(line + used, BUFFER_SIZE - used, "%s", kept);
+}
+
+/**
+ * find_backend - a named backend's index, -1 if there is none
+ */
+int find_backend(const char *name) {
+    for (int b = 0; b < backend_count; b++) {
+        if (backends[b].name != NULL && strcmp(backends[b].name, name) == 0) return b;
+    }
+    return -1;
+}
+
+/**
+ * route_request - picks the backend for a request line (options already taken)
+ * Returns its index, or -1 with an error reply in reply
+ */
+int route_request(proxy_client_t *client, const char *line, const char *tenant, char *reply, size_t size) {
+    if (tenant[0] != '\0') {
+        int b = find_backend(tenant);
+        if (b == -1) snprintf(reply, size, "ERROR: Unknown tenant: %s\n", tenant);
+        return b;
+    }
+    char atom[16];
+    if (sscanf(line, "ADD %15s", atom) == 1) {
+        int b = find_backend(atom);
+        if (b != -1) return b;
+    }
+    if (default_count == 0) {
+        snprintf(reply, size, "ERROR: No backend for this request, add TENANT=NAME.\n");
+        return -1;
+    }
+    return default_backends[client->default_backend];
+}
+
+/**
+ * queue_request - adds a request to the end of a client's reply order
+ * Returns NULL (and drops the client) if it cannot be allocated
+ */
+proxy_request_t *queue_request(proxy_client_t *client, const char *client_id) {
+    proxy_request_t *request = calloc(1, sizeof(*request));
+    if (request == NULL) {
+        mark_dead(client);
+        return NULL;
+    }
+    request->client = client;
+    snprintf(request->client_id, sizeof(request->client_id), "%s", client_id);
+    if (client->tail) client->tail->next = request;
+    else client->head = request;
+    client->tail = request;
+    client->pending++;
+    return request;
+}
+
+/**
+ * reject_too_long - answers a line longer than a request may be
+ * Its ID= may be in the part that was cut off, so the reply is untagged
+ */
+void reject_too_long(proxy_client_t *client) {
+    proxy_request_t *request = queue_request(client, "");
+    if (request == NULL)
+        return;
+    stat_local++;
+    stat_too_long++;
+    finish_request(request, "ERROR: Command too long.\n");
+}
+
+/**
+ * handle_line - forwards one client request, or answers it here
+ */
+void handle_line(proxy_client_t *client, char *line) {
+    char client_id[REQUEST_ID_SIZE], tenant[REQUEST_ID_SIZE], reply[BUFFER_SIZE];
+    unsigned long long wait_ms;
+    take_options(line, client_id, tenant, sizeof(client_id), &wait_ms);
+    if (line[0] == '\0')
+        return;
+
+    proxy_request_t *request = queue_request(client, client_id);
+    if (request == NULL)
+        return;
+
+    if (client->pending > MAX_CLIENT_PENDING) {
+        stat_local++;
+        finish_request(request, "ERROR: Too many requests in flight.\n");
+        return;
+    }
+    if (strcmp(line, "WATCH") == 0 || strcmp(line, "UNWATCH") == 0 || strcmp(line, "SHM") == 0) {
+        stat_local++;
+        snprintf(reply, sizeof(reply), "ERROR: %s is not available through the proxy.\n", line);
+        finish_request(request, reply);
+        return;
+    }
+
+    int b = route_request(client, line, tenant, reply, sizeof(reply));
+    if (b == -1) {
+        stat_local++;
+        finish_request(request, reply);
+        return;
+    }
+
+    backend_t *backend = &backends[b];
+    wc_balancer_t *target = backend->pool;
+    int timeout_ms = BACKEND_TIMEOUT_MS;
+    if (strncmp(line, "DELIVER", 7) == 0) {
+        if (backend->datagram == NULL) {
+            stat_local++;
+            finish_request(request, "ERROR: DELIVER needs a backend with a datagram address.\n");
+            return;
+        }
+        target = backend->datagram;
+        if (wait_ms > 60000) wait_ms = 60000;
+        timeout_ms += (int)wait_ms;
+    }
+    // A client keeps to one pooled connection, so its commands run in the order sent
+    if (wc_balancer_submit_keyed(target, client->key, line, timeout_ms, backend_reply, request) == 0) {
+        backend_reply(request, WC_ERROR, "");
+        return;
+    }
+    backend->forwarded++;
+    stat_forwarded++;
+}
+
+/**
+ * read_client - reads requests from a client and handles complete lines
+ */
+void read_client(proxy_client_t *client) {
+    ssize_t n = recv(client->fd, client->in + client->in_len, sizeof(client->in) - 1 - client->in_len, 0);
+    if (n <= 0) {
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) mark_dead(client);
+        return;
+    }
+    client->in_len += (size_t)n;
+    client->in[client->in_len] = '\0';
+
+    char *start = client->in;
+    char *newline;
+    if (client->discarding) {
+        // The rest of a line that was already rejected
+        if ((newline = strchr(start, '\n')) == NULL) {
+            client->in_len = 0;
+            return;
+        }
+        start = newline + 1;
+        client->discarding = 0;
+    }
+    while ((newline = strchr(start, '\n')) != NULL) {
+        char line[BUFFER_SIZE];
+        size_t len = (size_t)(newline - start);
+        if (len > sizeof(line) - 1) {
+            reject_too_long(client);        // the backend would cut it, or run part of it
+        } else {
+            memcpy(line, start, len);
+            line[len] = '\0';
+            handle_line(client, line);
+        }
+        start = newline + 1;
+    }
+    client->in_len -= (size_t)(start - client->in);
+    memmove(client->in, start, client->in_len);
+    if (client->in_len >= BUFFER_SIZE) {
+        // Too long already, with no end in sight: answer now, skip to its newline
+        reject_too_long(client);
+        client->discarding = 1;
+        client->in_len = 0;
+    }
+}
+
+/**
+ * accept_clients - accepts every pending connection on a listener
+ */
+void accept_clients(int listen_fd, int is_tcp) {
+    while (1) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) perror("accept");
+            return;
+        }
+        if (fd >= MAX_CLIENT_FDS) {
+            close(fd);
+            continue;
+        }
+        proxy_client_t *client = calloc(1, sizeof(*client));
+        if (client == NULL) {
+            close(fd);
+            continue;
+        }
+        if (is_tcp) {
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        }
+        client->fd = fd;
+        client->key = (unsigned int)stat_accepted;
+        if (default_count > 0) {
+            client->default_backend = next_default;
+            next_default = (next_default + 1) % default_count;
+        }
+
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            close(fd);
+            free(client);
+            continue;
+        }
+        clients[fd] = client;
+        client_count++;
+        stat_accepted++;
+        client_write(client, welcome);
+    }
+}
+
+/**
+ * close_client - drops a client; its requests still in flight are orphaned
+ */
+void close_client(proxy_client_t *client) {
+    proxy_request_t *request = client->head;
+    while (request != NULL) {
+        proxy_request_t *next = request->next;
+        if (request->reply != NULL) {
+            free(request->reply);
+            free(request);
+        } else {
+            request->client = NULL;         // freed when its reply comes
+        }
+        request = next;
+    }
+    epoll_ctl(epfd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    clients[client->fd] = NULL;
+    client_count--;
+    free(client->out);
+    free(client);
+}
+
+/**
+ * add_backend - parses [NAME=]HOST:PORT[:UDP_PORT] or [NAME=]PATH[,DATAGRAM_PATH]
+ * Returns 0 on success, -1 if the spec is malformed
+ */
+int add_backend(const char *spec, int pool_size, wc_policy_t policy) {
+    if (backend_count == MAX_BACKENDS)
+        return -1;
+    backend_t *backend = &backends[backend_count];
+    char buf[BUFFER_SIZE];
+    snprintf(buf, sizeof(buf), "%s", spec);
+
+    char *address = buf;
+    char *equals = strchr(buf, '=');
+    if (equals != NULL) {
+        *equals = '\0';
+        backend->name = strdup(buf);
+        address = equals + 1;
+    }
+    backend->spec = strdup(spec);
+    backend->pool = wc_balancer_create(wc_loop, policy, 1000);
+    if (backend->pool == NULL)
+        return -1;
+
+    int is_uds = address[0] == '/' || address[0] == '.';
+    if (is_uds) {
+        char *datagram = strchr(address, ',');
+        if (datagram != NULL) *datagram++ = '\0';
+        for (int k = 0; k < pool_size; k++) {
+            wc_balancer_add(backend->pool, WC_UDS_STREAM, address, 0);
+        }
+        if (datagram != NULL) {
+            backend->datagram = wc_balancer_create(wc_loop, policy, 1000);
+            if (backend->datagram == NULL) return -1;
+            wc_balancer_add(backend->datagram, WC_UDS_DATAGRAM, datagram, 0);
+        }
+    } else {
+        char *port = strchr(address, ':');
+        if (port == NULL)
+            return -1;
+        *port++ = '\0';
+        char *udp = strchr(port, ':');
+        if (udp != NULL) *udp++ = '\0';
+        int tcp_port = atoi(port), udp_port = udp != NULL ? atoi(udp) : 0;
+        if (tcp_port <= 0 || tcp_port > 65535 || (udp != NULL && (udp_port <= 0 || udp_port > 65535)))
+            return -1;
+        for (int k = 0; k < pool_size; k++) {
+            wc_balancer_add(backend->pool, WC_TCP, address, tcp_port);
+        }
+        if (udp != NULL) {
+            backend->datagram = wc_balancer_create(wc_loop, policy, 1000);
+            if (backend->datagram == NULL) return -1;
+            wc_balancer_add(backend->datagram, WC_UDP, address, udp_port);
+        }
+    }
+    wc_balancer_set_tagged(backend->pool, 1);
+
+    if (backend->name == NULL) default_backends[default_count++] = backend_count;
+    backend_count++;
+    return 0;
+}
+
+/**
+ * print_stats - prints client and backend counters
+ */
+void print_stats(void) {
+    printf("Proxy: clients=%d accepted=%llu forwarded=%llu answered locally=%llu failed=%llu\n",
+           client_count, stat_accepted, stat_forwarded, stat_local, stat_failed);
+    printf("Clients: paused for unread replies=%llu, lines too long=%llu\n", stat_paused, stat_too_long);
+    printf("Batching: %llu backend writes rounds, %.1f requests per round\n",
+           stat_batches, stat_batches ? (double)stat_forwarded / (double)stat_batches : 0.0);
+    for (int b = 0; b < backend_count; b++) {
+        printf("Backend %s (%s): forwarded=%llu\n", backends[b].spec,
+               backends[b].name != NULL ? backends[b].name : "default", backends[b].forwarded);
+        wc_balancer_print(backends[b].pool, stdout);
+        if (backends[b].datagram != NULL) wc_balancer_print(backends[b].datagram, stdout);
+    }
+}
+
+/**
+ * listen_on - opens a non-blocking listening socket and adds it to epoll
+ */
+int listen_on(int tcp_port, const char *stream_path) {
+    int fd;
+    if (stream_path == NULL) {
+        struct sockaddr_in addr;
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0) { perror("TCP socket error"); exit(1); }
+        int opt = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = htons(tcp_port);
+        if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            perror("TCP bind");
+            exit(1);
+        }
+    } else {
+        struct sockaddr_un addr;
+        unlink(stream_path); // Remove existing socket file
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0) { perror("UDS stream socket error"); exit(1); }
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, stream_path, sizeof(addr.sun_path) - 1);
+        if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            perror("UDS stream bind");
+            exit(1);
+        }
+    }
+    if (listen(fd, SOMAXCONN) < 0) {
+        perror("listen");
+        exit(1);
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    return fd;
+}
+
+int main(int argc, char *argv[]) {
+    int tcp_port = -1;
+    char *stream_path = NULL;
+    char *backend_specs[MAX_BACKENDS];
+    int spec_count = 0;
+    int pool_size = DEFAULT_POOL_SIZE;
+    wc_policy_t policy = WC_LEAST_PENDING;
+    int timeout_seconds = 0;
+
+    static struct option long_options[] = {
+        {"tcp-port", required_argument, 0, 'T'},
+        {"stream-path", required_argument, 0, 's'},
+        {"backend", required_argument, 0, 'b'},
+        {"pool-size", required_argument, 0, 'n'},
+        {"balance", required_argument, 0, 'l'},
+        {"timeout", required_argument, 0, 't'},
+        {"help", no_argument, 0, '?'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "T:s:b:n:l:t:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'T':
+                tcp_port = atoi(optarg);
+                if (tcp_port <= 0 || tcp_port > 65535) {
+                    fprintf(stderr, "Error: Invalid TCP port: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 's':
+                stream_path = strdup(optarg);
+                break;
+            case 'b':
+                if (spec_count == MAX_BACKENDS) {
+                    fprintf(stderr, "Error: At most %d backends\n", MAX_BACKENDS);
+                    exit(EXIT_FAILURE);
+                }
+                backend_specs[spec_count++] = optarg;
+                break;
+            case 'n':
+                pool_size = atoi(optarg);
+                if (pool_size <= 0 || pool_size > WC_MAX_ENDPOINTS) {
+                    fprintf(stderr, "Error: Invalid pool size (1-%d): %s\n", WC_MAX_ENDPOINTS, optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'l':
+                if (strcmp(optarg, "least") == 0) {
+                    policy = WC_LEAST_PENDING;
+                } else if (strcmp(optarg, "p2c") == 0) {
+                    policy = WC_TWO_CHOICES;
+                } else {
+                    fprintf(stderr, "Error: Invalid balancing policy (least or p2c): %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                timeout_seconds = atoi(optarg);
+                if (timeout_seconds <= 0) {
+                    fprintf(stderr, "Error: Invalid timeout: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case '?':
+            default:
+                show_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (tcp_port == -1 && stream_path == NULL) {
+        fprintf(stderr, "Error: Must specify a TCP port (-T) or UDS stream path (-s)\n");
+        show_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (spec_count == 0) {
+        fprintf(stderr, "Error: At least one backend (-b) is required\n");
+        show_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    if (timeout_seconds > 0) {
+        signal(SIGALRM, timeout_handler);
+        alarm(timeout_seconds);
+        printf("Proxy will timeout after %d seconds of inactivity\n", timeout_seconds);
+    }
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    wc_loop = wc_loop_create();
+    if (epfd == -1 || wc_loop == NULL) {
+        perror("epoll");
+        exit(1);
+    }
+    for (int k = 0; k < spec_count; k++) {
+        if (add_backend(backend_specs[k], pool_size, policy) != 0) {
+            fprintf(stderr, "Error: Invalid backend (expected [NAME=]HOST:PORT[:UDP_PORT] or [NAME=]PATH[,DATAGRAM_PATH]): %s\n",
+                    backend_specs[k]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    snprintf(welcome, sizeof(welcome), "Connected to Warehouse Proxy (%d backends).\n", backend_count);
+
+    int tcp_fd = tcp_port != -1 ? listen_on(tcp_port, NULL) : -1;
+    int stream_fd = stream_path != NULL ? listen_on(0, stream_path) : -1;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = STDIN_FILENO;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev);
+    int backend_fd = wc_loop_fd(wc_loop);
+    ev.data.fd = backend_fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, backend_fd, &ev);
+
+    printf("Proxy ready with %d backend(s), %d connection(s) each. Type 'STATS' for counters, 'shutdown' to stop.\n",
+           backend_count, pool_size);
+
+    int running = 1;
+    while (running) {
+        if (timeout_occurred) {
+            printf("Timeout occurred. Proxy shutting down.\n");
+            break;
+        }
+
+        struct epoll_event events[PROXY_MAX_EVENTS];
+        int ready = epoll_wait(epfd, events, PROXY_MAX_EVENTS, PROXY_TICK_MS);
+        if (ready == -1) {
+            if (timeout_occurred) break;
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        if (timeout_seconds > 0 && ready > 0) {
+            alarm(timeout_seconds);
+        }
+
+        // Requests from every ready client join one write per backend connection
+        unsigned long long forwarded_before = stat_forwarded;
+        wc_loop_cork(wc_loop, 1);
+        for (int k = 0; k < ready; k++) {
+            int fd = events[k].data.fd;
+            if (fd == tcp_fd || fd == stream_fd) {
+                accept_clients(fd, fd == tcp_fd);
+            } else if (fd == STDIN_FILENO) {
+                char input[BUFFER_SIZE];
+                if (fgets(input, sizeof(input), stdin) == NULL || strncmp(input, "shutdown", 8) == 0) {
+                    printf("Shutdown command received.\n");
+                    running = 0;
+                } else if (strncmp(input, "STATS", 5) == 0) {
+                    print_stats();
+                } else {
+                    printf("Available commands: STATS, shutdown\n");
+                }
+            } else if (fd != backend_fd && clients[fd] != NULL && !clients[fd]->dead) {
+                if (events[k].events & EPOLLOUT) client_flush(clients[fd]);
+                if (clients[fd]->out_len >= MAX_CLIENT_OUTPUT) {
+                    // Paused: not read, but a hangup still ends it
+                    if (events[k].events & (EPOLLHUP | EPOLLERR)) mark_dead(clients[fd]);
+                } else if (events[k].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    read_client(clients[fd]);
+                }
+            }
+        }
+        // Backend replies, timeouts and health checks
+        wc_loop_run(wc_loop, 0);
+        wc_loop_cork(wc_loop, 0);
+        if (stat_forwarded != forwarded_before) stat_batches++;
+
+        while (dead_count > 0) {
+            close_client(clients[dead_fds[--dead_count]]);
+        }
+    }
+
+    print_stats();
+    for (int fd = 0; fd < MAX_CLIENT_FDS; fd++) {
+        if (clients[fd] != NULL) close_client(clients[fd]);
+    }
+    wc_loop_destroy(wc_loop);
+    close(epfd);
+    if (tcp_fd != -1) close(tcp_fd);
+    if (stream_fd != -1) {
+        close(stream_fd);
+        unlink(stream_path);
+        free(stream_path);
+    }
+    for (int b = 0; b < backend_count; b++) {
+        free(backends[b].name);
+        free(backends[b].spec);
+    }
+
+    printf("Proxy terminated.\n");
+    return 0;
+}
@@ -0,0 +1,377 @@
+/**
+ * warehouse_top.c - q6
+ *
+ * Live monitor for persistent_warehouse.
+ * With -v it maps the server's read-only inventory view and redraws
+ * inventory, molecule capacity and request rates without talking to the
+ * server. With -g it instead follows the multicast/broadcast inventory
+ * feed (-M on the server), counts lost packets by sequence number and asks
+ * the server's UDP port for a unicast SNAPSHOT after a gap or on silence.
+ *
+ * Usage:
+ *   ./warehouse_top -v /dev/shm/warehouse.view [-i MS] [-n COUNT]
+ *   ./warehouse_top -g 239.0.0.1:5000 [-S HOST:UDP_PORT] [-I ADDR] [-i MS] [-n COUNT]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "warehouse_view.h"
+#include "inventory_feed.h"
+
+// Receiver side of the inventory feed
+typedef struct {
+    int have;                           // a packet or snapshot was received
+    feed_packet_t state;                // newest inventory
+    unsigned long long packets, snapshots, gaps, lost, stale;
+    unsigned long long snapshot_requests;
+    unsigned long long last_packet_ns;
+} feed_state_t;
+
+/**
+ * show_usage - displays usage instructions
+ */
+void show_usage(const char *program_name) {
+    printf("Usage: %s -v PATH | -g GROUP:PORT [options]\n\n", program_name);
+    printf("  -v, --view PATH         View file given to persistent_warehouse -v\n");
+    printf("  -g, --group GROUP:PORT  Follow the inventory feed (persistent_warehouse -M)\n");
+    printf("  -S, --server HOST:PORT  Server UDP port for SNAPSHOT recovery requests\n");
+    printf("  -I, --interface ADDR    Local address to join the multicast group on\n");
+    printf("  -i, --interval MS       Refresh interval (default: 1000)\n");
+    printf("  -n, --count NUM         Exit after NUM refreshes (default: run until Ctrl+C)\n");
+    printf("\nExamples:\n");
+    printf("  %s -v /dev/shm/warehouse.view -i 500\n", program_name);
+    printf("  %s -g 239.0.0.1:5000 -S 127.0.0.1:12346 -I 127.0.0.1\n", program_name);
+}
+
+/**
+ * now_ns - monotonic clock in nanoseconds, same clock as the server's update_ns
+ */
+unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+/**
+ * rate - per-second rate of a counter between two samples
+ */
+double rate(uint64_t now, uint64_t before, double seconds) {
+    return seconds > 0 && now >= before ? (now - before) / seconds : 0.0;
+}
+
+/**
+ * parse_address - fills an IPv4 address from HOST:PORT (numeric host)
+ * Returns 0 on success, -1 on error
+ */
+int parse_address(const char *spec, struct sockaddr_in *addr) {
+    char host[64];
+    const char *colon = strrchr(spec, ':');
+    if (colon == NULL || (size_t)(colon - spec) >= sizeof(host) || atoi(colon + 1) <= 0 || atoi(colon + 1) > 65535)
+        return -1;
+    memcpy(host, spec, (size_t)(colon - spec));
+    host[colon - spec] = '\0';
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(atoi(colon + 1));
+    return inet_pton(AF_INET, host, &addr->sin_addr) == 1 ? 0 : -1;
+}
+
+/**
+ * open_feed_socket - binds the feed port and joins the group if it is multicast
+ */
+int open_feed_socket(const struct sockaddr_in *group, const char *interface) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_port = group->sin_port;
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(fd, (struct sockaddr*)&local, sizeof(local)) == -1) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+
+    if (IN_MULTICAST(ntohl(group->sin_addr.s_addr))) {
+        struct ip_mreq membership;
+        membership.imr_multiaddr = group->sin_addr;
+        membership.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (interface != NULL && inet_pton(AF_INET, interface, &membership.imr_interface) != 1) {
+            fprintf(stderr, "Error: Invalid interface address: %s\n", interface);
+            close(fd);
+            return -1;
+        }
+        if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) == -1) {
+            perror("IP_ADD_MEMBERSHIP");
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+/**
+ * request_snapshot - asks the server for the current inventory by unicast
+ */
+void request_snapshot(int fd, const struct sockaddr_in *server, feed_state_t *feed) {
+    if (sendto(fd, "SNAPSHOT\n", 9, 0, (const struct sockaddr*)server, sizeof(*server)) == -1) {
+        perror("SNAPSHOT request");
+        return;
+    }
+    feed->snapshot_requests++;
+}
+
+/**
+ * handle_feed_packet - applies a feed packet or snapshot, counting gaps
+ * Returns 1 if packets were lost and a snapshot should be requested
+ */
+int handle_feed_packet(feed_state_t *feed, const feed_packet_t *packet) {
+    int is_snapshot = (packet->flags & FEED_FLAG_SNAPSHOT) != 0;
+    int gap = 0;
+
+    if (!feed->have || packet->session != feed->state.session) {
+        // First packet, or the server restarted: start over from this one
+        feed->state = *packet;
+        feed->have = 1;
+    } else if (is_snapshot) {
+        if (packet->inventory_seq >= feed->state.inventory_seq) {
+            uint64_t feed_seq = feed->state.feed_seq > packet->feed_seq ? feed->state.feed_seq : packet->feed_seq;
+            feed->state = *packet;
+            feed->state.feed_seq = feed_seq;
+        }
+    } else if (packet->feed_seq <= feed->state.feed_seq) {
+        feed->stale++;
+        return 0;
+    } else {
+        if (packet->feed_seq > feed->state.feed_seq + 1) {
+            feed->gaps++;
+            feed->lost += packet->feed_seq - feed->state.feed_seq - 1;
+            gap = 1;
+        }
+        feed->state = *packet;
+    }
+
+    if (is_snapshot) feed->snapshots++;
+    else feed->packets++;
+    return gap;
+}
+
+/**
+ * run_feed - follows the inventory feed and prints the newest state every interval
+ */
+int run_feed(const char *group_spec, const char *server_spec, const char *interface, int interval_ms, int count) {
+    struct sockaddr_in group, server;
+    if (parse_address(group_spec, &group) == -1) {
+        fprintf(stderr, "Error: Invalid group (expected GROUP:PORT): %s\n", group_spec);
+        return EXIT_FAILURE;
+    }
+    if (server_spec != NULL && parse_address(server_spec, &server) == -1) {
+        fprintf(stderr, "Error: Invalid server (expected HOST:PORT): %s\n", server_spec);
+        return EXIT_FAILURE;
+    }
+    int fd = open_feed_socket(&group, interface);
+    if (fd == -1) {
+        return EXIT_FAILURE;
+    }
+
+    feed_state_t feed;
+    memset(&feed, 0, sizeof(feed));
+    if (server_spec != NULL) request_snapshot(fd, &server, &feed);
+
+    int redraw = isatty(STDOUT_FILENO);
+    unsigned long long next_draw = now_ns() + (unsigned long long)interval_ms * 1000000ULL;
+    unsigned long long silence_ns = 2ULL * FEED_HEARTBEAT_MS * 1000000ULL;
+    feed.last_packet_ns = now_ns();
+
+    for (int round = 0; count == 0 || round < count; ) {
+        unsigned long long now = now_ns();
+        if (now >= next_draw) {
+            if (redraw) printf("\033[H\033[J");
+            if (feed.have) {
+                printf("warehouse_top - feed %s, inventory seq %llu, feed seq %llu\n", group_spec,
+                       (unsigned long long)feed.state.inventory_seq, (unsigned long long)feed.state.feed_seq);
+                printf("Atoms:     CARBON %llu  OXYGEN %llu  HYDROGEN %llu\n",
+                       (unsigned long long)feed.state.carbon, (unsigned long long)feed.state.oxygen,
+                       (unsigned long long)feed.state.hydrogen);
+            } else {
+                printf("warehouse_top - feed %s, waiting for the first packet\n", group_spec);
+            }
+            printf("Feed:      packets %llu  gaps %llu (lost %llu)  stale %llu  snapshots %llu/%llu\n",
+                   feed.packets, feed.gaps, feed.lost, feed.stale, feed.snapshots, feed.snapshot_requests);
+            fflush(stdout);
+            next_draw = now + (unsigned long long)interval_ms * 1000000ULL;
+            round++;
+            continue;
+        }
+
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, (int)((next_draw - now) / 1000000ULL) + 1);
+        if (ready == -1 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        if (ready > 0) {
+            char buf[256];
+            feed_packet_t packet;
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n > 0 && feed_decode(buf, (size_t)n, &packet) == 0) {
+                feed.last_packet_ns = now_ns();
+                if (handle_feed_packet(&feed, &packet) && server_spec != NULL) {
+                    request_snapshot(fd, &server, &feed);
+                }
+            }
+        }
+        // The server sends a heartbeat every second; ask directly if the feed went quiet
+        if (server_spec != NULL && now_ns() - feed.last_packet_ns > silence_ns) {
+            request_snapshot(fd, &server, &feed);
+            feed.last_packet_ns = now_ns();
+        }
+    }
+
+    close(fd);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    char *view_path = NULL;
+    char *group_spec = NULL, *server_spec = NULL, *interface = NULL;
+    int interval_ms = 1000;
+    int count = 0;
+
+    static struct option long_options[] = {
+        {"view", required_argument, 0, 'v'},
+        {"group", required_argument, 0, 'g'},
+        {"server", required_argument, 0, 'S'},
+        {"interface", required_argument, 0, 'I'},
+        {"interval", required_argument, 0, 'i'},
+        {"count", required_argument, 0, 'n'},
+        {"help", no_argument, 0, '?'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "v:g:S:I:i:n:", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'v':
+                view_path = optarg;
+                break;
+            case 'g':
+                group_spec = optarg;
+                break;
+            case 'S':
+                server_spec = optarg;
+                break;
+            case 'I':
+                interface = optarg;
+                break;
+            case 'i':
+                interval_ms = atoi(optarg);
+                if (interval_ms <= 0) {
+                    fprintf(stderr, "Error: Invalid interval: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'n':
+                count = atoi(optarg);
+                if (count <= 0) {
+                    fprintf(stderr, "Error: Invalid count: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case '?':
+            default:
+                show_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if ((view_path == NULL) == (group_spec == NULL)) {
+        fprintf(stderr, "Error: Give either a view file (-v) or a feed group (-g)\n");
+        show_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (group_spec != NULL) {
+        return run_feed(group_spec, server_spec, interface, interval_ms, count);
+    }
+
+    int fd = open(view_path, O_RDONLY);
+    if (fd == -1) {
+        perror("Error opening view file");
+        exit(EXIT_FAILURE);
+    }
+    const warehouse_view_t *view = mmap(NULL, sizeof(warehouse_view_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (view == MAP_FAILED) {
+        perror("Error mapping view file");
+        exit(EXIT_FAILURE);
+    }
+    if (__atomic_load_n(&view->magic, __ATOMIC_ACQUIRE) != VIEW_MAGIC || view->version != VIEW_VERSION) {
+        fprintf(stderr, "Error: %s is not a warehouse view (or has another version)\n", view_path);
+        exit(EXIT_FAILURE);
+    }
+
+    int redraw = isatty(STDOUT_FILENO);
+    warehouse_view_t snap, prev;
+    unsigned long long prev_ns = 0;
+    memset(&prev, 0, sizeof(prev));
+
+    for (int round = 0; count == 0 || round < count; round++) {
+        if (round > 0) {
+            struct timespec pause = {interval_ms / 1000, (interval_ms % 1000) * 1000000L};
+            nanosleep(&pause, NULL);
+        }
+        unsigned long long sample_ns = now_ns();
+        if (view_read(view, &snap) == -1) {
+            printf("View is being rewritten, skipping this refresh.\n");
+            continue;
+        }
+
+        int alive = kill((pid_t)snap.pid, 0) == 0 || errno == EPERM;
+        double age = snap.update_ns <= sample_ns ? (sample_ns - snap.update_ns) / 1e9 : 0.0;
+        double seconds = prev_ns != 0 ? (sample_ns - prev_ns) / 1e9 : 0.0;
+
+        if (redraw) printf("\033[H\033[J");
+        printf("warehouse_top - pid %llu%s, inventory seq %llu, updated %.1f s ago\n",
+               (unsigned long long)snap.pid, alive ? "" : " (not running)",
+               (unsigned long long)snap.seq, age);
+        printf("Atoms:     CARBON %llu  OXYGEN %llu  HYDROGEN %llu\n",
+               (unsigned long long)snap.carbon, (unsigned long long)snap.oxygen, (unsigned long long)snap.hydrogen);
+        printf("Capacity:  WATER %llu  CARBON DIOXIDE %llu  ALCOHOL %llu  GLUCOSE %llu\n",
+               (unsigned long long)snap.water, (unsigned long long)snap.co2,
+               (unsigned long long)snap.alcohol, (unsigned long long)snap.glucose);
+        printf("Requests:  stream %llu (%.0f/s)  datagram %llu (%.0f/s)\n",
+               (unsigned long long)snap.stream_requests, rate(snap.stream_requests, prev.stream_requests, seconds),
+               (unsigned long long)snap.datagram_requests, rate(snap.datagram_requests, prev.datagram_requests, seconds));
+        printf("Delivers:  ok %llu (%.0f/s)  failed %llu\n",
+               (unsigned long long)snap.delivered, rate(snap.delivered, prev.delivered, seconds),
+               (unsigned long long)snap.deliver_failures);
+        fflush(stdout);
+
+        prev = snap;
+        prev_ns = sample_ns;
+    }
+
+    munmap((void *)view, sizeof(warehouse_view_t));
+    return 0;
+}
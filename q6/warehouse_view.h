@@ -0,0 +1,67 @@
+/**
+ * warehouse_view.h - q6
+ *
+ * Read-only inventory view shared with local monitors (persistent_warehouse -v PATH).
+ * The server is the only writer; the block is guarded by a seqlock, so
+ * readers like warehouse_top get a consistent copy without system calls
+ * and without involving the server's event loop.
+ */
+
+#ifndef WAREHOUSE_VIEW_H
+#define WAREHOUSE_VIEW_H
+
+#include <stdint.h>
+
+#define VIEW_MAGIC 0x31564857U               // "WHV1"
+#define VIEW_VERSION 1
+#define VIEW_READ_RETRIES 1000
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t lock;                      // odd while the view is being written
+    uint64_t pid;
+    uint64_t seq;                       // inventory version
+    uint64_t carbon, oxygen, hydrogen;
+    uint64_t water, co2, alcohol, glucose;
+    uint64_t stream_requests;           // commands from stream and shared-memory clients
+    uint64_t datagram_requests;         // UDP / UDS datagram requests
+    uint64_t delivered;                 // DELIVER requests that succeeded
+    uint64_t deliver_failures;
+    uint64_t update_ns;                 // CLOCK_MONOTONIC time of the last update
+} warehouse_view_t;
+
+/**
+ * view_read - copies a consistent snapshot of the view
+ * Returns 0 on success, -1 if the writer stayed busy (or died mid-update)
+ */
+static inline int view_read(const warehouse_view_t *view, warehouse_view_t *out) {
+    for (int tries = 0; tries < VIEW_READ_RETRIES; tries++) {
+        uint64_t before = __atomic_load_n(&view->lock, __ATOMIC_ACQUIRE);
+        if (before & 1)
+            continue;
+        out->magic = view->magic;
+        out->version = view->version;
+        out->lock = before;
+        out->pid = __atomic_load_n(&view->pid, __ATOMIC_RELAXED);
+        out->seq = __atomic_load_n(&view->seq, __ATOMIC_RELAXED);
+        out->carbon = __atomic_load_n(&view->carbon, __ATOMIC_RELAXED);
+        out->oxygen = __atomic_load_n(&view->oxygen, __ATOMIC_RELAXED);
+        out->hydrogen = __atomic_load_n(&view->hydrogen, __ATOMIC_RELAXED);
+        out->water = __atomic_load_n(&view->water, __ATOMIC_RELAXED);
+        out->co2 = __atomic_load_n(&view->co2, __ATOMIC_RELAXED);
+        out->alcohol = __atomic_load_n(&view->alcohol, __ATOMIC_RELAXED);
+        out->glucose = __atomic_load_n(&view->glucose, __ATOMIC_RELAXED);
+        out->stream_requests = __atomic_load_n(&view->stream_requests, __ATOMIC_RELAXED);
+        out->datagram_requests = __atomic_load_n(&view->datagram_requests, __ATOMIC_RELAXED);
+        out->delivered = __atomic_load_n(&view->delivered, __ATOMIC_RELAXED);
+        out->deliver_failures = __atomic_load_n(&view->deliver_failures, __ATOMIC_RELAXED);
+        out->update_ns = __atomic_load_n(&view->update_ns, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&view->lock, __ATOMIC_RELAXED) == before)
+            return 0;
+    }
+    return -1;
+}
+
+#endif